@@ -25,6 +25,33 @@ public:
 
     void ReportInterrupt() {
         m_interruptReported = true;
+        m_pVirtQueue->Statistics().Interrupts++;
+        StampInterrupt();
+    }
+
+    /* the first interrupt after the last DPC of the path keeps its time */
+    void StampInterrupt()
+    {
+        if (m_InterruptTimestamp == 0)
+        {
+            m_InterruptTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+        }
+    }
+
+    /* called by the DPC, 0 if no interrupt came since the previous call */
+    LONGLONG TakeInterruptTimestamp()
+    {
+        return InterlockedExchange64(&m_InterruptTimestamp, 0);
+    }
+
+    tQueueStatistics &QueueStatistics()
+    {
+        return m_pVirtQueue->Statistics();
+    }
+
+    tQueueLatency &QueueLatency()
+    {
+        return m_Latency;
     }
 
     UINT getMessageIndex() {
@@ -68,6 +95,8 @@ protected:
     u16 m_messageIndex = (u16)-1;
     u16 m_queueIndex = (u16)-1;
     bool m_interruptReported;
+    volatile LONGLONG m_InterruptTimestamp = 0;
+    tQueueLatency m_Latency = {};
 };
 
 
@@ -9,10 +9,15 @@
 CParaNdisCX::CParaNdisCX()
 {
     m_ControlData.Virtual = nullptr;
+    NdisZeroMemory(m_Slots, sizeof(m_Slots));
+    NdisZeroMemory(m_VlanWanted, sizeof(m_VlanWanted));
+    NdisZeroMemory(m_VlanInDevice, sizeof(m_VlanInDevice));
 }
 
 CParaNdisCX::~CParaNdisCX()
 {
+    DropPendingCommands();
+
     if (m_ControlData.Virtual != nullptr)
     {
         ParaNdis_FreePhysicalMemory(m_Context, &m_ControlData);
@@ -24,7 +29,7 @@ bool CParaNdisCX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
     m_Context = Context;
     m_queueIndex = (u16)DeviceQueueIndex;
 
-    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, 512, &m_ControlData))
+    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, PARANDIS_CX_SLOTS * PARANDIS_CX_SLOT_SIZE, &m_ControlData))
     {
         DPrintf(0, "CParaNdisCX::Create - ParaNdis_InitialAllocatePhysicalMemory failed for %u\n",
             DeviceQueueIndex);
@@ -32,6 +37,13 @@ bool CParaNdisCX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
         return false;
     }
 
+    for (ULONG i = 0; i < PARANDIS_CX_SLOTS; i++)
+    {
+        m_Slots[i].Virtual = (PUCHAR)m_ControlData.Virtual + i * PARANDIS_CX_SLOT_SIZE;
+        m_Slots[i].Physical.QuadPart = m_ControlData.Physical.QuadPart + i * PARANDIS_CX_SLOT_SIZE;
+    }
+    m_FreeSlots = (1 << PARANDIS_CX_SLOTS) - 1;
+
     m_Context->m_CxStateMachine.Start();
 
     return m_VirtQueue.Create(DeviceQueueIndex,
@@ -39,96 +51,473 @@ bool CParaNdisCX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
         m_Context->MiniportHandle);
 }
 
-BOOLEAN CParaNdisCX::SendControlMessage(
+CParaNdisCX::tCXSlot *CParaNdisCX::AllocateSlot()
+{
+    ULONG index;
+
+    if (!_BitScanForward(&index, m_FreeSlots))
+    {
+        return nullptr;
+    }
+
+    m_FreeSlots &= ~(1 << index);
+    return &m_Slots[index];
+}
+
+void CParaNdisCX::FreeSlot(tCXSlot *Slot)
+{
+    ULONG index = (ULONG)(Slot - m_Slots);
+
+    NETKVM_ASSERT(!(m_FreeSlots & (1 << index)));
+    m_FreeSlots |= 1 << index;
+}
+
+bool CParaNdisCX::PostSlot(tCXSlot *Slot, PVOID buffer1, ULONG size1, PVOID buffer2, ULONG size2)
+{
+    struct VirtIOBufferDescriptor sg[4];
+    PUCHAR pBase = Slot->Virtual;
+    PHYSICAL_ADDRESS phBase = Slot->Physical;
+    ULONG offset = 0;
+    UINT nOut = 1;
+
+    ((virtio_net_ctrl_hdr *)pBase)->class_of_command = Slot->Class;
+    ((virtio_net_ctrl_hdr *)pBase)->cmd = Slot->Command;
+    sg[0].physAddr = phBase;
+    sg[0].length = sizeof(virtio_net_ctrl_hdr);
+    offset += sg[0].length;
+    offset = (offset + 3) & ~3;
+    if (size1)
+    {
+        NdisMoveMemory(pBase + offset, buffer1, size1);
+        sg[nOut].physAddr = phBase;
+        sg[nOut].physAddr.QuadPart += offset;
+        sg[nOut].length = size1;
+        offset += size1;
+        offset = (offset + 3) & ~3;
+        nOut++;
+    }
+    if (size2)
+    {
+        NdisMoveMemory(pBase + offset, buffer2, size2);
+        sg[nOut].physAddr = phBase;
+        sg[nOut].physAddr.QuadPart += offset;
+        sg[nOut].length = size2;
+        offset += size2;
+        offset = (offset + 3) & ~3;
+        nOut++;
+    }
+    sg[nOut].physAddr = phBase;
+    sg[nOut].physAddr.QuadPart += offset;
+    sg[nOut].length = sizeof(virtio_net_ctrl_ack);
+    *(virtio_net_ctrl_ack *)(pBase + offset) = VIRTIO_NET_ERR;
+    Slot->AckOffset = offset;
+    Slot->bDone = false;
+    Slot->bOK = false;
+
+    if (0 > m_VirtQueue.AddBuf(sg, nOut, 1, Slot, NULL, 0))
+    {
+        DPrintf(0, "%s - ERROR: add_buf failed\n", __FUNCTION__);
+        return false;
+    }
+
+    m_Context->m_CxStateMachine.RegisterOutstandingItem();
+    m_NeedsKick = true;
+    return true;
+}
+
+void CParaNdisCX::CompleteSlot(tCXSlot *Slot, UINT len)
+{
+    virtio_net_ctrl_ack ack = *(virtio_net_ctrl_ack *)(Slot->Virtual + Slot->AckOffset);
+
+    m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+
+    if (len != sizeof(virtio_net_ctrl_ack))
+    {
+        DPrintf(0, "%s - ERROR: wrong len %d\n", __FUNCTION__, len);
+    }
+    else if (ack != VIRTIO_NET_OK)
+    {
+        DPrintf(0, "%s - ERROR: error %d returned for class %d\n", __FUNCTION__, ack, Slot->Class);
+    }
+    else
+    {
+        // everything is OK
+        DPrintf(Slot->LevelIfOK, "%s OK(%d.%d)\n", __FUNCTION__, Slot->Class, Slot->Command);
+        Slot->bOK = true;
+    }
+
+    if (!Slot->bOK)
+    {
+        m_FailedCommands++;
+    }
+
+    if (Slot->Completion != nullptr)
+    {
+        Slot->Completion(Slot->CompletionContext, Slot->CompletionParam, Slot->bOK);
+    }
+
+    if (Slot->bVlan)
+    {
+        m_VlanSlotsInUse--;
+    }
+
+    if (Slot->bWaited)
+    {
+        Slot->bDone = true;
+    }
+    else
+    {
+        FreeSlot(Slot);
+    }
+}
+
+void CParaNdisCX::ReapCompletions()
+{
+    tCXSlot *Slot;
+    UINT len;
+
+    while (nullptr != (Slot = (tCXSlot *)m_VirtQueue.GetBuf(&len)))
+    {
+        CompleteSlot(Slot, len);
+    }
+}
+
+void CParaNdisCX::KickIfNeeded()
+{
+    if (m_NeedsKick && !m_BatchDepth)
+    {
+        m_VirtQueue.Kick();
+        m_NeedsKick = false;
+    }
+}
+
+bool CParaNdisCX::CanSend(ULONG size1, ULONG size2)
+{
+    if (!m_ControlData.Virtual || PARANDIS_CX_SLOT_SIZE <= (size1 + size2 + 16))
+    {
+        DPrintf(0, "%s (buffer %d,%d) - ERROR: message too LARGE\n", __FUNCTION__, size1, size2);
+        return false;
+    }
+    return true;
+}
+
+void CParaNdisCX::InitSlot(tCXSlot *Slot, UCHAR cls, UCHAR cmd, int levelIfOK, bool bWaited)
+{
+    Slot->Class = cls;
+    Slot->Command = cmd;
+    Slot->LevelIfOK = levelIfOK;
+    Slot->Completion = nullptr;
+    Slot->bWaited = bWaited;
+    Slot->bVlan = false;
+}
+
+void CParaNdisCX::PostPendingCommands()
+{
+    CCXPendingCommand *Command;
+
+    while (m_FreeSlots && nullptr != (Command = m_PendingCommands.Pop()))
+    {
+        tCXSlot *Slot = AllocateSlot();
+
+        InitSlot(Slot, Command->Class, Command->Command, Command->LevelIfOK, false);
+        Slot->Completion = Command->Completion;
+        Slot->CompletionContext = Command->CompletionContext;
+        Slot->CompletionParam = Command->CompletionParam;
+        if (!PostSlot(Slot, Command->Data, Command->Size1, Command->Data + Command->Size1, Command->Size2))
+        {
+            FreeSlot(Slot);
+            m_FailedCommands++;
+        }
+        CCXPendingCommand::Destroy(Command, m_Context->MiniportHandle);
+    }
+
+    KickIfNeeded();
+}
+
+void CParaNdisCX::DropPendingCommands()
+{
+    m_PendingCommands.ForEachDetached([this](CCXPendingCommand *Command)
+    {
+        CCXPendingCommand::Destroy(Command, m_Context->MiniportHandle);
+    });
+}
+
+BOOLEAN CParaNdisCX::QueueControlMessage(
     UCHAR cls,
     UCHAR cmd,
     PVOID buffer1,
     ULONG size1,
     PVOID buffer2,
     ULONG size2,
-    int levelIfOK
+    int levelIfOK,
+    tCXCompletionRoutine Completion,
+    PVOID CompletionContext,
+    ULONG_PTR CompletionParam
     )
 {
-    BOOLEAN bOK = FALSE;
     CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+    tCXSlot *Slot;
 
-    if (m_ControlData.Virtual && m_ControlData.size > (size1 + size2 + 16))
+    if (!CanSend(size1, size2))
     {
-        struct VirtIOBufferDescriptor sg[4];
-        PUCHAR pBase = (PUCHAR)m_ControlData.Virtual;
-        PHYSICAL_ADDRESS phBase = m_ControlData.Physical;
-        ULONG offset = 0;
-        UINT nOut = 1;
+        return FALSE;
+    }
 
-        ((virtio_net_ctrl_hdr *)pBase)->class_of_command = cls;
-        ((virtio_net_ctrl_hdr *)pBase)->cmd = cmd;
-        sg[0].physAddr = phBase;
-        sg[0].length = sizeof(virtio_net_ctrl_hdr);
-        offset += sg[0].length;
-        offset = (offset + 3) & ~3;
-        if (size1)
+    // commands queued earlier go first
+    if (m_PendingCommands.IsEmpty())
+    {
+        Slot = AllocateSlot();
+        if (Slot == nullptr)
         {
-            NdisMoveMemory(pBase + offset, buffer1, size1);
-            sg[nOut].physAddr = phBase;
-            sg[nOut].physAddr.QuadPart += offset;
-            sg[nOut].length = size1;
-            offset += size1;
-            offset = (offset + 3) & ~3;
-            nOut++;
+            ReapCompletions();
+            Slot = AllocateSlot();
         }
-        if (size2)
+        if (Slot != nullptr)
         {
-            NdisMoveMemory(pBase + offset, buffer2, size2);
-            sg[nOut].physAddr = phBase;
-            sg[nOut].physAddr.QuadPart += offset;
-            sg[nOut].length = size2;
-            offset += size2;
-            offset = (offset + 3) & ~3;
-            nOut++;
+            InitSlot(Slot, cls, cmd, levelIfOK, false);
+            Slot->Completion = Completion;
+            Slot->CompletionContext = CompletionContext;
+            Slot->CompletionParam = CompletionParam;
+            if (!PostSlot(Slot, buffer1, size1, buffer2, size2))
+            {
+                FreeSlot(Slot);
+                return FALSE;
+            }
+            KickIfNeeded();
+            return TRUE;
         }
-        sg[nOut].physAddr = phBase;
-        sg[nOut].physAddr.QuadPart += offset;
-        sg[nOut].length = sizeof(virtio_net_ctrl_ack);
-        *(virtio_net_ctrl_ack *)(pBase + offset) = VIRTIO_NET_ERR;
+    }
 
-        if (0 <= m_VirtQueue.AddBuf(sg, nOut, 1, (PVOID)1, NULL, 0))
-        {
-            UINT len;
-            m_Context->m_CxStateMachine.RegisterOutstandingItem();
+    // the device does not keep up, ProcessCompletions posts the command
+    // when it answers one of the outstanding ones
+    CCXPendingCommand *Command = new (m_Context->MiniportHandle) CCXPendingCommand;
+    if (Command == nullptr)
+    {
+        DPrintf(0, "%s - ERROR: no memory for command %d.%d\n", __FUNCTION__, cls, cmd);
+        m_FailedCommands++;
+        return FALSE;
+    }
 
-            m_VirtQueue.Kick();
-            while (!m_VirtQueue.GetBuf(&len))
-            {
-                UINT interval = 1;
-                NdisStallExecution(interval);
-            }
-            m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+    Command->Class = cls;
+    Command->Command = cmd;
+    Command->LevelIfOK = levelIfOK;
+    Command->Completion = Completion;
+    Command->CompletionContext = CompletionContext;
+    Command->CompletionParam = CompletionParam;
+    Command->Size1 = size1;
+    Command->Size2 = size2;
+    if (size1)
+    {
+        NdisMoveMemory(Command->Data, buffer1, size1);
+    }
+    if (size2)
+    {
+        NdisMoveMemory(Command->Data + size1, buffer2, size2);
+    }
+    m_PendingCommands.PushBack(Command);
+
+    // posts it right away if ReapCompletions freed a slot for the queued ones
+    PostPendingCommands();
+    return TRUE;
+}
+
+BOOLEAN CParaNdisCX::SendControlMessage(
+    UCHAR cls,
+    UCHAR cmd,
+    PVOID buffer1,
+    ULONG size1,
+    PVOID buffer2,
+    ULONG size2,
+    int levelIfOK
+    )
+{
+    BOOLEAN bOK = FALSE;
+    tCXSlot *Slot = nullptr;
+
+    if (!CanSend(size1, size2))
+    {
+        return FALSE;
+    }
 
-            if (len != sizeof(virtio_net_ctrl_ack))
+    // the caller waits for the answer, so it also waits here for
+    // the queued commands to be posted and for a free slot
+    for (;;)
+    {
+        bool bDone = false;
+
+        m_Lock.Lock();
+        if (Slot == nullptr)
+        {
+            ReapCompletions();
+            PostPendingCommands();
+            if (m_PendingCommands.IsEmpty() && nullptr != (Slot = AllocateSlot()))
             {
-                DPrintf(0, "%s - ERROR: wrong len %d\n", __FUNCTION__, len);
+                InitSlot(Slot, cls, cmd, levelIfOK, true);
+                if (!PostSlot(Slot, buffer1, size1, buffer2, size2))
+                {
+                    FreeSlot(Slot);
+                    bDone = true;
+                }
+                else
+                {
+                    m_VirtQueue.Kick();
+                    m_NeedsKick = false;
+                }
             }
-            else if (*(virtio_net_ctrl_ack *)(pBase + offset) != VIRTIO_NET_OK)
+        }
+        else
+        {
+            if (!Slot->bDone)
             {
-                DPrintf(0, "%s - ERROR: error %d returned for class %d\n", __FUNCTION__, *(virtio_net_ctrl_ack *)(pBase + offset), cls);
+                ReapCompletions();
             }
-            else
+            bDone = Slot->bDone;
+            if (bDone)
             {
-                // everything is OK
-                DPrintf(levelIfOK, "%s OK(%d.%d,buffers of %d and %d) \n", __FUNCTION__, cls, cmd, size1, size2);
-                bOK = TRUE;
+                bOK = Slot->bOK;
+                FreeSlot(Slot);
             }
         }
-        else
+        m_Lock.Unlock();
+
+        if (bDone)
         {
-            DPrintf(0, "%s - ERROR: add_buf failed\n", __FUNCTION__);
+            break;
         }
+        NdisStallExecution(1);
+    }
+
+    return bOK;
+}
+
+void CParaNdisCX::StartBatch()
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+    m_BatchDepth++;
+}
+
+void CParaNdisCX::CompleteBatch()
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+    NETKVM_ASSERT(m_BatchDepth != 0);
+    m_BatchDepth--;
+    KickIfNeeded();
+}
+
+void CParaNdisCX::PostVlanUpdates()
+{
+    ULONG word = 0;
+
+    // the device has no bulk VLAN command, so only the entries that
+    // differ from what it already has are sent, a few at a time
+    while (m_VlanSlotsInUse < PARANDIS_CX_MAX_VLAN_SLOTS && m_FreeSlots)
+    {
+        ULONG bit;
+
+        while (word < ARRAYSIZE(m_VlanWanted) && m_VlanWanted[word] == m_VlanInDevice[word])
+        {
+            word++;
+        }
+        if (word == ARRAYSIZE(m_VlanWanted))
+        {
+            break;
+        }
+
+        _BitScanForward(&bit, m_VlanWanted[word] ^ m_VlanInDevice[word]);
+
+        u16 vlanId = (u16)(word * 32 + bit);
+        tCXSlot *Slot = AllocateSlot();
+
+        InitSlot(Slot, VIRTIO_NET_CTRL_VLAN,
+                 (m_VlanWanted[word] & (1 << bit)) ? VIRTIO_NET_CTRL_VLAN_ADD : VIRTIO_NET_CTRL_VLAN_DEL,
+                 7, false);
+        Slot->bVlan = true;
+
+        if (!PostSlot(Slot, &vlanId, sizeof(vlanId), NULL, 0))
+        {
+            FreeSlot(Slot);
+            break;
+        }
+
+        m_VlanInDevice[word] ^= 1 << bit;
+        m_VlanSlotsInUse++;
+    }
+
+    KickIfNeeded();
+}
+
+void CParaNdisCX::SetVlanFilters(ULONG FilterSet)
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+
+    if (!m_ControlData.Virtual)
+    {
+        return;
+    }
+
+    if (FilterSet >= PARANDIS_CX_VLAN_IDS)
+    {
+        NdisFillMemory(m_VlanWanted, sizeof(m_VlanWanted), 0xFF);
     }
     else
     {
-        DPrintf(0, "%s (buffer %d,%d) - ERROR: message too LARGE\n", __FUNCTION__, size1, size2);
+        NdisZeroMemory(m_VlanWanted, sizeof(m_VlanWanted));
+        if (FilterSet)
+        {
+            m_VlanWanted[FilterSet / 32] = 1 << (FilterSet % 32);
+        }
     }
-    return bOK;
+
+    PostVlanUpdates();
+}
+
+void CParaNdisCX::ProcessCompletions()
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+
+    if (!m_ControlData.Virtual)
+    {
+        return;
+    }
+
+    do
+    {
+        ReapCompletions();
+    } while (!m_VirtQueue.Restart());
+
+    PostPendingCommands();
+    PostVlanUpdates();
+}
+
+void CParaNdisCX::Shutdown()
+{
+    TPassiveSpinLocker LockedContext(m_Lock);
+
+    // the device is reset, commands it did not answer are dropped
+    for (ULONG i = 0; i < PARANDIS_CX_SLOTS; i++)
+    {
+        tCXSlot *Slot = &m_Slots[i];
+
+        if (!(m_FreeSlots & (1 << i)) && !Slot->bDone)
+        {
+            m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+            if (Slot->bWaited)
+            {
+                Slot->bDone = true;
+            }
+            else
+            {
+                FreeSlot(Slot);
+            }
+        }
+    }
+
+    DropPendingCommands();
+    m_VlanSlotsInUse = 0;
+    m_NeedsKick = false;
+    NdisZeroMemory(m_VlanInDevice, sizeof(m_VlanInDevice));
+
+    m_VirtQueue.Shutdown();
 }
 
 NDIS_STATUS CParaNdisCX::SetupMessageIndex(u16 vector)
@@ -3,6 +3,36 @@
 #include "ndis56common.h"
 #include "ParaNdis-AbstractPath.h"
 
+// number of control commands that may be outstanding on the device at once
+#define PARANDIS_CX_SLOTS               16
+// room for one command: header, up to two data buffers and the ack byte
+#define PARANDIS_CX_SLOT_SIZE           256
+// VLAN filter updates leave room in the ring for other commands
+#define PARANDIS_CX_MAX_VLAN_SLOTS      (PARANDIS_CX_SLOTS / 2)
+#define PARANDIS_CX_VLAN_IDS            4096
+
+/* Called when the device answers a queued command, under the control
+   queue lock at DISPATCH_LEVEL, so it must not send other commands */
+typedef VOID (*tCXCompletionRoutine)(PVOID Context, ULONG_PTR Param, BOOLEAN bOK);
+
+/* Command that found all the slots busy, posted from ProcessCompletions
+   when the device frees one */
+class CCXPendingCommand : public CNdisAllocatable<CCXPendingCommand, 'CPXC'>
+{
+public:
+    UCHAR Class;
+    UCHAR Command;
+    int LevelIfOK;
+    tCXCompletionRoutine Completion;
+    PVOID CompletionContext;
+    ULONG_PTR CompletionParam;
+    ULONG Size1;
+    ULONG Size2;
+    UCHAR Data[PARANDIS_CX_SLOT_SIZE];
+
+    DECLARE_CNDISLIST_ENTRY(CCXPendingCommand);
+};
+
 class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementAllocatable {
 public:
     CParaNdisCX();
@@ -12,6 +42,7 @@ public:
 
     virtual NDIS_STATUS SetupMessageIndex(u16 vector);
 
+    // posts the command and waits for the device to answer
     BOOLEAN CParaNdisCX::SendControlMessage(
         UCHAR cls,
         UCHAR cmd,
@@ -22,6 +53,76 @@ public:
         int levelIfOK
         );
 
+    // posts the command and returns, the answer is checked on completion;
+    // when the device has all the slots, the command waits in a list
+    BOOLEAN QueueControlMessage(
+        UCHAR cls,
+        UCHAR cmd,
+        PVOID buffer1,
+        ULONG size1,
+        PVOID buffer2,
+        ULONG size2,
+        int levelIfOK,
+        tCXCompletionRoutine Completion = nullptr,
+        PVOID CompletionContext = nullptr,
+        ULONG_PTR CompletionParam = 0
+        );
+
+    // commands queued between these calls are announced to the device with one kick
+    void StartBatch();
+    void CompleteBatch();
+
+    // FilterSet: 0 - no VLAN, 1..4095 - this VLAN only, 4096 - all VLANs
+    void SetVlanFilters(ULONG FilterSet);
+
+    // called from the DPC when the control queue interrupt is reported
+    void ProcessCompletions();
+
+    void Shutdown();
+
+    ULONG GetFailedCommands() const
+    { return m_FailedCommands; }
+
 protected:
+    typedef struct _tagCXSlot
+    {
+        PUCHAR Virtual;
+        PHYSICAL_ADDRESS Physical;
+        ULONG AckOffset;
+        UCHAR Class;
+        UCHAR Command;
+        int LevelIfOK;
+        tCXCompletionRoutine Completion;
+        PVOID CompletionContext;
+        ULONG_PTR CompletionParam;
+        bool bWaited;
+        bool bVlan;
+        bool bDone;
+        bool bOK;
+    } tCXSlot;
+
+    tCXSlot *AllocateSlot();
+    void FreeSlot(tCXSlot *Slot);
+    bool PostSlot(tCXSlot *Slot, PVOID buffer1, ULONG size1, PVOID buffer2, ULONG size2);
+    bool CanSend(ULONG size1, ULONG size2);
+    void InitSlot(tCXSlot *Slot, UCHAR cls, UCHAR cmd, int levelIfOK, bool bWaited);
+    void CompleteSlot(tCXSlot *Slot, UINT len);
+    void ReapCompletions();
+    void PostPendingCommands();
+    void DropPendingCommands();
+    void PostVlanUpdates();
+    void KickIfNeeded();
+
     tCompletePhysicalAddress m_ControlData;
+    tCXSlot m_Slots[PARANDIS_CX_SLOTS];
+    ULONG m_FreeSlots = 0;
+    ULONG m_VlanSlotsInUse = 0;
+    ULONG m_BatchDepth = 0;
+    bool m_NeedsKick = false;
+    ULONG m_FailedCommands = 0;
+    CNdisList<CCXPendingCommand, CRawAccess, CNonCountingObject> m_PendingCommands;
+
+    // VLAN filter table as requested by the OS and as programmed to the device
+    ULONG m_VlanWanted[PARANDIS_CX_VLAN_IDS / 32];
+    ULONG m_VlanInDevice[PARANDIS_CX_VLAN_IDS / 32];
 };
@@ -37,6 +37,7 @@
 #endif
 
 static VOID ParaNdis_UpdateMAC(PARANDIS_ADAPTER *pContext);
+static VOID UpdateAdaptiveModeration(PARANDIS_ADAPTER *pContext);
 
 static __inline pRxNetDescriptor ReceiveQueueGetBuffer(PPARANDIS_RECEIVE_QUEUE pQueue);
 
@@ -79,6 +80,7 @@ typedef struct _tagConfigurationEntries
     tConfigurationEntry debugLevel;
     tConfigurationEntry TxCapacity;
     tConfigurationEntry RxCapacity;
+    tConfigurationEntry RxCopyThreshold;
     tConfigurationEntry OffloadTxChecksum;
     tConfigurationEntry OffloadTxLSO;
     tConfigurationEntry OffloadRxCS;
@@ -94,13 +96,16 @@ typedef struct _tagConfigurationEntries
     tConfigurationEntry VlanId;
     tConfigurationEntry MTU;
     tConfigurationEntry NumberOfHandledRXPacketsInDPC;
+    tConfigurationEntry InterruptModeration;
 #if PARANDIS_SUPPORT_RSS
     tConfigurationEntry RSSOffloadSupported;
     tConfigurationEntry NumRSSQueues;
+    tConfigurationEntry TxSteering;
 #endif
 #if PARANDIS_SUPPORT_RSC
     tConfigurationEntry RSCIPv4Supported;
     tConfigurationEntry RSCIPv6Supported;
+    tConfigurationEntry SoftwareRSC;
 #endif
 }tConfigurationEntries;
 
@@ -112,6 +117,7 @@ static const tConfigurationEntries defaultConfiguration =
     { "DebugLevel",     2,  0,  8 },
     { "TxCapacity",     1024,   16, 1024 },
     { "RxCapacity",     256, 32, 1024 },
+    { "RxCopyThreshold", PARANDIS_RX_COPY_THRESHOLD_DEFAULT, 0, 1514 },
     { "Offload.TxChecksum", 0, 0, 31},
     { "Offload.TxLSO",  0, 0, 2},
     { "Offload.RxCS",   0, 0, 31},
@@ -127,13 +133,16 @@ static const tConfigurationEntries defaultConfiguration =
     { "VlanId", 0, 0, MAX_VLAN_ID},
     { "MTU", 1500, 576, 65500},
     { "NumberOfHandledRXPacketsInDPC", MAX_RX_LOOPS, 1, 10000},
+    { "*InterruptModeration", imAdaptive, imDisabled, imAdaptive},
 #if PARANDIS_SUPPORT_RSS
     { "*RSS", 1, 0, 1},
     { "*NumRssQueues", 8, 1, PARANDIS_RSS_MAX_RECEIVE_QUEUES},
+    { "TxSteering", txsRSS, txsRSS, txsCPU},
 #endif
 #if PARANDIS_SUPPORT_RSC
     { "*RscIPv4", 1, 0, 1},
     { "*RscIPv6", 1, 0, 1},
+    { "SoftwareRsc", 0, 0, 1},
 #endif
 };
 
@@ -199,26 +208,6 @@ static void GetConfigurationEntry(NDIS_HANDLE cfg, tConfigurationEntry *pEntry)
     if (name.Buffer) NdisFreeString(name);
 }
 
-static void DisableLSOv4Permanently(PARANDIS_ADAPTER *pContext, LPCSTR procname, LPCSTR reason)
-{
-    if (pContext->Offload.flagsValue & osbT4Lso)
-    {
-        DPrintf(0, "[%s] Warning: %s", procname, reason);
-        pContext->Offload.flagsValue &= ~osbT4Lso;
-        ParaNdis_ResetOffloadSettings(pContext, NULL, NULL);
-    }
-}
-
-static void DisableLSOv6Permanently(PARANDIS_ADAPTER *pContext, LPCSTR procname, LPCSTR reason)
-{
-    if (pContext->Offload.flagsValue & osbT6Lso)
-    {
-        DPrintf(0, "[%s] Warning: %s\n", procname, reason);
-        pContext->Offload.flagsValue &= ~osbT6Lso;
-        ParaNdis_ResetOffloadSettings(pContext, NULL, NULL);
-    }
-}
-
 /**********************************************************
 Loads NIC parameters from adapter registry key
 Parameters:
@@ -241,6 +230,7 @@ static void ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
             GetConfigurationEntry(cfg, &pConfiguration->PrioritySupport);
             GetConfigurationEntry(cfg, &pConfiguration->TxCapacity);
             GetConfigurationEntry(cfg, &pConfiguration->RxCapacity);
+            GetConfigurationEntry(cfg, &pConfiguration->RxCopyThreshold);
             GetConfigurationEntry(cfg, &pConfiguration->OffloadTxChecksum);
             GetConfigurationEntry(cfg, &pConfiguration->OffloadTxLSO);
             GetConfigurationEntry(cfg, &pConfiguration->OffloadRxCS);
@@ -256,20 +246,25 @@ static void ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
             GetConfigurationEntry(cfg, &pConfiguration->VlanId);
             GetConfigurationEntry(cfg, &pConfiguration->MTU);
             GetConfigurationEntry(cfg, &pConfiguration->NumberOfHandledRXPacketsInDPC);
+            GetConfigurationEntry(cfg, &pConfiguration->InterruptModeration);
 #if PARANDIS_SUPPORT_RSS
             GetConfigurationEntry(cfg, &pConfiguration->RSSOffloadSupported);
             GetConfigurationEntry(cfg, &pConfiguration->NumRSSQueues);
+            GetConfigurationEntry(cfg, &pConfiguration->TxSteering);
 #endif
 #if PARANDIS_SUPPORT_RSC
             GetConfigurationEntry(cfg, &pConfiguration->RSCIPv4Supported);
             GetConfigurationEntry(cfg, &pConfiguration->RSCIPv6Supported);
+            GetConfigurationEntry(cfg, &pConfiguration->SoftwareRSC);
 #endif
 
             bDebugPrint = pConfiguration->isLogEnabled.ulValue;
             virtioDebugLevel = pConfiguration->debugLevel.ulValue;
             pContext->maxFreeTxDescriptors = pConfiguration->TxCapacity.ulValue;
             pContext->NetMaxReceiveBuffers = pConfiguration->RxCapacity.ulValue;
+            pContext->uRxCopyThreshold = pConfiguration->RxCopyThreshold.ulValue;
             pContext->uNumberOfHandledRXPacketsInDPC = pConfiguration->NumberOfHandledRXPacketsInDPC.ulValue;
+            pContext->InterruptModeration = (tInterruptModeration) pConfiguration->InterruptModeration.ulValue;
             pContext->bDoSupportPriority = pConfiguration->PrioritySupport.ulValue != 0;
             pContext->ulFormalLinkSpeed  = pConfiguration->ConnectRate.ulValue;
             pContext->ulFormalLinkSpeed *= 1000000;
@@ -305,10 +300,12 @@ static void ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
 #if PARANDIS_SUPPORT_RSS
             pContext->bRSSOffloadSupported = pConfiguration->RSSOffloadSupported.ulValue ? TRUE : FALSE;
             pContext->RSSMaxQueuesNumber = (CCHAR) pConfiguration->NumRSSQueues.ulValue;
+            pContext->TxSteering = (tTxSteering) pConfiguration->TxSteering.ulValue;
 #endif
 #if PARANDIS_SUPPORT_RSC
             pContext->RSC.bIPv4SupportedSW = (UCHAR)pConfiguration->RSCIPv4Supported.ulValue;
             pContext->RSC.bIPv6SupportedSW = (UCHAR)pConfiguration->RSCIPv6Supported.ulValue;
+            pContext->RSC.bSoftwareCoalescing = (UCHAR)pConfiguration->SoftwareRSC.ulValue;
 #endif
             if (!pContext->bDoSupportPriority)
                 pContext->ulPriorityVlanSetting = 0;
@@ -402,6 +399,7 @@ static void DumpVirtIOFeatures(PPARANDIS_ADAPTER pContext)
         {VIRTIO_NET_F_CTRL_RX_EXTRA, "VIRTIO_NET_F_CTRL_RX_EXTRA"},
         {VIRTIO_NET_F_CTRL_MAC_ADDR, "VIRTIO_NET_F_CTRL_MAC_ADDR"},
         {VIRTIO_NET_F_MQ, "VIRTIO_NET_F_MQ"},
+        {VIRTIO_NET_F_NOTF_COAL, "VIRTIO_NET_F_NOTF_COAL"},
         {VIRTIO_RING_F_INDIRECT_DESC, "VIRTIO_RING_F_INDIRECT_DESC"},
         {VIRTIO_F_ANY_LAYOUT, "VIRTIO_F_ANY_LAYOUT"},
         {VIRTIO_RING_F_EVENT_IDX, "VIRTIO_RING_F_EVENT_IDX"},
@@ -431,8 +429,92 @@ AckFeature(PPARANDIS_ADAPTER pContext, UINT64 Feature)
 /**********************************************************
 Prints out statistics
 ***********************************************************/
+/* Sums the per-CPU counters into the adapter's Statistics and
+   extraStatistics, called before those are reported */
+void ParaNdis_CollectStatistics(PARANDIS_ADAPTER *pContext)
+{
+    tCpuStatistics Total = {};
+
+    for (ULONG i = 0; pContext->pCpuStatistics != NULL && i < pContext->nCpuStatistics; i++)
+    {
+        const tCpuStatistics *pCpu = &pContext->pCpuStatistics[i];
+
+        Total.ifHCInOctets += pCpu->ifHCInOctets;
+        Total.ifHCInUcastPkts += pCpu->ifHCInUcastPkts;
+        Total.ifHCInUcastOctets += pCpu->ifHCInUcastOctets;
+        Total.ifHCInMulticastPkts += pCpu->ifHCInMulticastPkts;
+        Total.ifHCInMulticastOctets += pCpu->ifHCInMulticastOctets;
+        Total.ifHCInBroadcastPkts += pCpu->ifHCInBroadcastPkts;
+        Total.ifHCInBroadcastOctets += pCpu->ifHCInBroadcastOctets;
+        Total.ifInErrors += pCpu->ifInErrors;
+        Total.ifInDiscards += pCpu->ifInDiscards;
+        Total.ifHCOutOctets += pCpu->ifHCOutOctets;
+        Total.ifHCOutUcastPkts += pCpu->ifHCOutUcastPkts;
+        Total.ifHCOutUcastOctets += pCpu->ifHCOutUcastOctets;
+        Total.ifHCOutMulticastPkts += pCpu->ifHCOutMulticastPkts;
+        Total.ifHCOutMulticastOctets += pCpu->ifHCOutMulticastOctets;
+        Total.ifHCOutBroadcastPkts += pCpu->ifHCOutBroadcastPkts;
+        Total.ifHCOutBroadcastOctets += pCpu->ifHCOutBroadcastOctets;
+
+        Total.Extra.framesCSOffload += pCpu->Extra.framesCSOffload;
+        Total.Extra.framesLSO += pCpu->Extra.framesLSO;
+        Total.Extra.framesRxPriority += pCpu->Extra.framesRxPriority;
+        Total.Extra.framesRxCSHwOK += pCpu->Extra.framesRxCSHwOK;
+        Total.Extra.framesFilteredOut += pCpu->Extra.framesFilteredOut;
+        Total.Extra.framesCoalescedHost += pCpu->Extra.framesCoalescedHost;
+        Total.Extra.framesCoalescedWindows += pCpu->Extra.framesCoalescedWindows;
+        Total.Extra.framesCoalescedSoftware += pCpu->Extra.framesCoalescedSoftware;
+        for (ULONG j = 0; j < PARANDIS_RX_SIZE_CLASSES; j++)
+        {
+            Total.Extra.framesRxBySize[j] += pCpu->Extra.framesRxBySize[j];
+            Total.Extra.framesRxCopied[j] += pCpu->Extra.framesRxCopied[j];
+        }
+        Total.Extra.framesRxCopyNoBuffer += pCpu->Extra.framesRxCopyNoBuffer;
+    }
+
+    pContext->Statistics.ifHCInOctets = Total.ifHCInOctets;
+    pContext->Statistics.ifHCInUcastPkts = Total.ifHCInUcastPkts;
+    pContext->Statistics.ifHCInUcastOctets = Total.ifHCInUcastOctets;
+    pContext->Statistics.ifHCInMulticastPkts = Total.ifHCInMulticastPkts;
+    pContext->Statistics.ifHCInMulticastOctets = Total.ifHCInMulticastOctets;
+    pContext->Statistics.ifHCInBroadcastPkts = Total.ifHCInBroadcastPkts;
+    pContext->Statistics.ifHCInBroadcastOctets = Total.ifHCInBroadcastOctets;
+    pContext->Statistics.ifInErrors = Total.ifInErrors;
+    pContext->Statistics.ifInDiscards = Total.ifInDiscards;
+    pContext->Statistics.ifHCOutOctets = Total.ifHCOutOctets;
+    pContext->Statistics.ifHCOutUcastPkts = Total.ifHCOutUcastPkts;
+    pContext->Statistics.ifHCOutUcastOctets = Total.ifHCOutUcastOctets;
+    pContext->Statistics.ifHCOutMulticastPkts = Total.ifHCOutMulticastPkts;
+    pContext->Statistics.ifHCOutMulticastOctets = Total.ifHCOutMulticastOctets;
+    pContext->Statistics.ifHCOutBroadcastPkts = Total.ifHCOutBroadcastPkts;
+    pContext->Statistics.ifHCOutBroadcastOctets = Total.ifHCOutBroadcastOctets;
+    pContext->extraStatistics = Total.Extra;
+}
+
+/* Racy against the data path, as the WMI reset always was */
+void ParaNdis_ResetExtraStatistics(PARANDIS_ADAPTER *pContext)
+{
+    for (ULONG i = 0; pContext->pCpuStatistics != NULL && i < pContext->nCpuStatistics; i++)
+    {
+        RtlZeroMemory(&pContext->pCpuStatistics[i].Extra, sizeof(pContext->pCpuStatistics[i].Extra));
+    }
+    RtlZeroMemory(&pContext->extraStatistics, sizeof(pContext->extraStatistics));
+}
+
+/* Racy against the data path as well */
+void ParaNdis_ResetLatencyHistograms(PARANDIS_ADAPTER *pContext)
+{
+    for (UINT i = 0; i < pContext->nPathBundles; i++)
+    {
+        RtlZeroMemory(&pContext->pPathBundles[i].rxPath.QueueLatency(), sizeof(tQueueLatency));
+        RtlZeroMemory(&pContext->pPathBundles[i].txPath.QueueLatency(), sizeof(tQueueLatency));
+    }
+}
+
 static void PrintStatistics(PARANDIS_ADAPTER *pContext)
 {
+    ParaNdis_CollectStatistics(pContext);
+
     ULONG64 totalTxFrames =
         pContext->Statistics.ifHCOutBroadcastPkts +
         pContext->Statistics.ifHCOutMulticastPkts +
@@ -463,6 +545,55 @@ static void PrintStatistics(PARANDIS_ADAPTER *pContext)
     DPrintf(0, "[Diag!] Rx frames %I64u, Rx.Pri %d, RxHwCS.OK %d, FiltOut %d\n",
         totalRxFrames, pContext->extraStatistics.framesRxPriority,
         pContext->extraStatistics.framesRxCSHwOK, pContext->extraStatistics.framesFilteredOut);
+    DPrintf(0, "[Diag!] Rx coalesced: host %d, windows %d, software %d\n",
+        pContext->extraStatistics.framesCoalescedHost,
+        pContext->extraStatistics.framesCoalescedWindows,
+        pContext->extraStatistics.framesCoalescedSoftware);
+    DPrintf(0, "[Diag!] Rx copy threshold %d, no copy buffer %d\n",
+        pContext->uRxCopyThreshold, pContext->extraStatistics.framesRxCopyNoBuffer);
+    for (ULONG i = 0; i < PARANDIS_RX_SIZE_CLASSES; i++)
+    {
+        DPrintf(0, "[Diag!] Rx frames %s %d bytes: %d, copied %d\n",
+            i < PARANDIS_RX_SIZE_CLASSES - 1 ? "up to" : "above", 64 << min(i, PARANDIS_RX_SIZE_CLASSES - 2),
+            pContext->extraStatistics.framesRxBySize[i], pContext->extraStatistics.framesRxCopied[i]);
+    }
+    if (pContext->bCXPathCreated)
+    {
+        DPrintf(0, "[Diag!] Control commands failed %d\n", pContext->CXPath.GetFailedCommands());
+    }
+    if (pContext->nPathBundles > 1)
+    {
+        DPrintf(0, "[Diag!] Queue pairs %d of %d, used by TX %d, changes %d\n",
+            pContext->nQueuePairsSet, pContext->nPathBundles,
+            pContext->nActivePathBundles, pContext->nQueuePairsChanges);
+    }
+#if PARANDIS_SUPPORT_RSS
+    if (pContext->bRSSInitialized)
+    {
+        DPrintf(0, "[Diag!] RSS migrations drained %d, forced %d, frames held %d, reclassified %d\n",
+            pContext->RSSParameters.MigrationsDrained, pContext->RSSParameters.MigrationsForced,
+            pContext->RSSParameters.FramesHeld, pContext->RSSParameters.FramesReclassified);
+    }
+#endif
+    if (pContext->bNotfCoalSupported)
+    {
+        DPrintf(0, "[Diag!] Interrupt moderation %d, coalescing profile %d, changes %d\n",
+            pContext->InterruptModeration, pContext->NotfCoal.Level, pContext->NotfCoal.LevelChanges);
+    }
+    for (UINT i = 0; i < pContext->nPathBundles; i++)
+    {
+        CParaNdisRX &rxPath = pContext->pPathBundles[i].rxPath;
+        ULONG nReturned = rxPath.GetReturnedBuffers();
+        ULONG nLocks = rxPath.GetReturnLockAcquisitions();
+        DPrintf(0, "[Diag!] Rx queue %d: returned %d, locks %d (%d per 1000 returns)\n",
+            i, nReturned, nLocks, nReturned ? (ULONG)((ULONG64)nLocks * 1000 / nReturned) : 0);
+    }
+    for (UINT i = 0; i < pContext->nPathBundles; i++)
+    {
+        ULONG64 txPackets = pContext->pPathBundles[i].txPath.QueueStatistics().Packets;
+        DPrintf(0, "[Diag!] Tx queue %d: frames %I64u (%d per 1000)\n",
+            i, txPackets, totalTxFrames ? (ULONG)(txPackets * 1000 / totalTxFrames) : 0);
+    }
 }
 
 static
@@ -472,6 +603,8 @@ VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
 
     pContext->RSC.bIPv4Enabled = FALSE;
     pContext->RSC.bIPv6Enabled = FALSE;
+    pContext->RSC.bIPv4Software = FALSE;
+    pContext->RSC.bIPv6Software = FALSE;
 
     if(!pContext->bGuestChecksumSupported)
     {
@@ -491,6 +624,13 @@ VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
         pContext->RSC.bIPv4EnabledQEMU =
             pContext->RSC.bIPv4SupportedQEMU =
                 bDynamicOffloadsPossible && AckFeature(pContext, VIRTIO_F_VERSION_1) && AckFeature(pContext, VIRTIO_NET_F_GUEST_RSC4);
+
+        if (!pContext->RSC.bIPv4SupportedHW && pContext->RSC.bSoftwareCoalescing)
+        {
+            pContext->RSC.bIPv4Enabled =
+                pContext->RSC.bIPv4SupportedHW =
+                    pContext->RSC.bIPv4Software = TRUE;
+        }
     }
     else
     {
@@ -511,6 +651,13 @@ VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
         pContext->RSC.bIPv6EnabledQEMU =
             pContext->RSC.bIPv6SupportedQEMU =
                 bDynamicOffloadsPossible && AckFeature(pContext, VIRTIO_F_VERSION_1) && AckFeature(pContext, VIRTIO_NET_F_GUEST_RSC6);
+
+        if (!pContext->RSC.bIPv6SupportedHW && pContext->RSC.bSoftwareCoalescing)
+        {
+            pContext->RSC.bIPv6Enabled =
+                pContext->RSC.bIPv6SupportedHW =
+                    pContext->RSC.bIPv6Software = TRUE;
+        }
     }
     else
     {
@@ -522,13 +669,17 @@ VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
             bDynamicOffloadsPossible && AckFeature(pContext, VIRTIO_F_VERSION_1) && AckFeature(pContext, VIRTIO_NET_F_GUEST_RSC6);
     }
 
-    pContext->RSC.bHasDynamicConfig = (pContext->RSC.bIPv4Enabled || pContext->RSC.bIPv6Enabled ||
+    pContext->RSC.bHasDynamicConfig = ((pContext->RSC.bIPv4Enabled && !pContext->RSC.bIPv4Software) ||
+                                      (pContext->RSC.bIPv6Enabled && !pContext->RSC.bIPv6Software) ||
                                       pContext->RSC.bIPv4SupportedQEMU || pContext->RSC.bIPv6SupportedQEMU) &&
                                       bDynamicOffloadsPossible;
 
     DPrintf(0, "[%s] Guest TSO state: IP4=%d, IP6=%d, Dynamic=%d\n", __FUNCTION__,
         pContext->RSC.bIPv4Enabled, pContext->RSC.bIPv6Enabled, pContext->RSC.bHasDynamicConfig);
 
+    DPrintf(0, "[%s] Software RSC state: IP4=%d, IP6=%d\n", __FUNCTION__,
+        pContext->RSC.bIPv4Software, pContext->RSC.bIPv6Software);
+
     DPrintf(0, "[%s] Guest QEMU RSC support state: Supported IP4=%d, Supported IP6=%d, Enabled IP4=%d, Enabled IP6=%d\n", __FUNCTION__,
         pContext->RSC.bIPv4SupportedQEMU, pContext->RSC.bIPv6SupportedQEMU, pContext->RSC.bIPv4EnabledQEMU, pContext->RSC.bIPv6EnabledQEMU);
 #else
@@ -680,6 +831,24 @@ NDIS_STATUS ParaNdis_InitializeContext(
 
     new (&pContext->guestAnnouncePackets) CGuestAnnouncePackets(pContext);
 
+    // one spare block to align the array to the cache line
+    pContext->nCpuStatistics = ParaNdis_GetSystemCPUCount();
+    pContext->pCpuStatisticsMemory = ParaNdis_AllocateMemory(pContext,
+        (pContext->nCpuStatistics + 1) * sizeof(tCpuStatistics));
+    if (pContext->pCpuStatisticsMemory == NULL)
+    {
+        DPrintf(0, "[%s] Failed to allocate statistics for %d CPUs\n", __FUNCTION__, pContext->nCpuStatistics);
+        status = NDIS_STATUS_RESOURCES;
+        DEBUG_EXIT_STATUS(0, status);
+        return status;
+    }
+    NdisZeroMemory(pContext->pCpuStatisticsMemory, (pContext->nCpuStatistics + 1) * sizeof(tCpuStatistics));
+    pContext->pCpuStatistics = (tCpuStatistics *)ALIGN_UP_POINTER_BY(pContext->pCpuStatisticsMemory, SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    LARGE_INTEGER Frequency;
+    KeQueryPerformanceCounter(&Frequency);
+    pContext->ulLatencyTicksPerUs = max((ULONG)(Frequency.QuadPart / 1000000), 1ul);
+
     if (pContext->PciResources.Init(pContext->MiniportHandle, pResourceList))
     {
         if (pContext->PciResources.GetInterruptFlags() & CM_RESOURCE_INTERRUPT_MESSAGE)
@@ -751,6 +920,8 @@ NDIS_STATUS ParaNdis_InitializeContext(
         pContext->nHardwareQueues = 1;
     }
 
+    pContext->bNotfCoalSupported = pContext->bControlQueueSupported && AckFeature(pContext, VIRTIO_NET_F_NOTF_COAL);
+
     dependentOptions = osbT4TcpChecksum | osbT4UdpChecksum | osbT4TcpOptionsChecksum |
         osbT6TcpChecksum | osbT6UdpChecksum | osbT6TcpOptionsChecksum | osbT6IpExtChecksum;
 
@@ -768,14 +939,19 @@ NDIS_STATUS ParaNdis_InitializeContext(
     // configuration of offload tasks
     ParaNdis_ResetOffloadSettings(pContext, NULL, NULL);
 
+    pContext->Offload.bHostChecksum = AckFeature(pContext, VIRTIO_NET_F_CSUM);
+
+    // LSO stays advertised to the OS, packets are segmented by the driver
     if (pContext->Offload.flags.fTxLso && !AckFeature(pContext, VIRTIO_NET_F_HOST_TSO4))
     {
-        DisableLSOv4Permanently(pContext, __FUNCTION__, "Host does not support TSOv4\n");
+        DPrintf(0, "[%s] Host does not support TSOv4, using software segmentation\n", __FUNCTION__);
+        pContext->Offload.bSoftwareLsov4 = TRUE;
     }
 
     if (pContext->Offload.flags.fTxLsov6 && !AckFeature(pContext, VIRTIO_NET_F_HOST_TSO6))
     {
-        DisableLSOv6Permanently(pContext, __FUNCTION__, "Host does not support TSOv6");
+        DPrintf(0, "[%s] Host does not support TSOv6, using software segmentation\n", __FUNCTION__);
+        pContext->Offload.bSoftwareLsov6 = TRUE;
     }
 
     pContext->bUseIndirect = AckFeature(pContext, VIRTIO_RING_F_INDIRECT_DESC);
@@ -821,6 +997,12 @@ void ParaNdis_FreeRxBufferDescriptor(PARANDIS_ADAPTER *pContext, pRxNetDescripto
     ULONG i;
 
     ParaNdis_UnbindRxBufferFromPacket(p);
+    if (p->InArena)
+    {
+        // the memory is released with the whole arena, see CParaNdisRX::FreeRxArena
+        return;
+    }
+
     for(i = 0; i < p->BufferSGLength; i++)
     {
         ParaNdis_FreePhysicalMemory(pContext, &p->PhysicalPages[i]);
@@ -1019,6 +1201,193 @@ NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext)
     NdisFreeMemoryWithTagPriority(pContext->MiniportHandle, cpuIndexTable, PARANDIS_MEMORY_TAG);
     return NDIS_STATUS_SUCCESS;
 }
+
+/* time given to the TX of the queue pairs being disabled to complete */
+#define PARANDIS_QUEUE_PAIRS_DRAIN_MS   100
+
+/* The bundle of each CPU is fixed, so the queue pairs needed by the
+   indirection table are the ones up to the highest referenced bundle */
+static UINT QueuePairsForRSS(PARANDIS_ADAPTER *pContext)
+{
+    ULONG rssTableSize = pContext->RSSParameters.RSSScalingSettings.IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
+    UINT nPairs = 1;
+
+    if (pContext->RSSParameters.RSSMode != PARANDIS_RSS_FULL || pContext->RSS2QueueMap == nullptr)
+    {
+        return pContext->nPathBundles;
+    }
+
+    for (ULONG rssIndex = 0; rssIndex < rssTableSize; rssIndex++)
+    {
+        UINT bundleIndex = UINT(pContext->RSS2QueueMap[rssIndex] - pContext->pPathBundles);
+        if (bundleIndex >= nPairs)
+        {
+            nPairs = bundleIndex + 1;
+        }
+    }
+
+    return nPairs;
+}
+
+/**********************************************************
+Control queue completion of VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, the commands
+complete in the order they were sent, so the last answer is what the
+device uses. The RSS lock can't be taken here, the work item applies it.
+***********************************************************/
+static VOID OnQueuePairsSet(PVOID Context, ULONG_PTR Param, BOOLEAN bOK)
+{
+    PARANDIS_ADAPTER *pContext = (PARANDIS_ADAPTER *)Context;
+    UINT nPairs = UINT(Param);
+
+    if (bOK)
+    {
+        DPrintf(0, "[%s] %u of %u queue pairs enabled\n", __FUNCTION__, nPairs, pContext->nPathBundles);
+        pContext->nQueuePairsSet = nPairs;
+        pContext->nQueuePairsChanges++;
+    }
+    else
+    {
+        DPrintf(0, "[%s] - %u queue pairs rejected, the device keeps %u\n", __FUNCTION__, nPairs, pContext->nQueuePairsSet);
+        // allows to request them again, unless another request is already sent
+        InterlockedCompareExchange(&pContext->nQueuePairsRequested, LONG(pContext->nQueuePairsSet), LONG(nPairs));
+    }
+
+    ParaNdis_TrimQueuePairs(pContext);
+}
+
+/* Sends the queue pair count to the device without waiting for the answer,
+   called under RSS write lock */
+static VOID RequestQueuePairs(PARANDIS_ADAPTER *pContext, UINT nPairs)
+{
+    u16 nPaths = u16(nPairs);
+
+    InterlockedExchange(&pContext->nQueuePairsRequested, LONG(nPairs));
+    if (!pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &nPaths, sizeof(nPaths), NULL, 0, 2,
+                                              OnQueuePairsSet, pContext, nPairs))
+    {
+        DPrintf(0, "[%s] - %u queue pairs not sent\n", __FUNCTION__, nPairs);
+        InterlockedExchange(&pContext->nQueuePairsRequested, LONG(pContext->nQueuePairsSet));
+    }
+}
+
+/**********************************************************
+Follows the queues the RSS indirection table refers to. More queue
+pairs are requested from the device and used by the TX path once it
+enables them, fewer are only stopped being used here, the device is
+told later by ParaNdis_TrimQueuePairs when their sends are completed.
+Called under RSS write lock after ParaNdis_SetupRSSQueueMap
+***********************************************************/
+VOID ParaNdis_UpdateQueuePairs(PARANDIS_ADAPTER *pContext)
+{
+    if (pContext->nPathBundles <= 1 || !pContext->bCXPathCreated)
+    {
+        return;
+    }
+
+    UINT nPairs = QueuePairsForRSS(pContext);
+
+    if (nPairs > UINT(pContext->nQueuePairsRequested))
+    {
+        RequestQueuePairs(pContext, nPairs);
+    }
+
+    pContext->nActivePathBundles = min(nPairs, pContext->nQueuePairsSet);
+}
+
+/**********************************************************
+Applies the answers of the device to the TX path and disables on the
+device the queue pairs the driver does not use anymore, once everything
+sent on them is completed. The buffers of their receive queues stay
+posted: without a per-queue reset they cannot be taken back while the
+device runs, they are used again when the queue pairs are enabled.
+Returns TRUE when it has to be called again to see the sends completed.
+Called at PASSIVE_LEVEL from the work item
+***********************************************************/
+static BOOLEAN ApplyQueuePairs(PARANDIS_ADAPTER *pContext)
+{
+    CNdisPassiveWriteAutoLock autoLock(pContext->RSSParameters.rwLock);
+    UINT nPairs = QueuePairsForRSS(pContext);
+    UINT nSet = pContext->nQueuePairsSet;
+
+    pContext->nActivePathBundles = min(nPairs, nSet);
+
+    // nothing to disable, or more queue pairs are still to be enabled
+    if (nPairs >= UINT(pContext->nQueuePairsRequested))
+    {
+        return FALSE;
+    }
+
+    for (UINT i = nPairs; i < nSet; i++)
+    {
+        if (pContext->pPathBundles[i].txPath.HasOutstandingNBLs())
+        {
+            return TRUE;
+        }
+    }
+
+    RequestQueuePairs(pContext, nPairs);
+    return FALSE;
+}
+
+static VOID QueuePairsWorkItem(PVOID WorkItemContext, NDIS_HANDLE NdisIoWorkItemHandle)
+{
+    PARANDIS_ADAPTER *pContext = (PARANDIS_ADAPTER *)WorkItemContext;
+    LONG nRequests;
+
+    NdisFreeIoWorkItem(NdisIoWorkItemHandle);
+
+    // runs again if it was requested in the meantime
+    do
+    {
+        nRequests = pContext->nQueuePairsWork;
+
+        UINT i;
+        for (i = 0; i < PARANDIS_QUEUE_PAIRS_DRAIN_MS && ApplyQueuePairs(pContext); i++)
+        {
+            NdisMSleep(1000);
+        }
+        if (i == PARANDIS_QUEUE_PAIRS_DRAIN_MS)
+        {
+            DPrintf(0, "[%s] TX of queue pairs %u..%u is not drained, they stay enabled\n",
+                __FUNCTION__, pContext->nActivePathBundles, pContext->nQueuePairsSet - 1);
+        }
+    } while (InterlockedCompareExchange(&pContext->nQueuePairsWork, 0, nRequests) != nRequests);
+}
+
+/**********************************************************
+Queues the work item that follows the queue pairs enabled by the device
+and trims the ones not used anymore, so neither the OID nor the control
+queue DPC waits for the sends to complete
+Called at IRQL <= DISPATCH_LEVEL, not under RSS lock
+***********************************************************/
+VOID ParaNdis_TrimQueuePairs(PARANDIS_ADAPTER *pContext)
+{
+    if (pContext->nPathBundles <= 1 || !pContext->bCXPathCreated)
+    {
+        return;
+    }
+
+    if (InterlockedIncrement(&pContext->nQueuePairsWork) == 1)
+    {
+        NDIS_HANDLE hwo = NdisAllocateIoWorkItem(pContext->MiniportHandle);
+        if (hwo == NULL)
+        {
+            DPrintf(0, "[%s] - no work item, queue pairs stay as they are\n", __FUNCTION__);
+            InterlockedExchange(&pContext->nQueuePairsWork, 0);
+            return;
+        }
+        NdisQueueIoWorkItem(hwo, QueuePairsWorkItem, pContext);
+    }
+}
+
+/* Called at PASSIVE_LEVEL when the DPCs do not run anymore */
+VOID ParaNdis_WaitForQueuePairsWork(PARANDIS_ADAPTER *pContext)
+{
+    while (pContext->nQueuePairsWork)
+    {
+        NdisMSleep(1000);
+    }
+}
 #endif
 
 /**********************************************************
@@ -1042,6 +1411,9 @@ static NDIS_STATUS ParaNdis_VirtIONetInit(PARANDIS_ADAPTER *pContext)
         DPrintf(0, "[%s] - no I/O paths\n", __FUNCTION__);
         return NDIS_STATUS_RESOURCES;
     }
+    pContext->nQueuePairsSet = pContext->nPathBundles;
+    pContext->nQueuePairsRequested = LONG(pContext->nPathBundles);
+    pContext->nActivePathBundles = pContext->nPathBundles;
 
     NTSTATUS nt_status = virtio_reserve_queue_memory(&pContext->IODevice, nVirtIOQueues);
     if (!NT_SUCCESS(nt_status))
@@ -1137,8 +1509,8 @@ void ParaNdis_DeviceConfigureRSC(PARANDIS_ADAPTER *pContext)
     UINT64 GuestOffloads;
 
     GuestOffloads = 1 << VIRTIO_NET_F_GUEST_CSUM |
-        ((pContext->RSC.bIPv4Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
-        ((pContext->RSC.bIPv6Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
+        ((pContext->RSC.bIPv4Enabled && !pContext->RSC.bIPv4Software) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
+        ((pContext->RSC.bIPv6Enabled && !pContext->RSC.bIPv6Software) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
         ((pContext->RSC.bIPv4EnabledQEMU) ? ((UINT64)1 << VIRTIO_NET_F_GUEST_RSC4) : 0) |
         ((pContext->RSC.bIPv6EnabledQEMU) ? ((UINT64)1 << VIRTIO_NET_F_GUEST_RSC6) : 0);
 
@@ -1157,7 +1529,9 @@ NDIS_STATUS ParaNdis_DeviceConfigureMultiQueue(PARANDIS_ADAPTER *pContext)
 
     if (pContext->nPathBundles > 1)
     {
-        u16 nPaths = u16(pContext->nPathBundles);
+        u16 nPaths = u16(pContext->nQueuePairsSet);
+        // the requests the device did not answer before the reset are dropped
+        pContext->nQueuePairsRequested = LONG(pContext->nQueuePairsSet);
         if (!pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &nPaths, sizeof(nPaths), NULL, 0, 2))
         {
             DPrintf(0, "[%s] - Sending MQ control message failed\n", __FUNCTION__);
@@ -1191,6 +1565,9 @@ NDIS_STATUS ParaNdis_DeviceEnterD0(PARANDIS_ADAPTER *pContext)
     ParaNdis_DeviceConfigureMultiQueue(pContext);
     ParaNdis_DeviceConfigureRSC(pContext);
     ParaNdis_UpdateMAC(pContext);
+    /* the device forgot the coalescing parameters on reset */
+    pContext->NotfCoal.Level = -1;
+    ParaNdis_SetInterruptModeration(pContext, pContext->InterruptModeration);
     ParaNdis_KickRX(pContext);
 
     DEBUG_EXIT_STATUS(0, status);
@@ -1334,6 +1711,10 @@ VOID ParaNdis_CleanupContext(PARANDIS_ADAPTER *pContext)
 
     PreventDPCServicing(pContext);
 
+#if PARANDIS_SUPPORT_RSS
+    ParaNdis_WaitForQueuePairsWork(pContext);
+#endif
+
     /****************************************
     ensure all the incoming packets returned,
     free all the buffers and their descriptors
@@ -1396,6 +1777,13 @@ VOID ParaNdis_CleanupContext(PARANDIS_ADAPTER *pContext)
     virtio_device_shutdown(&pContext->IODevice);
 
     pContext->PciResources.~CPciResources();
+
+    if (pContext->pCpuStatisticsMemory)
+    {
+        NdisFreeMemory(pContext->pCpuStatisticsMemory, 0, 0);
+        pContext->pCpuStatisticsMemory = NULL;
+        pContext->pCpuStatistics = NULL;
+    }
 }
 
 
@@ -1414,8 +1802,6 @@ VOID ParaNdis_OnShutdown(PARANDIS_ADAPTER *pContext)
 
 static ULONG ShallPassPacket(PARANDIS_ADAPTER *pContext, PNET_PACKET_INFO pPacketInfo)
 {
-    ULONG i;
-
     if (pPacketInfo->dataLength > pContext->MaxPacketSize.nMaxFullSizeOsRx + ETH_PRIORITY_HEADER_SIZE)
         return FALSE;
 
@@ -1455,18 +1841,8 @@ static ULONG ShallPassPacket(PARANDIS_ADAPTER *pContext, PNET_PACKET_INFO pPacke
     if(!(pContext->PacketFilter & NDIS_PACKET_TYPE_MULTICAST))
         return FALSE;
 
-    for (i = 0; i < pContext->MulticastData.nofMulticastEntries; i++)
-    {
-        ULONG Res;
-        PUCHAR CurrMcastAddr = &pContext->MulticastData.MulticastList[i*ETH_ALEN];
-
-        ETH_COMPARE_NETWORK_ADDRESSES_EQ(pPacketInfo->ethDestAddr, CurrMcastAddr, &Res);
-
-        if(!Res)
-            return TRUE;
-    }
-
-    return FALSE;
+    return ParaNdis_MulticastFilterLookup(&pContext->MulticastFilters[pContext->ActiveMulticastFilter],
+                                          pPacketInfo->ethDestAddr) ? TRUE : FALSE;
 }
 
 BOOLEAN ParaNdis_PerformPacketAnalysis(
@@ -1536,17 +1912,32 @@ VOID ParaNdis_QueueRSSDpc(PARANDIS_ADAPTER *pContext, ULONG MessageIndex, PGROUP
 }
 
 
-VOID ParaNdis_ReceiveQueueAddBuffer(PPARANDIS_RECEIVE_QUEUE pQueue, pRxNetDescriptor pBuffer)
+/* Returns the position of the buffer in the queue */
+ULONG ParaNdis_ReceiveQueueAddBuffer(PPARANDIS_RECEIVE_QUEUE pQueue, pRxNetDescriptor pBuffer)
 {
-    NdisInterlockedInsertTailList(  &pQueue->BuffersList,
-                                    &pBuffer->ReceiveQueueListEntry,
-                                    &pQueue->Lock);
+    ULONG position;
+
+    NdisAcquireSpinLock(&pQueue->Lock);
+    InsertTailList(&pQueue->BuffersList, &pBuffer->ReceiveQueueListEntry);
+    position = ++pQueue->QueuedPosition;
+    NdisReleaseSpinLock(&pQueue->Lock);
+
+    return position;
 }
 
 static __inline
 pRxNetDescriptor ReceiveQueueGetBuffer(PPARANDIS_RECEIVE_QUEUE pQueue)
 {
-    PLIST_ENTRY pListEntry = NdisInterlockedRemoveHeadList(&pQueue->BuffersList, &pQueue->Lock);
+    PLIST_ENTRY pListEntry = NULL;
+
+    NdisAcquireSpinLock(&pQueue->Lock);
+    if (!IsListEmpty(&pQueue->BuffersList))
+    {
+        pListEntry = RemoveHeadList(&pQueue->BuffersList);
+        pQueue->TakenPosition++;
+    }
+    NdisReleaseSpinLock(&pQueue->Lock);
+
     return pListEntry ? CONTAINING_RECORD(pListEntry, RxNetDescriptor, ReceiveQueueListEntry) : NULL;
 }
 
@@ -1567,22 +1958,24 @@ UpdateReceiveSuccessStatistics(PPARANDIS_ADAPTER pContext,
                                PNET_PACKET_INFO pPacketInfo,
                                UINT nCoalescedSegmentsCount)
 {
-    pContext->Statistics.ifHCInOctets += pPacketInfo->dataLength;
+    tCpuStatistics *pStatistics = ParaNdis_CpuStatistics(pContext);
+
+    pStatistics->ifHCInOctets += pPacketInfo->dataLength;
 
     if(pPacketInfo->isUnicast)
     {
-        pContext->Statistics.ifHCInUcastPkts += nCoalescedSegmentsCount;
-        pContext->Statistics.ifHCInUcastOctets += pPacketInfo->dataLength;
+        pStatistics->ifHCInUcastPkts += nCoalescedSegmentsCount;
+        pStatistics->ifHCInUcastOctets += pPacketInfo->dataLength;
     }
     else if (pPacketInfo->isBroadcast)
     {
-        pContext->Statistics.ifHCInBroadcastPkts += nCoalescedSegmentsCount;
-        pContext->Statistics.ifHCInBroadcastOctets += pPacketInfo->dataLength;
+        pStatistics->ifHCInBroadcastPkts += nCoalescedSegmentsCount;
+        pStatistics->ifHCInBroadcastOctets += pPacketInfo->dataLength;
     }
     else if (pPacketInfo->isMulticast)
     {
-        pContext->Statistics.ifHCInMulticastPkts += nCoalescedSegmentsCount;
-        pContext->Statistics.ifHCInMulticastOctets += pPacketInfo->dataLength;
+        pStatistics->ifHCInMulticastPkts += nCoalescedSegmentsCount;
+        pStatistics->ifHCInMulticastOctets += pPacketInfo->dataLength;
     }
     else
     {
@@ -1593,8 +1986,100 @@ UpdateReceiveSuccessStatistics(PPARANDIS_ADAPTER pContext,
 static __inline VOID
 UpdateReceiveFailStatistics(PPARANDIS_ADAPTER pContext, UINT nCoalescedSegmentsCount)
 {
-    pContext->Statistics.ifInErrors++;
-    pContext->Statistics.ifInDiscards += nCoalescedSegmentsCount;
+    tCpuStatistics *pStatistics = ParaNdis_CpuStatistics(pContext);
+
+    pStatistics->ifInErrors++;
+    pStatistics->ifInDiscards += nCoalescedSegmentsCount;
+}
+
+static void ReuseReceiveDescriptor(pRxNetDescriptor pBufferDescriptor)
+{
+#if PARANDIS_SUPPORT_RSC
+    pRxNetDescriptor pSegment = ParaNdis_SwRscDetachSegments(pBufferDescriptor);
+    while (pSegment != NULL)
+    {
+        pRxNetDescriptor pNext = pSegment->CoalescedNext;
+        pSegment->CoalescedNext = NULL;
+        pSegment->Queue->ReuseReceiveBuffer(pSegment);
+        pSegment = pNext;
+    }
+#endif
+    pBufferDescriptor->Queue->ReuseReceiveBuffer(pBufferDescriptor);
+}
+
+/* Returned buffers are collected in the lock-free cache of their queue
+   and reposted in bulk, either here once the cache is large enough
+   or by the DPC of the queue */
+static LONG ReturnReceiveDescriptor(pRxNetDescriptor pBufferDescriptor)
+{
+    LONG nReturned = 1;
+#if PARANDIS_SUPPORT_RSC
+    pRxNetDescriptor pSegment = ParaNdis_SwRscDetachSegments(pBufferDescriptor);
+    while (pSegment != NULL)
+    {
+        pRxNetDescriptor pNext = pSegment->CoalescedNext;
+        pSegment->CoalescedNext = NULL;
+        pSegment->Queue->ReturnReceiveBuffer(pSegment);
+        if (pSegment->Queue == pBufferDescriptor->Queue)
+        {
+            nReturned++;
+        }
+        else
+        {
+            pSegment->Queue->FlushReturnedBuffersIfNeeded(1);
+        }
+        pSegment = pNext;
+    }
+#endif
+    pBufferDescriptor->Queue->ReturnReceiveBuffer(pBufferDescriptor);
+    return nReturned;
+}
+
+static void IndicateReceivedBuffer(PARANDIS_ADAPTER *pContext,
+                                   pRxNetDescriptor pBufferDescriptor,
+                                   PULONG pnPacketsToIndicateLeft,
+                                   PNET_BUFFER_LIST *indicate,
+                                   PNET_BUFFER_LIST *indicateTail,
+                                   ULONG *nIndicate)
+{
+    UINT nCoalescedSegmentsCount;
+    PNET_BUFFER_LIST packet = ParaNdis_PrepareReceivedPacket(pContext, pBufferDescriptor, &nCoalescedSegmentsCount);
+    if(packet != NULL)
+    {
+        UpdateReceiveSuccessStatistics(pContext, &pBufferDescriptor->PacketInfo, nCoalescedSegmentsCount);
+
+        PNET_BUFFER_LIST copy = ParaNdis_CopyReceivedPacket(pContext, pBufferDescriptor, packet);
+        if (copy != NULL)
+        {
+            // the frame is in the copy buffer, the ring buffer goes back right away
+            CParaNdisRX *pQueue = pBufferDescriptor->Queue;
+            pQueue->FlushReturnedBuffersIfNeeded(ReturnReceiveDescriptor(pBufferDescriptor));
+            packet = copy;
+        }
+
+        if (*indicate == nullptr)
+        {
+            *indicate = *indicateTail = packet;
+        }
+        else
+        {
+            NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = packet;
+            *indicateTail = packet;
+        }
+
+        NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = NULL;
+        // aggregations flushed at the end of the pass may go beyond the limit
+        if (*pnPacketsToIndicateLeft > 0)
+        {
+            (*pnPacketsToIndicateLeft)--;
+        }
+        (*nIndicate)++;
+    }
+    else
+    {
+        UpdateReceiveFailStatistics(pContext, nCoalescedSegmentsCount);
+        ReuseReceiveDescriptor(pBufferDescriptor);
+    }
 }
 
 static void ProcessReceiveQueue(PARANDIS_ADAPTER *pContext,
@@ -1605,6 +2090,18 @@ static void ProcessReceiveQueue(PARANDIS_ADAPTER *pContext,
                                 ULONG *nIndicate)
 {
     pRxNetDescriptor pBufferDescriptor;
+#if PARANDIS_SUPPORT_RSC
+    tSwRscContext SwRsc;
+    tSwRscContext *pSwRsc = NULL;
+
+    if (ParaNdis_SwRscIsActive(pContext))
+    {
+        ParaNdis_SwRscInit(&SwRsc,
+                           pContext->RSC.bIPv4Software && pContext->RSC.bIPv4Enabled,
+                           pContext->RSC.bIPv6Software && pContext->RSC.bIPv6Enabled);
+        pSwRsc = &SwRsc;
+    }
+#endif
 
     while( (*pnPacketsToIndicateLeft > 0) &&
             (NULL != (pBufferDescriptor = ReceiveQueueGetBuffer(pTargetReceiveQueue))) )
@@ -1615,37 +2112,70 @@ static void ProcessReceiveQueue(PARANDIS_ADAPTER *pContext,
             pContext->bConnected &&
             ShallPassPacket(pContext, pPacketInfo))
         {
-            UINT nCoalescedSegmentsCount;
-            PNET_BUFFER_LIST packet = ParaNdis_PrepareReceivedPacket(pContext, pBufferDescriptor, &nCoalescedSegmentsCount);
-            if(packet != NULL)
+#if PARANDIS_SUPPORT_RSC
+            if (pSwRsc != NULL)
             {
-                UpdateReceiveSuccessStatistics(pContext, pPacketInfo, nCoalescedSegmentsCount);
-                if (*indicate == nullptr)
+                pRxNetDescriptor pFlushed;
+                BOOLEAN bTaken = ParaNdis_SwRscReceive(pSwRsc, pBufferDescriptor, &pFlushed);
+
+                if (pFlushed != NULL)
                 {
-                    *indicate = *indicateTail = packet;
+                    IndicateReceivedBuffer(pContext, pFlushed, pnPacketsToIndicateLeft,
+                                           indicate, indicateTail, nIndicate);
                 }
-                else
+                if (bTaken)
                 {
-                    NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = packet;
-                    *indicateTail = packet;
+                    continue;
                 }
-
-                NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = NULL;
-                (*pnPacketsToIndicateLeft)--;
-                (*nIndicate)++;
-            }
-            else
-            {
-                UpdateReceiveFailStatistics(pContext, nCoalescedSegmentsCount);
-                pBufferDescriptor->Queue->ReuseReceiveBuffer(pBufferDescriptor);
             }
+#endif
+            IndicateReceivedBuffer(pContext, pBufferDescriptor, pnPacketsToIndicateLeft,
+                                   indicate, indicateTail, nIndicate);
         }
         else
         {
-            pContext->extraStatistics.framesFilteredOut++;
+            ParaNdis_CpuStatistics(pContext)->Extra.framesFilteredOut++;
             pBufferDescriptor->Queue->ReuseReceiveBuffer(pBufferDescriptor);
         }
     }
+
+#if PARANDIS_SUPPORT_RSC
+    if (pSwRsc != NULL)
+    {
+        while (NULL != (pBufferDescriptor = ParaNdis_SwRscFlush(pSwRsc)))
+        {
+            IndicateReceivedBuffer(pContext, pBufferDescriptor, pnPacketsToIndicateLeft,
+                                   indicate, indicateTail, nIndicate);
+        }
+    }
+#endif
+}
+
+/* Each frame counts in the histogram of its queue, the frames of a queue
+   are indicated on its RSS processor, so the updates rarely race */
+static void RecordIndicationLatency(PARANDIS_ADAPTER *pContext, PNET_BUFFER_LIST pNBL)
+{
+    LONGLONG now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    for (; pNBL != NULL; pNBL = NET_BUFFER_LIST_NEXT_NBL(pNBL))
+    {
+        pRxNetDescriptor pBufferDescriptor = (pRxNetDescriptor)pNBL->MiniportReserved[0];
+        CParaNdisRX *pQueue;
+        LONGLONG usedTime;
+
+        if (pBufferDescriptor != NULL)
+        {
+            pQueue = pBufferDescriptor->Queue;
+            usedTime = pBufferDescriptor->UsedTimestamp;
+        }
+        else
+        {
+            CRxCopyBuffer *pCopyBuffer = (CRxCopyBuffer *)pNBL->MiniportReserved[1];
+            pQueue = pCopyBuffer->Queue;
+            usedTime = pCopyBuffer->UsedTimestamp;
+        }
+        ParaNdis_RecordLatency(pContext, pQueue->QueueLatency().Completion, now - usedTime);
+    }
 }
 
 
@@ -1662,7 +2192,8 @@ reading.
 
 Under these conditions, the RxDPCWorkBody's loop terminates because
 ProcessReceiveQueue is limited by the nPacketsToIndicate parameter, accepting
-the configuration value for DPC throttling. ProcessReceiveQueue decreases
+the adaptive per-queue DPC budget (see CParaNdisRX::UpdateDpcBudget), which
+never exceeds the configuration value for DPC throttling. ProcessReceiveQueue decreases
 the nPacketsToIndicate's value each time the packet is indicated toward the
 OS's upper layer and stops indicating when nPacketsToIndicate drops to zero.
 
@@ -1670,15 +2201,24 @@ When nPacketsToIndicate reaches zero, the loop operates in the following way:
 ProcessRxRing fetches the ready-to-process packet from virtqueue and places
 them into receiving queues, but the packets are not indicated by
 ProcessReceiveQueue; OS has no packets to be reinserted into the virtqueue,
-virtqueue eventually becomes empty and RxDPCWorkBody's loop exits  */
+virtqueue eventually becomes empty and RxDPCWorkBody's loop exits.
+
+At the end of each DPC the budget of the queue is adjusted: it grows while
+the budget is exhausted with more packets pending, and shrinks when the DPC
+runs longer than PARANDIS_RX_DPC_TIME_BUDGET_US or the upper layers keep
+most of the receive buffers */
 
 static
-BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULONG nPacketsToIndicate)
+BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULONG nMaxPacketsToIndicate)
 {
     BOOLEAN res = FALSE;
     bool rxPathOwner = false;
     PNET_BUFFER_LIST indicate, indicateTail;
     ULONG nIndicate;
+    ULONG nBudget = (pathBundle != nullptr) ? pathBundle->rxPath.GetDpcBudget() : pContext->uNumberOfHandledRXPacketsInDPC;
+    ULONG nLimit = min(nMaxPacketsToIndicate, nBudget);
+    ULONG nPacketsToIndicate = nLimit;
+    LARGE_INTEGER startTime = KeQueryPerformanceCounter(NULL);
 
     CCHAR CurrCpuReceiveQueue = GetReceiveQueueForCurrentCPU(pContext);
 
@@ -1703,10 +2243,13 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
     }
 
 #ifdef PARANDIS_SUPPORT_RSS
+    ULONG nTakenPosition = 0;
+
     if (CurrCpuReceiveQueue != PARANDIS_RECEIVE_NO_QUEUE)
     {
         ProcessReceiveQueue(pContext, &nPacketsToIndicate, &pContext->ReceiveQueues[CurrCpuReceiveQueue],
                             &indicate, &indicateTail, &nIndicate);
+        nTakenPosition = pContext->ReceiveQueues[CurrCpuReceiveQueue].TakenPosition;
         res |= ReceiveQueueHasBuffers(&pContext->ReceiveQueues[CurrCpuReceiveQueue]);
     }
 #endif
@@ -1715,6 +2258,7 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
     {
         if(pContext->m_RxStateMachine.RegisterOutstandingItems(nIndicate))
         {
+            RecordIndicationLatency(pContext, indicate);
             NdisMIndicateReceiveNetBufferLists(pContext->MiniportHandle,
                                                 indicate, 0, nIndicate, NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL);
         }
@@ -1724,6 +2268,14 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
         }
     }
 
+#ifdef PARANDIS_SUPPORT_RSS
+    /* RSS entries moved away from this queue may switch now */
+    if (CurrCpuReceiveQueue != PARANDIS_RECEIVE_NO_QUEUE)
+    {
+        ParaNdis6_RSSReceiveQueueIndicated(&pContext->RSSParameters, CurrCpuReceiveQueue, nTakenPosition);
+    }
+#endif
+
     if (rxPathOwner)
     {
         pathBundle->rxPath.UnclassifiedPacketsQueue().Ownership.Release();
@@ -1733,6 +2285,12 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
     {
         res |= pathBundle->rxPath.RestartQueue() |
                ReceiveQueueHasBuffers(&pathBundle->rxPath.UnclassifiedPacketsQueue());
+
+        LONGLONG elapsedTicks = KeQueryPerformanceCounter(NULL).QuadPart - startTime.QuadPart;
+
+        pathBundle->rxPath.UpdateDpcBudget(nLimit - nPacketsToIndicate, nLimit, res != FALSE,
+                                           nMaxPacketsToIndicate < nBudget, elapsedTicks);
+        ParaNdis_RecordLatency(pContext, pathBundle->rxPath.QueueLatency().DpcDuration, elapsedTicks);
     }
 
     return res;
@@ -1740,6 +2298,9 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
 
 void ParaNdis_ReuseRxNBLs(PNET_BUFFER_LIST pNBL)
 {
+    CParaNdisRX *pQueue = NULL;
+    LONG nReturned = 0;
+
     while (pNBL)
     {
         PNET_BUFFER_LIST pTemp = pNBL;
@@ -1747,15 +2308,45 @@ void ParaNdis_ReuseRxNBLs(PNET_BUFFER_LIST pNBL)
         DPrintf(3, "  Returned NBL of pBuffersDescriptor %p!\n", pBuffersDescriptor);
         pNBL = NET_BUFFER_LIST_NEXT_NBL(pNBL);
         NET_BUFFER_LIST_NEXT_NBL(pTemp) = NULL;
-        NdisFreeNetBufferList(pTemp);
-        pBuffersDescriptor->Queue->ReuseReceiveBuffer(pBuffersDescriptor);
+        if (pBuffersDescriptor == NULL)
+        {
+            // a small frame indicated from a copy buffer, the descriptor is back already
+            CRxCopyBuffer *pCopyBuffer = (CRxCopyBuffer *)pTemp->MiniportReserved[1];
+            pCopyBuffer->Queue->ReturnCopyBuffer(pCopyBuffer);
+            continue;
+        }
+        if (pBuffersDescriptor->Queue != pQueue)
+        {
+            if (pQueue != NULL)
+            {
+                pQueue->FlushReturnedBuffersIfNeeded(nReturned);
+            }
+            pQueue = pBuffersDescriptor->Queue;
+            nReturned = 0;
+        }
+        nReturned += ReturnReceiveDescriptor(pBuffersDescriptor);
+    }
+
+    if (pQueue != NULL)
+    {
+        pQueue->FlushReturnedBuffersIfNeeded(nReturned);
+    }
+}
+
+static void RecordInterruptLatency(PARANDIS_ADAPTER *pContext, CParaNdisAbstractPath &path, LONGLONG now)
+{
+    LONGLONG interruptTime = path.TakeInterruptTimestamp();
+
+    if (interruptTime != 0)
+    {
+        ParaNdis_RecordLatency(pContext, path.QueueLatency().InterruptToDpc, now - interruptTime);
     }
 }
 
 bool ParaNdis_DPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIndicate)
 {
     bool stillRequiresProcessing = false;
-    UINT numOfPacketsToIndicate = min(ulMaxPacketsToIndicate, pContext->uNumberOfHandledRXPacketsInDPC);
+    UINT numOfPacketsToIndicate = ulMaxPacketsToIndicate;
 
     DEBUG_ENTRY(5);
 
@@ -1778,14 +2369,33 @@ bool ParaNdis_DPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIndica
     /* When DPC is scheduled for RSS processing, it may be assigned to CPU that has no
     correspondent path, so pathBundle may remain null. */
 
+    if (pathBundle != nullptr)
+    {
+        LONGLONG now = KeQueryPerformanceCounter(NULL).QuadPart;
+        RecordInterruptLatency(pContext, pathBundle->rxPath, now);
+        RecordInterruptLatency(pContext, pathBundle->txPath, now);
+    }
+
     if (pContext->bEnableInterruptHandlingDPC)
     {
         if (RxDPCWorkBody(pContext, pathBundle, numOfPacketsToIndicate))
         {
             stillRequiresProcessing = true;
+            if (pathBundle != nullptr)
+            {
+                pathBundle->rxPath.QueueStatistics().DpcRequeues++;
+            }
+        }
+        if (pContext->InterruptModeration == imAdaptive)
+        {
+            UpdateAdaptiveModeration(pContext);
         }
         if (pContext->CXPath.WasInterruptReported())
         {
+            if (pContext->bCXPathCreated)
+            {
+                pContext->CXPath.ProcessCompletions();
+            }
             ReadLinkState(pContext);
             if (pContext->bLinkDetectSupported)
             {
@@ -1794,15 +2404,22 @@ bool ParaNdis_DPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIndica
             if (pContext->bGuestAnnounceSupported && pContext->bGuestAnnounced)
             {
                 ParaNdis_SendGratuitousArpPacket(pContext);
-                pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_ANNOUNCE, VIRTIO_NET_CTRL_ANNOUNCE_ACK, NULL, 0, NULL, 0, 0);
+                pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_ANNOUNCE, VIRTIO_NET_CTRL_ANNOUNCE_ACK, NULL, 0, NULL, 0, 0);
                 pContext->bGuestAnnounced = FALSE;
             }
             pContext->CXPath.ClearInterruptReport();
         }
 
-        if (pathBundle != nullptr && pathBundle->txPath.DoPendingTasks())
+        if (pathBundle != nullptr)
         {
-            stillRequiresProcessing = true;
+            LARGE_INTEGER txStart = KeQueryPerformanceCounter(NULL);
+            if (pathBundle->txPath.DoPendingTasks())
+            {
+                stillRequiresProcessing = true;
+                pathBundle->txPath.QueueStatistics().DpcRequeues++;
+            }
+            ParaNdis_RecordLatency(pContext, pathBundle->txPath.QueueLatency().DpcDuration,
+                                   KeQueryPerformanceCounter(NULL).QuadPart - txStart.QuadPart);
         }
     }
     InterlockedDecrement(&pContext->counterDPCInside);
@@ -1811,13 +2428,26 @@ bool ParaNdis_DPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIndica
 }
 
 #ifdef PARANDIS_SUPPORT_RSS
+/* Moves the packets waiting on the RSS queues whose processor changed
+   to the unclassified queues of their RX paths. The other queues are left
+   to their processor, the RSS entries moved away from them wait until
+   their packets are indicated */
 VOID ParaNdis_ResetRxClassification(PARANDIS_ADAPTER *pContext)
 {
     ULONG i;
+    LONG nQueues = InterlockedExchange(&pContext->RSSParameters.ReceiveQueuesToReclassify, 0);
 
     for(i = PARANDIS_FIRST_RSS_RECEIVE_QUEUE; i < ARRAYSIZE(pContext->ReceiveQueues); i++)
     {
         PPARANDIS_RECEIVE_QUEUE pCurrQueue = &pContext->ReceiveQueues[i];
+        LONG nReclassified = 0;
+        ULONG nTakenPosition;
+
+        if (!(nQueues & (1 << i)))
+        {
+            continue;
+        }
+
         NdisAcquireSpinLock(&pCurrQueue->Lock);
 
         while(!IsListEmpty(&pCurrQueue->BuffersList))
@@ -1825,9 +2455,18 @@ VOID ParaNdis_ResetRxClassification(PARANDIS_ADAPTER *pContext)
             PLIST_ENTRY pListEntry = RemoveHeadList(&pCurrQueue->BuffersList);
             pRxNetDescriptor pBufferDescriptor = CONTAINING_RECORD(pListEntry, RxNetDescriptor, ReceiveQueueListEntry);
             ParaNdis_ReceiveQueueAddBuffer(&pBufferDescriptor->Queue->UnclassifiedPacketsQueue(), pBufferDescriptor);
+            pCurrQueue->TakenPosition++;
+            nReclassified++;
         }
+        nTakenPosition = pCurrQueue->TakenPosition;
 
         NdisReleaseSpinLock(&pCurrQueue->Lock);
+
+        ParaNdis6_RSSReceiveQueueIndicated(&pContext->RSSParameters, (CCHAR) i, nTakenPosition);
+        if (nReclassified)
+        {
+            InterlockedExchangeAdd(&pContext->RSSParameters.FramesReclassified, nReclassified);
+        }
     }
 }
 #endif
@@ -1841,6 +2480,8 @@ Parameters:
     PUINT pBytesNeeded      update on wrong buffer size
 Return value:
     SUCCESS or kind of failure
+The filter not in use is rebuilt and published, the receive DPCs
+look it up without a lock. Called at PASSIVE_LEVEL.
 ***********************************************************/
 NDIS_STATUS ParaNdis_SetMulticastList(
     PARANDIS_ADAPTER *pContext,
@@ -1861,12 +2502,24 @@ NDIS_STATUS ParaNdis_SetMulticastList(
         status = NDIS_STATUS_INVALID_LENGTH;
         *pBytesNeeded = (length / ETH_ALEN) * ETH_ALEN;
     }
+    else if (!ParaNdis_SynchronizeWithDispatchReaders(pContext->MiniportHandle))
+    {
+        // a DPC may still probe the inactive filter of the previous update
+        status = NDIS_STATUS_RESOURCES;
+    }
     else
     {
+        LONG nextFilter = !pContext->ActiveMulticastFilter;
+
         NdisZeroMemory(pContext->MulticastData.MulticastList, sizeof(pContext->MulticastData.MulticastList));
         if (length)
             NdisMoveMemory(pContext->MulticastData.MulticastList, Buffer, length);
         pContext->MulticastData.nofMulticastEntries = length / ETH_ALEN;
+
+        ParaNdis_MulticastFilterBuild(&pContext->MulticastFilters[nextFilter],
+                                      pContext->MulticastData.MulticastList,
+                                      pContext->MulticastData.nofMulticastEntries);
+        InterlockedExchange(&pContext->ActiveMulticastFilter, nextFilter);
         DPrintf(1, "[%s] New multicast list of %d bytes\n", __FUNCTION__, length);
         *pBytesRead = length;
         status = NDIS_STATUS_SUCCESS;
@@ -1919,30 +2572,50 @@ VOID ParaNdis_OnPnPEvent(
         pContext->nPnpEventIndex = 0;
 }
 
+static BOOLEAN IsDeviceMulticastListOverflow(PARANDIS_ADAPTER *pContext)
+{
+    return (pContext->PacketFilter & NDIS_PACKET_TYPE_MULTICAST) &&
+           pContext->MulticastData.nofMulticastEntries > PARANDIS_DEVICE_MULTICAST_LIST_SIZE;
+}
+
 static VOID ParaNdis_DeviceFiltersUpdateRxMode(PARANDIS_ADAPTER *pContext)
 {
     u8 val;
     ULONG f = pContext->PacketFilter;
     val = (f & NDIS_PACKET_TYPE_PROMISCUOUS) ? 1 : 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &val, sizeof(val), NULL, 0, 2);
-    val = (f & NDIS_PACKET_TYPE_ALL_MULTICAST) ? 1 : 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &val, sizeof(val), NULL, 0, 2);
+    pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &val, sizeof(val), NULL, 0, 2);
+    val = ((f & NDIS_PACKET_TYPE_ALL_MULTICAST) || IsDeviceMulticastListOverflow(pContext)) ? 1 : 0;
+    pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &val, sizeof(val), NULL, 0, 2);
 
     if (pContext->bCtrlRXExtraFiltersSupported)
     {
         val = (f & (NDIS_PACKET_TYPE_MULTICAST | NDIS_PACKET_TYPE_ALL_MULTICAST)) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOMULTI, &val, sizeof(val), NULL, 0, 2);
+        pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOMULTI, &val, sizeof(val), NULL, 0, 2);
         val = (f & NDIS_PACKET_TYPE_DIRECTED) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOUNI, &val, sizeof(val), NULL, 0, 2);
+        pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOUNI, &val, sizeof(val), NULL, 0, 2);
         val = (f & NDIS_PACKET_TYPE_BROADCAST) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOBCAST, &val, sizeof(val), NULL, 0, 2);
+        pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_NOBCAST, &val, sizeof(val), NULL, 0, 2);
     }
 }
 
 static VOID ParaNdis_DeviceFiltersUpdateAddresses(PARANDIS_ADAPTER *pContext)
 {
     u32 u32UniCastEntries = 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET,
+    u32 u32MultiCastEntries = 0;
+
+    if (IsDeviceMulticastListOverflow(pContext))
+    {
+        // the device runs in all-multicast mode, the driver filters
+        pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET,
+                            &u32UniCastEntries,
+                            sizeof(u32UniCastEntries),
+                            &u32MultiCastEntries,
+                            sizeof(u32MultiCastEntries),
+                            2);
+        return;
+    }
+
+    pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET,
                         &u32UniCastEntries,
                         sizeof(u32UniCastEntries),
                         &pContext->MulticastData,
@@ -1950,26 +2623,14 @@ static VOID ParaNdis_DeviceFiltersUpdateAddresses(PARANDIS_ADAPTER *pContext)
                         2);
 }
 
-static VOID SetSingleVlanFilter(PARANDIS_ADAPTER *pContext, ULONG vlanId, BOOLEAN bOn, int levelIfOK)
-{
-    u16 val = vlanId & 0xfff;
-    UCHAR cmd = bOn ? VIRTIO_NET_CTRL_VLAN_ADD : VIRTIO_NET_CTRL_VLAN_DEL;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_VLAN, cmd, &val, sizeof(val), NULL, 0, levelIfOK);
-}
-
-static VOID SetAllVlanFilters(PARANDIS_ADAPTER *pContext, BOOLEAN bOn)
-{
-    ULONG i;
-    for (i = 0; i <= MAX_VLAN_ID; ++i)
-        SetSingleVlanFilter(pContext, i, bOn, 7);
-}
-
 /*
     possible values of filter set (pContext->ulCurrentVlansFilterSet):
     0 - all disabled
     1..4095 - one selected enabled
     4096 - all enabled
     Note that only 0th vlan can't be enabled
+    The control path sends only the difference against what the
+    device already has, in the background
 */
 VOID ParaNdis_DeviceFiltersUpdateVlanId(PARANDIS_ADAPTER *pContext)
 {
@@ -1980,25 +2641,21 @@ VOID ParaNdis_DeviceFiltersUpdateVlanId(PARANDIS_ADAPTER *pContext)
             newFilterSet = pContext->VlanId ? pContext->VlanId : (MAX_VLAN_ID + 1);
         else
             newFilterSet = IsPrioritySupported(pContext) ? (MAX_VLAN_ID + 1) : 0;
-        if (newFilterSet != pContext->ulCurrentVlansFilterSet)
-        {
-            if (pContext->ulCurrentVlansFilterSet > MAX_VLAN_ID)
-                SetAllVlanFilters(pContext, FALSE);
-            else if (pContext->ulCurrentVlansFilterSet)
-                SetSingleVlanFilter(pContext, pContext->ulCurrentVlansFilterSet, FALSE, 2);
-
-            pContext->ulCurrentVlansFilterSet = newFilterSet;
 
-            if (pContext->ulCurrentVlansFilterSet > MAX_VLAN_ID)
-                SetAllVlanFilters(pContext, TRUE);
-            else if (pContext->ulCurrentVlansFilterSet)
-                SetSingleVlanFilter(pContext, pContext->ulCurrentVlansFilterSet, TRUE, 2);
-        }
+        pContext->ulCurrentVlansFilterSet = newFilterSet;
+        pContext->CXPath.SetVlanFilters(newFilterSet);
     }
 }
 
 VOID ParaNdis_UpdateDeviceFilters(PARANDIS_ADAPTER *pContext)
 {
+    if (!pContext->bCXPathCreated)
+    {
+        return;
+    }
+
+    pContext->CXPath.StartBatch();
+
     if (pContext->bCtrlRXFiltersSupported)
     {
         ParaNdis_DeviceFiltersUpdateRxMode(pContext);
@@ -2006,6 +2663,8 @@ VOID ParaNdis_UpdateDeviceFilters(PARANDIS_ADAPTER *pContext)
     }
 
     ParaNdis_DeviceFiltersUpdateVlanId(pContext);
+
+    pContext->CXPath.CompleteBatch();
 }
 
 static VOID
@@ -2013,20 +2672,113 @@ ParaNdis_UpdateMAC(PARANDIS_ADAPTER *pContext)
 {
     if (pContext->bCtrlMACAddrSupported)
     {
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET,
+        pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET,
                            pContext->CurrentMacAddress,
                            ETH_ALEN,
                            NULL, 0, 4);
     }
 }
 
+/* notification coalescing profiles, *InterruptModeration "low" uses the first
+   non-zero one. The adaptive moderation moves one profile up when the packet
+   rate reaches MinRate of the next one and down when the rate falls below
+   half of MinRate of the current one */
+static const struct
+{
+    ULONG Usecs;
+    ULONG MaxPackets;
+    ULONG MinRate;      /* packets per second */
+} NotfCoalProfiles[] =
+{
+    { 0,  0,  0 },
+    { 16, 16, 20000 },
+    { 64, 64, 150000 },
+};
+
+#define PARANDIS_NOTF_COAL_LOW              1
+/* 100 ms, in units of KeQueryInterruptTime */
+#define PARANDIS_NOTF_COAL_SAMPLE_PERIOD    1000000
+
+static VOID SetNotificationCoalescing(PARANDIS_ADAPTER *pContext, LONG Level)
+{
+    virtio_net_ctrl_coal_rx rx;
+    virtio_net_ctrl_coal_tx tx;
+
+    if (!pContext->bNotfCoalSupported || !pContext->bCXPathCreated ||
+        InterlockedExchange(&pContext->NotfCoal.Level, Level) == Level)
+    {
+        return;
+    }
+
+    rx.rx_max_packets = tx.tx_max_packets = NotfCoalProfiles[Level].MaxPackets;
+    rx.rx_usecs = tx.tx_usecs = NotfCoalProfiles[Level].Usecs;
+
+    pContext->CXPath.StartBatch();
+    pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_NOTF_COAL, VIRTIO_NET_CTRL_NOTF_COAL_RX_SET,
+                       &rx, sizeof(rx), NULL, 0, 4);
+    pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_NOTF_COAL, VIRTIO_NET_CTRL_NOTF_COAL_TX_SET,
+                       &tx, sizeof(tx), NULL, 0, 4);
+    pContext->CXPath.CompleteBatch();
+    pContext->NotfCoal.LevelChanges++;
+}
+
+/* called from the DPC, one of the CPUs samples the packet rate once in a period */
+static VOID UpdateAdaptiveModeration(PARANDIS_ADAPTER *pContext)
+{
+    LONG64 Now = (LONG64)KeQueryInterruptTime();
+    LONG64 Last = pContext->NotfCoal.LastSampleTime;
+    ULONG64 Packets = 0;
+    ULONG64 Rate;
+    LONG Level;
+
+    if (!pContext->bNotfCoalSupported || Now - Last < PARANDIS_NOTF_COAL_SAMPLE_PERIOD ||
+        InterlockedCompareExchange64(&pContext->NotfCoal.LastSampleTime, Now, Last) != Last)
+    {
+        return;
+    }
+
+    for (UINT i = 0; i < pContext->nPathBundles; i++)
+    {
+        Packets += pContext->pPathBundles[i].rxPath.QueueStatistics().Packets;
+        Packets += pContext->pPathBundles[i].txPath.QueueStatistics().Packets;
+    }
+    Rate = (Packets - pContext->NotfCoal.LastPackets) * 10000000 / (ULONG64)(Now - Last);
+    pContext->NotfCoal.LastPackets = Packets;
+    if (Last == 0)
+    {
+        return;
+    }
+
+    Level = max(pContext->NotfCoal.Level, 0);
+    if ((ULONG)Level + 1 < ARRAYSIZE(NotfCoalProfiles) && Rate >= NotfCoalProfiles[Level + 1].MinRate)
+    {
+        Level++;
+    }
+    else if (Level > 0 && Rate < NotfCoalProfiles[Level].MinRate / 2)
+    {
+        Level--;
+    }
+    SetNotificationCoalescing(pContext, Level);
+}
+
+/**********************************************************
+Applies *InterruptModeration setting to the device, the adaptive
+moderation starts without coalescing and follows the packet rate
+from the DPC
+***********************************************************/
+VOID ParaNdis_SetInterruptModeration(PARANDIS_ADAPTER *pContext, tInterruptModeration Moderation)
+{
+    pContext->InterruptModeration = Moderation;
+    SetNotificationCoalescing(pContext, Moderation == imLow ? PARANDIS_NOTF_COAL_LOW : 0);
+}
+
 #if PARANDIS_SUPPORT_RSC
 VOID
 ParaNdis_UpdateGuestOffloads(PARANDIS_ADAPTER *pContext, UINT64 Offloads)
 {
     if (pContext->RSC.bHasDynamicConfig)
     {
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_GUEST_OFFLOADS, VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET,
+        pContext->CXPath.QueueControlMessage(VIRTIO_NET_CTRL_GUEST_OFFLOADS, VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET,
                            &Offloads,
                            sizeof(Offloads),
                            NULL, 0, 2);
@@ -2100,6 +2852,10 @@ VOID ParaNdis_PowerOff(PARANDIS_ADAPTER *pContext)
 
     PreventDPCServicing(pContext);
 
+#if PARANDIS_SUPPORT_RSS
+    ParaNdis_WaitForQueuePairsWork(pContext);
+#endif
+
     /*******************************************************************
         shutdown queues to have all the receive buffers under our control
         all the transmit buffers move to list of free buffers
@@ -2140,7 +2896,6 @@ tChecksumCheckResult ParaNdis_CheckRxChecksum(
     tOffloadSettingsFlags f = pContext->Offload.flags;
     tChecksumCheckResult res;
     tTcpIpPacketParsingResult ppr;
-    ULONG ulPacketLength = pPacketInfo->dataLength;
     ULONG flagsToCalculate = 0;
     res.value = 0;
 
@@ -2166,9 +2921,8 @@ tChecksumCheckResult ParaNdis_CheckRxChecksum(
 
     if (pPacketInfo->isIP4 || pPacketInfo->isIP6)
     {
-        ppr = ParaNdis_CheckSumVerify(pPacketPages, ulPacketLength - ETH_HEADER_SIZE,
-                                      ulDataOffset + ETH_HEADER_SIZE, flagsToCalculate,
-                                      verifyLength, __FUNCTION__);
+        ppr = ParaNdis_CheckSumVerifyParsed(pPacketPages, ulDataOffset, pPacketInfo,
+                                            flagsToCalculate, verifyLength, __FUNCTION__);
     }
     else
     {
@@ -2185,7 +2939,7 @@ tChecksumCheckResult ParaNdis_CheckRxChecksum(
 
     if (virtioFlags & VIRTIO_NET_HDR_F_DATA_VALID)
     {
-        pContext->extraStatistics.framesRxCSHwOK++;
+        ParaNdis_CpuStatistics(pContext)->Extra.framesRxCSHwOK++;
         ppr.xxpCheckSum = ppresCSOK;
     }
 
@@ -0,0 +1,99 @@
+#pragma once
+
+/* Multicast address filter used on the RX path: an open addressing hash
+   set of the addresses with a 64-bit Bloom word in front of it, so that
+   most of the unwanted multicast frames are rejected by a single bit test.
+   Depends only on the basic types and PARANDIS_MULTICAST_LIST_SIZE, so it
+   can be built in user mode as well (DebugTools/MulticastFilter) */
+
+#define PARANDIS_MULTICAST_HASH_SIZE    (2 * PARANDIS_MULTICAST_LIST_SIZE)
+#define PARANDIS_MULTICAST_ADDR_LEN     6
+
+typedef struct _tagMulticastHashEntry
+{
+    UCHAR       Address[PARANDIS_MULTICAST_ADDR_LEN];
+    USHORT      bUsed;
+}tMulticastHashEntry;
+
+typedef struct _tagMulticastFilter
+{
+    ULONGLONG               Bloom;
+    ULONG                   nofEntries;
+    tMulticastHashEntry     Table[PARANDIS_MULTICAST_HASH_SIZE];
+}tMulticastFilter;
+
+static __inline ULONG ParaNdis_MulticastHash(const UCHAR *Address)
+{
+    ULONGLONG Value = 0;
+
+    for (ULONG i = 0; i < PARANDIS_MULTICAST_ADDR_LEN; i++)
+    {
+        Value = (Value << 8) | Address[i];
+    }
+
+    // Fibonacci hashing, the upper half is well mixed
+    return (ULONG)((Value * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static __inline bool ParaNdis_MulticastAddressEqual(const UCHAR *A1, const UCHAR *A2)
+{
+    return (*(const ULONG UNALIGNED *)A1 == *(const ULONG UNALIGNED *)A2) &&
+           (*(const USHORT UNALIGNED *)(A1 + 4) == *(const USHORT UNALIGNED *)(A2 + 4));
+}
+
+static __inline void ParaNdis_MulticastFilterBuild(tMulticastFilter *Filter, const UCHAR *List, ULONG nofEntries)
+{
+    Filter->Bloom = 0;
+    Filter->nofEntries = 0;
+    for (ULONG i = 0; i < PARANDIS_MULTICAST_HASH_SIZE; i++)
+    {
+        Filter->Table[i].bUsed = 0;
+    }
+
+    for (ULONG i = 0; i < nofEntries && i < PARANDIS_MULTICAST_LIST_SIZE; i++)
+    {
+        const UCHAR *Address = List + i * PARANDIS_MULTICAST_ADDR_LEN;
+        ULONG Hash = ParaNdis_MulticastHash(Address);
+        ULONG Index = (Hash >> 6) & (PARANDIS_MULTICAST_HASH_SIZE - 1);
+
+        while (Filter->Table[Index].bUsed &&
+               !ParaNdis_MulticastAddressEqual(Filter->Table[Index].Address, Address))
+        {
+            Index = (Index + 1) & (PARANDIS_MULTICAST_HASH_SIZE - 1);
+        }
+
+        if (!Filter->Table[Index].bUsed)
+        {
+            for (ULONG j = 0; j < PARANDIS_MULTICAST_ADDR_LEN; j++)
+            {
+                Filter->Table[Index].Address[j] = Address[j];
+            }
+            Filter->Table[Index].bUsed = 1;
+            Filter->Bloom |= 1ull << (Hash & 63);
+            Filter->nofEntries++;
+        }
+    }
+}
+
+static __inline bool ParaNdis_MulticastFilterLookup(const tMulticastFilter *Filter, const UCHAR *Address)
+{
+    ULONG Hash = ParaNdis_MulticastHash(Address);
+
+    if (!(Filter->Bloom & (1ull << (Hash & 63))))
+    {
+        return false;
+    }
+
+    // the table is at most half full, so the probe always ends on a free entry
+    for (ULONG Index = (Hash >> 6) & (PARANDIS_MULTICAST_HASH_SIZE - 1);
+         Filter->Table[Index].bUsed;
+         Index = (Index + 1) & (PARANDIS_MULTICAST_HASH_SIZE - 1))
+    {
+        if (ParaNdis_MulticastAddressEqual(Filter->Table[Index].Address, Address))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
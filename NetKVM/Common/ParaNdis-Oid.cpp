@@ -237,6 +237,7 @@ NDIS_STATUS ParaNdis_OidQueryCommon(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
         NDIS_PNP_CAPABILITIES                   PMCaps;
     } u;
 #define SETINFO(field, value) pInfo = &u.##field; ulSize = sizeof(u.##field); u.##field = (value)
+    ParaNdis_CollectStatistics(pContext);
     switch (pOid->Oid)
     {
     case OID_GEN_SUPPORTED_LIST:
@@ -0,0 +1,434 @@
+#pragma once
+
+/* Parser of the headers of a received packet. It walks the L2, L3
+   (including IPv6 extension headers) and L4 headers once and records in
+   NET_PACKET_INFO everything the RX path needs later: RSS hashing,
+   checksum validation, filtering and RSC use the record and do not parse
+   the headers again.
+   Depends only on the basic types and the definitions of ethernetutils.h,
+   so it can be built in user mode as well (DebugTools/PacketParser) */
+
+// till IP header size is 8 bit
+#define MAX_SUPPORTED_IPV6_HEADERS  (256 - 4)
+
+// IPv6 Header RFC 2460 (n*8 bytes)
+typedef struct _tagIPv6ExtHeader {
+    UCHAR       ip6ext_next_header;     // next header type
+    UCHAR       ip6ext_hdr_len;         // length of this header in 8 bytes unit, not including first 8 bytes
+    USHORT      options;                //
+} IPv6ExtHeader;
+
+// IP v6 extension header option
+typedef struct _tagIP6_EXT_HDR_OPTION
+{
+    UCHAR Type;
+    UCHAR Length;
+} IP6_EXT_HDR_OPTION, *PIP6_EXT_HDR_OPTION;
+
+#define IP6_EXT_HDR_OPTION_PAD1         (0)
+#define IP6_EXT_HDR_OPTION_HOME_ADDR    (201)
+
+// IP v6 routing header
+typedef struct _tagIP6_TYPE2_ROUTING_HEADER
+{
+    UCHAR           NextHdr;
+    UCHAR           HdrLen;
+    UCHAR           RoutingType;
+    UCHAR           SegmentsLeft;
+    ULONG           Reserved;
+    IPV6_ADDRESS    Address;
+} IP6_TYPE2_ROUTING_HEADER, *PIP6_TYPE2_ROUTING_HEADER;
+
+#define PROTOCOL_TCP                    6
+#define PROTOCOL_UDP                    17
+
+#define IP_HEADER_LENGTH(pHeader)       (((pHeader)->ip_verlen & 0x0F) << 2)
+#define IP_HEADER_VERSION(pHeader)      (((pHeader)->ip_verlen & 0xF0) >> 4)
+#define IP_HEADER_IS_FRAGMENT(pHeader)  (((pHeader)->ip_offset & ~0xC0) != 0)
+
+#define IP6_HEADER_VERSION(pHeader)     (((pHeader)->ip6_ver_tc & 0xF0) >> 4)
+
+#define ETH_GET_VLAN_HDR(ethHdr)        ((PVLAN_HEADER) RtlOffsetToPointer(ethHdr, ETH_HEADER_SIZE))
+#define VLAN_GET_USER_PRIORITY(vlanHdr) ( (((PUCHAR)(vlanHdr))[0] & 0xE0) >> 5 )
+#define VLAN_GET_VLAN_ID(vlanHdr)       ( ((USHORT) (((PUCHAR)(vlanHdr))[0] & 0x0F) << 8) | ( ((PUCHAR)(vlanHdr))[1] ) )
+
+#define ETH_PROTO_IP4 (0x0800)
+#define ETH_PROTO_IP6 (0x86DD)
+
+#define IP6_HDR_HOP_BY_HOP        (0)
+#define IP6_HDR_ROUTING           (43)
+#define IP6_HDR_FRAGMENT          (44)
+#define IP6_HDR_ESP               (50)
+#define IP6_HDR_AUTHENTICATION    (51)
+#define IP6_HDR_NONE              (59)
+#define IP6_HDR_DESTINATION       (60)
+#define IP6_HDR_MOBILITY          (135)
+
+#define IP6_EXT_HDR_GRANULARITY   (8)
+
+typedef struct _tagNET_PACKET_INFO
+{
+    struct
+    {
+        int isBroadcast   : 1;
+        int isMulticast   : 1;
+        int isUnicast     : 1;
+        int hasVlanHeader : 1;
+        int isIP4         : 1;
+        int isIP6         : 1;
+        int isTCP         : 1;
+        int isUDP         : 1;
+        int isFragment    : 1;
+        // the basic TCP or UDP header is within the data
+        int isL4HdrComplete : 1;
+        // IP length does not fit the L2 payload or the IP headers
+        int isIPTruncated   : 1;
+        int hasIP6ExtHeaders : 1;
+    };
+
+    struct
+    {
+        UINT32 UserPriority : 3;
+        UINT32 VlanId       : 12;
+    } Vlan;
+
+#if PARANDIS_SUPPORT_RSS
+    struct
+    {
+        ULONG Value;
+        ULONG Type;
+        ULONG Function;
+    } RSSHash;
+#endif
+
+    ULONG L2HdrLen;
+    ULONG L3HdrLen;
+    // TCP header including options or UDP header, valid if isL4HdrComplete
+    ULONG L4HdrLen;
+    ULONG L2PayloadLen;
+    // IP header and payload as the IP header states it
+    ULONG IPTotalLength;
+    ULONG ip6HomeAddrOffset;
+    ULONG ip6DestAddrOffset;
+    // protocol following IPv4 header or the last IPv6 extension header
+    UCHAR L4Protocol;
+
+    PUCHAR ethDestAddr;
+
+    PVOID headersBuffer;
+    ULONG dataLength;
+} NET_PACKET_INFO, *PNET_PACKET_INFO;
+
+static __inline
+BOOLEAN ParaNdis_ParseL2Hdr(PNET_PACKET_INFO packetInfo)
+{
+    PETH_HEADER dataBuffer = (PETH_HEADER) packetInfo->headersBuffer;
+    USHORT L3Proto;
+
+    if (packetInfo->dataLength < ETH_HEADER_SIZE)
+        return FALSE;
+
+    packetInfo->ethDestAddr = dataBuffer->DstAddr;
+
+    if (ETH_IS_BROADCAST(dataBuffer))
+    {
+        packetInfo->isBroadcast = TRUE;
+    }
+    else if (ETH_IS_MULTICAST(dataBuffer))
+    {
+        packetInfo->isMulticast = TRUE;
+    }
+    else
+    {
+        packetInfo->isUnicast = TRUE;
+    }
+
+    if(ETH_HAS_PRIO_HEADER(dataBuffer))
+    {
+        PVLAN_HEADER vlanHdr = ETH_GET_VLAN_HDR(dataBuffer);
+
+        if(packetInfo->dataLength < ETH_HEADER_SIZE + ETH_PRIORITY_HEADER_SIZE)
+            return FALSE;
+
+        packetInfo->hasVlanHeader     = TRUE;
+        packetInfo->Vlan.UserPriority = VLAN_GET_USER_PRIORITY(vlanHdr);
+        packetInfo->Vlan.VlanId       = VLAN_GET_VLAN_ID(vlanHdr);
+        packetInfo->L2HdrLen          = ETH_HEADER_SIZE + ETH_PRIORITY_HEADER_SIZE;
+        L3Proto = vlanHdr->EthType;
+    }
+    else
+    {
+        packetInfo->L2HdrLen = ETH_HEADER_SIZE;
+        L3Proto = dataBuffer->EthType;
+    }
+
+    packetInfo->isIP4 = (L3Proto == RtlUshortByteSwap(ETH_PROTO_IP4));
+    packetInfo->isIP6 = (L3Proto == RtlUshortByteSwap(ETH_PROTO_IP6));
+    packetInfo->L2PayloadLen = packetInfo->dataLength - packetInfo->L2HdrLen;
+
+    return TRUE;
+}
+
+static __inline
+BOOLEAN ParaNdis_SkipIP6ExtensionHeader(
+    IPv6Header *ip6Hdr,
+    ULONG dataLength,
+    PULONG ip6HdrLength,
+    PUCHAR nextHdr)
+{
+    IPv6ExtHeader* ip6ExtHdr;
+
+    if (*ip6HdrLength + sizeof(*ip6ExtHdr) > dataLength)
+        return FALSE;
+
+    ip6ExtHdr = (IPv6ExtHeader *)RtlOffsetToPointer(ip6Hdr, *ip6HdrLength);
+    *nextHdr = ip6ExtHdr->ip6ext_next_header;
+    *ip6HdrLength += (ip6ExtHdr->ip6ext_hdr_len + 1) * IP6_EXT_HDR_GRANULARITY;
+    return TRUE;
+}
+
+static __inline
+BOOLEAN ParaNdis_ParseIP6RoutingExtension(
+    PIP6_TYPE2_ROUTING_HEADER routingHdr,
+    ULONG dataLength,
+    IPV6_ADDRESS **destAddr)
+{
+    if(dataLength < sizeof(*routingHdr))
+        return FALSE;
+    if(routingHdr->RoutingType == 2)
+    {
+        if((dataLength != sizeof(*routingHdr)) || (routingHdr->SegmentsLeft != 1))
+            return FALSE;
+
+        *destAddr = &routingHdr->Address;
+    }
+    else *destAddr = NULL;
+
+    return TRUE;
+}
+
+static __inline
+BOOLEAN ParaNdis_ParseIP6DestinationExtension(
+    PVOID destHdr,
+    ULONG dataLength,
+    IPV6_ADDRESS **homeAddr)
+{
+    while(dataLength != 0)
+    {
+        PIP6_EXT_HDR_OPTION optHdr = (PIP6_EXT_HDR_OPTION) destHdr;
+        ULONG optionLen;
+
+        switch(optHdr->Type)
+        {
+        case IP6_EXT_HDR_OPTION_HOME_ADDR:
+            if(dataLength < sizeof(IP6_EXT_HDR_OPTION))
+                return FALSE;
+
+            optionLen = optHdr->Length + sizeof(IP6_EXT_HDR_OPTION);
+            if(optHdr->Length != sizeof(IPV6_ADDRESS))
+                return FALSE;
+
+            *homeAddr = (IPV6_ADDRESS*) RtlOffsetToPointer(optHdr, sizeof(IP6_EXT_HDR_OPTION));
+            break;
+
+        case IP6_EXT_HDR_OPTION_PAD1:
+            optionLen = RTL_SIZEOF_THROUGH_FIELD(IP6_EXT_HDR_OPTION, Type);
+            break;
+
+        default:
+            if(dataLength < sizeof(IP6_EXT_HDR_OPTION))
+                return FALSE;
+
+            optionLen = optHdr->Length + sizeof(IP6_EXT_HDR_OPTION);
+            break;
+        }
+
+        destHdr = RtlOffsetToPointer(destHdr, optionLen);
+        if(dataLength < optionLen)
+            return FALSE;
+
+        dataLength -= optionLen;
+    }
+
+    return TRUE;
+}
+
+static __inline
+BOOLEAN ParaNdis_ParseIP6Hdr(
+    IPv6Header *ip6Hdr,
+    ULONG dataLength,
+    PULONG ip6HdrLength,
+    PUCHAR nextHdr,
+    PULONG homeAddrOffset,
+    PULONG destAddrOffset)
+{
+    *homeAddrOffset = 0;
+    *destAddrOffset = 0;
+
+    *ip6HdrLength = sizeof(*ip6Hdr);
+    if(dataLength < *ip6HdrLength)
+        return FALSE;
+
+    *nextHdr = ip6Hdr->ip6_next_header;
+    for(;;)
+    {
+        switch (*nextHdr)
+        {
+        default:
+        case IP6_HDR_NONE:
+            __fallthrough;
+        case PROTOCOL_TCP:
+            __fallthrough;
+        case PROTOCOL_UDP:
+            __fallthrough;
+        case IP6_HDR_FRAGMENT:
+            return TRUE;
+        case IP6_HDR_DESTINATION:
+            {
+                IPV6_ADDRESS *homeAddr = NULL;
+                ULONG destHdrOffset = *ip6HdrLength;
+                if(!ParaNdis_SkipIP6ExtensionHeader(ip6Hdr, dataLength, ip6HdrLength, nextHdr))
+                    return FALSE;
+
+                if(!ParaNdis_ParseIP6DestinationExtension(RtlOffsetToPointer(ip6Hdr, destHdrOffset),
+                    *ip6HdrLength - destHdrOffset, &homeAddr))
+                    return FALSE;
+
+                *homeAddrOffset = homeAddr ? (ULONG) RtlPointerToOffset(ip6Hdr, homeAddr) : 0;
+            }
+            break;
+        case IP6_HDR_ROUTING:
+            {
+                IPV6_ADDRESS *destAddr = NULL;
+                ULONG routingHdrOffset = *ip6HdrLength;
+
+                if(!ParaNdis_SkipIP6ExtensionHeader(ip6Hdr, dataLength, ip6HdrLength, nextHdr))
+                    return FALSE;
+
+                if(!ParaNdis_ParseIP6RoutingExtension((PIP6_TYPE2_ROUTING_HEADER) RtlOffsetToPointer(ip6Hdr, routingHdrOffset),
+                    *ip6HdrLength - routingHdrOffset, &destAddr))
+                    return FALSE;
+
+                *destAddrOffset = destAddr ? (ULONG) RtlPointerToOffset(ip6Hdr, destAddr) : 0;
+            }
+            break;
+        case IP6_HDR_HOP_BY_HOP:
+            __fallthrough;
+        case IP6_HDR_ESP:
+            __fallthrough;
+        case IP6_HDR_AUTHENTICATION:
+            __fallthrough;
+        case IP6_HDR_MOBILITY:
+            if(!ParaNdis_SkipIP6ExtensionHeader(ip6Hdr, dataLength, ip6HdrLength, nextHdr))
+                return FALSE;
+
+            break;
+        }
+    }
+}
+
+static __inline
+VOID ParaNdis_ParseL4Hdr(PNET_PACKET_INFO packetInfo)
+{
+    ULONG L4Offset = packetInfo->L2HdrLen + packetInfo->L3HdrLen;
+
+    packetInfo->isTCP = (packetInfo->L4Protocol == PROTOCOL_TCP);
+    packetInfo->isUDP = (packetInfo->L4Protocol == PROTOCOL_UDP);
+
+    if (packetInfo->isTCP && packetInfo->dataLength >= L4Offset + sizeof(TCPHeader))
+    {
+        TCPHeader *tcpHdr = (TCPHeader *) RtlOffsetToPointer(packetInfo->headersBuffer, L4Offset);
+
+        packetInfo->isL4HdrComplete = TRUE;
+        packetInfo->L4HdrLen = TCP_HEADER_LENGTH(tcpHdr);
+    }
+    else if (packetInfo->isUDP && packetInfo->dataLength >= L4Offset + sizeof(UDPHeader))
+    {
+        packetInfo->isL4HdrComplete = TRUE;
+        packetInfo->L4HdrLen = sizeof(UDPHeader);
+    }
+}
+
+static __inline
+BOOLEAN ParaNdis_ParseL3Hdr(PNET_PACKET_INFO packetInfo)
+{
+    if(packetInfo->isIP4)
+    {
+        IPv4Header *ip4Hdr = (IPv4Header *) RtlOffsetToPointer(packetInfo->headersBuffer, packetInfo->L2HdrLen);
+
+        if(packetInfo->dataLength < packetInfo->L2HdrLen + sizeof(*ip4Hdr))
+            return FALSE;
+
+        packetInfo->L3HdrLen = IP_HEADER_LENGTH(ip4Hdr);
+        if ((packetInfo->L3HdrLen < sizeof(*ip4Hdr)) ||
+            (packetInfo->dataLength < packetInfo->L2HdrLen + packetInfo->L3HdrLen))
+            return FALSE;
+
+        if(IP_HEADER_VERSION(ip4Hdr) != 4)
+            return FALSE;
+
+        packetInfo->IPTotalLength = RtlUshortByteSwap(ip4Hdr->ip_length);
+        packetInfo->isIPTruncated = (packetInfo->IPTotalLength <= packetInfo->L3HdrLen) ||
+                                    (packetInfo->IPTotalLength > packetInfo->L2PayloadLen);
+        packetInfo->isFragment = IP_HEADER_IS_FRAGMENT(ip4Hdr);
+        packetInfo->L4Protocol = ip4Hdr->ip_protocol;
+    }
+    else if(packetInfo->isIP6)
+    {
+        ULONG homeAddrOffset, destAddrOffset;
+        UCHAR l4Proto;
+
+        IPv6Header *ip6Hdr = (IPv6Header *) RtlOffsetToPointer(packetInfo->headersBuffer, packetInfo->L2HdrLen);
+
+        if(packetInfo->L2PayloadLen < sizeof(*ip6Hdr))
+            return FALSE;
+
+        if(IP6_HEADER_VERSION(ip6Hdr) != 6)
+            return FALSE;
+
+        if(!ParaNdis_ParseIP6Hdr(ip6Hdr, packetInfo->L2PayloadLen,
+            &packetInfo->L3HdrLen, &l4Proto, &homeAddrOffset, &destAddrOffset))
+            return FALSE;
+
+        if (packetInfo->L3HdrLen > MAX_SUPPORTED_IPV6_HEADERS)
+            return FALSE;
+
+        packetInfo->ip6HomeAddrOffset = (homeAddrOffset) ? packetInfo->L2HdrLen + homeAddrOffset : 0;
+        packetInfo->ip6DestAddrOffset = (destAddrOffset) ? packetInfo->L2HdrLen + destAddrOffset : 0;
+        packetInfo->hasIP6ExtHeaders = (packetInfo->L3HdrLen != sizeof(*ip6Hdr));
+
+        packetInfo->IPTotalLength = sizeof(*ip6Hdr) + RtlUshortByteSwap(ip6Hdr->ip6_payload_len);
+        packetInfo->isIPTruncated = (packetInfo->IPTotalLength < packetInfo->L3HdrLen) ||
+                                    (packetInfo->IPTotalLength > packetInfo->L2PayloadLen);
+        packetInfo->isFragment = (l4Proto == IP6_HDR_FRAGMENT);
+        packetInfo->L4Protocol = l4Proto;
+    }
+    else
+    {
+        return TRUE;
+    }
+
+    if(!packetInfo->isFragment)
+    {
+        ParaNdis_ParseL4Hdr(packetInfo);
+    }
+
+    return TRUE;
+}
+
+static __inline
+BOOLEAN ParaNdis_ParsePacketHeaders(
+    PVOID headersBuffer,
+    ULONG dataLength,
+    PNET_PACKET_INFO packetInfo)
+{
+    NdisZeroMemory(packetInfo, sizeof(*packetInfo));
+
+    packetInfo->headersBuffer = headersBuffer;
+    packetInfo->dataLength = dataLength;
+
+    if(!ParaNdis_ParseL2Hdr(packetInfo))
+        return FALSE;
+
+    return ParaNdis_ParseL3Hdr(packetInfo);
+}
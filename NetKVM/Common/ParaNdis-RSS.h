@@ -38,8 +38,37 @@ typedef struct _tagPARANDIS_SCALING_SETTINGS
     ULONG          CPUIndexMappingSize;
 
     LONG           FirstQueueIndirectionIndex;
+
+    /* processor of each receive queue, valid below ReceiveQueuesMapped */
+    PROCESSOR_NUMBER QueueProcessor[PARANDIS_RSS_MAX_RECEIVE_QUEUES];
+    CCHAR            ReceiveQueuesMapped;
 } PARANDIS_SCALING_SETTINGS, *PPARANDIS_SCALING_SETTINGS;
 
+/* Immutable copy of the settings used by the data path.
+   A new snapshot is published as a whole on each configuration change,
+   the previous one is freed only after all the DISPATCH_LEVEL readers
+   that could see it have completed */
+typedef struct _tagPARANDIS_RSS_SNAPSHOT
+{
+    struct _tagPARANDIS_RSS_SNAPSHOT *NextRetired;
+    ULONG                       Version;
+    PARANDIS_RSS_MODE           RSSMode;
+    PARANDIS_HASHING_SETTINGS   HashingSettings;
+    PARANDIS_SCALING_SETTINGS   ScalingSettings;
+} PARANDIS_RSS_SNAPSHOT, *PPARANDIS_RSS_SNAPSHOT;
+
+/* An indirection entry moved to another queue keeps using the previous one
+   until the packets queued there before and while it is held are indicated,
+   so its flows are not reordered between the DPCs of the two processors.
+   Written only while the entry moves */
+typedef struct _tagPARANDIS_RSS_ENTRY_STATE
+{
+    volatile LONG   MovedVersion;   /* snapshot version that moved the entry, 0 once settled */
+    volatile LONG   HoldStart;      /* low part of the interrupt time, 0 until the first hold */
+    volatile LONG   DrainPosition;  /* position in the previous queue to wait for, 0 until the first hold */
+    CCHAR           PreviousQueue;  /* set with MovedVersion */
+} PARANDIS_RSS_ENTRY_STATE;
+
 typedef struct _tagPARANDIS_RSS_PARAMS
 {
     CCHAR             ReceiveQueuesNumber;
@@ -50,12 +79,37 @@ typedef struct _tagPARANDIS_RSS_PARAMS
     PARANDIS_HASHING_SETTINGS RSSHashingSettings;
     PARANDIS_SCALING_SETTINGS RSSScalingSettings;
 
-    PARANDIS_HASHING_SETTINGS ActiveHashingSettings;
-    PARANDIS_SCALING_SETTINGS ActiveRSSScalingSettings;
+    /* published under rwLock, read without lock at DISPATCH_LEVEL */
+    PPARANDIS_RSS_SNAPSHOT volatile     ActiveSnapshot;
+    PPARANDIS_RSS_SNAPSHOT              RetiredSnapshots;
+    PARANDIS_RSS_SNAPSHOT               DisabledSnapshot;
+    ULONG                               SnapshotVersion;
+    NDIS_HANDLE                         MiniportHandle;
+
+    /* updated without lock by the data path */
+    PARANDIS_RSS_ENTRY_STATE            EntryState[NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_2 / sizeof(PROCESSOR_NUMBER)];
+    volatile LONG                       QueueIndicated[PARANDIS_RSS_MAX_RECEIVE_QUEUES];
+    /* QueuedPosition of the receive queues, read only while an entry moves */
+    const volatile ULONG                *QueueQueued[PARANDIS_RSS_MAX_RECEIVE_QUEUES];
+    /* queues whose processor changed with the last snapshot, bit per queue */
+    volatile LONG                       ReceiveQueuesToReclassify;
+
+    volatile LONG                       MigrationsDrained;
+    volatile LONG                       MigrationsForced;
+    volatile LONG                       FramesHeld;
+    volatile LONG                       FramesReclassified;
 
     mutable CNdisRWLock                 rwLock;
 } PARANDIS_RSS_PARAMS, *PPARANDIS_RSS_PARAMS;
 
+/* The returned snapshot may be used until the caller leaves DISPATCH_LEVEL
+   or for as long as it holds rwLock */
+static __inline
+const PARANDIS_RSS_SNAPSHOT *ParaNdis6_RSSGetActiveSnapshot(const PARANDIS_RSS_PARAMS *RSSParameters)
+{
+    return RSSParameters->ActiveSnapshot;
+}
+
 typedef struct _tagRSS_HASH_KEY_PARAMETERS
 {
     NDIS_RECEIVE_HASH_PARAMETERS        ReceiveHashParameters;
@@ -75,11 +129,16 @@ NDIS_STATUS ParaNdis6_RSSSetReceiveHash(PARANDIS_RSS_PARAMS *RSSParameters,
                                         UINT ParamsLength,
                                         PUINT ParamsBytesRead);
 
+/* Frees the snapshots replaced by ParaNdis6_RSSSetParameters/ParaNdis6_RSSSetReceiveHash.
+   Must be called at PASSIVE_LEVEL without rwLock held */
+VOID ParaNdis6_RSSReleaseRetiredSnapshots(PARANDIS_RSS_PARAMS *RSSParameters);
+
 VOID ParaNdis6_RSSCleanupConfiguration(PARANDIS_RSS_PARAMS *RSSParameters);
 
 NDIS_RECEIVE_SCALE_CAPABILITIES* ParaNdis6_RSSCreateConfiguration(PARANDIS_RSS_PARAMS *RSSParameters,
                                                                   NDIS_RECEIVE_SCALE_CAPABILITIES *RSSCapabilities,
-                                                                  CCHAR RSSMaxQueuesNumber);
+                                                                  CCHAR RSSMaxQueuesNumber,
+                                                                  NDIS_HANDLE MiniportHandle);
 
 struct _tagNET_PACKET_INFO;
 
@@ -95,6 +154,21 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(
 
 CCHAR ParaNdis6_RSSGetCurrentCpuReceiveQueue(PARANDIS_RSS_PARAMS *RSSParameters);
 
+/* A packet with the hash value was added to the receive queue at the position,
+   recorded only while its indirection entry moves away from the queue */
+VOID ParaNdis6_RSSPacketQueued(
+    PARANDIS_RSS_PARAMS *RSSParameters,
+    ULONG hashValue,
+    CCHAR receiveQueue,
+    ULONG position);
+
+/* The packets of the receive queue up to the position were indicated
+   or left the queue otherwise */
+VOID ParaNdis6_RSSReceiveQueueIndicated(
+    PARANDIS_RSS_PARAMS *RSSParameters,
+    CCHAR receiveQueue,
+    ULONG position);
+
 #else
 
 #define PARANDIS_RSS_MAX_RECEIVE_QUEUES (0)
@@ -0,0 +1,229 @@
+#pragma once
+
+/* RSS hash of a received packet as the NetKVM RX path computes it: the
+   Toeplitz hash of the addresses and ports selected by the hash types of
+   HashInformation, taken from the headers recorded in NET_PACKET_INFO by
+   the packet parser (ParaNdis-PacketParser.h).
+   Depends only on the basic types and NDIS hash definitions, so it can be
+   built in user mode as well (DebugTools/RSS-Toeplitz) */
+
+/* The UDP hash types exist since NDIS 6.80. The driver is built with older
+   headers, so they are defined here and the hash types are taken from the
+   hash information with a mask that keeps them; NDIS sets them only when
+   the capabilities advertise them (ParaNdis6-RSS.cpp) */
+#ifndef NDIS_HASH_UDP_IPV4
+#define NDIS_HASH_UDP_IPV4          0x00004000
+#define NDIS_HASH_UDP_IPV6          0x00008000
+#define NDIS_HASH_UDP_IPV6_EX       0x00010000
+#endif
+/* and the capabilities that advertise them, as in ntddndis.h */
+#ifndef NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4
+#define NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4    0x00000800
+#define NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6    0x00001000
+#define NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6_EX 0x00002000
+#endif
+
+#define PARANDIS_HASH_UDP_TYPES     (NDIS_HASH_UDP_IPV4 | NDIS_HASH_UDP_IPV6 | NDIS_HASH_UDP_IPV6_EX)
+#define PARANDIS_HASH_IPV6_EX_TYPES (NDIS_HASH_TCP_IPV6_EX | NDIS_HASH_IPV6_EX | NDIS_HASH_UDP_IPV6_EX)
+#define PARANDIS_RSS_HASH_TYPE_FROM_HASH_INFO(HashInformation) \
+    (NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(HashInformation) | ((HashInformation) & PARANDIS_HASH_UDP_TYPES))
+
+typedef struct _tagHASH_CALC_SG_BUF_ENTRY
+{
+    PCHAR chunkPtr;
+    ULONG  chunkLen;
+} HASH_CALC_SG_BUF_ENTRY, *PHASH_CALC_SG_BUF_ENTRY;
+
+// Little Endian version ONLY
+static __inline
+UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, PCCHAR fullKey)
+{
+#define TOEPLITZ_MAX_BIT_NUM (7)
+#define TOEPLITZ_BYTE_HAS_BIT(byte, bit) ((byte) & (1 << (TOEPLITZ_MAX_BIT_NUM - (bit))))
+#define TOEPLITZ_BYTE_BIT_STATE(byte, bit) (((byte) >> (TOEPLITZ_MAX_BIT_NUM - (bit))) & 1)
+
+    UINT32 firstKeyWord, res = 0;
+    UINT byte, bit;
+    PHASH_CALC_SG_BUF_ENTRY sgEntry;
+    PCCHAR next_key_byte = fullKey + sizeof(firstKeyWord);
+    firstKeyWord = RtlUlongByteSwap(*(UINT32*)fullKey);
+
+    for(sgEntry = sgBuff; sgEntry < sgBuff + sgEntriesNum; ++sgEntry)
+    {
+        for (byte = 0; byte < sgEntry->chunkLen; ++byte)
+        {
+            for (bit = 0; bit <= TOEPLITZ_MAX_BIT_NUM; ++bit)
+            {
+                if (TOEPLITZ_BYTE_HAS_BIT(sgEntry->chunkPtr[byte], bit))
+                {
+                    res ^= firstKeyWord;
+                }
+                firstKeyWord = (firstKeyWord << 1) | TOEPLITZ_BYTE_BIT_STATE(*next_key_byte, bit);
+            }
+            ++next_key_byte;
+        }
+    }
+    return res;
+
+#undef TOEPLITZ_BYTE_HAS_BIT
+#undef TOEPLITZ_BYTE_BIT_STATE
+#undef TOEPLITZ_MAX_BIT_NUM
+}
+
+static __inline
+IPV6_ADDRESS* GetIP6SrcAddrForHash(
+                            PVOID dataBuffer,
+                            PNET_PACKET_INFO packetInfo,
+                            ULONG hashTypes)
+{
+    return ((hashTypes & PARANDIS_HASH_IPV6_EX_TYPES) && packetInfo->ip6HomeAddrOffset)
+        ? (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->ip6HomeAddrOffset)
+        : (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen + FIELD_OFFSET(IPv6Header, ip6_src_address));
+}
+
+static __inline
+IPV6_ADDRESS* GetIP6DstAddrForHash(
+                            PVOID dataBuffer,
+                            PNET_PACKET_INFO packetInfo,
+                            ULONG hashTypes)
+{
+    return ((hashTypes & PARANDIS_HASH_IPV6_EX_TYPES) && packetInfo->ip6DestAddrOffset)
+        ? (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->ip6DestAddrOffset)
+        : (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen + FIELD_OFFSET(IPv6Header, ip6_dst_address));
+}
+
+static __inline
+BOOLEAN HasUDPHeaderForHash(PNET_PACKET_INFO packetInfo)
+{
+    return packetInfo->isUDP && packetInfo->isL4HdrComplete;
+}
+
+static __inline
+VOID RSSCalcHash_Unsafe(
+                ULONG HashInformation,
+                PCCHAR HashSecretKey,
+                PVOID dataBuffer,
+                PNET_PACKET_INFO packetInfo)
+{
+    HASH_CALC_SG_BUF_ENTRY sgBuff[3];
+    ULONG hashTypes = PARANDIS_RSS_HASH_TYPE_FROM_HASH_INFO(HashInformation);
+
+    if(packetInfo->isIP4)
+    {
+        if(packetInfo->isTCP && packetInfo->isL4HdrComplete && (hashTypes & NDIS_HASH_TCP_IPV4))
+        {
+            IPv4Header *pIpHeader = (IPv4Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
+            TCPHeader *pTCPHeader = (TCPHeader *) RtlOffsetToPointer(pIpHeader, packetInfo->L3HdrLen);
+
+            sgBuff[0].chunkPtr = RtlOffsetToPointer(pIpHeader, FIELD_OFFSET(IPv4Header, ip_src));
+            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
+            sgBuff[1].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
+            sgBuff[1].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
+
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, HashSecretKey);
+            packetInfo->RSSHash.Type = NDIS_HASH_TCP_IPV4;
+            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+            return;
+        }
+
+        if(HasUDPHeaderForHash(packetInfo) && (hashTypes & NDIS_HASH_UDP_IPV4))
+        {
+            IPv4Header *pIpHeader = (IPv4Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
+            UDPHeader *pUDPHeader = (UDPHeader *) RtlOffsetToPointer(pIpHeader, packetInfo->L3HdrLen);
+
+            sgBuff[0].chunkPtr = RtlOffsetToPointer(pIpHeader, FIELD_OFFSET(IPv4Header, ip_src));
+            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
+            sgBuff[1].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
+            sgBuff[1].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
+
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, HashSecretKey);
+            packetInfo->RSSHash.Type = NDIS_HASH_UDP_IPV4;
+            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+            return;
+        }
+
+        if(hashTypes & NDIS_HASH_IPV4)
+        {
+            sgBuff[0].chunkPtr = RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen + FIELD_OFFSET(IPv4Header, ip_src));
+            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
+
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, HashSecretKey);
+            packetInfo->RSSHash.Type = NDIS_HASH_IPV4;
+            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+            return;
+        }
+    }
+    else if(packetInfo->isIP6)
+    {
+        if(packetInfo->isTCP)
+        {
+            if(packetInfo->isL4HdrComplete && (hashTypes & (NDIS_HASH_TCP_IPV6 | NDIS_HASH_TCP_IPV6_EX)))
+            {
+                IPv6Header *pIpHeader =  (IPv6Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
+                TCPHeader  *pTCPHeader = (TCPHeader *) RtlOffsetToPointer(pIpHeader, packetInfo->L3HdrLen);
+
+                sgBuff[0].chunkPtr = (PCHAR) GetIP6SrcAddrForHash(dataBuffer, packetInfo, hashTypes);
+                sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address);
+                sgBuff[1].chunkPtr = (PCHAR) GetIP6DstAddrForHash(dataBuffer, packetInfo, hashTypes);
+                sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
+                sgBuff[2].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
+                sgBuff[2].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
+
+                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, HashSecretKey);
+                packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_TCP_IPV6_EX) ? NDIS_HASH_TCP_IPV6_EX : NDIS_HASH_TCP_IPV6;
+                packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+                return;
+            }
+        }
+        else if(HasUDPHeaderForHash(packetInfo))
+        {
+            if(hashTypes & (NDIS_HASH_UDP_IPV6 | NDIS_HASH_UDP_IPV6_EX))
+            {
+                IPv6Header *pIpHeader =  (IPv6Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
+                UDPHeader  *pUDPHeader = (UDPHeader *) RtlOffsetToPointer(pIpHeader, packetInfo->L3HdrLen);
+
+                sgBuff[0].chunkPtr = (PCHAR) GetIP6SrcAddrForHash(dataBuffer, packetInfo, hashTypes);
+                sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address);
+                sgBuff[1].chunkPtr = (PCHAR) GetIP6DstAddrForHash(dataBuffer, packetInfo, hashTypes);
+                sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
+                sgBuff[2].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
+                sgBuff[2].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
+
+                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, HashSecretKey);
+                packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_UDP_IPV6_EX) ? NDIS_HASH_UDP_IPV6_EX : NDIS_HASH_UDP_IPV6;
+                packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+                return;
+            }
+        }
+
+        if(hashTypes & (NDIS_HASH_IPV6 | NDIS_HASH_IPV6_EX))
+        {
+            sgBuff[0].chunkPtr = (PCHAR) GetIP6SrcAddrForHash(dataBuffer, packetInfo, hashTypes);
+            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address);
+            sgBuff[1].chunkPtr = (PCHAR) GetIP6DstAddrForHash(dataBuffer, packetInfo, hashTypes);
+            sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
+
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, HashSecretKey);
+            packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_IPV6_EX) ? NDIS_HASH_IPV6_EX : NDIS_HASH_IPV6;
+            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+            return;
+        }
+
+        if(hashTypes & NDIS_HASH_IPV6)
+        {
+            IPv6Header *pIpHeader = (IPv6Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
+
+            sgBuff[0].chunkPtr = RtlOffsetToPointer(pIpHeader, FIELD_OFFSET(IPv6Header, ip6_src_address));
+            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address) + RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
+
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, HashSecretKey);
+            packetInfo->RSSHash.Type = NDIS_HASH_IPV6;
+            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+            return;
+        }
+    }
+
+    packetInfo->RSSHash.Value = 0;
+    packetInfo->RSSHash.Type = 0;
+    packetInfo->RSSHash.Function = 0;
+}
@@ -34,21 +34,133 @@ bool CParaNdisRX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
 
     m_nReusedRxBuffersLimit = m_Context->NetMaxReceiveBuffers / 4 + 1;
 
+    LARGE_INTEGER Frequency;
+    KeQueryPerformanceCounter(&Frequency);
+    m_DpcTimeBudgetTicks = Frequency.QuadPart * PARANDIS_RX_DPC_TIME_BUDGET_US / 1000000;
+    m_DpcBudgetMax = m_Context->uNumberOfHandledRXPacketsInDPC;
+    m_DpcBudgetMin = min(m_DpcBudgetMax, (ULONG)PARANDIS_RX_BUDGET_MIN);
+    m_DpcBudget = min(m_DpcBudgetMax, (ULONG)PARANDIS_RX_BUDGET_INITIAL);
+
+    // the cache must be able to hold all the buffers of the queue
+    INT nCacheSize = 1;
+    while (nCacheSize <= (INT)m_Context->NetMaxReceiveBuffers)
+    {
+        nCacheSize <<= 1;
+    }
+    m_bReturnedBuffersCache = !!m_ReturnedBuffersCache.Create(m_Context, nCacheSize);
+    if (!m_bReturnedBuffersCache)
+    {
+        DPrintf(0, "[%s] no cache for returned buffers, queue %d\n", __FUNCTION__, DeviceQueueIndex);
+    }
+
     PrepareReceiveBuffers();
 
+    if (m_Context->uRxCopyThreshold)
+    {
+        CreateCopyBuffers(m_NetNofReceiveBuffers);
+    }
+
     return true;
 }
 
+/* One copy buffer per ring buffer, so the upper layers may hold
+   a full ring worth of small frames while the ring stays full */
+void CParaNdisRX::CreateCopyBuffers(ULONG nBuffers)
+{
+    ULONG ulStride = (m_Context->uRxCopyThreshold + SYSTEM_CACHE_ALIGNMENT_SIZE - 1) & ~(SYSTEM_CACHE_ALIGNMENT_SIZE - 1);
+
+    if (nBuffers == 0)
+    {
+        return;
+    }
+
+    m_CopyBuffers = (CRxCopyBuffer *)ParaNdis_AllocateMemory(m_Context, sizeof(*m_CopyBuffers) * nBuffers);
+    m_CopyBuffersData = ParaNdis_AllocateMemory(m_Context, ulStride * nBuffers);
+    if (m_CopyBuffers == nullptr || m_CopyBuffersData == nullptr)
+    {
+        DPrintf(0, "[%s] queue %d: no memory for the copy buffers\n", __FUNCTION__, m_queueIndex);
+        FreeCopyBuffers();
+        return;
+    }
+    NdisZeroMemory(m_CopyBuffers, sizeof(*m_CopyBuffers) * nBuffers);
+
+    for (m_nCopyBuffers = 0; m_nCopyBuffers < nBuffers; m_nCopyBuffers++)
+    {
+        CRxCopyBuffer *p = &m_CopyBuffers[m_nCopyBuffers];
+
+        p->Queue = this;
+        p->Data = RtlOffsetToPointer(m_CopyBuffersData, m_nCopyBuffers * ulStride);
+        p->Mdl = NdisAllocateMdl(m_Context->MiniportHandle, p->Data, ulStride);
+        if (p->Mdl == NULL)
+        {
+            break;
+        }
+        p->NBL = NdisAllocateNetBufferAndNetBufferList(m_Context->BufferListsPool, 0, 0, p->Mdl, 0, 0);
+        if (p->NBL == NULL)
+        {
+            NdisFreeMdl(p->Mdl);
+            break;
+        }
+        p->NBL->SourceHandle = m_Context->MiniportHandle;
+        // no descriptor, the NBL is returned to the copy buffers
+        p->NBL->MiniportReserved[0] = NULL;
+        p->NBL->MiniportReserved[1] = p;
+
+        m_CopyBuffersList.PushBack(p);
+    }
+
+    DPrintf(0, "[%s] queue %d: %d copy buffers of %d bytes\n", __FUNCTION__, m_queueIndex, m_nCopyBuffers, ulStride);
+}
+
+void CParaNdisRX::FreeCopyBuffers()
+{
+    m_CopyBuffersList.ForEachDetached([](CRxCopyBuffer *) {});
+
+    for (ULONG i = 0; i < m_nCopyBuffers; i++)
+    {
+        NdisFreeNetBufferList(m_CopyBuffers[i].NBL);
+        NdisFreeMdl(m_CopyBuffers[i].Mdl);
+    }
+    m_nCopyBuffers = 0;
+
+    if (m_CopyBuffers != nullptr)
+    {
+        NdisFreeMemory(m_CopyBuffers, 0, 0);
+        m_CopyBuffers = nullptr;
+    }
+    if (m_CopyBuffersData != nullptr)
+    {
+        NdisFreeMemory(m_CopyBuffersData, 0, 0);
+        m_CopyBuffersData = nullptr;
+    }
+}
+
 int CParaNdisRX::PrepareReceiveBuffers()
 {
     int nRet = 0;
     UINT i;
     DEBUG_ENTRY(4);
 
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Start = KeQueryPerformanceCounter(&Frequency);
+
+    UINT nArenaBuffers = CreateRxArena(m_Context->NetMaxReceiveBuffers);
+    pRxNetDescriptor ArenaDescriptors = (pRxNetDescriptor)m_ArenaMetadata;
+
     for (i = 0; i < m_Context->NetMaxReceiveBuffers; ++i)
     {
-        pRxNetDescriptor pBuffersDescriptor = CreateRxDescriptorOnInit();
-        if (!pBuffersDescriptor) break;
+        pRxNetDescriptor pBuffersDescriptor;
+        if (i < nArenaBuffers)
+        {
+            pBuffersDescriptor = &ArenaDescriptors[i];
+            if (!BindRxDescriptor(pBuffersDescriptor)) break;
+        }
+        else
+        {
+            // the arena could not fit all the buffers, the rest is allocated one by one
+            pBuffersDescriptor = CreateRxDescriptorOnInit();
+            if (!pBuffersDescriptor) break;
+        }
 
         pBuffersDescriptor->Queue = this;
 
@@ -65,11 +177,118 @@ int CParaNdisRX::PrepareReceiveBuffers()
     /* TODO - NetMaxReceiveBuffers should take into account all queues */
     m_Context->NetMaxReceiveBuffers = m_NetNofReceiveBuffers;
     DPrintf(0, "[%s] MaxReceiveBuffers %d\n", __FUNCTION__, m_Context->NetMaxReceiveBuffers);
+
+    LONGLONG ElapsedUs = (KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart) * 1000000 / Frequency.QuadPart;
+    DPrintf(0, "[%s] queue %d: %d buffers (%d in arena) in %I64d us, %d shared memory blocks, %d pool allocations\n",
+        __FUNCTION__, m_queueIndex, m_NetNofReceiveBuffers, min(nArenaBuffers, m_NetNofReceiveBuffers),
+        ElapsedUs, m_nInitSharedAllocations, m_nInitPoolAllocations);
+
     m_Reinsert = true;
 
     return nRet;
 }
 
+UINT CParaNdisRX::CreateRxArena(UINT nBuffers)
+{
+    // the same layout as CreateRxDescriptorOnInit makes: one page for virtio
+    // header and indirect buffers array, then the pages for the data
+    ULONG ulStride = (m_Context->MaxPacketSize.nMaxDataSizeHwRx / PAGE_SIZE + 2) * PAGE_SIZE;
+    ULONG ulMetadataSize = nBuffers * (sizeof(RxNetDescriptor) +
+        PARANDIS_RX_ARENA_SG_ENTRIES * (sizeof(tCompletePhysicalAddress) + sizeof(struct VirtIOBufferDescriptor)));
+
+    if (nBuffers == 0)
+    {
+        return 0;
+    }
+
+    m_ArenaMetadata = ParaNdis_AllocateMemory(m_Context, ulMetadataSize);
+    // at worst each block holds a single buffer
+    m_ArenaBlocks = (tCompletePhysicalAddress *)ParaNdis_AllocateMemory(m_Context, sizeof(*m_ArenaBlocks) * nBuffers);
+    if (m_ArenaMetadata == nullptr || m_ArenaBlocks == nullptr)
+    {
+        DPrintf(0, "[%s] queue %d: no memory for the arena\n", __FUNCTION__, m_queueIndex);
+        FreeRxArena();
+        return 0;
+    }
+    m_nInitPoolAllocations += 2;
+    NdisZeroMemory(m_ArenaMetadata, ulMetadataSize);
+
+    pRxNetDescriptor Descriptors = (pRxNetDescriptor)m_ArenaMetadata;
+    tCompletePhysicalAddress *Pages = (tCompletePhysicalAddress *)(Descriptors + nBuffers);
+    struct VirtIOBufferDescriptor *SGArray =
+        (struct VirtIOBufferDescriptor *)(Pages + nBuffers * PARANDIS_RX_ARENA_SG_ENTRIES);
+
+    ULONG ulBlockSize = max(PARANDIS_RX_ARENA_BLOCK_SIZE / ulStride, 1ul) * ulStride;
+    UINT nCarved = 0;
+
+    while (nCarved < nBuffers)
+    {
+        tCompletePhysicalAddress *Block = &m_ArenaBlocks[m_nArenaBlocks];
+
+        ulBlockSize = min(ulBlockSize, (nBuffers - nCarved) * ulStride);
+        while (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, ulBlockSize, Block))
+        {
+            // Retry with half the buffers
+            if (ulBlockSize == ulStride)
+            {
+                DPrintf(0, "[%s] queue %d: arena stopped at %d buffers\n", __FUNCTION__, m_queueIndex, nCarved);
+                return nCarved;
+            }
+            ulBlockSize = max(ulBlockSize / ulStride / 2, 1ul) * ulStride;
+        }
+        m_nArenaBlocks++;
+        m_nInitSharedAllocations++;
+
+        for (ULONG ulOffset = 0; ulOffset + ulStride <= Block->size; ulOffset += ulStride)
+        {
+            pRxNetDescriptor p = &Descriptors[nCarved];
+
+            p->InArena = TRUE;
+            p->PhysicalPages = &Pages[nCarved * PARANDIS_RX_ARENA_SG_ENTRIES];
+            p->BufferSGArray = &SGArray[nCarved * PARANDIS_RX_ARENA_SG_ENTRIES];
+            p->BufferSGLength = PARANDIS_RX_ARENA_SG_ENTRIES;
+
+            p->PhysicalPages[0].Virtual = RtlOffsetToPointer(Block->Virtual, ulOffset);
+            p->PhysicalPages[0].Physical.QuadPart = Block->Physical.QuadPart + ulOffset;
+            p->PhysicalPages[0].size = PAGE_SIZE;
+
+            p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual = RtlOffsetToPointer(Block->Virtual, ulOffset + PAGE_SIZE);
+            p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Physical.QuadPart = Block->Physical.QuadPart + ulOffset + PAGE_SIZE;
+            p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size = ulStride - PAGE_SIZE;
+
+            for (ULONG i = 0; i < PARANDIS_RX_ARENA_SG_ENTRIES; i++)
+            {
+                p->BufferSGArray[i].physAddr = p->PhysicalPages[i].Physical;
+                p->BufferSGArray[i].length = p->PhysicalPages[i].size;
+            }
+
+            nCarved++;
+        }
+    }
+
+    return nCarved;
+}
+
+void CParaNdisRX::FreeRxArena()
+{
+    for (ULONG i = 0; i < m_nArenaBlocks; i++)
+    {
+        ParaNdis_FreePhysicalMemory(m_Context, &m_ArenaBlocks[i]);
+    }
+    m_nArenaBlocks = 0;
+
+    if (m_ArenaBlocks != nullptr)
+    {
+        NdisFreeMemory(m_ArenaBlocks, 0, 0);
+        m_ArenaBlocks = nullptr;
+    }
+    if (m_ArenaMetadata != nullptr)
+    {
+        NdisFreeMemory(m_ArenaMetadata, 0, 0);
+        m_ArenaMetadata = nullptr;
+    }
+}
+
 pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
 {
     //For RX packets we allocate following pages
@@ -91,6 +310,8 @@ pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
         ParaNdis_AllocateMemory(m_Context, sizeof(*p->PhysicalPages) * ulNumPages);
     if (p->PhysicalPages == NULL) goto error_exit;
 
+    m_nInitPoolAllocations += 3;
+
     p->BufferSGLength = 0;
     while (ulNumPages > 0)
     {
@@ -114,8 +335,21 @@ pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
 
         ulNumPages -= ulPagesToAlloc;
         p->BufferSGLength++;
+        m_nInitSharedAllocations++;
     }
 
+    if (!BindRxDescriptor(p))
+        goto error_exit;
+
+    return p;
+
+error_exit:
+    ParaNdis_FreeRxBufferDescriptor(m_Context, p);
+    return NULL;
+}
+
+bool CParaNdisRX::BindRxDescriptor(pRxNetDescriptor p)
+{
     //First page is for virtio header, size needs to be adjusted correspondingly
     p->BufferSGArray[0].length = m_Context->nVirtioHeaderSize;
 
@@ -124,14 +358,7 @@ pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
     p->IndirectArea.Virtual = RtlOffsetToPointer(p->PhysicalPages[0].Virtual, m_Context->nVirtioHeaderSize);
     p->IndirectArea.size = PAGE_SIZE - m_Context->nVirtioHeaderSize;
 
-    if (!ParaNdis_BindRxBufferToPacket(m_Context, p))
-        goto error_exit;
-
-    return p;
-
-error_exit:
-    ParaNdis_FreeRxBufferDescriptor(m_Context, p);
-    return NULL;
+    return !!ParaNdis_BindRxBufferToPacket(m_Context, p);
 }
 
 /* TODO - make it method in pRXNetDescriptor */
@@ -148,14 +375,23 @@ BOOLEAN CParaNdisRX::AddRxBufferToQueue(pRxNetDescriptor pBufferDescriptor)
 
 void CParaNdisRX::FreeRxDescriptorsFromList()
 {
+    pRxNetDescriptor pReturned;
+    while (m_bReturnedBuffersCache && (pReturned = m_ReturnedBuffersCache.Dequeue()) != NULL)
+    {
+        ParaNdis_FreeRxBufferDescriptor(m_Context, pReturned);
+    }
+
     while (!IsListEmpty(&m_NetReceiveBuffers))
     {
         pRxNetDescriptor pBufferDescriptor = (pRxNetDescriptor)RemoveHeadList(&m_NetReceiveBuffers);
         ParaNdis_FreeRxBufferDescriptor(m_Context, pBufferDescriptor);
     }
+
+    FreeRxArena();
+    FreeCopyBuffers();
 }
 
-void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
+void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor, bool bKick)
 {
     DEBUG_ENTRY(4);
 
@@ -177,7 +413,7 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
         }
 
         /* TODO - nReusedRXBuffers per queue or per context ?*/
-        if (++m_nReusedRxBuffersCounter >= m_nReusedRxBuffersLimit)
+        if (++m_nReusedRxBuffersCounter >= m_nReusedRxBuffersLimit && bKick)
         {
             m_nReusedRxBuffersCounter = 0;
             m_VirtQueue.Kick();
@@ -192,6 +428,98 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
     }
 }
 
+void CParaNdisRX::ReturnReceiveBuffer(pRxNetDescriptor pBuffersDescriptor)
+{
+    if (!m_bReturnedBuffersCache || !m_ReturnedBuffersCache.Enqueue(pBuffersDescriptor))
+    {
+        TPassiveSpinLocker autoLock(m_Lock);
+
+        m_nReturnLockAcquisitions++;
+        m_nReturnedBuffers++;
+        ReuseReceiveBufferNoLock(pBuffersDescriptor);
+    }
+}
+
+void CParaNdisRX::FlushReturnedBuffersIfNeeded(LONG nReturned)
+{
+    // the interlocked operation orders the enqueue against the read of m_Reinsert
+    LONG nPending = InterlockedExchangeAdd(&m_nPendingReturns, nReturned) + nReturned;
+
+    if (!m_Reinsert ||
+        nPending >= (LONG)m_nReusedRxBuffersLimit ||
+        m_NetNofReceiveBuffers < m_nReusedRxBuffersLimit)
+    {
+        TPassiveSpinLocker autoLock(m_Lock);
+
+        m_nReturnLockAcquisitions++;
+        FlushReturnedBuffersNoLock();
+    }
+}
+
+/* Reposts all the cached buffers with a single kick,
+   called under m_Lock from the return path and from the DPC */
+void CParaNdisRX::FlushReturnedBuffersNoLock()
+{
+    pRxNetDescriptor pBufferDescriptor;
+    ULONG nFlushed = 0;
+
+    if (!m_bReturnedBuffersCache)
+    {
+        return;
+    }
+
+    InterlockedExchange(&m_nPendingReturns, 0);
+
+    while ((pBufferDescriptor = m_ReturnedBuffersCache.Dequeue()) != NULL)
+    {
+        ReuseReceiveBufferNoLock(pBufferDescriptor, false);
+        nFlushed++;
+    }
+
+    m_nReturnedBuffers += nFlushed;
+
+    if (nFlushed && m_Reinsert)
+    {
+        m_nReusedRxBuffersCounter = 0;
+        m_VirtQueue.Kick();
+    }
+}
+
+/* The budget doubles when the DPC used all of it, the ring still has
+   packets and the time limit was kept. It halves when the time limit
+   was exceeded or when the upper layers hold most of the RX buffers,
+   i.e. indicating more would only starve the ring further. */
+void CParaNdisRX::UpdateDpcBudget(ULONG nIndicated, ULONG nLimit, bool bMoreWork, bool bLimitedByOS, LONGLONG ElapsedTicks)
+{
+    ULONG bucket = 0;
+
+    if (nIndicated)
+    {
+        _BitScanReverse(&bucket, nIndicated);
+        bucket = min(bucket + 1, (ULONG)PARANDIS_RX_BUDGET_HISTOGRAM_SIZE - 1);
+    }
+    m_DpcHistogram[bucket]++;
+
+    bool bBackpressure = m_NetNofReceiveBuffers < m_Context->NetMaxReceiveBuffers / 4;
+
+    if (ElapsedTicks > m_DpcTimeBudgetTicks || bBackpressure)
+    {
+        if (m_DpcBudget > m_DpcBudgetMin)
+        {
+            m_DpcBudget = max(m_DpcBudget / 2, m_DpcBudgetMin);
+            m_DpcBudgetShrinks++;
+        }
+    }
+    else if (nIndicated >= nLimit && bMoreWork && !bLimitedByOS)
+    {
+        if (m_DpcBudget < m_DpcBudgetMax)
+        {
+            m_DpcBudget = min(m_DpcBudget * 2, m_DpcBudgetMax);
+            m_DpcBudgetGrows++;
+        }
+    }
+}
+
 VOID CParaNdisRX::KickRXRing()
 {
     m_VirtQueue.Kick();
@@ -208,10 +536,16 @@ VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
 
     TDPCSpinLocker autoLock(m_Lock);
 
+    FlushReturnedBuffersNoLock();
+
+    // one timestamp for the pass, the latency histograms are logarithmic
+    LONGLONG UsedTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+
     while (NULL != (pBufferDescriptor = (pRxNetDescriptor)m_VirtQueue.GetBuf(&nFullLength)))
     {
         RemoveEntryList(&pBufferDescriptor->listEntry);
         m_NetNofReceiveBuffers--;
+        pBufferDescriptor->UsedTimestamp = UsedTimestamp;
 
         BOOLEAN packetAnalysisRC;
 
@@ -228,11 +562,16 @@ VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
         if (!packetAnalysisRC)
         {
             pBufferDescriptor->Queue->ReuseReceiveBufferNoLock(pBufferDescriptor);
-            m_Context->Statistics.ifInErrors++;
-            m_Context->Statistics.ifInDiscards++;
+            tCpuStatistics *pStatistics = ParaNdis_CpuStatistics(m_Context);
+            pStatistics->ifInErrors++;
+            pStatistics->ifInDiscards++;
+            m_VirtQueue.Statistics().Drops++;
             continue;
         }
 
+        m_VirtQueue.Statistics().Packets++;
+        m_VirtQueue.Statistics().Bytes += pBufferDescriptor->PacketInfo.dataLength;
+
 #ifdef PARANDIS_SUPPORT_RSS
         CCHAR nTargetReceiveQueueNum;
         GROUP_AFFINITY TargetAffinity;
@@ -249,7 +588,11 @@ VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
         }
         else
         {
-            ParaNdis_ReceiveQueueAddBuffer(&m_Context->ReceiveQueues[nTargetReceiveQueueNum], pBufferDescriptor);
+            /* the buffer may be taken by another processor once added */
+            ULONG hashValue = pBufferDescriptor->PacketInfo.RSSHash.Value;
+            ULONG position = ParaNdis_ReceiveQueueAddBuffer(&m_Context->ReceiveQueues[nTargetReceiveQueueNum], pBufferDescriptor);
+
+            ParaNdis6_RSSPacketQueued(&m_Context->RSSParameters, hashValue, nTargetReceiveQueueNum, position);
 
             if (nTargetReceiveQueueNum != nCurrCpuReceiveQueue)
             {
@@ -268,6 +611,8 @@ void CParaNdisRX::PopulateQueue()
     LIST_ENTRY TempList;
     TPassiveSpinLocker autoLock(m_Lock);
 
+    // the queue is stopped, so the cached buffers go to the list
+    FlushReturnedBuffersNoLock();
 
     InitializeListHead(&TempList);
 
@@ -1,6 +1,24 @@
 #pragma once
 #include "ParaNdis-VirtQueue.h"
 #include "ParaNdis-AbstractPath.h"
+#include "ParaNdis_LockFreeQueue.h"
+
+class CParaNdisRX;
+
+/* Buffer a small received frame is copied to, so that its ring
+   buffer is reposted without waiting for the upper layers */
+class CRxCopyBuffer
+{
+public:
+    CParaNdisRX *Queue;
+    PNET_BUFFER_LIST NBL;
+    PMDL Mdl;
+    PVOID Data;
+    /* the UsedTimestamp of the descriptor the frame was copied from */
+    LONGLONG UsedTimestamp;
+
+    DECLARE_CNDISLIST_ENTRY(CRxCopyBuffer);
+};
 
 class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAllocatable < CParaNdisRX, 'XRHR' > {
 public:
@@ -22,6 +40,14 @@ public:
         ReuseReceiveBufferNoLock(pBuffersDescriptor);
     }
 
+    // called when the upper layers return the buffer, does not take the lock
+    void ReturnReceiveBuffer(pRxNetDescriptor pBuffersDescriptor);
+    // reposts the returned buffers when enough of them are cached or the ring runs low
+    void FlushReturnedBuffersIfNeeded(LONG nReturned);
+
+    ULONG GetReturnedBuffers() const { return m_nReturnedBuffers; }
+    ULONG GetReturnLockAcquisitions() const { return m_nReturnLockAcquisitions; }
+
     VOID ProcessRxRing(CCHAR nCurrCpuReceiveQueue);
 
     BOOLEAN RestartQueue();
@@ -32,12 +58,25 @@ public:
 
         m_VirtQueue.Shutdown();
         m_Reinsert = false;
+        // pairs with the barrier in FlushReturnedBuffersIfNeeded
+        KeMemoryBarrier();
+        FlushReturnedBuffersNoLock();
     }
 
     void KickRXRing();
 
     PARANDIS_RECEIVE_QUEUE &UnclassifiedPacketsQueue() { return m_UnclassifiedPacketsQueue;  }
 
+    ULONG GetDpcBudget() const { return m_DpcBudget; }
+    void UpdateDpcBudget(ULONG nIndicated, ULONG nLimit, bool bMoreWork, bool bLimitedByOS, LONGLONG ElapsedTicks);
+    ULONG GetDpcBudgetGrows() const { return m_DpcBudgetGrows; }
+    ULONG GetDpcBudgetShrinks() const { return m_DpcBudgetShrinks; }
+    const ULONG *GetDpcHistogram() const { return m_DpcHistogram; }
+
+    CRxCopyBuffer *GetCopyBuffer() { return m_CopyBuffersList.Pop(); }
+    // the most recently used buffer is taken first, its data is still in the cache
+    void ReturnCopyBuffer(CRxCopyBuffer *pCopyBuffer) { m_CopyBuffersList.Push(pCopyBuffer); }
+
 private:
     /* list of Rx buffers available for data (under VIRTIO management) */
     LIST_ENTRY              m_NetReceiveBuffers;
@@ -49,8 +88,43 @@ private:
 
     PARANDIS_RECEIVE_QUEUE m_UnclassifiedPacketsQueue;
 
-    void ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor);
+    ULONG m_DpcBudget = PARANDIS_RX_BUDGET_INITIAL;
+    ULONG m_DpcBudgetMin = PARANDIS_RX_BUDGET_MIN;
+    ULONG m_DpcBudgetMax = PARANDIS_RX_BUDGET_INITIAL;
+    LONGLONG m_DpcTimeBudgetTicks = 0;
+    ULONG m_DpcBudgetGrows = 0;
+    ULONG m_DpcBudgetShrinks = 0;
+    ULONG m_DpcHistogram[PARANDIS_RX_BUDGET_HISTOGRAM_SIZE] = {};
+
+    /* buffers returned by the upper layers, waiting to be reposted */
+    CLockFreeQueue<RxNetDescriptor> m_ReturnedBuffersCache;
+    bool m_bReturnedBuffersCache = false;
+    volatile LONG m_nPendingReturns = 0;
+    ULONG m_nReturnedBuffers = 0;
+    ULONG m_nReturnLockAcquisitions = 0;
+
+    /* descriptors of the arena are one array, their buffers are
+       carved out of a few large shared memory blocks */
+    PVOID m_ArenaMetadata = nullptr;
+    tCompletePhysicalAddress *m_ArenaBlocks = nullptr;
+    ULONG m_nArenaBlocks = 0;
+    ULONG m_nInitPoolAllocations = 0;
+    ULONG m_nInitSharedAllocations = 0;
+
+    /* small frames are copied to these, RxCopyThreshold bytes each */
+    CNdisList<CRxCopyBuffer, CLockedAccess, CCountingObject> m_CopyBuffersList;
+    CRxCopyBuffer *m_CopyBuffers = nullptr;
+    PVOID m_CopyBuffersData = nullptr;
+    ULONG m_nCopyBuffers = 0;
+
+    void ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor, bool bKick = true);
+    void FlushReturnedBuffersNoLock();
 private:
     int PrepareReceiveBuffers();
+    UINT CreateRxArena(UINT nBuffers);
+    void FreeRxArena();
+    void CreateCopyBuffers(ULONG nBuffers);
+    void FreeCopyBuffers();
     pRxNetDescriptor CreateRxDescriptorOnInit();
+    bool BindRxDescriptor(pRxNetDescriptor p);
 };
@@ -77,6 +77,12 @@ public:
         UnregisterOutstandingItems(1);
     }
 
+    // nothing is registered besides the reference of the running state
+    bool HasOutstandingItems()
+    {
+        return (m_Counter & ~StoppedMask) > 1;
+    }
+
     CFlowStateMachine() { m_Counter.SetMask(StoppedMask); }
     ~CFlowStateMachine() = default;
     CFlowStateMachine(const CFlowStateMachine&) = delete;
@@ -0,0 +1,288 @@
+/*
+ * This file contains the flow logic of the software RSC: which received
+ * TCP segments are merged and when an aggregation is complete
+ *
+ * Copyright (c) 2008-2017 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "ndis56common.h"
+#if !defined(OFFLOAD_UNIT_TEST)
+#include "kdebugprint.h"
+#include "Trace.h"
+#ifdef NETKVM_WPP_ENABLED
+#include "ParaNdis-SwRsc.tmh"
+#endif
+#endif
+
+#if PARANDIS_SUPPORT_RSC
+
+static __inline
+IPHeader *SwRscIpHeader(tSwRscSegment *p)
+{
+    return (IPHeader *) RtlOffsetToPointer(p->PacketInfo->headersBuffer, p->PacketInfo->L2HdrLen);
+}
+
+static __inline
+TCPHeader *SwRscTcpHeader(tSwRscSegment *p)
+{
+    return (TCPHeader *) RtlOffsetToPointer(p->PacketInfo->headersBuffer,
+                                            p->PacketInfo->L2HdrLen + p->PacketInfo->L3HdrLen);
+}
+
+ULONG ParaNdis_SwRscPayloadLength(const tSwRscContext *pRsc, PNET_PACKET_INFO pPacketInfo)
+{
+    TCPHeader *pTcpHeader;
+    ULONG nIpLength = pPacketInfo->IPTotalLength;
+    ULONG nTcpHeaderLength = pPacketInfo->L4HdrLen;
+
+    if (!pPacketInfo->isTCP || !pPacketInfo->isL4HdrComplete ||
+        pPacketInfo->isFragment || pPacketInfo->hasVlanHeader)
+        return 0;
+
+    if (pPacketInfo->isIP4)
+    {
+        if (!pRsc->bIPv4 || pPacketInfo->L3HdrLen != sizeof(IPv4Header))
+            return 0;
+    }
+    else if (pPacketInfo->isIP6)
+    {
+        if (!pRsc->bIPv6 || pPacketInfo->L3HdrLen != sizeof(IPv6Header))
+            return 0;
+    }
+    else
+    {
+        return 0;
+    }
+
+    // no Ethernet padding
+    if ((pPacketInfo->L2HdrLen + nIpLength != pPacketInfo->dataLength) ||
+        (nIpLength < pPacketInfo->L3HdrLen + sizeof(TCPHeader)))
+        return 0;
+
+    pTcpHeader = (TCPHeader *) RtlOffsetToPointer(pPacketInfo->headersBuffer,
+                                                  pPacketInfo->L2HdrLen + pPacketInfo->L3HdrLen);
+
+    // pure ACKs are not coalesced
+    if ((nTcpHeaderLength < sizeof(TCPHeader)) ||
+        (nIpLength <= pPacketInfo->L3HdrLen + nTcpHeaderLength))
+        return 0;
+
+    // SYN, FIN, RST, URG, ECE and CWR end the coalescing
+    if ((pTcpHeader->tcp_flags & TCP_FLAGS_MASK & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+        return 0;
+
+    return nIpLength - pPacketInfo->L3HdrLen - nTcpHeaderLength;
+}
+
+static
+BOOLEAN SwRscIsSameFlow(tSwRscSegment *pHead, tSwRscSegment *p)
+{
+    IPHeader *pHeadIp = SwRscIpHeader(pHead);
+    IPHeader *pIp = SwRscIpHeader(p);
+    TCPHeader *pHeadTcp = SwRscTcpHeader(pHead);
+    TCPHeader *pTcp = SwRscTcpHeader(p);
+
+    if (pHead->PacketInfo->isIP4 != p->PacketInfo->isIP4)
+        return FALSE;
+
+    if (pTcp->tcp_src != pHeadTcp->tcp_src || pTcp->tcp_dest != pHeadTcp->tcp_dest)
+        return FALSE;
+
+    if (p->PacketInfo->isIP4)
+    {
+        return pIp->v4.ip_src == pHeadIp->v4.ip_src && pIp->v4.ip_dest == pHeadIp->v4.ip_dest;
+    }
+
+    // source and destination addresses are adjacent
+    return RtlEqualMemory(pIp->v6.ip6_src_address, pHeadIp->v6.ip6_src_address, 2 * sizeof(IPV6_ADDRESS));
+}
+
+static
+BOOLEAN SwRscCanMerge(tSwRscFlow *pFlow, tSwRscSegment *p)
+{
+    tSwRscSegment *pHead = pFlow->Head;
+    IPHeader *pHeadIp = SwRscIpHeader(pHead);
+    IPHeader *pIp = SwRscIpHeader(p);
+    TCPHeader *pHeadTcp = SwRscTcpHeader(pHead);
+    TCPHeader *pTcp = SwRscTcpHeader(p);
+    ULONG nTcpHeaderLength = p->PacketInfo->L4HdrLen;
+
+    // out-of-order data or retransmission
+    if (RtlUlongByteSwap(pTcp->tcp_seq) != pFlow->NextSeq)
+        return FALSE;
+
+    if (pTcp->tcp_ack != pHeadTcp->tcp_ack || p->nPayloadLength > pFlow->Mss)
+        return FALSE;
+
+    if (pHead->nSegments >= PARANDIS_SW_RSC_MAX_SEGMENTS ||
+        pHead->PacketInfo->L2PayloadLen + pFlow->CoalescedBytes + p->nPayloadLength > MAXUSHORT)
+        return FALSE;
+
+    // TCP options, timestamps included, must not change
+    if (nTcpHeaderLength != pHead->PacketInfo->L4HdrLen ||
+        !RtlEqualMemory(pTcp + 1, pHeadTcp + 1, nTcpHeaderLength - sizeof(TCPHeader)))
+        return FALSE;
+
+    if (p->PacketInfo->isIP4)
+    {
+        return pIp->v4.ip_tos == pHeadIp->v4.ip_tos &&
+               pIp->v4.ip_ttl == pHeadIp->v4.ip_ttl &&
+               pIp->v4.ip_offset == pHeadIp->v4.ip_offset;
+    }
+
+    return pIp->v6.ip6_ver_tc == pHeadIp->v6.ip6_ver_tc &&
+           pIp->v6.ip6_tc_fl == pHeadIp->v6.ip6_tc_fl &&
+           pIp->v6.ip6_fl == pHeadIp->v6.ip6_fl &&
+           pIp->v6.ip6_hoplimit == pHeadIp->v6.ip6_hoplimit;
+}
+
+static
+VOID SwRscAppend(tSwRscFlow *pFlow, tSwRscSegment *p)
+{
+    tSwRscSegment *pHead = pFlow->Head;
+    TCPHeader *pHeadTcp = SwRscTcpHeader(pHead);
+    TCPHeader *pTcp = SwRscTcpHeader(p);
+
+    p->Next = NULL;
+    pFlow->Tail->Next = p;
+    pFlow->Tail = p;
+
+    // the coalesced frame carries the latest window and the push flag
+    pHeadTcp->tcp_window = pTcp->tcp_window;
+    pHeadTcp->tcp_flags |= (pTcp->tcp_flags & TCP_FLAG_PSH);
+
+    pFlow->NextSeq += p->nPayloadLength;
+    pFlow->CoalescedBytes += p->nPayloadLength;
+    pHead->nSegments++;
+}
+
+static
+tSwRscSegment *SwRscRemoveFlow(tSwRscContext *pRsc, tSwRscFlow *pFlow)
+{
+    tSwRscSegment *pHead = pFlow->Head;
+    ULONG nFlowIndex = (ULONG) (pFlow - pRsc->Flows);
+
+    if (pHead->Next != NULL)
+    {
+        PNET_PACKET_INFO pPacketInfo = pHead->PacketInfo;
+        IPHeader *pIpHeader = SwRscIpHeader(pHead);
+
+        pPacketInfo->IPTotalLength += pFlow->CoalescedBytes;
+        if (pPacketInfo->isIP4)
+        {
+            pIpHeader->v4.ip_length = RtlUshortByteSwap((USHORT) pPacketInfo->IPTotalLength);
+            pIpHeader->v4.ip_xsum = 0;
+            pIpHeader->v4.ip_xsum = ParaNdis_CheckSumFinalize(
+                ParaNdis_CopyWithCheckSum(NULL, pIpHeader, sizeof(IPv4Header)));
+        }
+        else
+        {
+            pIpHeader->v6.ip6_payload_len = RtlUshortByteSwap(
+                (USHORT) (pPacketInfo->IPTotalLength - sizeof(IPv6Header)));
+        }
+
+        pPacketInfo->dataLength += pFlow->CoalescedBytes;
+        pPacketInfo->L2PayloadLen += pFlow->CoalescedBytes;
+    }
+
+    pRsc->nFlows--;
+    if (nFlowIndex < pRsc->nFlows)
+    {
+        RtlMoveMemory(&pRsc->Flows[nFlowIndex], &pRsc->Flows[nFlowIndex + 1],
+                      (pRsc->nFlows - nFlowIndex) * sizeof(pRsc->Flows[0]));
+    }
+
+    return pHead;
+}
+
+BOOLEAN ParaNdis_SwRscOffer(
+    tSwRscContext *pRsc,
+    tSwRscSegment *pSegment,
+    ULONG nPayloadLength,
+    tSwRscSegment **ppFlushed)
+{
+    PNET_PACKET_INFO pPacketInfo = pSegment->PacketInfo;
+    tSwRscFlow *pFlow = NULL;
+    ULONG i;
+
+    *ppFlushed = NULL;
+    pSegment->Next = NULL;
+    pSegment->nPayloadLength = nPayloadLength;
+    pSegment->nSegments = 1;
+
+    if (pPacketInfo->isTCP && pPacketInfo->isL4HdrComplete && (pPacketInfo->isIP4 || pPacketInfo->isIP6))
+    {
+        for (i = 0; i < pRsc->nFlows; i++)
+        {
+            if (SwRscIsSameFlow(pRsc->Flows[i].Head, pSegment))
+            {
+                pFlow = &pRsc->Flows[i];
+                break;
+            }
+        }
+    }
+
+    if (pFlow != NULL)
+    {
+        if (nPayloadLength != 0 && SwRscCanMerge(pFlow, pSegment))
+        {
+            SwRscAppend(pFlow, pSegment);
+            // a short or pushed segment completes the aggregation
+            if (nPayloadLength < pFlow->Mss || (SwRscTcpHeader(pSegment)->tcp_flags & TCP_FLAG_PSH))
+            {
+                *ppFlushed = SwRscRemoveFlow(pRsc, pFlow);
+            }
+            return TRUE;
+        }
+
+        // whatever was coalesced so far must be indicated before this segment
+        *ppFlushed = SwRscRemoveFlow(pRsc, pFlow);
+    }
+
+    if (nPayloadLength == 0 || (SwRscTcpHeader(pSegment)->tcp_flags & TCP_FLAG_PSH))
+        return FALSE;
+
+    if (pRsc->nFlows == PARANDIS_SW_RSC_MAX_FLOWS)
+    {
+        // no room and no flow of ours was flushed, push out the oldest one
+        NETKVM_ASSERT(*ppFlushed == NULL);
+        *ppFlushed = SwRscRemoveFlow(pRsc, &pRsc->Flows[0]);
+    }
+
+    pFlow = &pRsc->Flows[pRsc->nFlows++];
+    pFlow->Head = pFlow->Tail = pSegment;
+    pFlow->NextSeq = RtlUlongByteSwap(SwRscTcpHeader(pSegment)->tcp_seq) + nPayloadLength;
+    pFlow->CoalescedBytes = 0;
+    pFlow->Mss = nPayloadLength;
+
+    return TRUE;
+}
+
+tSwRscSegment *ParaNdis_SwRscFlushPending(tSwRscContext *pRsc)
+{
+    return (pRsc->nFlows != 0) ? SwRscRemoveFlow(pRsc, &pRsc->Flows[0]) : NULL;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+
+/* Software RSC, used when the host does not provide GUEST_TSO.
+   In-order TCP segments of the same flow found in one pass over a receive
+   queue are merged into a single frame: the first segment keeps its headers
+   (with the IP length fixed), the payload of the rest follows it.
+   This part decides which segments are merged and when an aggregation is
+   complete, from the headers recorded by the packet parser
+   (ParaNdis-PacketParser.h) only; the receive descriptors and their MDLs
+   are handled by the NDIS part (ParaNdis6-Impl.cpp). It is built in user
+   mode as well (DebugTools/PacketParser) */
+
+#define PARANDIS_SW_RSC_MAX_FLOWS       4
+#define PARANDIS_SW_RSC_MAX_SEGMENTS    64
+
+/* A received frame offered to the software RSC, kept in the receive
+   descriptor */
+typedef struct _tagSwRscSegment
+{
+    /* merged segments following the head of an aggregation */
+    struct _tagSwRscSegment *Next;
+    PNET_PACKET_INFO    PacketInfo;
+    ULONG               nPayloadLength;
+    /* number of segments of the aggregation, valid in its head */
+    ULONG               nSegments;
+} tSwRscSegment;
+
+typedef struct _tagSwRscFlow
+{
+    tSwRscSegment       *Head;
+    tSwRscSegment       *Tail;
+    ULONG               NextSeq;
+    ULONG               CoalescedBytes;
+    ULONG               Mss;
+} tSwRscFlow;
+
+/* Software RSC state of a single pass over a receive queue */
+typedef struct _tagSwRscContext
+{
+    BOOLEAN             bIPv4;
+    BOOLEAN             bIPv6;
+    ULONG               nFlows;
+    tSwRscFlow          Flows[PARANDIS_SW_RSC_MAX_FLOWS];
+} tSwRscContext;
+
+static __inline
+VOID ParaNdis_SwRscInit(tSwRscContext *pRsc, BOOLEAN bIPv4, BOOLEAN bIPv6)
+{
+    pRsc->bIPv4 = bIPv4;
+    pRsc->bIPv6 = bIPv6;
+    pRsc->nFlows = 0;
+}
+
+/* Returns the TCP payload length of the frame if it may be merged, 0 if
+   it may not. The caller checks what the headers do not tell: the host
+   validated the checksums and the frame is not GSO, the frame is in a
+   single buffer */
+ULONG ParaNdis_SwRscPayloadLength(
+    const tSwRscContext *pRsc,
+    PNET_PACKET_INFO pPacketInfo);
+
+/* Offers the frame to the flows of the pass, nPayloadLength as returned by
+   ParaNdis_SwRscPayloadLength. Returns TRUE if the frame was taken, either
+   merged or as the head of a new flow; *ppFlushed receives an aggregation
+   that is complete and must be indicated before anything else of this
+   pass, including the frame when it was not taken */
+BOOLEAN ParaNdis_SwRscOffer(
+    tSwRscContext *pRsc,
+    tSwRscSegment *pSegment,
+    ULONG nPayloadLength,
+    tSwRscSegment **ppFlushed);
+
+/* Returns the next pending aggregation at the end of the pass or NULL */
+tSwRscSegment *ParaNdis_SwRscFlushPending(
+    tSwRscContext *pRsc);
@@ -12,6 +12,7 @@ CNBL::CNBL(PNET_BUFFER_LIST NBL, PPARANDIS_ADAPTER Context, CParaNdisTX &ParentT
     , m_ParentTXPath(&ParentTXPath)
     , CNdisAllocatableViaHelper<CNBL>(NBLAllocator)
     , m_NBAllocator(NBAllocator)
+    , m_SendTimestamp(KeQueryPerformanceCounter(NULL).QuadPart)
 {
     m_NBL->Scratch = this;
     m_LsoInfo.Value = NET_BUFFER_LIST_INFO(m_NBL, TcpLargeSendNetBufferListInfo);
@@ -165,6 +166,13 @@ bool CNBL::ParseLSO()
         return false;
     }
 
+    // the host can't segment, the packet is cut into MSS-sized frames here
+    if (MSS() != 0)
+    {
+        m_SoftwareLSO = (m_LsoInfo.LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv6) ?
+                        m_Context->Offload.bSoftwareLsov6 : m_Context->Offload.bSoftwareLsov4;
+    }
+
     return true;
 }
 
@@ -269,6 +277,10 @@ void CNBL::OnLastReferenceGone()
 
 CParaNdisTX::~CParaNdisTX()
 {
+    if (m_ReclaimTimer != nullptr)
+    {
+        StopReclaimTimer();
+    }
 
     TPassiveSpinLocker LockedContext(m_Lock);
     CNBL* NBL = nullptr;
@@ -303,13 +315,32 @@ bool CParaNdisTX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
 
     m_SendQueueFullListIsEmpty = TRUE;
 
-    return m_VirtQueue.Create(DeviceQueueIndex,
+    NDIS_TIMER_CHARACTERISTICS TimerCharacteristics = {};
+    TimerCharacteristics.Header.Type = NDIS_OBJECT_TYPE_TIMER_CHARACTERISTICS;
+    TimerCharacteristics.Header.Revision = NDIS_TIMER_CHARACTERISTICS_REVISION_1;
+    TimerCharacteristics.Header.Size = NDIS_SIZEOF_TIMER_CHARACTERISTICS_REVISION_1;
+    TimerCharacteristics.AllocationTag = PARANDIS_MEMORY_TAG;
+    TimerCharacteristics.TimerFunction = ReclaimTimerCallback;
+    TimerCharacteristics.FunctionContext = this;
+    if (NdisAllocateTimerObject(m_Context->MiniportHandle, &TimerCharacteristics, &m_ReclaimTimer) != NDIS_STATUS_SUCCESS)
+    {
+        DPrintf(0, "[%s] no reclaim timer, TX interrupts stay on\n", __FUNCTION__);
+        m_ReclaimTimer = nullptr;
+    }
+
+    if (!m_VirtQueue.Create(DeviceQueueIndex,
         &m_Context->IODevice,
         m_Context->MiniportHandle,
         m_Context->maxFreeTxDescriptors,
         m_Context->nVirtioHeaderSize,
-        m_Context) &&
-        m_SendQueue.Create(Context, m_SendQueue.IsPowerOfTwo(m_Context->maxFreeTxDescriptors) ?
+        m_Context))
+    {
+        return false;
+    }
+
+    m_ReclaimWatermark = m_VirtQueue.GetTotalTXDescriptors() / PARANDIS_TX_RECLAIM_WATERMARK_DIVIDER;
+
+    return m_SendQueue.Create(Context, m_SendQueue.IsPowerOfTwo(m_Context->maxFreeTxDescriptors) ?
             8 * m_Context->maxFreeTxDescriptors : PARANDIS_TX_LOCK_FREE_QUEUE_DEFAULT_SIZE);
 }
 
@@ -483,8 +514,11 @@ PNET_BUFFER_LIST CParaNdisTX::ProcessWaitingList(CRawCNBLList& completed)
     }
     // end of locked part under waiting list lock
 
+    LONGLONG now = KeQueryPerformanceCounter(NULL).QuadPart;
+
     completed.ForEachDetached([&](CNBL* NBL)
     {
+        ParaNdis_RecordLatency(m_Context, m_Latency.Completion, now - NBL->SendTimestamp());
         NBL->SetStatus(NDIS_STATUS_SUCCESS);
         auto RawNBL = NBL->DetachInternalObject();
         NBL->Release();
@@ -544,9 +578,89 @@ bool CParaNdisTX::RestartQueue()
     return res;
 }
 
+BOOLEAN _Function_class_(MINIPORT_SYNCHRONIZE_INTERRUPT)
+CParaNdisTX::RestartQueueDelayedSynchronously(PVOID ctx)
+{
+    auto This = static_cast<CParaNdisTX*>(ctx);
+    return !This->m_VirtQueue.RestartDelayed();
+}
+
+/* TX interrupts are left disabled while packets keep coming, the send
+   path reclaims the completions itself and the reclaim timer covers the
+   end of the stream. They are re-armed (after 3/4 of the in-flight
+   packets complete) only when the queue is full or there was nothing
+   new to send.
+   Called with TX lock held, returns true if the DPC shall run again */
+bool CParaNdisTX::RearmCompletions(bool bStreaming, bool bQueueFull)
+{
+    if (!m_VirtQueue.HaveTXInFlight())
+    {
+        return false;
+    }
+
+    if (bStreaming && !bQueueFull && m_ReclaimTimer != nullptr)
+    {
+        ArmReclaimTimer();
+        return false;
+    }
+
+    return ParaNdis_SynchronizeWithInterrupt(m_Context,
+                                             m_messageIndex,
+                                             RestartQueueDelayedSynchronously,
+                                             this) ? true : false;
+}
+
+void CParaNdisTX::ArmReclaimTimer()
+{
+    if (InterlockedCompareExchange(&m_ReclaimTimerArmed, ReclaimTimerArmed, ReclaimTimerIdle) == ReclaimTimerIdle)
+    {
+        LARGE_INTEGER DueTime;
+        DueTime.QuadPart = -10000LL * PARANDIS_TX_RECLAIM_TIMEOUT_MS;
+        NdisSetTimerObject(m_ReclaimTimer, DueTime, 0, nullptr);
+    }
+}
+
+VOID CParaNdisTX::ReclaimTimerCallback(PVOID SystemSpecific1, PVOID FunctionContext,
+                                       PVOID SystemSpecific2, PVOID SystemSpecific3)
+{
+    auto This = static_cast<CParaNdisTX*>(FunctionContext);
+
+    UNREFERENCED_PARAMETER(SystemSpecific1);
+    UNREFERENCED_PARAMETER(SystemSpecific2);
+    UNREFERENCED_PARAMETER(SystemSpecific3);
+
+    // stopped meanwhile, the object may be going away
+    if (InterlockedCompareExchange(&This->m_ReclaimTimerArmed, ReclaimTimerIdle, ReclaimTimerArmed) != ReclaimTimerArmed)
+    {
+        return;
+    }
+
+    if (This->m_Context->bEnableInterruptHandlingDPC)
+    {
+#if NDIS_SUPPORT_NDIS620
+        NdisMQueueDpcEx(This->m_Context->InterruptHandle, This->m_messageIndex, &This->DPCAffinity, NULL);
+#else
+        NdisMQueueDpc(This->m_Context->InterruptHandle, 0, 1 << KeGetCurrentProcessorNumber(), NULL);
+#endif
+    }
+}
+
+/* Keeps the timer from being armed again and waits for a callback that
+   already runs, the timer is freed after that. Called at PASSIVE_LEVEL */
+void CParaNdisTX::StopReclaimTimer()
+{
+    InterlockedExchange(&m_ReclaimTimerArmed, ReclaimTimerStopped);
+    if (!NdisCancelTimerObject(m_ReclaimTimer))
+    {
+        KeFlushQueuedDpcs();
+    }
+    NdisFreeTimerObject(m_ReclaimTimer);
+    m_ReclaimTimer = nullptr;
+}
+
 //called with TX lock held
 //returns queue restart status
-bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList& toWaitingList)
+bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBList& nbToFree, CRawCNBLList& toWaitingList)
 {
     bool SentOutSomeBuffers = false;
     bool bRestartStatus = false;
@@ -559,6 +673,12 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList& toWaitingList)
         {
             auto NBLHolder = PeekMappedToSendNBL();
 
+            // reclaim before the ring runs dry, the device does not interrupt us meanwhile
+            if (m_VirtQueue.GetFreeTXDescriptors() < m_ReclaimWatermark)
+            {
+                m_VirtQueue.ProcessTXCompletions(nbToFree);
+            }
+
             if (NBLHolder->HaveMappedBuffers())
             {
                 auto NBHolder = NBLHolder->PopMappedNB();
@@ -568,8 +688,9 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList& toWaitingList)
                 {
                 case SUBMIT_NO_PLACE_IN_QUEUE:
                     NBLHolder->PushMappedNB(NBHolder);
-                    HaveBuffers = false;
+                    // retry if anything completed meanwhile, otherwise
                     // break the loop, allow to kick and free some buffers
+                    HaveBuffers = m_VirtQueue.ProcessTXCompletions(nbToFree) != 0;
                     break;
 
                 case SUBMIT_FAILURE:
@@ -598,6 +719,7 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList& toWaitingList)
                     }
                     else
                     {
+                        m_VirtQueue.Statistics().Drops++;
                         CNB::Destroy(NBHolder);
                         NBLHolder->NBComplete();
                     }
@@ -616,7 +738,7 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList& toWaitingList)
 
     if (IsInterrupt)
     {
-        bRestartStatus = RestartQueue();
+        bRestartStatus = RearmCompletions(SentOutSomeBuffers, !HaveBuffers);
     }
 
     if (SentOutSomeBuffers || !HaveBuffers)
@@ -675,7 +797,7 @@ bool CParaNdisTX::DoPendingTasks()
                     m_VirtQueue.ProcessTXCompletions(nbToFree);
                     m_DpcWaiting.Release();
 
-                    bRestartQueueStatus = SendMapped(TRUE, completedNBLs);
+                    bRestartQueueStatus = SendMapped(TRUE, nbToFree, completedNBLs);
                     if (bRestartQueueStatus)
                     {
                         // the call initiated by Send(), we can give up
@@ -683,7 +805,7 @@ bool CParaNdisTX::DoPendingTasks()
                         // if we can't enable interrupts on queue right now,
                         // we can retrieve completed packets and try again
                         m_VirtQueue.ProcessTXCompletions(nbToFree);
-                        bRestartQueueStatus = SendMapped(true, completedNBLs);
+                        bRestartQueueStatus = SendMapped(true, nbToFree, completedNBLs);
                     }
                  });
 
@@ -825,23 +947,26 @@ void CNB::DoIPHdrCSO(PVOID IpHeader, ULONG EthPayloadLength) const
 bool CNB::FillDescriptorSGList(CTXDescriptor &Descriptor, ULONG ParsedHeadersLength) const
 {
     return Descriptor.SetupHeaders(ParsedHeadersLength) &&
-           MapDataToVirtioSGL(Descriptor, ParsedHeadersLength + NET_BUFFER_DATA_OFFSET(m_NB));
+           MapDataToVirtioSGL(Descriptor, ParsedHeadersLength + NET_BUFFER_DATA_OFFSET(m_NB),
+                              GetDataLength() - ParsedHeadersLength);
 }
 
-bool CNB::MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset) const
+bool CNB::MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset, ULONG Length) const
 {
-    for (ULONG i = 0; i < m_SGL->NumberOfElements; i++)
+    for (ULONG i = 0; i < m_SGL->NumberOfElements && Length != 0; i++)
     {
         if (Offset < m_SGL->Elements[i].Length)
         {
             PHYSICAL_ADDRESS PA;
+            ULONG ChunkLength = min(m_SGL->Elements[i].Length - Offset, Length);
             PA.QuadPart = m_SGL->Elements[i].Address.QuadPart + Offset;
 
-            if (!Descriptor.AddDataChunk(PA, m_SGL->Elements[i].Length - Offset))
+            if (!Descriptor.AddDataChunk(PA, ChunkLength))
             {
                 return false;
             }
 
+            Length -= ChunkLength;
             Offset = 0;
         }
         else
@@ -902,6 +1027,7 @@ void CNB::PrepareOffloads(virtio_net_hdr *VirtioHeader, PVOID IpHeader, ULONG Et
 
     if (m_ParentNBL->IsLSO())
     {
+        NETKVM_ASSERT(!m_ParentNBL->IsSoftwareLSO());
         SetupLSO(VirtioHeader, IpHeader, EthPayloadLength);
     }
     else if (m_ParentNBL->IsTcpCSO() || m_ParentNBL->IsUdpCSO())
@@ -943,6 +1069,196 @@ bool CNB::BindToDescriptor(CTXDescriptor &Descriptor)
     return FillDescriptorSGList(Descriptor, HeadersLength);
 }
 
+bool CNB::CopySegmentHeaders(PVOID Destination, ULONG MaxSize)
+{
+    ULONG TcpHeaderOffset = m_ParentNBL->TCPHeaderOffset();
+
+    if (m_SegmentHeadersLength == 0)
+    {
+        // unlike the host LSO path the TCP options are repeated in
+        // every segment, so the complete TCP header is needed here
+        if (TcpHeaderOffset + sizeof(TCPHeader) > MaxSize ||
+            !Copy(Destination, TcpHeaderOffset + sizeof(TCPHeader)))
+        {
+            return false;
+        }
+
+        auto TcpHeader = reinterpret_cast<TCPHeader*>(RtlOffsetToPointer(Destination, TcpHeaderOffset));
+        ULONG TcpHeaderLength = TCP_HEADER_LENGTH(TcpHeader);
+
+        if (TcpHeaderLength < sizeof(TCPHeader) ||
+            TcpHeaderOffset + TcpHeaderLength > min(MaxSize, GetDataLength()))
+        {
+            DPrintf(0, "[%s] ERROR: bad TCP header length %d\n", __FUNCTION__, TcpHeaderLength);
+            return false;
+        }
+
+        m_SegmentHeadersLength = TcpHeaderOffset + TcpHeaderLength;
+        m_SegmentPayloadLength = GetDataLength() - m_SegmentHeadersLength;
+    }
+
+    return (m_SegmentHeadersLength <= MaxSize) && Copy(Destination, m_SegmentHeadersLength);
+}
+
+bool CNB::CalculateRawCheckSum(ULONG Offset, ULONG Length, UINT64 &RawSum) const
+{
+    ULONG CurrOffset = NET_BUFFER_CURRENT_MDL_OFFSET(m_NB) + Offset;
+    ULONG Done = 0;
+
+    for (PMDL CurrMDL = NET_BUFFER_CURRENT_MDL(m_NB);
+         CurrMDL != nullptr && Done < Length;
+         CurrMDL = CurrMDL->Next)
+    {
+        ULONG CurrLen;
+        PVOID CurrAddr;
+
+#if NDIS_SUPPORT_NDIS620
+        NdisQueryMdl(CurrMDL, &CurrAddr, &CurrLen, MM_PAGE_PRIORITY(LowPagePriority | MdlMappingNoExecute));
+#else
+        NdisQueryMdl(CurrMDL, &CurrAddr, &CurrLen, MM_PAGE_PRIORITY(LowPagePriority));
+#endif
+
+        if (CurrAddr == nullptr)
+        {
+            break;
+        }
+
+        if (CurrOffset >= CurrLen)
+        {
+            CurrOffset -= CurrLen;
+            continue;
+        }
+
+        CurrLen = min(CurrLen - CurrOffset, Length - Done);
+
+        UINT64 ChunkSum = ParaNdis_CopyWithCheckSum(nullptr, RtlOffsetToPointer(CurrAddr, CurrOffset), CurrLen);
+        if (Done & 1)
+        {
+            // the chunk starts on an odd byte of the segment,
+            // so its 16-bit words are byte-swapped relative to ours
+            ChunkSum = RtlUshortByteSwap(static_cast<USHORT>(~ParaNdis_CheckSumFinalize(ChunkSum)));
+        }
+        RawSum += ChunkSum;
+
+        Done += CurrLen;
+        CurrOffset = 0;
+    }
+
+    return (Done == Length);
+}
+
+void CNB::PrepareSegmentHeaders(virtio_net_hdr *VirtioHeader, PVOID EthHeaders) const
+{
+    auto IpHeaderOffset = m_Context->Offload.ipHeaderOffset;
+    auto TcpHeaderOffset = m_ParentNBL->TCPHeaderOffset();
+    auto IpHeader = reinterpret_cast<IPHeader*>(RtlOffsetToPointer(EthHeaders, IpHeaderOffset));
+    auto TcpHeader = reinterpret_cast<TCPHeader*>(RtlOffsetToPointer(EthHeaders, TcpHeaderOffset));
+    USHORT IpLength = static_cast<USHORT>(m_SegmentHeadersLength - IpHeaderOffset + m_CurrSegmentLength);
+
+    if ((IpHeader->v4.ip_verlen & 0xF0) == 0x40)
+    {
+        IpHeader->v4.ip_length = swap_short(IpLength);
+        IpHeader->v4.ip_id = swap_short(static_cast<USHORT>(swap_short(IpHeader->v4.ip_id) + m_SegmentsSubmitted));
+    }
+    else
+    {
+        IpHeader->v6.ip6_payload_len = swap_short(IpLength - IPV6_HEADER_MIN_SIZE);
+    }
+
+    TcpHeader->tcp_seq = RtlUlongByteSwap(RtlUlongByteSwap(TcpHeader->tcp_seq) + m_SegmentOffset);
+    if (m_SegmentOffset + m_CurrSegmentLength < m_SegmentPayloadLength)
+    {
+        TcpHeader->tcp_flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    }
+    if (m_SegmentsSubmitted != 0)
+    {
+        TcpHeader->tcp_flags &= ~TCP_FLAG_CWR;
+    }
+
+    // fixes the IP header checksum and puts the pseudo-header sum into the TCP checksum field
+    ParaNdis_CheckSumVerifyFlat(IpHeader, IpLength,
+                                pcrIpChecksum | pcrFixIPChecksum | pcrTcpChecksum | pcrFixPHChecksum,
+                                FALSE,
+                                __FUNCTION__);
+
+    *VirtioHeader = {};
+
+    if (m_Context->Offload.bHostChecksum)
+    {
+        auto PriorityHdrLen = (m_ParentNBL->TCI() != 0) ? ETH_PRIORITY_HEADER_SIZE : 0;
+
+        VirtioHeader->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        VirtioHeader->csum_start = (USHORT)(TcpHeaderOffset + PriorityHdrLen);
+        VirtioHeader->csum_offset = TCP_CHECKSUM_OFFSET;
+    }
+}
+
+bool CNB::BindSegmentToDescriptor(CTXDescriptor &Descriptor)
+{
+    if (m_SGL == nullptr)
+    {
+        return false;
+    }
+
+    Descriptor.SetNB(this);
+
+    auto &HeadersArea = Descriptor.HeadersAreaAccessor();
+    auto EthHeaders = HeadersArea.EthHeadersAreaVA();
+
+    if (!CopySegmentHeaders(EthHeaders, HeadersArea.MaxEthHeadersSize()))
+    {
+        return false;
+    }
+
+    m_CurrSegmentLength = min(m_ParentNBL->MSS(), m_SegmentPayloadLength - m_SegmentOffset);
+    PrepareSegmentHeaders(HeadersArea.VirtioHeader(), EthHeaders);
+
+    if (!m_Context->Offload.bHostChecksum)
+    {
+        auto TcpHeaderOffset = m_ParentNBL->TCPHeaderOffset();
+        auto TcpHeader = reinterpret_cast<TCPHeader*>(RtlOffsetToPointer(EthHeaders, TcpHeaderOffset));
+        UINT64 RawSum = ParaNdis_CopyWithCheckSum(nullptr, TcpHeader, m_SegmentHeadersLength - TcpHeaderOffset);
+
+        if (!CalculateRawCheckSum(m_SegmentHeadersLength + m_SegmentOffset, m_CurrSegmentLength, RawSum))
+        {
+            return false;
+        }
+        TcpHeader->tcp_xsum = ParaNdis_CheckSumFinalize(RawSum);
+    }
+
+    BuildPriorityHeader(HeadersArea.EthHeader(), HeadersArea.VlanHeader());
+
+    return Descriptor.SetupHeaders(m_SegmentHeadersLength) &&
+           MapDataToVirtioSGL(Descriptor,
+                              m_SegmentHeadersLength + m_SegmentOffset + NET_BUFFER_DATA_OFFSET(m_NB),
+                              m_CurrSegmentLength);
+}
+
+void CNB::SegmentSubmitted()
+{
+    m_SegmentOffset += m_CurrSegmentLength;
+    m_SegmentsSubmitted++;
+    m_SegmentsInFlight++;
+
+    if (m_SegmentOffset >= m_SegmentPayloadLength)
+    {
+        m_SegmentationDone = true;
+    }
+}
+
+bool CNB::SegmentCompleted()
+{
+    if (!m_ParentNBL->IsSoftwareLSO())
+    {
+        return true;
+    }
+
+    NETKVM_ASSERT(m_SegmentsInFlight != 0);
+    m_SegmentsInFlight--;
+
+    return (m_SegmentsInFlight == 0) && m_SegmentationDone;
+}
+
 bool CNB::Copy(PVOID Dst, ULONG Length) const
 {
     ULONG CurrOffset = NET_BUFFER_CURRENT_MDL_OFFSET(m_NB);
@@ -978,3 +1294,84 @@ bool CNB::Copy(PVOID Dst, ULONG Length) const
 
     return (Copied == Length);
 }
+
+// Cheap hash of the flow used for TX queue selection when the protocol
+// did not provide the RSS hash: addresses and TCP/UDP ports for IP,
+// the destination address for everything else. Zero if the headers
+// cannot be read.
+#define PARANDIS_TX_FLOW_HASH_HEADERS   (ETH_HEADER_SIZE + ETH_PRIORITY_HEADER_SIZE + \
+                                         MAX_IPV4_HEADER_SIZE + sizeof(UDPHeader))
+#define PARANDIS_TX_FLOW_HASH_TCP       6
+#define PARANDIS_TX_FLOW_HASH_UDP       17
+// ip_offset as read from the wire, everything but the DF flag
+#define PARANDIS_TX_FLOW_HASH_FRAGMENT  0xFFBF
+
+ULONG ParaNdis_TxFlowHash(PNET_BUFFER_LIST NBL)
+{
+    PNET_BUFFER NB = NET_BUFFER_LIST_FIRST_NB(NBL);
+    UCHAR Storage[PARANDIS_TX_FLOW_HASH_HEADERS];
+    ULONG Length = min(NET_BUFFER_DATA_LENGTH(NB), (ULONG)sizeof(Storage));
+
+    if (Length < ETH_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    PUCHAR Headers = (PUCHAR)NdisGetDataBuffer(NB, Length, Storage, 1, 0);
+    if (Headers == nullptr)
+    {
+        return 0;
+    }
+
+    ULONG Offset = ETH_HEADER_SIZE;
+    USHORT EthType = RtlUshortByteSwap(((PETH_HEADER)Headers)->EthType);
+    if (EthType == PRIO_HEADER_ETH_TYPE && Length >= ETH_HEADER_SIZE + ETH_PRIORITY_HEADER_SIZE)
+    {
+        EthType = RtlUshortByteSwap(((PVLAN_HEADER)(Headers + ETH_HEADER_SIZE))->EthType);
+        Offset += ETH_PRIORITY_HEADER_SIZE;
+    }
+
+    ULONG64 Value = 0;
+    UCHAR Protocol = 0;
+    ULONG L4Offset = 0;
+
+    if (EthType == ETH_IP_PROTOCOL_TYPE && Length >= Offset + sizeof(IPv4Header))
+    {
+        IPv4Header *IP = (IPv4Header *)(Headers + Offset);
+        Value = ((ULONG64)IP->ip_src << 32) | IP->ip_dest;
+        // fragments of a datagram stay on one queue, only the first one has the ports
+        if (!(IP->ip_offset & PARANDIS_TX_FLOW_HASH_FRAGMENT))
+        {
+            Protocol = IP->ip_protocol;
+            L4Offset = Offset + (IP->ip_verlen & 0x0F) * sizeof(ULONG);
+        }
+    }
+    else if (EthType == ETH_ETHER_TYPE_IPV6 && Length >= Offset + sizeof(IPv6Header))
+    {
+        IPv6Header *IP = (IPv6Header *)(Headers + Offset);
+        for (ULONG i = 0; i < ARRAYSIZE(IP->ip6_src_address); i++)
+        {
+            Value = (Value * 0x9E3779B97F4A7C15ull) ^
+                    (((ULONG64)IP->ip6_src_address[i] << 32) | IP->ip6_dst_address[i]);
+        }
+        Protocol = IP->ip6_next_header;
+        L4Offset = Offset + sizeof(IPv6Header);
+    }
+    else
+    {
+        for (ULONG i = 0; i < ETH_ALEN; i++)
+        {
+            Value = (Value << 8) | Headers[i];
+        }
+    }
+
+    if ((Protocol == PARANDIS_TX_FLOW_HASH_TCP || Protocol == PARANDIS_TX_FLOW_HASH_UDP) &&
+        Length >= L4Offset + sizeof(ULONG))
+    {
+        // source and destination ports are the first 4 bytes of both headers
+        Value ^= (ULONG64)*(ULONG UNALIGNED *)(Headers + L4Offset) << 16;
+    }
+
+    // Fibonacci hashing, the upper half is well mixed
+    return (ULONG)((Value * 0x9E3779B97F4A7C15ull) >> 32);
+}
@@ -7,6 +7,13 @@
 /* Must be a power of 2 */
 #define PARANDIS_TX_LOCK_FREE_QUEUE_DEFAULT_SIZE 2048
 
+/* Completions are reclaimed on the send path when less than
+   1/PARANDIS_TX_RECLAIM_WATERMARK_DIVIDER of the descriptors are free */
+#define PARANDIS_TX_RECLAIM_WATERMARK_DIVIDER    4
+/* While TX interrupts are off, in-flight packets are reclaimed
+   not later than this */
+#define PARANDIS_TX_RECLAIM_TIMEOUT_MS           2
+
 class CNB;
 class CParaNdisTX;
 
@@ -51,6 +58,17 @@ public:
     }
 
     bool BindToDescriptor(CTXDescriptor &Descriptor);
+
+    // software LSO, the NB is sent as a number of MSS-sized packets
+    bool BindSegmentToDescriptor(CTXDescriptor &Descriptor);
+    void SegmentSubmitted();
+    bool SegmentCompleted();
+    bool AllSegmentsSubmitted() const
+    { return m_SegmentationDone; }
+    bool HaveSegmentsInFlight() const
+    { return m_SegmentsInFlight != 0; }
+    void AbortSegmentation()
+    { m_SegmentationDone = true; }
 private:
     bool Copy(PVOID Dst, ULONG Length) const;
     bool CopyHeaders(PVOID Destination, ULONG MaxSize, ULONG &HeadersLength, ULONG &L4HeaderOffset) const;
@@ -61,14 +79,25 @@ private:
     void DoIPHdrCSO(PVOID EthHeaders, ULONG HeadersLength) const;
     void SetupCSO(virtio_net_hdr *VirtioHeader, ULONG L4HeaderOffset) const;
     bool FillDescriptorSGList(CTXDescriptor &Descriptor, ULONG DataOffset) const;
-    bool MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset) const;
+    bool MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset, ULONG Length) const;
     void PopulateIPLength(IPHeader *IpHeader, USHORT IpLength) const;
+    bool CopySegmentHeaders(PVOID Destination, ULONG MaxSize);
+    void PrepareSegmentHeaders(virtio_net_hdr *VirtioHeader, PVOID EthHeaders) const;
+    bool CalculateRawCheckSum(ULONG Offset, ULONG Length, UINT64 &RawSum) const;
 
     PNET_BUFFER m_NB;
     CNBL *m_ParentNBL;
     PPARANDIS_ADAPTER m_Context;
     PSCATTER_GATHER_LIST m_SGL = nullptr;
 
+    ULONG m_SegmentHeadersLength = 0;
+    ULONG m_SegmentPayloadLength = 0;
+    ULONG m_SegmentOffset = 0;
+    ULONG m_CurrSegmentLength = 0;
+    ULONG m_SegmentsSubmitted = 0;
+    ULONG m_SegmentsInFlight = 0;
+    bool m_SegmentationDone = false;
+
     CNB(const CNB&) = delete;
     CNB& operator= (const CNB&) = delete;
 
@@ -100,6 +129,8 @@ public:
     bool MappingSucceeded() { return !m_HaveFailedMappings; }
     void SetStatus(NDIS_STATUS Status)
     { m_NBL->Status = Status; }
+    LONGLONG SendTimestamp()
+    { return m_SendTimestamp; }
 
     // called under m_Lock of parent TX path for CNBL object in Send list
     CNB *PopMappedNB();
@@ -131,6 +162,8 @@ public:
     { return m_TCI; }
     bool IsLSO()
     { return (m_LsoInfo.Value != nullptr); }
+    bool IsSoftwareLSO()
+    { return m_SoftwareLSO; }
     bool IsTcpCSO()
     { return m_CsoInfo.Transmit.TcpChecksum; }
     bool IsUdpCSO()
@@ -174,6 +207,7 @@ private:
     // align storage for CNB on pointer size boundary and provide enough room for it
     ULONG_PTR m_CNB_Storage[(sizeof(CNB) + sizeof(ULONG_PTR) - 1) / sizeof(ULONG_PTR)];
     bool m_HaveFailedMappings = false;
+    bool m_SoftwareLSO = false;
 
     CNdisList<CNB, CRawAccess, CNonCountingObject> m_Buffers;
 
@@ -192,6 +226,8 @@ private:
     NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO m_CsoInfo;
 
     CAllocationHelper<CNB> *m_NBAllocator;
+    // performance counter at the time the NBL was handed to the driver
+    LONGLONG m_SendTimestamp;
 
     CNBL(const CNBL&) = delete;
     CNBL& operator= (const CNBL&) = delete;
@@ -227,6 +263,10 @@ public:
 
     bool RestartQueue();
 
+    // NBLs sent on this path and not completed yet
+    bool HasOutstandingNBLs()
+    { return m_StateMachine.HasOutstandingItems(); }
+
     //TODO: Needs review/temporary?
     ULONG GetFreeTXDescriptors()
     { return m_VirtQueue.GetFreeTXDescriptors(); }
@@ -241,7 +281,16 @@ public:
     void CompleteOutstandingInternalNBL(PNET_BUFFER_LIST NBL, BOOLEAN UnregisterOutstanding = TRUE);
 private:
 
-    bool SendMapped(bool IsInterrupt, CRawCNBLList& toWaitingList);
+    bool SendMapped(bool IsInterrupt, CRawCNBList& nbToFree, CRawCNBLList& toWaitingList);
+
+    bool RearmCompletions(bool bStreaming, bool bQueueFull);
+
+    static BOOLEAN _Function_class_(MINIPORT_SYNCHRONIZE_INTERRUPT)
+    RestartQueueDelayedSynchronously(PVOID ctx);
+
+    void ArmReclaimTimer();
+    void StopReclaimTimer();
+    static NDIS_TIMER_FUNCTION ReclaimTimerCallback;
 
     bool FillQueue();
 
@@ -277,4 +326,12 @@ private:
 
     CPool<CNB, 'BNHR'>  m_nbPool;
     CPool<CNBL, 'LNHR'> m_nblPool;
+
+    ULONG m_ReclaimWatermark = 0;
+    NDIS_HANDLE m_ReclaimTimer = nullptr;
+    enum { ReclaimTimerIdle, ReclaimTimerArmed, ReclaimTimerStopped };
+    volatile LONG m_ReclaimTimerArmed = ReclaimTimerIdle;
 };
+
+// hash of the addresses and ports of the first packet in the list, for TX queue selection
+ULONG ParaNdis_TxFlowHash(PNET_BUFFER_LIST NBL);
@@ -107,3 +107,73 @@ ULONG ParaNdis_GetSystemCPUCount()
 
     return nProcessors;
 }
+
+#if NDIS_SUPPORT_NDIS620
+typedef struct _tagDISPATCH_SYNC_CONTEXT
+{
+    LONG   Pending;
+    KEVENT Done;
+} DISPATCH_SYNC_CONTEXT;
+
+static KDEFERRED_ROUTINE DispatchSyncDpc;
+
+static VOID DispatchSyncDpc(PKDPC Dpc, PVOID Context, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    auto SyncContext = static_cast<DISPATCH_SYNC_CONTEXT *>(Context);
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (InterlockedDecrement(&SyncContext->Pending) == 0)
+    {
+        KeSetEvent(&SyncContext->Done, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+/* A DPC can run on a processor only when nothing else runs there
+   at DISPATCH_LEVEL, so once a DPC has run on each processor,
+   all the preexisting DISPATCH_LEVEL sections are over */
+bool ParaNdis_SynchronizeWithDispatchReaders(NDIS_HANDLE MiniportHandle)
+{
+    ULONG nProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    DISPATCH_SYNC_CONTEXT SyncContext;
+    PKDPC Dpcs;
+
+    NETKVM_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    Dpcs = static_cast<PKDPC>(NdisAllocateMemoryWithTagPriority(MiniportHandle, sizeof(KDPC) * nProcessors,
+                                                                PARANDIS_MEMORY_TAG, NormalPoolPriority));
+    if (Dpcs == nullptr)
+    {
+        DPrintf(0, "[%s] - DPC array allocation failed\n", __FUNCTION__);
+        return false;
+    }
+
+    // one extra reference is held until all the DPCs are queued
+    SyncContext.Pending = nProcessors + 1;
+    KeInitializeEvent(&SyncContext.Done, NotificationEvent, FALSE);
+
+    for (ULONG i = 0; i < nProcessors; i++)
+    {
+        PROCESSOR_NUMBER ProcNumber;
+
+        KeInitializeDpc(&Dpcs[i], DispatchSyncDpc, &SyncContext);
+        KeSetImportanceDpc(&Dpcs[i], HighImportance);
+        if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &ProcNumber)) ||
+            !NT_SUCCESS(KeSetTargetProcessorDpcEx(&Dpcs[i], &ProcNumber)) ||
+            !KeInsertQueueDpc(&Dpcs[i], nullptr, nullptr))
+        {
+            InterlockedDecrement(&SyncContext.Pending);
+        }
+    }
+
+    if (InterlockedDecrement(&SyncContext.Pending) != 0)
+    {
+        KeWaitForSingleObject(&SyncContext.Done, Executive, KernelMode, FALSE, nullptr);
+    }
+
+    NdisFreeMemoryWithTagPriority(MiniportHandle, Dpcs, PARANDIS_MEMORY_TAG);
+    return true;
+}
+#endif
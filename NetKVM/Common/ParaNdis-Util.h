@@ -740,6 +740,14 @@ ULONG FORCEINLINE ParaNdis_GetCurrentCPUIndex()
 #endif
 }
 
+#if NDIS_SUPPORT_NDIS620
+/* Returns when every processor has passed through IRQL below DISPATCH_LEVEL,
+   i.e. all the code running at DISPATCH_LEVEL at the moment of the call
+   has completed. Called at PASSIVE_LEVEL without spin locks held,
+   returns false if resources for synchronization could not be allocated */
+bool ParaNdis_SynchronizeWithDispatchReaders(NDIS_HANDLE MiniportHandle);
+#endif
+
 template <size_t PrintWidth, size_t ColumnWidth, typename TTable, typename... AccessorsFuncs>
 void ParaNdis_PrintTable(int DebugPrintLevel, TTable table, size_t Size, LPCSTR Format, AccessorsFuncs... Accessors)
 {
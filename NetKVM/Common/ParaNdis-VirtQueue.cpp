@@ -179,31 +179,35 @@ void CTXVirtQueue::UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor)
     auto &HeadersArea = Descriptor.HeadersAreaAccessor();
     PVOID EthHeader = HeadersArea.EthHeader();
 
-    //TODO: Statistics must be atomic
+    // called under the TX lock, i.e. at DISPATCH_LEVEL
     auto BytesSent = NB.GetDataLength();
     auto NBL = NB.GetParentNBL();
+    tCpuStatistics *pStatistics = ParaNdis_CpuStatistics(m_Context);
 
-    m_Context->Statistics.ifHCOutOctets += BytesSent;
+    Statistics().Packets++;
+    Statistics().Bytes += BytesSent;
+
+    pStatistics->ifHCOutOctets += BytesSent;
 
     if (ETH_IS_BROADCAST(EthHeader))
     {
-        m_Context->Statistics.ifHCOutBroadcastOctets += BytesSent;
-        m_Context->Statistics.ifHCOutBroadcastPkts++;
+        pStatistics->ifHCOutBroadcastOctets += BytesSent;
+        pStatistics->ifHCOutBroadcastPkts++;
     }
     else if (ETH_IS_MULTICAST(EthHeader))
     {
-        m_Context->Statistics.ifHCOutMulticastOctets += BytesSent;
-        m_Context->Statistics.ifHCOutMulticastPkts++;
+        pStatistics->ifHCOutMulticastOctets += BytesSent;
+        pStatistics->ifHCOutMulticastPkts++;
     }
     else
     {
-        m_Context->Statistics.ifHCOutUcastOctets += BytesSent;
-        m_Context->Statistics.ifHCOutUcastPkts++;
+        pStatistics->ifHCOutUcastOctets += BytesSent;
+        pStatistics->ifHCOutUcastPkts++;
     }
 
     if (NBL->IsLSO())
     {
-        m_Context->extraStatistics.framesLSO++;
+        pStatistics->Extra.framesLSO++;
 
         auto EthHeaders = Descriptor.HeadersAreaAccessor().EthHeadersAreaVA();
         auto TCPHdr = reinterpret_cast<TCPHeader *>(RtlOffsetToPointer(EthHeaders, NBL->TCPHeaderOffset()));
@@ -212,12 +216,71 @@ void CTXVirtQueue::UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor)
     }
     else if (NBL->IsTcpCSO() || NBL->IsUdpCSO())
     {
-        m_Context->extraStatistics.framesCSOffload++;
+        pStatistics->Extra.framesCSOffload++;
+    }
+}
+
+SubmitTxPacketResult CTXVirtQueue::SubmitSegments(CNB &NB)
+{
+    // Every segment takes its own descriptor. When the queue fills up
+    // the NB keeps its progress and the rest goes out on the next attempt.
+    CTXDescriptor *TXDescriptor = nullptr;
+
+    while (!NB.AllSegmentsSubmitted())
+    {
+        SubmitTxPacketResult res;
+
+        if (!m_Descriptors.GetCount())
+        {
+            res = SUBMIT_NO_PLACE_IN_QUEUE;
+        }
+        else if (!NB.BindSegmentToDescriptor(*(TXDescriptor = m_Descriptors.Pop())))
+        {
+            m_Descriptors.Push(TXDescriptor);
+            res = SUBMIT_FAILURE;
+        }
+        else
+        {
+            res = TXDescriptor->Enqueue(this, m_TotalHWBuffers, m_FreeHWBuffers);
+            if (res == SUBMIT_SUCCESS)
+            {
+                m_FreeHWBuffers -= TXDescriptor->GetUsedBuffersNum();
+                m_DescriptorsInUse.PushBack(TXDescriptor);
+                NB.SegmentSubmitted();
+                continue;
+            }
+            m_Descriptors.Push(TXDescriptor);
+        }
+
+        if (res == SUBMIT_NO_PLACE_IN_QUEUE)
+        {
+            KickQueueOnOverflow();
+            return res;
+        }
+
+        if (!NB.HaveSegmentsInFlight())
+        {
+            return res;
+        }
+
+        // part of the packet is already on the wire, drop the rest
+        // and let the completion of the sent segments release the NB
+        DPrintf(0, "[%s] ERROR: segmentation aborted (%d)\n", __FUNCTION__, res);
+        NB.AbortSegmentation();
+        return SUBMIT_SUCCESS;
     }
+
+    UpdateTXStats(NB, *TXDescriptor);
+    return SUBMIT_SUCCESS;
 }
 
 SubmitTxPacketResult CTXVirtQueue::SubmitPacket(CNB &NB)
 {
+    if (NB.GetParentNBL()->IsSoftwareLSO())
+    {
+        return SubmitSegments(NB);
+    }
+
     if (!m_Descriptors.GetCount())
     {
         KickQueueOnOverflow();
@@ -275,7 +338,10 @@ UINT CTXVirtQueue::ReleaseTransmitBuffers(CRawCNBList& listDone)
             DPrintf(0, "[%s] ERROR: nofUsedBuffers not set!\n", __FUNCTION__);
         }
         m_FreeHWBuffers += TXDescriptor->GetUsedBuffersNum();
-        listDone.PushBack(TXDescriptor->GetNB());
+        if (TXDescriptor->GetNB()->SegmentCompleted())
+        {
+            listDone.PushBack(TXDescriptor->GetNB());
+        }
         m_Descriptors.Push(TXDescriptor);
         DPrintf(3, "[%s] Free Tx: desc %d, buff %d\n", __FUNCTION__, m_Descriptors.GetCount(), m_FreeHWBuffers);
         ++i;
@@ -290,12 +356,13 @@ UINT CTXVirtQueue::ReleaseTransmitBuffers(CRawCNBList& listDone)
 }
 
 //TODO: Needs review
-void CTXVirtQueue::ProcessTXCompletions(CRawCNBList& listDone)
+UINT CTXVirtQueue::ProcessTXCompletions(CRawCNBList& listDone)
 {
     if (m_Descriptors.GetCount() < m_TotalDescriptors)
     {
-        ReleaseTransmitBuffers(listDone);
+        return ReleaseTransmitBuffers(listDone);
     }
+    return 0;
 }
 
 void CTXVirtQueue::Shutdown()
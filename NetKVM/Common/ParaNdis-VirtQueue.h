@@ -25,6 +25,31 @@ typedef enum
     SUBMIT_FAILURE
 } SubmitTxPacketResult;
 
+/* Per-queue counters, each updated only by the owner of the queue
+   (under its lock, in its DPC or in its interrupt) */
+typedef struct _tagQueueStatistics
+{
+    ULONG64 Packets;
+    ULONG64 Bytes;
+    ULONG   Drops;
+    ULONG   Kicks;
+    ULONG   Interrupts;
+    ULONG   DpcRequeues;
+} tQueueStatistics;
+
+// latency buckets in microseconds: 0, 1, 2-3, 4-7, ... 16384 and more
+#define PARANDIS_LATENCY_HISTOGRAM_SIZE     16
+
+/* Per-queue latency histograms, timed with the performance counter
+   and updated by the same owners as tQueueStatistics */
+typedef struct _tagQueueLatency
+{
+    ULONG   InterruptToDpc[PARANDIS_LATENCY_HISTOGRAM_SIZE];
+    ULONG   DpcDuration[PARANDIS_LATENCY_HISTOGRAM_SIZE];
+    /* RX: taken from the used ring to indicated, TX: sent to completed */
+    ULONG   Completion[PARANDIS_LATENCY_HISTOGRAM_SIZE];
+} tQueueLatency;
+
 class CTXHeaders
 {
 public:
@@ -190,11 +215,20 @@ public:
 
     //TODO: Needs review / temporary
     void Kick()
-    { virtqueue_kick(m_VirtQueue); }
+    {
+        m_Statistics.Kicks++;
+        virtqueue_kick(m_VirtQueue);
+    }
 
     //TODO: Needs review / temporary
     void KickAlways()
-    { virtqueue_notify(m_VirtQueue); }
+    {
+        m_Statistics.Kicks++;
+        virtqueue_notify(m_VirtQueue);
+    }
+
+    tQueueStatistics &Statistics()
+    { return m_Statistics; }
 
     bool Restart()
     {
@@ -207,6 +241,18 @@ public:
         return true;
     }
 
+    // same as Restart, but the interrupt comes after ~3/4 of the pending buffers are used
+    bool RestartDelayed()
+    {
+        if (!virtqueue_enable_cb_delayed(m_VirtQueue))
+        {
+            virtqueue_disable_cb(m_VirtQueue);
+            return false;
+        }
+
+        return true;
+    }
+
     //TODO: Needs review/temporary?
     void EnableInterruptsDelayed()
     { virtqueue_enable_cb_delayed(m_VirtQueue); }
@@ -231,6 +277,7 @@ private:
 
     CNdisSharedMemory m_SharedMemory;
     struct virtqueue *m_VirtQueue = nullptr;
+    tQueueStatistics m_Statistics = {};
 
     CVirtQueue(const CVirtQueue&) = delete;
     CVirtQueue& operator= (const CVirtQueue&) = delete;
@@ -255,12 +302,18 @@ public:
 
     SubmitTxPacketResult SubmitPacket(CNB &NB);
 
-    void ProcessTXCompletions(CRawCNBList& listDone);
+    UINT ProcessTXCompletions(CRawCNBList& listDone);
 
     //TODO: Needs review/temporary?
     ULONG GetFreeTXDescriptors()
     { return m_Descriptors.GetCount(); }
 
+    bool HaveTXInFlight()
+    { return m_Descriptors.GetCount() < m_TotalDescriptors; }
+
+    ULONG GetTotalTXDescriptors()
+    { return m_TotalDescriptors; }
+
     //TODO: Needs review/temporary?
     ULONG GetFreeHWBuffers()
     { return m_FreeHWBuffers; }
@@ -276,6 +329,7 @@ private:
     ULONG m_HeaderSize;
 
     void KickQueueOnOverflow();
+    SubmitTxPacketResult SubmitSegments(CNB &NB);
     void UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor);
 
     CNdisList<CTXDescriptor, CRawAccess, CCountingObject> m_Descriptors;
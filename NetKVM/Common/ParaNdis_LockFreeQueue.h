@@ -3,10 +3,18 @@
 /*
 * Multiple producer single consumer lock free queue implementation
 *
-* This implementation of lock free queue is based on the freebsd implementation
-* of a lock free queue which can be found in:
-* https://svnweb.freebsd.org/base/release/8.0.0/sys/sys/buf_ring.h?view=markup
-* https://svnweb.freebsd.org/base/release/8.0.0/sys/kern/subr_bufring.c?view=markup
+* Bounded ring of slots, each slot carries a sequence number telling
+* whose turn it is: a producer may fill the slot when the sequence equals
+* its position, the consumer may take the entry when the sequence is one
+* past the position. A producer claims a position with a single CAS and
+* publishes its slot on its own, so neither the other producers nor the
+* consumer ever wait for an enqueue in progress. The consumer sees such
+* a slot as the end of the queue; the producer notifies the consumer after
+* the publication as before.
+*
+* The scheme is the bounded MPMC queue of Dmitry Vyukov:
+* http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+* reduced to a single consumer.
 *
 * Copyright Red Hat, Inc. 2017
 *
@@ -21,29 +29,19 @@ class CLockFreeQueue
 public:
     CLockFreeQueue() :
         m_Context(nullptr),
-        m_ProducerSize(0),
-        m_ConsumerSize(0),
-        m_ProducerMask(0),
-        m_ConsumerMask(0),
-        m_ProducerHead(0),
-        m_ConsumerHead(0),
-        m_ProducerTail(0),
-        m_ConsumerTail(0),
-        m_PQueueRing(nullptr)
+        m_Size(0),
+        m_Mask(0),
+        m_Slots(nullptr),
+        m_EnqueuePosition(0),
+        m_DequeuePosition(0)
     {
     }
 
     BOOLEAN Create(PPARANDIS_ADAPTER pContext, INT size)
     {
-        m_Context = pContext;
-        m_ProducerSize = size;
-        m_ConsumerSize = size;
-        m_ProducerMask = size - 1;
-        m_ConsumerMask = size - 1;
-
         /*
          * The size of the queue has to be a power of two in order to easily
-         * implement the overflow cyclic check
+         * map the ever growing positions to the slots
          */
 
         if (!IsPowerOfTwo(size))
@@ -51,55 +49,78 @@ public:
             return FALSE;
         }
 
-        m_PQueueRing = (TEntryType **) ParaNdis_AllocateMemory(pContext, sizeof(TEntryType *) * size);
-        if (m_PQueueRing == nullptr)
+        m_Slots = (tSlot *) ParaNdis_AllocateMemory(pContext, sizeof(tSlot) * size);
+        if (m_Slots == nullptr)
         {
             return FALSE;
         }
+
+        m_Context = pContext;
+        m_Size = size;
+        m_Mask = size - 1;
+
+        for (INT i = 0; i < size; i++)
+        {
+            m_Slots[i].Sequence = i;
+            m_Slots[i].Entry = nullptr;
+        }
         return TRUE;
     }
 
     ~CLockFreeQueue()
     {
-        if (m_PQueueRing != nullptr)
+        if (m_Slots != nullptr)
         {
-            NdisFreeMemory(m_PQueueRing, 0, 0);
-            m_PQueueRing = nullptr;
+            NdisFreeMemory(m_Slots, 0, 0);
+            m_Slots = nullptr;
         }
     }
 
    /*
     * multi-producer safe lock-free ring buffer enqueue
+    * returns FALSE when the ring is full
     */
 
     BOOLEAN Enqueue(TEntryType *entry)
     {
-        LONG producer_head, producer_next, consumer_tail;
-        /* Critical section */
+        LONG position = m_EnqueuePosition;
+        tSlot *slot;
+
+        if (m_Slots == nullptr)
         {
-            do {
-                producer_head = m_ProducerHead;
-                producer_next = (producer_head + 1) & m_ProducerMask;
-                consumer_tail = m_ConsumerTail;
+            return FALSE;
+        }
 
-                if (producer_next == consumer_tail) {
-                    return FALSE;
+        for (;;)
+        {
+            slot = &m_Slots[position & m_Mask];
+            LONG distance = Distance(slot->Sequence, position);
+
+            if (distance == 0)
+            {
+                LONG current = InterlockedCompareExchange(&m_EnqueuePosition, Advance(position, 1), position);
+                if (current == position)
+                {
+                    break;
                 }
-            } while (InterlockedCompareExchange(&m_ProducerHead, producer_next, producer_head) != producer_head);
-
-            m_PQueueRing[producer_head] = entry;
-            KeMemoryBarrier();
+                position = current;
+            }
+            else if (distance < 0)
+            {
+                /* the consumer did not take the entry of the previous round yet */
+                return FALSE;
+            }
+            else
+            {
+                /* another producer claimed the slot */
+                position = m_EnqueuePosition;
+            }
+        }
 
-           /*
-            * If there are other enqueues in progress
-            * that preceded us, we need to wait for them
-            * to complete
-            */
-            while (m_ProducerTail != producer_head)
-            {}
+        slot->Entry = entry;
+        KeMemoryBarrier();
+        slot->Sequence = Advance(position, 1);
 
-            m_ProducerTail = producer_next;
-        }
         return TRUE;
     }
 
@@ -110,24 +131,19 @@ public:
 
     TEntryType *Dequeue()
     {
-        LONG consumer_head, consumer_next;
-        volatile LONG producer_tail;
-        TEntryType *entry;
-
-        consumer_head = m_ConsumerHead;
-        producer_tail = m_ProducerTail;
-
-        consumer_next = (consumer_head + 1) & m_ConsumerMask;
-
-        if (consumer_head == producer_tail)
+        if (!IsHeadReady())
         {
             return nullptr;
         }
 
-        m_ConsumerHead = consumer_next;
-        entry = m_PQueueRing[consumer_head];
+        tSlot *slot = &m_Slots[m_DequeuePosition & m_Mask];
+        KeMemoryBarrier();
+        TEntryType *entry = slot->Entry;
 
-        m_ConsumerTail = consumer_next;
+        /* the entry is read before the slot goes to the next round */
+        KeMemoryBarrier();
+        slot->Sequence = Advance(m_DequeuePosition, m_Size);
+        m_DequeuePosition = Advance(m_DequeuePosition, 1);
 
         return entry;
     }
@@ -139,21 +155,23 @@ public:
 
     TEntryType *Peek()
     {
-        if (m_ConsumerHead == m_ProducerTail)
+        if (!IsHeadReady())
         {
             return nullptr;
         }
-        return m_PQueueRing[m_ConsumerHead];
+        KeMemoryBarrier();
+        return m_Slots[m_DequeuePosition & m_Mask].Entry;
     }
 
     BOOLEAN IsEmpty()
     {
-        return (m_ConsumerHead == m_ProducerTail);
+        return !IsHeadReady();
     }
 
     BOOLEAN IsFull()
     {
-        return (((m_ProducerHead + 1) & m_ProducerMask) == m_ConsumerTail);
+        LONG position = m_EnqueuePosition;
+        return m_Slots == nullptr || Distance(m_Slots[position & m_Mask].Sequence, position) < 0;
     }
 
     BOOLEAN IsPowerOfTwo(INT x)
@@ -163,15 +181,38 @@ public:
 
 private:
 
-    volatile LONG m_ProducerHead;
-    volatile LONG m_ProducerTail;
-    INT m_ProducerSize;
-    INT m_ProducerMask;
-    volatile LONG m_ConsumerHead;
-    volatile LONG m_ConsumerTail;
-    INT m_ConsumerSize;
-    INT m_ConsumerMask;
-    TEntryType **m_PQueueRing;
+    typedef struct _tagSlot
+    {
+        volatile LONG Sequence;
+        TEntryType *Entry;
+    } tSlot;
+
+    /* the positions wrap around, compare them as a signed distance */
+    static LONG Distance(LONG a, LONG b)
+    {
+        return (LONG)((ULONG)a - (ULONG)b);
+    }
+
+    static LONG Advance(LONG position, LONG n)
+    {
+        return (LONG)((ULONG)position + (ULONG)n);
+    }
+
+    bool IsHeadReady()
+    {
+        return m_Slots != nullptr &&
+               m_Slots[m_DequeuePosition & m_Mask].Sequence == Advance(m_DequeuePosition, 1);
+    }
 
     PPARANDIS_ADAPTER m_Context;
+    LONG m_Size;
+    LONG m_Mask;
+    tSlot *m_Slots;
+
+    /* the producers and the consumer move their positions on separate cache lines */
+    UCHAR m_PadShared[SYSTEM_CACHE_ALIGNMENT_SIZE];
+    volatile LONG m_EnqueuePosition;
+    UCHAR m_PadProducers[SYSTEM_CACHE_ALIGNMENT_SIZE - sizeof(LONG)];
+    LONG m_DequeuePosition;
+    UCHAR m_PadConsumer[SYSTEM_CACHE_ALIGNMENT_SIZE - sizeof(LONG)];
 };
@@ -31,14 +31,34 @@
 #define PARANDIS_56_COMMON_H
 
 #if defined(OFFLOAD_UNIT_TEST)
+#if defined(_WIN32)
 #include <windows.h>
+#define RtlOffsetToPointer(B,O)  ((PCHAR)( ((PCHAR)(B)) + ((ULONG_PTR)(O))  ))
+#else
+/* DebugTools/PacketParser */
+#include "ndis_shim.h"
+#endif
 #include <stdio.h>
+#include <assert.h>
 
-#define DoPrint(fmt, ...) printf(fmt##"\n", __VA_ARGS__)
-#define DPrintf(a,b) DoPrint b
-#define RtlOffsetToPointer(B,O)  ((PCHAR)( ((PCHAR)(B)) + ((ULONG_PTR)(O))  ))
+extern int virtioDebugLevel;
+#define DPrintf(Level, ...) do { if ((Level) <= virtioDebugLevel) printf(__VA_ARGS__); } while (0)
+#define NETKVM_ASSERT(x) assert(x)
 
 #include "ethernetutils.h"
+#include "ParaNdis-PacketParser.h"
+#if PARANDIS_SUPPORT_RSC
+#include "ParaNdis-SwRsc.h"
+#endif
+
+typedef union _tagTcpIpPacketParsingResult tTcpIpPacketParsingResult;
+
+/* the sw offload only uses the virtual addresses */
+typedef struct _tagCompletePhysicalAddress
+{
+    PVOID               Virtual;
+    ULONG               size;
+} tCompletePhysicalAddress;
 #endif //+OFFLOAD_UNIT_TEST
 
 #if !defined(OFFLOAD_UNIT_TEST)
@@ -106,6 +126,9 @@ typedef struct _tagPARANDIS_RECEIVE_QUEUE
     NDIS_SPIN_LOCK          Lock;
     LIST_ENTRY              BuffersList;
     COwnership              Ownership;
+    /* buffers added and taken so far, under Lock */
+    ULONG                   QueuedPosition;
+    ULONG                   TakenPosition;
 } PARANDIS_RECEIVE_QUEUE, *PPARANDIS_RECEIVE_QUEUE;
 
 #include "ParaNdis-TX.h"
@@ -148,7 +171,9 @@ struct CPUPathBundle : public CPlacementAllocatable {
 
 #define VIRTIO_NET_INVALID_INTERRUPT_STATUS     0xFF
 
-#define PARANDIS_MULTICAST_LIST_SIZE        32
+#define PARANDIS_MULTICAST_LIST_SIZE        256
+// larger lists are filtered by the driver, the device receives all multicast
+#define PARANDIS_DEVICE_MULTICAST_LIST_SIZE 32
 #define PARANDIS_MEMORY_TAG                 '5muQ'
 #define PARANDIS_FORMAL_LINK_SPEED          (pContext->ulFormalLinkSpeed)
 #define PARANDIS_MAXIMUM_RECEIVE_SPEED      PARANDIS_FORMAL_LINK_SPEED
@@ -158,6 +183,25 @@ struct CPUPathBundle : public CPlacementAllocatable {
 
 #define PARANDIS_UNLIMITED_PACKETS_TO_INDICATE  (~0ul)
 
+// adaptive RX DPC budget, the NumberOfHandledRXPacketsInDPC value is its upper limit
+#define PARANDIS_RX_BUDGET_MIN                  16
+#define PARANDIS_RX_BUDGET_INITIAL              64
+#define PARANDIS_RX_DPC_TIME_BUDGET_US          100
+// buckets of packets indicated per DPC: 0, 1, 2-3, 4-7, ... 1024 and more
+#define PARANDIS_RX_BUDGET_HISTOGRAM_SIZE       12
+
+// RX buffers are carved out of shared memory blocks of up to this size
+#define PARANDIS_RX_ARENA_BLOCK_SIZE            (1024 * 1024)
+// arena buffers have two parts: virtio header page and contiguous data
+#define PARANDIS_RX_ARENA_SG_ENTRIES            2
+
+// received frames up to RxCopyThreshold bytes are copied to a small buffer
+// and their ring buffer is reposted at once
+#define PARANDIS_RX_COPY_THRESHOLD_DEFAULT      256
+// frame size classes of the RX statistics: up to 64, 128, 256, 512, 1024,
+// 2048 bytes and larger
+#define PARANDIS_RX_SIZE_CLASSES                7
+
 static const ULONG PARANDIS_PACKET_FILTERS =
     NDIS_PACKET_TYPE_DIRECTED |
     NDIS_PACKET_TYPE_MULTICAST |
@@ -175,6 +219,22 @@ typedef enum _tagSendReceiveState
     srsEnabled
 } tSendReceiveState;
 
+// how the TX queue is chosen for a packet when several queues are in use
+typedef enum _tagTxSteering
+{
+    txsRSS = 0,             // by the RSS hash and indirection table, queue 0 without it
+    txsFlowHash,            // by the RSS hash or a hash of the flow's 5-tuple
+    txsCPU                  // by the current CPU, the flow hash when it has no queue
+} tTxSteering;
+
+// *InterruptModeration: how long the device delays used buffer notifications
+typedef enum _tagInterruptModeration
+{
+    imDisabled = 0,         // notification for every used buffer
+    imLow,                  // short fixed delay
+    imAdaptive              // delay follows the packet rate
+} tInterruptModeration;
+
 typedef enum _tagOffloadSettingsBit
 {
     osbT4IpChecksum = (1 << 0),
@@ -240,6 +300,11 @@ typedef struct _tagOffloadSettings
     ULONG flagsValue;
     ULONG ipHeaderOffset;
     ULONG maxPacketSize;
+    /* host can't segment, LSO packets are segmented by the driver */
+    BOOLEAN bSoftwareLsov4;
+    BOOLEAN bSoftwareLsov6;
+    /* host completes the TCP checksum of the software segments */
+    BOOLEAN bHostChecksum;
 }tOffloadSettings;
 
 typedef struct _tagChecksumCheckResult
@@ -281,48 +346,13 @@ typedef struct _tagMulticastData
     UCHAR                   MulticastList[ETH_ALEN * PARANDIS_MULTICAST_LIST_SIZE];
 }tMulticastData;
 
-typedef struct _tagNET_PACKET_INFO
-{
-    struct
-    {
-        int isBroadcast   : 1;
-        int isMulticast   : 1;
-        int isUnicast     : 1;
-        int hasVlanHeader : 1;
-        int isIP4         : 1;
-        int isIP6         : 1;
-        int isTCP         : 1;
-        int isUDP         : 1;
-        int isFragment    : 1;
-    };
-
-    struct
-    {
-        UINT32 UserPriority : 3;
-        UINT32 VlanId       : 12;
-    } Vlan;
+#include "ParaNdis-MulticastFilter.h"
 
-#if PARANDIS_SUPPORT_RSS
-    struct
-    {
-        ULONG Value;
-        ULONG Type;
-        ULONG Function;
-    } RSSHash;
+#include "ParaNdis-PacketParser.h"
+#if PARANDIS_SUPPORT_RSC
+#include "ParaNdis-SwRsc.h"
 #endif
 
-    ULONG L2HdrLen;
-    ULONG L3HdrLen;
-    ULONG L2PayloadLen;
-    ULONG ip6HomeAddrOffset;
-    ULONG ip6DestAddrOffset;
-
-    PUCHAR ethDestAddr;
-
-    PVOID headersBuffer;
-    ULONG dataLength;
-} NET_PACKET_INFO, *PNET_PACKET_INFO;
-
 struct _tagRxNetDescriptor {
     LIST_ENTRY listEntry;
     LIST_ENTRY ReceiveQueueListEntry;
@@ -333,12 +363,68 @@ struct _tagRxNetDescriptor {
     ULONG                          BufferSGLength;
     tCompletePhysicalAddress       IndirectArea;
     tPacketHolderType              Holder;
+    /* NBL and NB pointing to Holder, allocated with the descriptor and
+       indicated for every packet received into its buffer */
+    PNET_BUFFER_LIST               BoundNBL;
 
     NET_PACKET_INFO PacketInfo;
 
     CParaNdisRX*                   Queue;
+    /* performance counter of the pass that took the buffer from the used ring */
+    LONGLONG                       UsedTimestamp;
+    /* the descriptor and its buffer belong to the arena of the queue */
+    BOOLEAN                        InArena;
+
+#if PARANDIS_SUPPORT_RSC
+    /* Software RSC: the descriptor heading a coalesced frame keeps the list
+       of merged segments, each of them contributes a payload-only MDL,
+       allocated with the descriptor and rebuilt when the frame is flushed */
+    tSwRscSegment                  SwRsc;
+    pRxNetDescriptor               CoalescedNext;
+    PMDL                           CoalescedMdl;
+    PMDL                           CoalescedSavedLinkage;
+#endif
 };
 
+typedef struct _tagExtraStatistics
+{
+    ULONG framesCSOffload;
+    ULONG framesLSO;
+    ULONG framesRxPriority;
+    ULONG framesRxCSHwOK;
+    ULONG framesFilteredOut;
+    ULONG framesCoalescedHost;
+    ULONG framesCoalescedWindows;
+    ULONG framesCoalescedSoftware;
+    ULONG framesRxBySize[PARANDIS_RX_SIZE_CLASSES];
+    ULONG framesRxCopied[PARANDIS_RX_SIZE_CLASSES];
+    ULONG framesRxCopyNoBuffer;
+} tExtraStatistics;
+
+/* Data path counters. Each CPU updates its own cache line aligned block
+   at DISPATCH_LEVEL, the blocks are summed into Statistics and
+   extraStatistics of the adapter by ParaNdis_CollectStatistics */
+typedef struct DECLSPEC_CACHEALIGN _tagCpuStatistics
+{
+    ULONG64 ifHCInOctets;
+    ULONG64 ifHCInUcastPkts;
+    ULONG64 ifHCInUcastOctets;
+    ULONG64 ifHCInMulticastPkts;
+    ULONG64 ifHCInMulticastOctets;
+    ULONG64 ifHCInBroadcastPkts;
+    ULONG64 ifHCInBroadcastOctets;
+    ULONG64 ifInErrors;
+    ULONG64 ifInDiscards;
+    ULONG64 ifHCOutOctets;
+    ULONG64 ifHCOutUcastPkts;
+    ULONG64 ifHCOutUcastOctets;
+    ULONG64 ifHCOutMulticastPkts;
+    ULONG64 ifHCOutMulticastOctets;
+    ULONG64 ifHCOutBroadcastPkts;
+    ULONG64 ifHCOutBroadcastOctets;
+    tExtraStatistics Extra;
+} tCpuStatistics;
+
 typedef struct _tagPARANDIS_ADAPTER
 {
     NDIS_HANDLE             DriverHandle;
@@ -377,11 +463,24 @@ typedef struct _tagPARANDIS_ADAPTER
     BOOLEAN                 bCtrlMACAddrSupported;
     BOOLEAN                 bCfgMACAddrSupported;
     BOOLEAN                 bMultiQueue;
+    BOOLEAN                 bNotfCoalSupported;
     USHORT                  nHardwareQueues;
     ULONG                   ulCurrentVlansFilterSet;
     tMulticastData          MulticastData;
+    /* the RX path uses the active one while the other is rebuilt */
+    tMulticastFilter        MulticastFilters[2];
+    volatile LONG           ActiveMulticastFilter;
     UINT                    uNumberOfHandledRXPacketsInDPC;
+    ULONG                   uRxCopyThreshold;
     LONG                    counterDPCInside;
+    tInterruptModeration    InterruptModeration;
+    struct {
+        /* index of the profile programmed to the device, -1 - none yet */
+        volatile LONG       Level;
+        volatile LONG64     LastSampleTime;
+        ULONG64             LastPackets;
+        ULONG               LevelChanges;
+    } NotfCoal;
     ULONG                   ulPriorityVlanSetting;
     ULONG                   VlanId;
     ULONGLONG               ulFormalLinkSpeed;
@@ -402,17 +501,14 @@ typedef struct _tagPARANDIS_ADAPTER
     CGuestAnnouncePackets    guestAnnouncePackets;
 
     /* send part */
+    /* snapshots filled by ParaNdis_CollectStatistics */
     NDIS_STATISTICS_INFO    Statistics;
-    struct
-    {
-        ULONG framesCSOffload;
-        ULONG framesLSO;
-        ULONG framesRxPriority;
-        ULONG framesRxCSHwOK;
-        ULONG framesFilteredOut;
-        ULONG framesCoalescedHost;
-        ULONG framesCoalescedWindows;
-    } extraStatistics;
+    tExtraStatistics        extraStatistics;
+    tCpuStatistics          *pCpuStatistics;
+    PVOID                   pCpuStatisticsMemory;
+    ULONG                   nCpuStatistics;
+    /* performance counter frequency for the latency histograms */
+    ULONG                   ulLatencyTicksPerUs;
 
     /* initial number of free Tx descriptor(from cfg) - max number of available Tx descriptors */
     UINT                    maxFreeTxDescriptors;
@@ -437,6 +533,16 @@ typedef struct _tagPARANDIS_ADAPTER
 
     CPUPathBundle               *pPathBundles;
     UINT                        nPathBundles;
+    /* queue pairs the device is told to use (VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET)
+       and the ones the driver transmits on, both follow the queues the RSS
+       indirection table refers to */
+    UINT                        nQueuePairsSet;
+    UINT                        nActivePathBundles;
+    ULONG                       nQueuePairsChanges;
+    /* last count sent to the device, may be not answered yet */
+    volatile LONG               nQueuePairsRequested;
+    /* requests to the queue pairs work item, it runs while not zero */
+    volatile LONG               nQueuePairsWork;
 
     CPUPathBundle              **RSS2QueueMap;
     USHORT                      RSS2QueueLength;
@@ -456,6 +562,7 @@ typedef struct _tagPARANDIS_ADAPTER
     NDIS_RECEIVE_SCALE_CAPABILITIES RSSCapabilities;
     PARANDIS_RSS_PARAMS         RSSParameters;
     CCHAR                       RSSMaxQueuesNumber;
+    tTxSteering                 TxSteering;
 #endif
 
 #if PARANDIS_SUPPORT_RSC
@@ -471,6 +578,10 @@ typedef struct _tagPARANDIS_ADAPTER
         BOOLEAN                     bIPv6EnabledQEMU;
         BOOLEAN                     bIPv4SupportedQEMU;
         BOOLEAN                     bIPv6SupportedQEMU;
+        /* coalescing is done by the driver, the host has no GUEST_TSO */
+        BOOLEAN                     bSoftwareCoalescing;
+        BOOLEAN                     bIPv4Software;
+        BOOLEAN                     bIPv6Software;
         struct {
             LARGE_INTEGER           CoalescedPkts;
             LARGE_INTEGER           CoalescedOctets;
@@ -503,6 +614,48 @@ BOOLEAN FORCEINLINE IsPrioritySupported(PARANDIS_ADAPTER *pContext)
     return pContext->ulPriorityVlanSetting & 1;
 }
 
+/* must be called at DISPATCH_LEVEL, so the CPU does not change under the caller */
+FORCEINLINE tCpuStatistics *ParaNdis_CpuStatistics(PARANDIS_ADAPTER *pContext)
+{
+    return &pContext->pCpuStatistics[ParaNdis_GetCurrentCPUIndex() % pContext->nCpuStatistics];
+}
+
+void ParaNdis_CollectStatistics(PARANDIS_ADAPTER *pContext);
+
+/* adds a latency in performance counter ticks to a histogram of a queue */
+FORCEINLINE void ParaNdis_RecordLatency(PARANDIS_ADAPTER *pContext, ULONG *Histogram, LONGLONG Ticks)
+{
+    ULONG bucket = 0;
+    ULONG64 us = Ticks > 0 ? (ULONG64)Ticks / pContext->ulLatencyTicksPerUs : 0;
+
+    if (us >= (1ull << (PARANDIS_LATENCY_HISTOGRAM_SIZE - 2)))
+    {
+        bucket = PARANDIS_LATENCY_HISTOGRAM_SIZE - 1;
+    }
+    else if (us)
+    {
+        _BitScanReverse(&bucket, (ULONG)us);
+        bucket++;
+    }
+    Histogram[bucket]++;
+}
+
+void ParaNdis_ResetLatencyHistograms(PARANDIS_ADAPTER *pContext);
+
+/* index of the size class of a received frame in the RX statistics */
+FORCEINLINE ULONG ParaNdis_RxSizeClass(ULONG ulLength)
+{
+    ULONG ulClass = 0;
+
+    while (ulClass < PARANDIS_RX_SIZE_CLASSES - 1 && ulLength > (64ul << ulClass))
+    {
+        ulClass++;
+    }
+    return ulClass;
+}
+
+void ParaNdis_ResetExtraStatistics(PARANDIS_ADAPTER *pContext);
+
 NDIS_STATUS ParaNdis_InitializeContext(
     PARANDIS_ADAPTER *pContext,
     PNDIS_RESOURCE_LIST ResourceList);
@@ -561,9 +714,12 @@ CCHAR ParaNdis_GetScalingDataForPacket(
 
 #if PARANDIS_SUPPORT_RSS
 NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext);
+VOID ParaNdis_UpdateQueuePairs(PARANDIS_ADAPTER *pContext);
+VOID ParaNdis_TrimQueuePairs(PARANDIS_ADAPTER *pContext);
+VOID ParaNdis_WaitForQueuePairsWork(PARANDIS_ADAPTER *pContext);
 #endif
 
-VOID ParaNdis_ReceiveQueueAddBuffer(
+ULONG ParaNdis_ReceiveQueueAddBuffer(
     PPARANDIS_RECEIVE_QUEUE pQueue,
     pRxNetDescriptor pBuffer);
 
@@ -596,7 +752,7 @@ CCHAR ParaNdis_GetScalingDataForPacket(
     PNET_PACKET_INFO pPacketInfo,
     PPROCESSOR_NUMBER pTargetProcessor);
 
-VOID ParaNdis_ReceiveQueueAddBuffer(
+ULONG ParaNdis_ReceiveQueueAddBuffer(
     PPARANDIS_RECEIVE_QUEUE pQueue,
     pRxNetDescriptor pBuffer);
 
@@ -641,6 +797,12 @@ VOID ParaNdis_UpdateGuestOffloads(
     UINT64 Offloads
 );
 #endif
+
+VOID ParaNdis_SetInterruptModeration(
+    PARANDIS_ADAPTER *pContext,
+    tInterruptModeration Moderation
+);
+
 void ParaNdis_ResetOffloadSettings(PARANDIS_ADAPTER *pContext, tOffloadSettingsFlags *pDest, PULONG from);
 
 tChecksumCheckResult ParaNdis_CheckRxChecksum(
@@ -679,6 +841,37 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(
     pRxNetDescriptor pBufferDesc,
     PUINT            pnCoalescedSegmentsCount);
 
+tPacketIndicationType ParaNdis_CopyReceivedPacket(
+    PARANDIS_ADAPTER *pContext,
+    pRxNetDescriptor pBufferDesc,
+    tPacketIndicationType Packet);
+
+#if PARANDIS_SUPPORT_RSC
+static __inline
+BOOLEAN ParaNdis_SwRscIsActive(PARANDIS_ADAPTER *pContext)
+{
+    return (pContext->RSC.bIPv4Software && pContext->RSC.bIPv4Enabled) ||
+           (pContext->RSC.bIPv6Software && pContext->RSC.bIPv6Enabled);
+}
+
+/* Offers the received buffer to the coalescing engine (ParaNdis-SwRsc.h).
+   Returns TRUE if the buffer was taken, *ppFlushed receives an aggregation
+   that must be indicated before anything else of this pass */
+BOOLEAN ParaNdis_SwRscReceive(
+    tSwRscContext *pRsc,
+    pRxNetDescriptor pBuffer,
+    pRxNetDescriptor *ppFlushed);
+
+/* Returns the next pending aggregation or NULL */
+pRxNetDescriptor ParaNdis_SwRscFlush(
+    tSwRscContext *pRsc);
+
+/* Restores the MDL chain of the descriptor and returns the list of
+   merged segments (linked through CoalescedNext) */
+pRxNetDescriptor ParaNdis_SwRscDetachSegments(
+    pRxNetDescriptor pHead);
+#endif
+
 BOOLEAN ParaNdis_SynchronizeWithInterrupt(
     PARANDIS_ADAPTER *pContext,
     ULONG messageId,
@@ -809,6 +1002,16 @@ tTcpIpPacketParsingResult ParaNdis_CheckSumVerify(
                                                 BOOLEAN verifyLength,
                                                 LPCSTR caller);
 
+/* Verifies the checksums of a received packet already analyzed by
+   ParaNdis_AnalyzeReceivedPacket, the headers are not parsed again */
+tTcpIpPacketParsingResult ParaNdis_CheckSumVerifyParsed(
+                                                tCompletePhysicalAddress *pDataPages,
+                                                ULONG ulDataOffset,
+                                                PNET_PACKET_INFO packetInfo,
+                                                ULONG flags,
+                                                BOOLEAN verifyLength,
+                                                LPCSTR caller);
+
 static __inline
 tTcpIpPacketParsingResult ParaNdis_CheckSumVerifyFlat(
                                                 PVOID pBuffer,
@@ -825,13 +1028,22 @@ tTcpIpPacketParsingResult ParaNdis_CheckSumVerifyFlat(
 
 USHORT CheckSumCalculator(PVOID buffer, ULONG len);
 
+/* Copies the buffer and returns its raw (not folded) one's complement sum.
+   Destination may be NULL to only calculate. Raw sums of consecutive chunks
+   may be added as long as all the chunks but the last are of even length */
+UINT64 ParaNdis_CopyWithCheckSum(PVOID Destination, PVOID Source, ULONG Length);
+USHORT ParaNdis_CheckSumFinalize(UINT64 RawSum);
+
 tTcpIpPacketParsingResult ParaNdis_ReviewIPPacket(PVOID buffer, ULONG size, BOOLEAN verityLength, LPCSTR caller);
 
 BOOLEAN ParaNdis_AnalyzeReceivedPacket(PVOID headersBuffer, ULONG dataLength, PNET_PACKET_INFO packetInfo);
 ULONG ParaNdis_StripVlanHeaderMoveHead(PNET_PACKET_INFO packetInfo);
 VOID ParaNdis_PadPacketToMinimalLength(PNET_PACKET_INFO packetInfo);
+
+#if !defined(OFFLOAD_UNIT_TEST)
 BOOLEAN ParaNdis_IsSendPossible(PARANDIS_ADAPTER *pContext);
 NDIS_STATUS ParaNdis_ExactSendFailureStatus(PARANDIS_ADAPTER *pContext);
 
 void ParaNdis_PrintIndirectionTable(const NDIS_RECEIVE_SCALE_PARAMETERS* Params);
 #endif
+#endif
@@ -27,21 +27,13 @@
  * SUCH DAMAGE.
  */
 #include "ndis56common.h"
+#if !defined(OFFLOAD_UNIT_TEST)
 #include "kdebugprint.h"
 #include "Trace.h"
 #ifdef NETKVM_WPP_ENABLED
 #include "sw-offload.tmh"
 #endif
-
-// till IP header size is 8 bit
-#define MAX_SUPPORTED_IPV6_HEADERS  (256 - 4)
-
-// IPv6 Header RFC 2460 (n*8 bytes)
-typedef struct _tagIPv6ExtHeader {
-    UCHAR       ip6ext_next_header;     // next header type
-    UCHAR       ip6ext_hdr_len;         // length of this header in 8 bytes unit, not including first 8 bytes
-    USHORT      options;                // 
-} IPv6ExtHeader;
+#endif
 
 // IP Pseudo Header RFC 768
 typedef struct _tagIPv4PseudoHeader {
@@ -63,92 +55,135 @@ typedef struct _tagIPv6PseudoHeader {
     UCHAR        ipph_protocol;             // TCP/UDP
 }tIPv6PseudoHeader;
 
-// IP v6 extension header option
-typedef struct _tagIP6_EXT_HDR_OPTION
+/*
+ * The raw sum is accumulated as 32-bit words in a 64-bit accumulator,
+ * the carries are folded back only once in RawCheckSumFinalize.
+ * Result does not depend on the path used to calculate it, so any
+ * partial sums (of even-sized chunks) may be added together.
+ * SSE2 is architectural on x64 and XMM registers may be used at any
+ * IRQL there, on x86 it would require saving the FP state, so the
+ * vector path is x64-only.
+ */
+#if defined(_M_AMD64) || defined(_M_X64)
+#define PARANDIS_CHECKSUM_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef PARANDIS_CHECKSUM_SSE2
+static __inline UINT64 RawCheckSumReduce(__m128i acc)
 {
-    UCHAR Type;
-    UCHAR Length;
-} IP6_EXT_HDR_OPTION, *PIP6_EXT_HDR_OPTION;
+    return (UINT64)_mm_cvtsi128_si64(acc) +
+           (UINT64)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+}
 
-#define IP6_EXT_HDR_OPTION_PAD1         (0)
-#define IP6_EXT_HDR_OPTION_HOME_ADDR    (201)
+// processes whole 32-byte blocks, returns the number of bytes consumed
+static __inline ULONG RawCheckSumBlocks(PUCHAR src, PUCHAR dst, ULONG len, UINT64 *sum)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    ULONG done = len & ~31UL;
 
-// IP v6 routing header
-typedef struct _tagIP6_TYPE2_ROUTING_HEADER
+    for (ULONG i = 0; i < done; i += 32)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        if (dst)
+        {
+            _mm_storeu_si128((__m128i *)(dst + i), v0);
+            _mm_storeu_si128((__m128i *)(dst + i + 16), v1);
+        }
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v0, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v0, zero));
+        acc2 = _mm_add_epi64(acc2, _mm_unpacklo_epi32(v1, zero));
+        acc3 = _mm_add_epi64(acc3, _mm_unpackhi_epi32(v1, zero));
+    }
+    acc0 = _mm_add_epi64(_mm_add_epi64(acc0, acc1), _mm_add_epi64(acc2, acc3));
+    *sum += RawCheckSumReduce(acc0);
+    return done;
+}
+#else
+static __inline ULONG RawCheckSumBlocks(PUCHAR src, PUCHAR dst, ULONG len, UINT64 *sum)
 {
-    UCHAR           NextHdr;
-    UCHAR           HdrLen;
-    UCHAR           RoutingType;
-    UCHAR           SegmentsLeft;
-    ULONG           Reserved;
-    IPV6_ADDRESS    Address;
-} IP6_TYPE2_ROUTING_HEADER, *PIP6_TYPE2_ROUTING_HEADER;
-
-#define PROTOCOL_TCP                    6
-#define PROTOCOL_UDP                    17
-
-#define IP_HEADER_LENGTH(pHeader)       (((pHeader)->ip_verlen & 0x0F) << 2)
-#define IP_HEADER_VERSION(pHeader)      (((pHeader)->ip_verlen & 0xF0) >> 4)
-#define IP_HEADER_IS_FRAGMENT(pHeader)  (((pHeader)->ip_offset & ~0xC0) != 0)
-
-#define IP6_HEADER_VERSION(pHeader)     (((pHeader)->ip6_ver_tc & 0xF0) >> 4)
-
-#define ETH_GET_VLAN_HDR(ethHdr)        ((PVLAN_HEADER) RtlOffsetToPointer(ethHdr, ETH_HEADER_SIZE))
-#define VLAN_GET_USER_PRIORITY(vlanHdr) ( (((PUCHAR)(vlanHdr))[0] & 0xE0) >> 5 )
-#define VLAN_GET_VLAN_ID(vlanHdr)       ( ((USHORT) (((PUCHAR)(vlanHdr))[0] & 0x0F) << 8) | ( ((PUCHAR)(vlanHdr))[1] ) )
-
-#define ETH_PROTO_IP4 (0x0800)
-#define ETH_PROTO_IP6 (0x86DD)
-
-#define IP6_HDR_HOP_BY_HOP        (0)
-#define IP6_HDR_ROUTING           (43)
-#define IP6_HDR_FRAGMENT          (44)
-#define IP6_HDR_ESP               (50)
-#define IP6_HDR_AUTHENTICATION    (51)
-#define IP6_HDR_NONE              (59)
-#define IP6_HDR_DESTINATION       (60)
-#define IP6_HDR_MOBILITY          (135)
-
-#define IP6_EXT_HDR_GRANULARITY   (8)
-
-static UINT_PTR RawCheckSumCalculator(PVOID buffer, ULONG len)
+    UINT64 s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    ULONG done = len & ~15UL;
+
+    for (ULONG i = 0; i < done; i += 16)
+    {
+        UINT32 w0 = *(UNALIGNED UINT32 *)(src + i);
+        UINT32 w1 = *(UNALIGNED UINT32 *)(src + i + 4);
+        UINT32 w2 = *(UNALIGNED UINT32 *)(src + i + 8);
+        UINT32 w3 = *(UNALIGNED UINT32 *)(src + i + 12);
+        if (dst)
+        {
+            *(UNALIGNED UINT32 *)(dst + i) = w0;
+            *(UNALIGNED UINT32 *)(dst + i + 4) = w1;
+            *(UNALIGNED UINT32 *)(dst + i + 8) = w2;
+            *(UNALIGNED UINT32 *)(dst + i + 12) = w3;
+        }
+        s0 += w0;
+        s1 += w1;
+        s2 += w2;
+        s3 += w3;
+    }
+    *sum += s0 + s1 + s2 + s3;
+    return done;
+}
+#endif
+
+static UINT64 RawCheckSumCopy(PVOID buffer, PVOID destination, ULONG len)
 {
-    UINT_PTR val = 0;
+    UINT64 val = 0;
     PUCHAR ptr = (PUCHAR)buffer;
-#ifdef _WIN64
-    ULONG count = len >> 2;
-    while (count--) {
-        val += *(PUINT32)ptr;
+    PUCHAR dst = (PUCHAR)destination;
+    ULONG done = RawCheckSumBlocks(ptr, dst, len, &val);
+
+    ptr += done;
+    if (dst)
+    {
+        dst += done;
+    }
+    len -= done;
+
+    while (len >= 4) {
+        UINT32 w = *(UNALIGNED UINT32 *)ptr;
+        if (dst) {
+            *(UNALIGNED UINT32 *)dst = w;
+            dst += 4;
+        }
+        val += w;
         ptr += 4;
+        len -= 4;
     }
     if (len & 2) {
-        val += *(PUINT16)ptr;
-        ptr += 2;
-    }
-#else
-    ULONG count = len >> 1;
-    while (count--) {
-        val += *(PUINT16)ptr;
+        USHORT w = *(UNALIGNED USHORT *)ptr;
+        if (dst) {
+            *(UNALIGNED USHORT *)dst = w;
+            dst += 2;
+        }
+        val += w;
         ptr += 2;
     }
-#endif
     if (len & 1) {
+        if (dst) {
+            *dst = *ptr;
+        }
         val += *ptr;
     }
     return val;
 }
 
-static __inline USHORT RawCheckSumFinalize(UINT_PTR sum)
+static __inline UINT64 RawCheckSumCalculator(PVOID buffer, ULONG len)
+{
+    return RawCheckSumCopy(buffer, NULL, len);
+}
+
+static __inline USHORT RawCheckSumFinalize(UINT64 sum)
 {
     UINT32 sum32;
     UINT16 sum16;
 
-#ifdef _WIN64
-    sum32 = (((sum >> 32) | (sum << 32)) + sum) >> 32;
-#else
-    sum32 = sum;
-#endif
-    sum16 = (((sum32 >> 16) | (sum32 << 16)) + sum32) >> 16;
+    sum32 = (UINT32)((((sum >> 32) | (sum << 32)) + sum) >> 32);
+    sum16 = (UINT16)((((sum32 >> 16) | (sum32 << 16)) + sum32) >> 16);
     return ~sum16;
 }
 
@@ -161,7 +196,7 @@ static __inline USHORT CheckSumCalculator(tCompletePhysicalAddress *pDataPages,
 {
     tCompletePhysicalAddress *pCurrentPage = &pDataPages[0];
     ULONG ulCurrPageOffset = 0;
-    UINT_PTR uRawCSum = 0;
+    UINT64 uRawCSum = 0;
 
     while(ulStartOffset > 0)
     {
@@ -475,6 +510,16 @@ USHORT CheckSumCalculator(PVOID buffer, ULONG len)
         return CheckSumCalculatorFlat(buffer, len);
 }
 
+UINT64 ParaNdis_CopyWithCheckSum(PVOID Destination, PVOID Source, ULONG Length)
+{
+    return RawCheckSumCopy(Source, Destination, Length);
+}
+
+USHORT ParaNdis_CheckSumFinalize(UINT64 RawSum)
+{
+    return RawCheckSumFinalize(RawSum);
+}
+
 static __inline BOOLEAN
 CompareNetCheckSumOnEndSystem(USHORT computedChecksum, USHORT arrivedChecksum)
 {
@@ -706,17 +751,16 @@ static __inline VOID PrintOutParsingResult(
         res.fixedXxpCS ? "(fixed)" : "");
 }
 
-tTcpIpPacketParsingResult ParaNdis_CheckSumVerify(
+static tTcpIpPacketParsingResult VerifyQualifiedPacket(
                                                 tCompletePhysicalAddress *pDataPages,
                                                 ULONG ulDataLength,
                                                 ULONG ulStartOffset,
+                                                tTcpIpPacketParsingResult res,
                                                 ULONG flags,
-                                                BOOLEAN verifyLength,
                                                 LPCSTR caller)
 {
     IPHeader *pIpHeader = (IPHeader *) RtlOffsetToPointer(pDataPages[0].Virtual, ulStartOffset);
 
-    tTcpIpPacketParsingResult res = QualifyIpPacket(pIpHeader, ulDataLength, verifyLength);
     if (res.ipStatus == ppresNotIP || res.ipCheckSum == ppresIPTooShort)
         return res;
 
@@ -766,291 +810,98 @@ tTcpIpPacketParsingResult ParaNdis_CheckSumVerify(
     return res;
 }
 
-tTcpIpPacketParsingResult ParaNdis_ReviewIPPacket(PVOID buffer, ULONG size, BOOLEAN verifyLength, LPCSTR caller)
+tTcpIpPacketParsingResult ParaNdis_CheckSumVerify(
+                                                tCompletePhysicalAddress *pDataPages,
+                                                ULONG ulDataLength,
+                                                ULONG ulStartOffset,
+                                                ULONG flags,
+                                                BOOLEAN verifyLength,
+                                                LPCSTR caller)
 {
-    tTcpIpPacketParsingResult res = QualifyIpPacket((IPHeader *) buffer, size, verifyLength);
-    PrintOutParsingResult(res, 1, caller);
-    return res;
-}
+    IPHeader *pIpHeader = (IPHeader *) RtlOffsetToPointer(pDataPages[0].Virtual, ulStartOffset);
 
-static __inline
-VOID AnalyzeL3Proto(
-    USHORT L3Proto,
-    PNET_PACKET_INFO packetInfo)
-{
-    packetInfo->isIP4 = (L3Proto == RtlUshortByteSwap(ETH_PROTO_IP4));
-    packetInfo->isIP6 = (L3Proto == RtlUshortByteSwap(ETH_PROTO_IP6));
+    tTcpIpPacketParsingResult res = QualifyIpPacket(pIpHeader, ulDataLength, verifyLength);
+    return VerifyQualifiedPacket(pDataPages, ulDataLength, ulStartOffset, res, flags, caller);
 }
 
-static
-BOOLEAN AnalyzeL2Hdr(PNET_PACKET_INFO packetInfo)
+/* The same result QualifyIpPacket produces, taken from the packet
+   information recorded by ParaNdis_ParsePacketHeaders */
+static tTcpIpPacketParsingResult QualifyParsedPacket(PNET_PACKET_INFO packetInfo, BOOLEAN verifyLength)
 {
-    PETH_HEADER dataBuffer = (PETH_HEADER) packetInfo->headersBuffer;
-
-    if (packetInfo->dataLength < ETH_HEADER_SIZE)
-        return FALSE;
-
-    packetInfo->ethDestAddr = dataBuffer->DstAddr;
+    tTcpIpPacketParsingResult res;
+    res.value = 0;
 
-    if (ETH_IS_BROADCAST(dataBuffer))
-    {
-        packetInfo->isBroadcast = TRUE;
-    }
-    else if (ETH_IS_MULTICAST(dataBuffer))
-    {
-        packetInfo->isMulticast = TRUE;
-    }
-    else
+    if (packetInfo->isIP4)
     {
-        packetInfo->isUnicast = TRUE;
+        res.ipStatus = ppresIPV4;
+        if (packetInfo->IPTotalLength <= packetInfo->L3HdrLen ||
+            (verifyLength && packetInfo->IPTotalLength > packetInfo->L2PayloadLen))
+        {
+            res.ipCheckSum = ppresIPTooShort;
+            return res;
+        }
     }
-
-    if(ETH_HAS_PRIO_HEADER(dataBuffer))
+    else if (packetInfo->isIP6)
     {
-        PVLAN_HEADER vlanHdr = ETH_GET_VLAN_HDR(dataBuffer);
-
-        if(packetInfo->dataLength < ETH_HEADER_SIZE + ETH_PRIORITY_HEADER_SIZE)
-            return FALSE;
-
-        packetInfo->hasVlanHeader     = TRUE;
-        packetInfo->Vlan.UserPriority = VLAN_GET_USER_PRIORITY(vlanHdr);
-        packetInfo->Vlan.VlanId       = VLAN_GET_VLAN_ID(vlanHdr);
-        packetInfo->L2HdrLen          = ETH_HEADER_SIZE + ETH_PRIORITY_HEADER_SIZE;
-        AnalyzeL3Proto(vlanHdr->EthType, packetInfo);
+        if (packetInfo->IPTotalLength < packetInfo->L3HdrLen ||
+            (verifyLength && packetInfo->IPTotalLength > packetInfo->L2PayloadLen))
+        {
+            res.ipStatus = ppresNotIP;
+            return res;
+        }
+        res.ipStatus = ppresIPV6;
+        res.ipCheckSum = ppresCSOK;
     }
     else
     {
-        packetInfo->L2HdrLen = ETH_HEADER_SIZE;
-        AnalyzeL3Proto(dataBuffer->EthType, packetInfo);
-    }
-
-    packetInfo->L2PayloadLen = packetInfo->dataLength - packetInfo->L2HdrLen;
-
-    return TRUE;
-}
-
-static __inline
-BOOLEAN SkipIP6ExtensionHeader(
-    IPv6Header *ip6Hdr,
-    ULONG dataLength,
-    PULONG ip6HdrLength,
-    PUCHAR nextHdr)
-{
-    IPv6ExtHeader* ip6ExtHdr;
-
-    if (*ip6HdrLength + sizeof(*ip6ExtHdr) > dataLength)
-        return FALSE;
-
-    ip6ExtHdr = (IPv6ExtHeader *)RtlOffsetToPointer(ip6Hdr, *ip6HdrLength);
-    *nextHdr = ip6ExtHdr->ip6ext_next_header;
-    *ip6HdrLength += (ip6ExtHdr->ip6ext_hdr_len + 1) * IP6_EXT_HDR_GRANULARITY;
-    return TRUE;
-}
-
-static
-BOOLEAN AnalyzeIP6RoutingExtension(
-    PIP6_TYPE2_ROUTING_HEADER routingHdr,
-    ULONG dataLength,
-    IPV6_ADDRESS **destAddr)
-{
-    if(dataLength < sizeof(*routingHdr))
-        return FALSE;
-    if(routingHdr->RoutingType == 2)
-    {
-        if((dataLength != sizeof(*routingHdr)) || (routingHdr->SegmentsLeft != 1))
-            return FALSE;
-
-        *destAddr = &routingHdr->Address;
+        res.ipStatus = ppresNotIP;
+        return res;
     }
-    else *destAddr = NULL;
 
-    return TRUE;
-}
+    res.ipHeaderSize = packetInfo->L3HdrLen;
+    res.IsFragment = packetInfo->isFragment;
 
-static
-BOOLEAN AnalyzeIP6DestinationExtension(
-    PVOID destHdr,
-    ULONG dataLength,
-    IPV6_ADDRESS **homeAddr)
-{
-    while(dataLength != 0)
+    // the parser does not look for TCP or UDP in fragments
+    if (packetInfo->isTCP || packetInfo->isUDP)
     {
-        PIP6_EXT_HDR_OPTION optHdr = (PIP6_EXT_HDR_OPTION) destHdr;
-        ULONG optionLen;
-
-        switch(optHdr->Type)
+        res.TcpUdp = packetInfo->isTCP ? ppresIsTCP : ppresIsUDP;
+        if (packetInfo->isL4HdrComplete)
         {
-        case IP6_EXT_HDR_OPTION_HOME_ADDR:
-            if(dataLength < sizeof(IP6_EXT_HDR_OPTION))
-                return FALSE;
-
-            optionLen = optHdr->Length + sizeof(IP6_EXT_HDR_OPTION);
-            if(optHdr->Length != sizeof(IPV6_ADDRESS))
-                return FALSE;
-
-            *homeAddr = (IPV6_ADDRESS*) RtlOffsetToPointer(optHdr, sizeof(IP6_EXT_HDR_OPTION));
-            break;
-
-        case IP6_EXT_HDR_OPTION_PAD1:
-            optionLen = RTL_SIZEOF_THROUGH_FIELD(IP6_EXT_HDR_OPTION, Type);
-            break;
-
-        default:
-            if(dataLength < sizeof(IP6_EXT_HDR_OPTION))
-                return FALSE;
-
-            optionLen = optHdr->Length + sizeof(IP6_EXT_HDR_OPTION);
-            break;
+            res.xxpStatus = ppresXxpKnown;
+            res.xxpFull = TRUE;
+            res.XxpIpHeaderSize = packetInfo->L3HdrLen + packetInfo->L4HdrLen;
         }
-
-        destHdr = RtlOffsetToPointer(destHdr, optionLen);
-        if(dataLength < optionLen)
-            return FALSE;
-
-        dataLength -= optionLen;
-    }
-
-    return TRUE;
-}
-
-static
-BOOLEAN AnalyzeIP6Hdr(
-    IPv6Header *ip6Hdr,
-    ULONG dataLength,
-    PULONG ip6HdrLength,
-    PUCHAR nextHdr,
-    PULONG homeAddrOffset,
-    PULONG destAddrOffset)
-{
-    *homeAddrOffset = 0;
-    *destAddrOffset = 0;
-
-    *ip6HdrLength = sizeof(*ip6Hdr);
-    if(dataLength < *ip6HdrLength)
-        return FALSE;
-
-    *nextHdr = ip6Hdr->ip6_next_header;
-    for(;;)
-    {
-        switch (*nextHdr)
+        else
         {
-        default:
-        case IP6_HDR_NONE:
-            __fallthrough;
-        case PROTOCOL_TCP:
-            __fallthrough;
-        case PROTOCOL_UDP:
-            __fallthrough;
-        case IP6_HDR_FRAGMENT:
-            return TRUE;
-        case IP6_HDR_DESTINATION:
-            {
-                IPV6_ADDRESS *homeAddr = NULL;
-                ULONG destHdrOffset = *ip6HdrLength;
-                if(!SkipIP6ExtensionHeader(ip6Hdr, dataLength, ip6HdrLength, nextHdr))
-                    return FALSE;
-
-                if(!AnalyzeIP6DestinationExtension(RtlOffsetToPointer(ip6Hdr, destHdrOffset),
-                    *ip6HdrLength - destHdrOffset, &homeAddr))
-                    return FALSE;
-
-                *homeAddrOffset = homeAddr ? RtlPointerToOffset(ip6Hdr, homeAddr) : 0;
-            }
-            break;
-        case IP6_HDR_ROUTING:
-            {
-                IPV6_ADDRESS *destAddr = NULL;
-                ULONG routingHdrOffset = *ip6HdrLength;
-
-                if(!SkipIP6ExtensionHeader(ip6Hdr, dataLength, ip6HdrLength, nextHdr))
-                    return FALSE;
-
-                if(!AnalyzeIP6RoutingExtension((PIP6_TYPE2_ROUTING_HEADER) RtlOffsetToPointer(ip6Hdr, routingHdrOffset),
-                    *ip6HdrLength - routingHdrOffset, &destAddr))
-                    return FALSE;
-
-                *destAddrOffset = destAddr ? RtlPointerToOffset(ip6Hdr, destAddr) : 0;
-            }
-            break;
-        case IP6_HDR_HOP_BY_HOP:
-            __fallthrough;
-        case IP6_HDR_ESP:
-            __fallthrough;
-        case IP6_HDR_AUTHENTICATION:
-            __fallthrough;
-        case IP6_HDR_MOBILITY:
-            if(!SkipIP6ExtensionHeader(ip6Hdr, dataLength, ip6HdrLength, nextHdr))
-                return FALSE;
-
-            break;
+            res.xxpStatus = ppresXxpIncomplete;
         }
     }
+    else
+    {
+        res.xxpStatus = ppresXxpOther;
+    }
+
+    return res;
 }
 
-static __inline
-VOID AnalyzeL4Proto(
-    UCHAR l4Protocol,
-    PNET_PACKET_INFO packetInfo)
+tTcpIpPacketParsingResult ParaNdis_CheckSumVerifyParsed(
+                                                tCompletePhysicalAddress *pDataPages,
+                                                ULONG ulDataOffset,
+                                                PNET_PACKET_INFO packetInfo,
+                                                ULONG flags,
+                                                BOOLEAN verifyLength,
+                                                LPCSTR caller)
 {
-    packetInfo->isTCP = (l4Protocol == PROTOCOL_TCP);
-    packetInfo->isUDP = (l4Protocol == PROTOCOL_UDP);
+    tTcpIpPacketParsingResult res = QualifyParsedPacket(packetInfo, verifyLength);
+    return VerifyQualifiedPacket(pDataPages, packetInfo->L2PayloadLen,
+                                 ulDataOffset + packetInfo->L2HdrLen, res, flags, caller);
 }
 
-static
-BOOLEAN AnalyzeL3Hdr(
-    PNET_PACKET_INFO packetInfo)
+tTcpIpPacketParsingResult ParaNdis_ReviewIPPacket(PVOID buffer, ULONG size, BOOLEAN verifyLength, LPCSTR caller)
 {
-    if(packetInfo->isIP4)
-    {
-        IPv4Header *ip4Hdr = (IPv4Header *) RtlOffsetToPointer(packetInfo->headersBuffer, packetInfo->L2HdrLen);
-
-        if(packetInfo->dataLength < packetInfo->L2HdrLen + sizeof(*ip4Hdr))
-            return FALSE;
-
-        packetInfo->L3HdrLen = IP_HEADER_LENGTH(ip4Hdr);
-        if ((packetInfo->L3HdrLen < sizeof(*ip4Hdr)) ||
-            (packetInfo->dataLength < packetInfo->L2HdrLen + packetInfo->L3HdrLen))
-            return FALSE;
-
-        if(IP_HEADER_VERSION(ip4Hdr) != 4)
-            return FALSE;
-
-        packetInfo->isFragment = IP_HEADER_IS_FRAGMENT(ip4Hdr);
-
-        if(!packetInfo->isFragment)
-        {
-            AnalyzeL4Proto(ip4Hdr->ip_protocol, packetInfo);
-        }
-    }
-    else if(packetInfo->isIP6)
-    {
-        ULONG homeAddrOffset, destAddrOffset;
-        UCHAR l4Proto;
-
-        IPv6Header *ip6Hdr = (IPv6Header *) RtlOffsetToPointer(packetInfo->headersBuffer, packetInfo->L2HdrLen);
-
-        if(IP6_HEADER_VERSION(ip6Hdr) != 6)
-            return FALSE;
-
-        if(!AnalyzeIP6Hdr(ip6Hdr, packetInfo->L2PayloadLen,
-            &packetInfo->L3HdrLen, &l4Proto, &homeAddrOffset, &destAddrOffset))
-            return FALSE;
-
-        if (packetInfo->L3HdrLen > MAX_SUPPORTED_IPV6_HEADERS)
-            return FALSE;
-
-        packetInfo->ip6HomeAddrOffset = (homeAddrOffset) ? packetInfo->L2HdrLen + homeAddrOffset : 0;
-        packetInfo->ip6DestAddrOffset = (destAddrOffset) ? packetInfo->L2HdrLen + destAddrOffset : 0;
-
-        packetInfo->isFragment = (l4Proto == IP6_HDR_FRAGMENT);
-
-        if(!packetInfo->isFragment)
-        {
-            AnalyzeL4Proto(l4Proto, packetInfo);
-        }
-    }
-
-    return TRUE;
+    tTcpIpPacketParsingResult res = QualifyIpPacket((IPHeader *) buffer, size, verifyLength);
+    PrintOutParsingResult(res, 1, caller);
+    return res;
 }
 
 BOOLEAN ParaNdis_AnalyzeReceivedPacket(
@@ -1058,18 +909,7 @@ BOOLEAN ParaNdis_AnalyzeReceivedPacket(
     ULONG dataLength,
     PNET_PACKET_INFO packetInfo)
 {
-    NdisZeroMemory(packetInfo, sizeof(*packetInfo));
-
-    packetInfo->headersBuffer = headersBuffer;
-    packetInfo->dataLength = dataLength;
-
-    if(!AnalyzeL2Hdr(packetInfo))
-        return FALSE;
-
-    if (!AnalyzeL3Hdr(packetInfo))
-        return FALSE;
-
-    return TRUE;
+    return ParaNdis_ParsePacketHeaders(headersBuffer, dataLength, packetInfo);
 }
 
 ULONG ParaNdis_StripVlanHeaderMoveHead(PNET_PACKET_INFO packetInfo)
@@ -1088,8 +928,11 @@ ULONG ParaNdis_StripVlanHeaderMoveHead(PNET_PACKET_INFO packetInfo)
     packetInfo->L2HdrLen = ETH_HEADER_SIZE;
 
     packetInfo->ethDestAddr = (PUCHAR) RtlOffsetToPointer(packetInfo->ethDestAddr, ETH_PRIORITY_HEADER_SIZE);
-    packetInfo->ip6DestAddrOffset -= ETH_PRIORITY_HEADER_SIZE;
-    packetInfo->ip6HomeAddrOffset -= ETH_PRIORITY_HEADER_SIZE;
+    // zero offsets mean there is no such address
+    if (packetInfo->ip6DestAddrOffset)
+        packetInfo->ip6DestAddrOffset -= ETH_PRIORITY_HEADER_SIZE;
+    if (packetInfo->ip6HomeAddrOffset)
+        packetInfo->ip6HomeAddrOffset -= ETH_PRIORITY_HEADER_SIZE;
 
     return ETH_PRIORITY_HEADER_SIZE;
 };
@@ -58,6 +58,7 @@
 #define VIRTIO_NET_F_CTRL_MAC_ADDR 23	/* Set MAC address */
 #define VIRTIO_NET_F_GUEST_RSC4 41	/* Guest can handle coalesced IPv4 tcp packets. */
 #define VIRTIO_NET_F_GUEST_RSC6 42	/* Guest can handle coalesced IPv6 tcp packets. */
+#define VIRTIO_NET_F_NOTF_COAL	53	/* Device supports notifications coalescing */
 
 #ifndef VIRTIO_NET_NO_LEGACY
 #define VIRTIO_NET_F_GSO	6	/* Host handles pkts w/ any GSO type */
@@ -252,6 +253,28 @@ struct virtio_net_ctrl_mq {
 #define VIRTIO_NET_CTRL_GUEST_OFFLOADS    5
  #define VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET        0
 
+/*
+ * Control notifications coalescing
+ *
+ * The device delays the used buffer notification of a queue until
+ * max_packets buffers are used or usecs microseconds have passed since
+ * the first of them, zero in both disables the coalescing.
+ * Available with the VIRTIO_NET_F_NOTF_COAL feature bit.
+ */
+struct virtio_net_ctrl_coal_tx {
+	__le32 tx_max_packets;
+	__le32 tx_usecs;
+};
+
+struct virtio_net_ctrl_coal_rx {
+	__le32 rx_max_packets;
+	__le32 rx_usecs;
+};
+
+#define VIRTIO_NET_CTRL_NOTF_COAL    6
+ #define VIRTIO_NET_CTRL_NOTF_COAL_TX_SET          0
+ #define VIRTIO_NET_CTRL_NOTF_COAL_RX_SET          1
+
 #include <poppack.h>
 
 #endif /* _LINUX_VIRTIO_NET_H */
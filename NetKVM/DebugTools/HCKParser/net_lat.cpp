@@ -0,0 +1,534 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <pcap.h>
+
+using namespace std;
+
+#include "ndis_shim.h"
+#include "ethernetutils.h"
+#include "ParaNdis-PacketParser.h"
+
+#define PROTOCOL_ICMP       1
+#define PROTOCOL_ICMPV6     58
+
+// reordering is looked for within that many last packets of a flow
+#define REORDER_WINDOW      256
+
+struct flow_key {
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint16_t sport;
+  uint16_t dport;
+  uint8_t proto;
+  bool ip6;
+
+  flow_key reverse() const
+  {
+    flow_key r = *this;
+    memcpy(r.src, dst, sizeof(r.src));
+    memcpy(r.dst, src, sizeof(r.dst));
+    r.sport = dport;
+    r.dport = sport;
+    return r;
+  }
+  bool operator<(const flow_key &o) const
+  {
+    return memcmp(this, &o, sizeof(*this)) < 0;
+  }
+  string str() const
+  {
+    char s[INET6_ADDRSTRLEN], d[INET6_ADDRSTRLEN];
+    ostringstream os;
+    inet_ntop(ip6 ? AF_INET6 : AF_INET, src, s, sizeof(s));
+    inet_ntop(ip6 ? AF_INET6 : AF_INET, dst, d, sizeof(d));
+    switch (proto) {
+    case PROTOCOL_TCP: os << "TCP "; break;
+    case PROTOCOL_UDP: os << "UDP "; break;
+    default: os << "proto " << (unsigned)proto << " ";
+    }
+    os << s;
+    if (sport || dport)
+      os << ":" << sport;
+    os << " -> " << d;
+    if (sport || dport)
+      os << ":" << dport;
+    return os.str();
+  }
+};
+
+struct packet {
+  double time;          // microseconds
+  flow_key flow;
+  uint32_t seq;         // TCP
+  uint32_t ack;
+  uint16_t tcp_flags;   // as in TCPHeader
+  uint32_t payload;     // L4 payload bytes
+  uint32_t ident;       // IPv4 ID, ICMP echo id and sequence
+  uint64_t digest;      // hash of the L4 payload start
+};
+
+struct capture {
+  string name;
+  vector<packet> packets;
+  unsigned long skipped;
+};
+
+struct reorder_state {
+  deque<uint32_t> window;       // start sequences of the last packets
+  uint32_t next;                // highest end sequence seen
+  bool started;
+  unsigned long packets;
+  unsigned long reordered;
+  unsigned long retransmitted;
+  unsigned long max_depth;
+};
+
+static inline bool seq_before(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+static uint64_t fnv1a(const UCHAR *p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static bool load(const char *name, capture &cap)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_t *p = pcap_open_offline(name, errbuf);
+  if (!p) {
+    cerr << name << ": " << errbuf << endl;
+    return false;
+  }
+  if (pcap_datalink(p) != DLT_EN10MB) {
+    cerr << name << ": not an Ethernet capture" << endl;
+    pcap_close(p);
+    return false;
+  }
+
+  cap.name = name;
+  cap.skipped = 0;
+
+  struct pcap_pkthdr *hdr;
+  const u_char *data;
+  while (pcap_next_ex(p, &hdr, &data) == 1) {
+    NET_PACKET_INFO info;
+    packet pkt = {};
+
+    if (!ParaNdis_ParsePacketHeaders((PVOID)data, hdr->caplen, &info) ||
+        !(info.isIP4 || info.isIP6) || info.isFragment) {
+      cap.skipped++;
+      continue;
+    }
+
+    const UCHAR *l3 = data + info.L2HdrLen;
+    const UCHAR *l4 = l3 + info.L3HdrLen;
+    ULONG ip_len = info.IPTotalLength;
+    // large send packets captured in the guest may carry no IP length
+    if (!ip_len)
+      ip_len = hdr->len - info.L2HdrLen;
+
+    pkt.time = hdr->ts.tv_sec * 1e6 + hdr->ts.tv_usec;
+    pkt.flow.ip6 = info.isIP6;
+    pkt.flow.proto = info.L4Protocol;
+    if (info.isIP4) {
+      memcpy(pkt.flow.src, l3 + FIELD_OFFSET(IPv4Header, ip_src), 4);
+      memcpy(pkt.flow.dst, l3 + FIELD_OFFSET(IPv4Header, ip_dest), 4);
+      pkt.ident = ntohs(*(const uint16_t *)(l3 + FIELD_OFFSET(IPv4Header, ip_id)));
+    } else {
+      memcpy(pkt.flow.src, l3 + FIELD_OFFSET(IPv6Header, ip6_src_address), 16);
+      memcpy(pkt.flow.dst, l3 + FIELD_OFFSET(IPv6Header, ip6_dst_address), 16);
+    }
+
+    if (info.isTCP || info.isUDP) {
+      if (!info.isL4HdrComplete) {
+        cap.skipped++;
+        continue;
+      }
+      pkt.flow.sport = (l4[0] << 8) | l4[1];
+      pkt.flow.dport = (l4[2] << 8) | l4[3];
+      pkt.payload = ip_len - info.L3HdrLen - info.L4HdrLen;
+      if (info.isTCP) {
+        const TCPHeader *tcp = (const TCPHeader *)l4;
+        pkt.seq = ntohl(tcp->tcp_seq);
+        pkt.ack = ntohl(tcp->tcp_ack);
+        pkt.tcp_flags = tcp->tcp_flags & TCP_FLAGS_MASK;
+      }
+    } else if ((info.L4Protocol == PROTOCOL_ICMP || info.L4Protocol == PROTOCOL_ICMPV6) &&
+               l4 + 8 <= data + hdr->caplen) {
+      // echo request/reply: type in the high byte, identifier and sequence
+      pkt.seq = l4[0];
+      pkt.ident = ntohl(*(const uint32_t *)(l4 + 4));
+      pkt.payload = ip_len - info.L3HdrLen;
+    }
+
+    const UCHAR *payload = l4 + info.L4HdrLen;
+    const UCHAR *end = data + hdr->caplen;
+    if (payload < end)
+      pkt.digest = fnv1a(payload, min<size_t>(end - payload, 64));
+
+    cap.packets.push_back(pkt);
+  }
+  pcap_close(p);
+  return true;
+}
+
+static double percentile(const vector<double> &sorted, double p)
+{
+  size_t i = (size_t)(p * sorted.size());
+  if (i >= sorted.size())
+    i = sorted.size() - 1;
+  return sorted[i];
+}
+
+static void print_distribution(const char *title, vector<double> &samples, const char *unit)
+{
+  cout << "  " << title << ": " << samples.size() << " samples";
+  if (samples.empty()) {
+    cout << endl;
+    return;
+  }
+  sort(samples.begin(), samples.end());
+  double sum = 0;
+  for (double s : samples)
+    sum += s;
+  cout << fixed << setprecision(1)
+       << ", mean " << sum / samples.size()
+       << " p50 " << percentile(samples, 0.5)
+       << " p99 " << percentile(samples, 0.99)
+       << " p999 " << percentile(samples, 0.999)
+       << " max " << samples.back() << " " << unit << endl;
+}
+
+// RFC 4737 style: the depth of a late packet is the number of packets
+// with a higher sequence that arrived before it
+static void reorder_update(reorder_state &st, const packet &pkt)
+{
+  uint32_t len = pkt.payload + !!(pkt.tcp_flags & (TCP_FLAG_SYN | TCP_FLAG_FIN));
+
+  if (!len)
+    return;
+  st.packets++;
+  if (!st.started) {
+    st.started = true;
+    st.next = pkt.seq + len;
+  } else if (seq_before(pkt.seq, st.next)) {
+    if (find(st.window.begin(), st.window.end(), pkt.seq) != st.window.end()) {
+      st.retransmitted++;
+    } else {
+      unsigned long depth = 0;
+      for (uint32_t s : st.window) {
+        if (seq_before(pkt.seq, s))
+          depth++;
+      }
+      if (depth) {
+        st.reordered++;
+        st.max_depth = max(st.max_depth, depth);
+      } else {
+        // older than the window, most probably sent again
+        st.retransmitted++;
+      }
+    }
+  } else {
+    st.next = pkt.seq + len;
+  }
+  st.window.push_back(pkt.seq);
+  if (st.window.size() > REORDER_WINDOW)
+    st.window.pop_front();
+}
+
+static void analyze_capture(capture &cap, double burst_gap, unsigned nflows)
+{
+  map<flow_key, reorder_state> flows;
+  vector<double> bursts, gaps;
+  unsigned long burst = 0;
+
+  for (size_t i = 0; i < cap.packets.size(); i++) {
+    const packet &pkt = cap.packets[i];
+    if (i) {
+      double gap = pkt.time - cap.packets[i - 1].time;
+      gaps.push_back(gap);
+      if (gap > burst_gap) {
+        bursts.push_back(burst);
+        burst = 0;
+      }
+    }
+    burst++;
+    if (pkt.flow.proto == PROTOCOL_TCP)
+      reorder_update(flows[pkt.flow], pkt);
+  }
+  if (burst)
+    bursts.push_back(burst);
+
+  unsigned long reordered = 0, retransmitted = 0, max_depth = 0, flows_reordered = 0;
+  vector<pair<flow_key, reorder_state> > worst;
+  for (auto &f : flows) {
+    reordered += f.second.reordered;
+    retransmitted += f.second.retransmitted;
+    max_depth = max(max_depth, f.second.max_depth);
+    if (f.second.reordered) {
+      flows_reordered++;
+      worst.push_back(f);
+    }
+  }
+
+  cout << cap.name << ": " << cap.packets.size() << " packets (" << cap.skipped
+       << " not IP or not parsed), " << flows.size() << " TCP flows" << endl;
+  cout << "  TCP reordered: " << reordered << " packets in " << flows_reordered
+       << " flows, max depth " << max_depth << ", retransmitted " << retransmitted << endl;
+  sort(worst.begin(), worst.end(), [](const pair<flow_key, reorder_state> &a, const pair<flow_key, reorder_state> &b) {
+    return a.second.reordered > b.second.reordered;
+  });
+  if (worst.size() > nflows)
+    worst.resize(nflows);
+  for (auto &w : worst) {
+    cout << "    " << setw(8) << w.second.reordered << " of " << setw(8) << w.second.packets
+         << " depth " << setw(3) << w.second.max_depth << "  " << w.first.str() << endl;
+  }
+  print_distribution("inter-arrival", gaps, "us");
+  cout << "  bursts (gap above " << burst_gap << " us):" << endl;
+  print_distribution("packets per burst", bursts, "packets");
+}
+
+// the guest and the host see the same packet with the same flow, TCP
+// sequence or IPv4 ID and payload start; RSC and LSO change the
+// segmentation, so TCP data is matched by the starting sequence only
+static string match_key(const packet &pkt)
+{
+  string key((const char *)&pkt.flow, sizeof(pkt.flow));
+  uint64_t id[2];
+
+  if (pkt.flow.proto == PROTOCOL_TCP) {
+    id[0] = pkt.seq;
+    id[1] = pkt.tcp_flags & (TCP_FLAG_SYN | TCP_FLAG_FIN);
+  } else {
+    id[0] = ((uint64_t)pkt.ident << 32) | pkt.seq;
+    id[1] = pkt.digest;
+  }
+  key.append((const char *)id, sizeof(id));
+  return key;
+}
+
+static bool is_guest(const flow_key &flow, const uint8_t *guest, bool guest_ip6)
+{
+  return flow.ip6 == guest_ip6 && !memcmp(flow.src, guest, guest_ip6 ? 16 : 4);
+}
+
+static void one_way(capture &a, capture &b, double offset, const uint8_t *guest, bool guest_ip6)
+{
+  map<string, deque<double> > sent;
+  vector<double> a_to_b, b_to_a, all;
+  unsigned long matched = 0, unmatched_b = 0;
+
+  for (const packet &pkt : a.packets) {
+    // pure ACKs repeat and carry no data to follow
+    if (pkt.flow.proto == PROTOCOL_TCP && !pkt.payload && !(pkt.tcp_flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)))
+      continue;
+    sent[match_key(pkt)].push_back(pkt.time);
+  }
+  for (const packet &pkt : b.packets) {
+    if (pkt.flow.proto == PROTOCOL_TCP && !pkt.payload && !(pkt.tcp_flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)))
+      continue;
+    auto it = sent.find(match_key(pkt));
+    if (it == sent.end() || it->second.empty()) {
+      unmatched_b++;
+      continue;
+    }
+    double delta = pkt.time - offset - it->second.front();
+    it->second.pop_front();
+    matched++;
+    if (guest) {
+      // packets of the guest go from the guest capture to the host one
+      if (is_guest(pkt.flow, guest, guest_ip6))
+        a_to_b.push_back(delta);
+      else
+        b_to_a.push_back(-delta);
+    } else {
+      all.push_back(delta);
+    }
+  }
+
+  unsigned long unmatched_a = 0;
+  for (auto &s : sent)
+    unmatched_a += s.second.size();
+
+  cout << "One-way latency, " << matched << " packets matched, " << unmatched_a
+       << " only in " << a.name << ", " << unmatched_b << " only in " << b.name << endl;
+  if (guest) {
+    print_distribution("guest TX (host time - guest time)", a_to_b, "us");
+    print_distribution("guest RX (guest time - host time)", b_to_a, "us");
+  } else {
+    print_distribution((b.name + " - " + a.name).c_str(), all, "us");
+  }
+}
+
+struct tcp_outstanding {
+  uint32_t start;
+  uint32_t end;
+  double time;
+  bool retransmitted;
+};
+
+// TCP data to the ACK covering it (Karn: not for retransmitted data),
+// ICMP echo to its reply and UDP datagram to the next one coming back
+static void round_trip(capture &cap)
+{
+  map<flow_key, deque<tcp_outstanding> > tcp;
+  map<flow_key, uint32_t> tcp_high;
+  map<string, double> echo;
+  map<flow_key, double> udp;
+  vector<double> tcp_rtt, echo_rtt, udp_rtt;
+
+  for (const packet &pkt : cap.packets) {
+    switch (pkt.flow.proto) {
+    case PROTOCOL_TCP: {
+      uint32_t len = pkt.payload + !!(pkt.tcp_flags & (TCP_FLAG_SYN | TCP_FLAG_FIN));
+      if (pkt.tcp_flags & TCP_FLAG_ACK) {
+        auto it = tcp.find(pkt.flow.reverse());
+        if (it != tcp.end()) {
+          deque<tcp_outstanding> &q = it->second;
+          bool acked = false;
+          tcp_outstanding last = {};
+          while (!q.empty() && !seq_before(pkt.ack, q.front().end)) {
+            last = q.front();
+            acked = true;
+            q.pop_front();
+          }
+          // a delayed ACK covers several segments, the last one is the fair sample
+          if (acked && !last.retransmitted)
+            tcp_rtt.push_back(pkt.time - last.time);
+        }
+      }
+      if (len) {
+        deque<tcp_outstanding> &q = tcp[pkt.flow];
+        auto high = tcp_high.find(pkt.flow);
+        uint32_t end = pkt.seq + len;
+        if (high != tcp_high.end() && !seq_before(high->second, end)) {
+          for (auto &o : q) {
+            if (seq_before(pkt.seq, o.end) && seq_before(o.start, end))
+              o.retransmitted = true;
+          }
+        } else {
+          tcp_outstanding o = { pkt.seq, end, pkt.time, false };
+          q.push_back(o);
+          tcp_high[pkt.flow] = end;
+        }
+      }
+      break;
+    }
+    case PROTOCOL_UDP: {
+      auto it = udp.find(pkt.flow.reverse());
+      if (it != udp.end()) {
+        udp_rtt.push_back(pkt.time - it->second);
+        udp.erase(it);
+      } else if (!udp.count(pkt.flow)) {
+        udp[pkt.flow] = pkt.time;
+      }
+      break;
+    }
+    case PROTOCOL_ICMP:
+    case PROTOCOL_ICMPV6: {
+      bool request = pkt.seq == 8 || pkt.seq == 128;
+      bool reply = pkt.seq == 0 || pkt.seq == 129;
+      flow_key f = request ? pkt.flow : pkt.flow.reverse();
+      string key((const char *)&f, sizeof(f));
+      key.append((const char *)&pkt.ident, sizeof(pkt.ident));
+      if (request) {
+        echo[key] = pkt.time;
+      } else if (reply) {
+        auto it = echo.find(key);
+        if (it != echo.end()) {
+          echo_rtt.push_back(pkt.time - it->second);
+          echo.erase(it);
+        }
+      }
+      break;
+    }
+    }
+  }
+
+  cout << "Round trip in " << cap.name << endl;
+  print_distribution("TCP data to ACK", tcp_rtt, "us");
+  print_distribution("UDP request to response", udp_rtt, "us");
+  print_distribution("ICMP echo", echo_rtt, "us");
+}
+
+static void usage(const char *name)
+{
+  cerr << "Usage: " << name << " [-g guest_ip] [-o offset_us] [-b burst_gap_us] [-f flows] file.pcap [host.pcap]" << endl
+       << "  one file:  round trip latency, reordering and bursts of the capture" << endl
+       << "  two files: also one-way latency of the packets found in both" << endl
+       << "  -g  the guest address: splits one-way latency to guest TX and RX" << endl
+       << "  -o  clock offset of the second capture against the first one (0)" << endl
+       << "  -b  a larger gap between packets starts a new burst (20 us)" << endl
+       << "  -f  number of the most reordered flows to report (10)" << endl;
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  double offset = 0, burst_gap = 20;
+  unsigned nflows = 10;
+  uint8_t guest[16];
+  bool guest_set = false, guest_ip6 = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "g:o:b:f:")) != -1) {
+    switch (opt) {
+    case 'g':
+      if (inet_pton(AF_INET, optarg, guest) == 1) {
+        guest_ip6 = false;
+      } else if (inet_pton(AF_INET6, optarg, guest) == 1) {
+        guest_ip6 = true;
+      } else {
+        cerr << "Bad address " << optarg << endl;
+        return 1;
+      }
+      guest_set = true;
+      break;
+    case 'o':
+      offset = strtod(optarg, NULL);
+      break;
+    case 'b':
+      burst_gap = strtod(optarg, NULL);
+      break;
+    case 'f':
+      nflows = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1 && argc - optind != 2)
+    usage(argv[0]);
+
+  vector<capture> caps(argc - optind);
+  for (size_t i = 0; i < caps.size(); i++) {
+    if (!load(argv[optind + i], caps[i]))
+      return 1;
+    analyze_capture(caps[i], burst_gap, nflows);
+  }
+  for (auto &cap : caps)
+    round_trip(cap);
+  if (caps.size() == 2)
+    one_way(caps[0], caps[1], offset, guest_set ? guest : NULL, guest_ip6);
+
+  return 0;
+}
@@ -0,0 +1,291 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sched.h>
+#include <inttypes.h>
+
+using namespace std;
+
+/* stand-ins for the WDK pieces used by ParaNdis_LockFreeQueue.h */
+typedef int32_t LONG, INT;
+typedef uint32_t ULONG;
+typedef uint8_t UCHAR, BOOLEAN;
+typedef void *PVOID;
+typedef struct _tagPARANDIS_ADAPTER *PPARANDIS_ADAPTER;
+#define TRUE 1
+#define FALSE 0
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define KeMemoryBarrier() __sync_synchronize()
+#define InterlockedCompareExchange(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#define NdisFreeMemory(p, l, f) free(p)
+
+static PVOID ParaNdis_AllocateMemory(PPARANDIS_ADAPTER, ULONG size)
+{
+  return malloc(size);
+}
+
+#include "ParaNdis_LockFreeQueue.h"
+
+/* The queue the driver used before: the FreeBSD buf_ring, where a producer
+   publishes only after all the producers that claimed earlier slots did */
+template <typename TEntryType>
+class CBufRingQueue
+{
+public:
+  ~CBufRingQueue() { free(m_Ring); }
+
+  BOOLEAN Create(PPARANDIS_ADAPTER, INT size)
+  {
+    m_Mask = size - 1;
+    m_Ring = (TEntryType **)malloc(sizeof(TEntryType *) * size);
+    return m_Ring != nullptr;
+  }
+
+  BOOLEAN Enqueue(TEntryType *entry)
+  {
+    LONG producer_head, producer_next, consumer_tail;
+    do {
+      producer_head = m_ProducerHead;
+      producer_next = (producer_head + 1) & m_Mask;
+      consumer_tail = m_ConsumerTail;
+      if (producer_next == consumer_tail)
+        return FALSE;
+    } while (InterlockedCompareExchange(&m_ProducerHead, producer_next, producer_head) != producer_head);
+
+    m_Ring[producer_head] = entry;
+    KeMemoryBarrier();
+    while (m_ProducerTail != producer_head)
+    {}
+    m_ProducerTail = producer_next;
+    return TRUE;
+  }
+
+  TEntryType *Dequeue()
+  {
+    LONG consumer_head = m_ConsumerHead;
+    if (consumer_head == m_ProducerTail)
+      return nullptr;
+    m_ConsumerHead = (consumer_head + 1) & m_Mask;
+    TEntryType *entry = m_Ring[consumer_head];
+    m_ConsumerTail = m_ConsumerHead;
+    return entry;
+  }
+
+private:
+  volatile LONG m_ProducerHead = 0;
+  volatile LONG m_ProducerTail = 0;
+  volatile LONG m_ConsumerHead = 0;
+  volatile LONG m_ConsumerTail = 0;
+  INT m_Mask = 0;
+  TEntryType **m_Ring = nullptr;
+};
+
+struct item {
+  uint64_t enqueued;
+  unsigned producer;
+  unsigned long seq;
+};
+
+struct result {
+  double seconds;
+  unsigned long items;
+  bool stopped;
+  unsigned long full;
+  // entries lost, duplicated or out of the order of their producer
+  unsigned long errors;
+  vector<uint64_t> enqueue_ns;
+  vector<uint64_t> handoff_ns;
+};
+
+static inline uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+template <typename TQueue>
+static bool run(unsigned producers, unsigned long per_producer, int size, unsigned limit, result &r)
+{
+  TQueue queue;
+  if (!queue.Create(nullptr, size))
+    return false;
+
+  unsigned long total = producers * per_producer;
+  vector<item> items(total);
+  vector<vector<uint64_t>> enqueue_ns(producers);
+  vector<unsigned long> full(producers);
+  atomic<bool> go(false), stop(false);
+  atomic<unsigned> producers_done(0);
+  atomic<unsigned long> produced(0);
+  vector<thread> threads;
+
+  r.handoff_ns.resize(total);
+  r.errors = 0;
+
+  thread consumer([&]() {
+    vector<unsigned long> next(producers);
+    unsigned long idle = 0;
+    while (!go)
+      cpu_relax();
+    for (unsigned long n = 0;;) {
+      item *i = queue.Dequeue();
+      if (!i) {
+        if (producers_done == producers && n == produced) {
+          r.items = n;
+          break;
+        }
+        // do not keep the producers off the CPU when there are more threads than CPUs
+        if (++idle % 64)
+          cpu_relax();
+        else
+          sched_yield();
+        continue;
+      }
+      r.handoff_ns[n++] = now_ns() - i->enqueued;
+      if (i->seq != next[i->producer])
+        r.errors++;
+      next[i->producer] = i->seq + 1;
+    }
+  });
+
+  for (unsigned p = 0; p < producers; p++) {
+    threads.emplace_back([&, p]() {
+      vector<uint64_t> &samples = enqueue_ns[p];
+      samples.reserve(per_producer);
+      while (!go)
+        cpu_relax();
+      for (unsigned long n = 0; n < per_producer && !stop; n++) {
+        item *i = &items[p * per_producer + n];
+        i->producer = p;
+        i->seq = n;
+        uint64_t start = now_ns();
+        i->enqueued = start;
+        // the driver moves the NBL to the overflow list, here we let
+        // the consumer run and retry
+        while (!queue.Enqueue(i)) {
+          full[p]++;
+          sched_yield();
+        }
+        samples.push_back(now_ns() - start);
+        produced++;
+      }
+      producers_done++;
+    });
+  }
+
+  uint64_t start = now_ns();
+  go = true;
+  while (producers_done < producers && now_ns() - start < limit * 1000000000ull)
+    usleep(1000);
+  r.stopped = producers_done < producers;
+  stop = true;
+  for (auto &t : threads)
+    t.join();
+  consumer.join();
+  r.seconds = (now_ns() - start) / 1e9;
+  r.handoff_ns.resize(r.items);
+
+  r.full = 0;
+  r.enqueue_ns.clear();
+  for (unsigned p = 0; p < producers; p++) {
+    r.full += full[p];
+    r.enqueue_ns.insert(r.enqueue_ns.end(), enqueue_ns[p].begin(), enqueue_ns[p].end());
+  }
+  return true;
+}
+
+static uint64_t percentile(vector<uint64_t> &v, double pct)
+{
+  size_t k = min(v.size() - 1, (size_t)(v.size() * pct / 100));
+  nth_element(v.begin(), v.begin() + k, v.end());
+  return v[k];
+}
+
+static void report(const char *name, unsigned producers, result &r)
+{
+  cout << left << setw(10) << name << right << setw(5) << producers
+       << fixed << setprecision(2) << setw(9) << r.items / r.seconds / 1e6;
+  for (auto *v : { &r.enqueue_ns, &r.handoff_ns }) {
+    cout << setw(9) << percentile(*v, 50) << setw(10) << percentile(*v, 99)
+         << setw(11) << percentile(*v, 99.9) << setw(12) << *max_element(v->begin(), v->end());
+  }
+  cout << setw(10) << r.full << setw(8) << r.errors;
+  if (r.stopped)
+    cout << "  time limit, " << r.items << " items";
+  cout << endl;
+}
+
+static void usage(const char *name)
+{
+  cerr << "Usage: " << name << " [-n items per producer] [-s ring size] [-t seconds per run] [producers ...]" << endl;
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long per_producer = 50000;
+  int size = 2048;
+  unsigned limit = 30;
+  vector<unsigned> counts;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      per_producer = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      size = atoi(optarg);
+      break;
+    case 't':
+      limit = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  for (int i = optind; i < argc; i++)
+    counts.push_back(strtoul(argv[i], NULL, 0));
+  if (counts.empty())
+    counts = { 1, 2, 4, 8, 16, 32, 64 };
+  if (!per_producer || !limit || size < 2 || (size & (size - 1)) ||
+      find(counts.begin(), counts.end(), 0u) != counts.end())
+    usage(argv[0]);
+
+  cout << thread::hardware_concurrency() << " CPUs, ring of " << size << ", "
+       << per_producer << " items per producer, times in ns" << endl;
+  cout << left << setw(10) << "queue" << right << setw(5) << "prod" << setw(9) << "Mops/s"
+       << setw(9) << "enq p50" << setw(10) << "p99" << setw(11) << "p99.9" << setw(12) << "max"
+       << setw(9) << "hnd p50" << setw(10) << "p99" << setw(11) << "p99.9" << setw(12) << "max"
+       << setw(10) << "full" << setw(8) << "errors" << endl;
+
+  unsigned long errors = 0;
+  for (unsigned producers : counts) {
+    result r;
+    if (!run<CBufRingQueue<item>>(producers, per_producer, size, limit, r))
+      return 1;
+    report("buf_ring", producers, r);
+    errors += r.errors;
+    if (!run<CLockFreeQueue<item>>(producers, per_producer, size, limit, r))
+      return 1;
+    report("seq ring", producers, r);
+    errors += r.errors;
+  }
+
+  return errors ? 2 : 0;
+}
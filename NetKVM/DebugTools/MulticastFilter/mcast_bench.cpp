@@ -0,0 +1,105 @@
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <inttypes.h>
+
+using namespace std;
+
+typedef uint8_t UCHAR;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef uint64_t ULONGLONG;
+#define UNALIGNED
+
+#define PARANDIS_MULTICAST_LIST_SIZE 256
+#include "ParaNdis-MulticastFilter.h"
+
+static const ULONG group_counts[] = { 1, 8, 32, 64, 128, 256 };
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void make_group(UCHAR *addr, uint32_t id)
+{
+  addr[0] = 0x33;
+  addr[1] = 0x33;
+  addr[2] = 0xff;
+  addr[3] = (id >> 16) & 0xff;
+  addr[4] = (id >> 8) & 0xff;
+  addr[5] = id & 0xff;
+}
+
+static bool linear_lookup(const UCHAR *list, ULONG count, const UCHAR *addr)
+{
+  for (ULONG i = 0; i < count; i++) {
+    if (!memcmp(list + i * PARANDIS_MULTICAST_ADDR_LEN, addr, PARANDIS_MULTICAST_ADDR_LEN))
+      return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long lookups = 10000000;
+  unsigned member_percent = 10;
+
+  if (argc > 1)
+    lookups = strtoul(argv[1], NULL, 0);
+  if (argc > 2)
+    member_percent = strtoul(argv[2], NULL, 0);
+  if (!lookups || member_percent > 100) {
+    cerr << "Usage: mcast_bench [lookups [member percentage]]" << endl;
+    return -1;
+  }
+
+  srand(1);
+
+  cout << "groups  linear ns/lookup  hash ns/lookup  matches" << endl;
+
+  for (ULONG count : group_counts) {
+    vector<UCHAR> list(count * PARANDIS_MULTICAST_ADDR_LEN);
+    vector<UCHAR> probes(lookups * PARANDIS_MULTICAST_ADDR_LEN);
+    static tMulticastFilter filter;
+
+    for (ULONG i = 0; i < count; i++)
+      make_group(&list[i * PARANDIS_MULTICAST_ADDR_LEN], rand() & 0xffffff);
+
+    for (unsigned long i = 0; i < lookups; i++) {
+      UCHAR *addr = &probes[i * PARANDIS_MULTICAST_ADDR_LEN];
+      if ((unsigned)(rand() % 100) < member_percent)
+        memcpy(addr, &list[(rand() % count) * PARANDIS_MULTICAST_ADDR_LEN], PARANDIS_MULTICAST_ADDR_LEN);
+      else
+        make_group(addr, rand() & 0xffffff);
+    }
+
+    ParaNdis_MulticastFilterBuild(&filter, list.data(), count);
+
+    unsigned long linear_hits = 0, hash_hits = 0;
+
+    double start = now_ns();
+    for (unsigned long i = 0; i < lookups; i++)
+      linear_hits += linear_lookup(list.data(), count, &probes[i * PARANDIS_MULTICAST_ADDR_LEN]);
+    double linear = (now_ns() - start) / lookups;
+
+    start = now_ns();
+    for (unsigned long i = 0; i < lookups; i++)
+      hash_hits += ParaNdis_MulticastFilterLookup(&filter, &probes[i * PARANDIS_MULTICAST_ADDR_LEN]);
+    double hash = (now_ns() - start) / lookups;
+
+    if (linear_hits != hash_hits) {
+      cerr << "Mismatch for " << count << " groups: linear " << linear_hits
+           << ", hash " << hash_hits << endl;
+      return -1;
+    }
+
+    printf("%6u  %16.2f  %14.2f  %lu\n", count, linear, hash, hash_hits);
+  }
+
+  return 0;
+}
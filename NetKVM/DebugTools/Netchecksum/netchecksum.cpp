@@ -29,12 +29,67 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
+#if defined(_WIN32)
 #include "stdafx.h"
-extern "C" {
+#else
+#include <ctype.h>
+#define _tmain main
+typedef char _TCHAR;
+#endif
 #include "ndis56common.h"
+
+int virtioDebugLevel = 0;
+
+UCHAR buf[0x10000];
+UCHAR copyBuf[0x10000 + 16];
+
+static USHORT ReferenceCheckSum(const UCHAR *p, ULONG len)
+{
+    ULONG sum = 0;
+    ULONG i;
+    for (i = 0; i + 1 < len; i += 2)
+    {
+        sum += p[i] | (p[i + 1] << 8);
+    }
+    if (len & 1)
+    {
+        sum += p[len - 1];
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (USHORT)~sum;
 }
 
-BYTE buf[0x10000];
+// compares the optimized copy+checksum with plain 16-bit summation
+// for every prefix of the packet and every destination alignment
+static bool CheckSumEquivalence(ULONG size)
+{
+    for (ULONG len = 0; len <= size; ++len)
+    {
+        USHORT expected = ReferenceCheckSum(buf, len);
+        for (ULONG align = 0; align < 16; ++align)
+        {
+            memset(copyBuf, 0, sizeof(copyBuf));
+            USHORT res = ParaNdis_CheckSumFinalize(ParaNdis_CopyWithCheckSum(copyBuf + align, buf, len));
+            if (res != expected || memcmp(copyBuf + align, buf, len))
+            {
+                DPrintf(0, "Checksum equivalence FAILED: len %d, align %d, expected %04X, received %04X\n",
+                    len, align, expected, res);
+                return false;
+            }
+        }
+        if ((len & 1) == 0 && len &&
+            ParaNdis_CheckSumFinalize(ParaNdis_CopyWithCheckSum(NULL, buf, len / 2 & ~1UL) +
+                                      ParaNdis_CopyWithCheckSum(NULL, buf + (len / 2 & ~1UL), len - (len / 2 & ~1UL))) != expected)
+        {
+            DPrintf(0, "Checksum split FAILED: len %d\n", len);
+            return false;
+        }
+    }
+    return true;
+}
 
 
 bool ProcessFile(FILE *f, ULONG flags, ULONG result[4])
@@ -63,18 +118,18 @@ bool ProcessFile(FILE *f, ULONG flags, ULONG result[4])
     {
         ULONG expected;
         ULONG pass = 0;
-        bContinue = true;
+        bContinue = CheckSumEquivalence(offset);
 
         if (bContinue)
         {
             pass++;
             expected = result[pass - 1];
-            DPrintf(0, ("Pass %d buffer of %d started", pass, offset));
-            res = ParaNdis_ReviewIPPacket(buf + 14, offset - 14, __FUNCTION__);
-            DPrintf(0, ("Pass %d buffer of %d finished", pass, offset));
+            DPrintf(0, "Pass %d buffer of %d started\n", pass, offset);
+            res = ParaNdis_ReviewIPPacket(buf + 14, offset - 14, FALSE, __FUNCTION__);
+            DPrintf(0, "Pass %d buffer of %d finished\n", pass, offset);
             if (res.value != expected)
             {
-                DPrintf(0, ("%d pass FAILED: expected %08X, received %08X", pass, expected, res.value));
+                DPrintf(0, "%d pass FAILED: expected %08X, received %08X\n", pass, expected, res.value);
                 bContinue = false;
             }
         }
@@ -83,12 +138,12 @@ bool ProcessFile(FILE *f, ULONG flags, ULONG result[4])
         {
             pass++;
             expected = result[pass - 1];
-            DPrintf(0, ("Pass %d buffer of %d started", pass, offset));
-            res = ParaNdis_CheckSumVerify(buf + 14, offset - 14, pcrAnyChecksum, __FUNCTION__);
-            DPrintf(0, ("Pass %d buffer of %d finished", pass, offset));
+            DPrintf(0, "Pass %d buffer of %d started\n", pass, offset);
+            res = ParaNdis_CheckSumVerifyFlat(buf + 14, offset - 14, pcrAnyChecksum, FALSE, __FUNCTION__);
+            DPrintf(0, "Pass %d buffer of %d finished\n", pass, offset);
             if (res.value != expected)
             {
-                DPrintf(0, ("%d pass FAILED: expected %08X, received %08X", pass, expected, res.value));
+                DPrintf(0, "%d pass FAILED: expected %08X, received %08X\n", pass, expected, res.value);
                 bContinue = false;
             }
         }
@@ -97,12 +152,12 @@ bool ProcessFile(FILE *f, ULONG flags, ULONG result[4])
         {
             pass++;
             expected = result[pass - 1];
-            DPrintf(0, ("Pass %d buffer of %d started", pass, offset));
-            res = ParaNdis_CheckSumVerify(buf + 14, offset - 14, pcrAnyChecksum | flags, __FUNCTION__);
-            DPrintf(0, ("Pass %d buffer of %d finished", pass, offset));
+            DPrintf(0, "Pass %d buffer of %d started\n", pass, offset);
+            res = ParaNdis_CheckSumVerifyFlat(buf + 14, offset - 14, pcrAnyChecksum | flags, FALSE, __FUNCTION__);
+            DPrintf(0, "Pass %d buffer of %d finished\n", pass, offset);
             if (res.value != expected)
             {
-                DPrintf(0, ("%d pass FAILED: expected %08X, received %08X", pass, expected, res.value));
+                DPrintf(0, "%d pass FAILED: expected %08X, received %08X\n", pass, expected, res.value);
                 bContinue = false;
             }
         }
@@ -111,12 +166,12 @@ bool ProcessFile(FILE *f, ULONG flags, ULONG result[4])
         {
             pass++;
             expected = result[pass - 1];
-            DPrintf(0, ("Pass %d buffer of %d started", pass, offset));
-            res = ParaNdis_CheckSumVerify(buf + 14, offset - 14, pcrAnyChecksum, __FUNCTION__);
-            DPrintf(0, ("Pass %d buffer of %d finished", pass, offset));
+            DPrintf(0, "Pass %d buffer of %d started\n", pass, offset);
+            res = ParaNdis_CheckSumVerifyFlat(buf + 14, offset - 14, pcrAnyChecksum, FALSE, __FUNCTION__);
+            DPrintf(0, "Pass %d buffer of %d finished\n", pass, offset);
             if (res.value != expected)
             {
-                DPrintf(0, ("%d pass FAILED: expected %08X, received %08X", pass, expected, res.value));
+                DPrintf(0, "%d pass FAILED: expected %08X, received %08X\n", pass, expected, res.value);
                 bContinue = false;
             }
         }
@@ -161,19 +216,19 @@ int _tmain(int argc, _TCHAR* argv[])
         f = fopen(Jobs[i].file,"rt");
         if (f)
         {
-            DPrintf(0, ("Processing file %s started", Jobs[i].file));
+            DPrintf(0, "Processing file %s started\n", Jobs[i].file);
             bOK = ProcessFile(f, Jobs[i].flags, Jobs[i].result);
-            DPrintf(0, ("Processing file %s finished", Jobs[i].file));
-            DPrintf(0, ("===================================="));
+            DPrintf(0, "Processing file %s finished\n", Jobs[i].file);
+            DPrintf(0, "====================================\n");
             fclose(f);
         }
     }
 
-    DPrintf(0, ("Unit test %s", bOK ? "PASSED" : "FAILED"));
+    DPrintf(0, "Unit test %s\n", bOK ? "PASSED" : "FAILED");
     
     //getchar();
 
-    return 0;
+    return bOK ? 0 : 1;
 }
 
 
@@ -0,0 +1,66 @@
+#pragma once
+
+/* Stand-ins for the WDK types and helpers used by the driver code that
+   is built in user mode (ParaNdis-PacketParser.h, ParaNdis-RSSHash.h,
+   sw-offload.cpp and ParaNdis-SwRsc.cpp with OFFLOAD_UNIT_TEST) */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+typedef uint8_t UCHAR, UINT8, BOOLEAN, *PUCHAR;
+typedef char CHAR, CCHAR, *PCHAR;
+typedef const char *PCCHAR, *LPCSTR;
+typedef uint16_t USHORT, UINT16;
+typedef uint32_t ULONG, UINT32, UINT, *PULONG, *PUINT32;
+typedef uint64_t ULONGLONG, UINT64;
+typedef void VOID, *PVOID;
+/* the x64 driver build, e.g. the SSE2 checksum of sw-offload.cpp */
+#if defined(__x86_64__) && !defined(_M_X64)
+#define _M_X64 1
+#endif
+
+#define TRUE 1
+#define FALSE 0
+#define UNALIGNED
+#define __fallthrough
+
+#define RtlOffsetToPointer(B, O)            ((PCHAR)(((PCHAR)(B)) + ((uintptr_t)(O))))
+#define RtlPointerToOffset(B, P)            ((ULONG)(((PCHAR)(P)) - ((PCHAR)(B))))
+#define RtlUshortByteSwap(x)                __builtin_bswap16(x)
+#define RtlUlongByteSwap(x)                 __builtin_bswap32(x)
+#define FIELD_OFFSET(t, f)                  offsetof(t, f)
+#define RTL_FIELD_SIZE(t, f)                (sizeof(((t *)0)->f))
+#define RTL_SIZEOF_THROUGH_FIELD(t, f)      (offsetof(t, f) + sizeof(((t *)0)->f))
+#define NdisZeroMemory(p, l)                memset((p), 0, (l))
+#define RtlZeroMemory(p, l)                 memset((p), 0, (l))
+#define RtlEqualMemory(d, s, l)             (!memcmp((d), (s), (l)))
+#define RtlMoveMemory(d, s, l)              memmove((d), (s), (l))
+#define MAXUSHORT                           0xffff
+#ifndef min
+#define min(a, b)                           (((a) < (b)) ? (a) : (b))
+#define max(a, b)                           (((a) > (b)) ? (a) : (b))
+#endif
+#define ETH_IS_BROADCAST(a) \
+    (((PUCHAR)(a))[0] == 0xff && ((PUCHAR)(a))[1] == 0xff && ((PUCHAR)(a))[2] == 0xff && \
+     ((PUCHAR)(a))[3] == 0xff && ((PUCHAR)(a))[4] == 0xff && ((PUCHAR)(a))[5] == 0xff)
+#define ETH_IS_MULTICAST(a)                 (((PUCHAR)(a))[0] & 0x01)
+
+/* ntddndis.h of the WDK the driver is built with, before NDIS 6.80:
+   no UDP hash types and capabilities (ParaNdis-RSSHash.h defines them) */
+#define NdisHashFunctionToeplitz            0x00000001
+#define NDIS_HASH_IPV4                      0x00000100
+#define NDIS_HASH_TCP_IPV4                  0x00000200
+#define NDIS_HASH_IPV6                      0x00000400
+#define NDIS_HASH_IPV6_EX                   0x00000800
+#define NDIS_HASH_TCP_IPV6                  0x00001000
+#define NDIS_HASH_TCP_IPV6_EX               0x00002000
+#define NDIS_HASH_TYPE_MASK                 0x00003f00
+#define NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(h) ((h) & NDIS_HASH_TYPE_MASK)
+#define NdisHashFunctionMask                0x000000ff
+#define NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV4    0x00000100
+#define NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6    0x00000200
+#define NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6_EX 0x00000400
+
+#define PARANDIS_SUPPORT_RSS 1
+#define PARANDIS_SUPPORT_RSC 1
@@ -0,0 +1,151 @@
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pcap.h>
+
+using namespace std;
+
+#include "ndis_shim.h"
+#include "ethernetutils.h"
+#include "ParaNdis-PacketParser.h"
+
+struct frame {
+  size_t offset;
+  ULONG len;
+};
+
+enum {
+  cntFailed, cntVlan, cntIPv4, cntIPv6, cntIPv6Ext, cntTCP, cntUDP,
+  cntFragment, cntL4Incomplete, cntIPTruncated, cntOther, cntMax
+};
+
+static const char *counter_names[cntMax] = {
+  "failed", "VLAN", "IPv4", "IPv6", "IPv6 ext.headers", "TCP", "UDP",
+  "fragments", "TCP/UDP incomplete", "IP truncated", "non-IP"
+};
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool load(const char *name, vector<UCHAR> &data, vector<frame> &frames)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_t *p = pcap_open_offline(name, errbuf);
+  if (!p) {
+    cerr << name << ": " << errbuf << endl;
+    return false;
+  }
+  if (pcap_datalink(p) != DLT_EN10MB) {
+    cerr << name << ": not an Ethernet capture" << endl;
+    pcap_close(p);
+    return false;
+  }
+
+  struct pcap_pkthdr *hdr;
+  const u_char *pkt;
+  while (pcap_next_ex(p, &hdr, &pkt) == 1) {
+    frame f = { data.size(), hdr->caplen };
+    data.insert(data.end(), pkt, pkt + hdr->caplen);
+    // keep the frames apart as they are in separate RX buffers
+    data.resize((data.size() + 63) & ~(size_t)63);
+    frames.push_back(f);
+  }
+  pcap_close(p);
+  return true;
+}
+
+static void classify(const NET_PACKET_INFO &info, bool ok, unsigned long *counters)
+{
+  if (!ok) {
+    counters[cntFailed]++;
+    return;
+  }
+  if (info.hasVlanHeader)
+    counters[cntVlan]++;
+  if (info.isIP4)
+    counters[cntIPv4]++;
+  else if (info.isIP6)
+    counters[cntIPv6]++;
+  else
+    counters[cntOther]++;
+  if (info.hasIP6ExtHeaders)
+    counters[cntIPv6Ext]++;
+  if (info.isTCP)
+    counters[cntTCP]++;
+  if (info.isUDP)
+    counters[cntUDP]++;
+  if (info.isFragment)
+    counters[cntFragment]++;
+  if ((info.isTCP || info.isUDP) && !info.isL4HdrComplete)
+    counters[cntL4Incomplete]++;
+  if ((info.isIP4 || info.isIP6) && info.isIPTruncated)
+    counters[cntIPTruncated]++;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long passes = 100;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt == 'n') {
+      passes = strtoul(optarg, NULL, 0);
+    } else {
+      cerr << "Usage: " << argv[0] << " [-n passes] file.pcap [file.pcap ...]" << endl;
+      return 1;
+    }
+  }
+  if (optind >= argc || !passes) {
+    cerr << "Usage: " << argv[0] << " [-n passes] file.pcap [file.pcap ...]" << endl;
+    return 1;
+  }
+
+  vector<UCHAR> data;
+  vector<frame> frames;
+  for (int i = optind; i < argc; i++) {
+    if (!load(argv[i], data, frames))
+      return 1;
+  }
+  if (frames.empty()) {
+    cerr << "No frames" << endl;
+    return 1;
+  }
+
+  unsigned long counters[cntMax] = {};
+  unsigned long long bytes = 0;
+  NET_PACKET_INFO info;
+
+  for (size_t i = 0; i < frames.size(); i++) {
+    bool ok = ParaNdis_ParsePacketHeaders(&data[frames[i].offset], frames[i].len, &info);
+    classify(info, ok, counters);
+    bytes += frames[i].len;
+  }
+
+  // the sum keeps the compiler from dropping the parsing
+  unsigned long long check = 0;
+  double start = now_ns();
+  for (unsigned long n = 0; n < passes; n++) {
+    for (size_t i = 0; i < frames.size(); i++) {
+      ParaNdis_ParsePacketHeaders(&data[frames[i].offset], frames[i].len, &info);
+      check += info.L2HdrLen + info.L3HdrLen + info.L4HdrLen;
+    }
+  }
+  double elapsed = now_ns() - start;
+
+  cout << frames.size() << " frames, " << bytes << " bytes" << endl;
+  for (int i = 0; i < cntMax; i++) {
+    cout << "  " << counter_names[i] << ": " << counters[i] << endl;
+  }
+  cout << "parse: " << elapsed / (passes * frames.size()) << " ns per frame, "
+       << passes << " passes (" << check % 10 << ")" << endl;
+
+  return 0;
+}
@@ -0,0 +1,291 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pcap.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+using namespace std;
+
+#include "ndis56common.h"
+#include "ParaNdis-RSSHash.h"
+
+#define RSS_TABLE_SIZE      128
+
+int virtioDebugLevel = -1;
+
+struct frame {
+  size_t offset;
+  ULONG len;
+};
+
+struct stage_result {
+  const char *name;
+  double ns;
+  uint64_t cycles;
+};
+
+static UCHAR hash_key[40] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+  0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+  0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+  0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+  0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa };
+
+static const ULONG hash_info = NdisHashFunctionToeplitz |
+  NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4 | NDIS_HASH_UDP_IPV4 |
+  NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6 | NDIS_HASH_UDP_IPV6;
+
+// the host did not validate the checksums (no VIRTIO_NET_HDR_F_DATA_VALID)
+static const ULONG rx_checksum_flags = pcrIpChecksum | pcrTcpChecksum | pcrUdpChecksum;
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint64_t cycles()
+{
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static bool load(const char *name, vector<UCHAR> &data, vector<frame> &frames)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_t *p = pcap_open_offline(name, errbuf);
+  if (!p) {
+    cerr << name << ": " << errbuf << endl;
+    return false;
+  }
+  if (pcap_datalink(p) != DLT_EN10MB) {
+    cerr << name << ": not an Ethernet capture" << endl;
+    pcap_close(p);
+    return false;
+  }
+
+  struct pcap_pkthdr *hdr;
+  const u_char *pkt;
+  while (pcap_next_ex(p, &hdr, &pkt) == 1) {
+    frame f = { data.size(), hdr->caplen };
+    data.insert(data.end(), pkt, pkt + hdr->caplen);
+    // keep the frames apart as they are in separate buffers
+    data.resize((data.size() + 63) & ~(size_t)63);
+    frames.push_back(f);
+  }
+  pcap_close(p);
+  return true;
+}
+
+class bench {
+public:
+  bench(vector<UCHAR> &data, vector<frame> &frames, unsigned long passes, unsigned queues)
+    : m_data(data), m_tx(data), m_frames(frames), m_info(frames.size()), m_passes(passes), m_check(0)
+  {
+    for (unsigned i = 0; i < RSS_TABLE_SIZE; i++)
+      m_table[i] = i % queues;
+    m_queues.resize(queues);
+  }
+
+  template <typename F>
+  void run(const char *name, F per_frame)
+  {
+    stage_result r = { name, 0, 0 };
+    double start = now_ns();
+    uint64_t c = cycles();
+    for (unsigned long n = 0; n < m_passes; n++) {
+      for (size_t i = 0; i < m_frames.size(); i++)
+        per_frame(i);
+    }
+    r.cycles = cycles() - c;
+    r.ns = now_ns() - start;
+    m_results.push_back(r);
+  }
+
+  /* ParaNdis_PerformPacketAnalysis */
+  void rx_analyze(size_t i)
+  {
+    ParaNdis_AnalyzeReceivedPacket(rx(i), m_frames[i].len, &m_info[i]);
+  }
+
+  /* ParaNdis_CheckRxChecksum */
+  void rx_checksum(size_t i)
+  {
+    if (!m_info[i].isIP4 && !m_info[i].isIP6)
+      return;
+    tCompletePhysicalAddress page = { rx(i), m_frames[i].len };
+    tTcpIpPacketParsingResult ppr =
+      ParaNdis_CheckSumVerifyParsed(&page, 0, &m_info[i], rx_checksum_flags, TRUE, __FUNCTION__);
+    m_check += ppr.value;
+  }
+
+  /* ParaNdis6_RSSAnalyzeReceivedPacket */
+  void rx_hash(size_t i)
+  {
+    RSSCalcHash_Unsafe(hash_info, (PCCHAR)hash_key, rx(i), &m_info[i]);
+  }
+
+  /* ParaNdis6_RSSGetScalingDataForPacket */
+  void rx_queue(size_t i)
+  {
+    if (m_info[i].RSSHash.Type)
+      m_queues[m_table[m_info[i].RSSHash.Value & (RSS_TABLE_SIZE - 1)]]++;
+  }
+
+  void rx_all(size_t i)
+  {
+    rx_analyze(i);
+    rx_checksum(i);
+    rx_hash(i);
+    rx_queue(i);
+  }
+
+  /* CNB::QueryL4HeaderOffset */
+  void tx_l4_offset(size_t i)
+  {
+    if (!m_info[i].isIP4 && !m_info[i].isIP6)
+      return;
+    tTcpIpPacketParsingResult ppr =
+      ParaNdis_ReviewIPPacket(ip(i), ip_len(i), FALSE, __FUNCTION__);
+    m_check += ppr.ipHeaderSize;
+  }
+
+  /* CNB::SetupLSO and CNB::DoIPHdrCSO: IP header checksum and TCP/UDP
+     pseudo header checksum for the host */
+  void tx_offload(size_t i)
+  {
+    if (!m_info[i].isIP4 && !m_info[i].isIP6)
+      return;
+    ULONG flags = pcrIpChecksum | pcrFixIPChecksum | pcrFixPHChecksum;
+    if (m_info[i].isTCP)
+      flags |= pcrTcpChecksum;
+    else if (m_info[i].isUDP)
+      flags |= pcrUdpChecksum;
+    ParaNdis_CheckSumVerifyFlat(ip(i), ip_len(i), flags, FALSE, __FUNCTION__);
+  }
+
+  /* checksums calculated in the guest when the host does not offload them */
+  void tx_sw_checksum(size_t i)
+  {
+    if (!m_info[i].isIP4 && !m_info[i].isIP6)
+      return;
+    ParaNdis_CheckSumVerifyFlat(ip(i), ip_len(i),
+                                pcrIpChecksum | pcrFixIPChecksum | pcrAnyChecksum | pcrFixXxpChecksum,
+                                FALSE, __FUNCTION__);
+  }
+
+  void report(unsigned long long bytes)
+  {
+    unsigned long long packets = (unsigned long long)m_passes * m_frames.size();
+    double total_bytes = (double)m_passes * bytes;
+
+    cout << left << setw(22) << "stage" << right << setw(12) << "ns/packet"
+         << setw(16) << "cycles/packet" << setw(14) << "cycles/byte" << endl;
+    for (auto &r : m_results) {
+      cout << left << setw(22) << r.name << right << fixed
+           << setprecision(1) << setw(12) << r.ns / packets;
+#ifdef HAVE_TSC
+      cout << setw(16) << (double)r.cycles / packets
+           << setprecision(3) << setw(14) << r.cycles / total_bytes;
+#endif
+      cout << endl;
+    }
+#ifndef HAVE_TSC
+    cout << "(no cycle counter on this platform)" << endl;
+#endif
+    cout << "packets per queue:";
+    for (auto q : m_queues)
+      cout << " " << q / (m_passes * 2);
+    // the sum keeps the compiler from dropping the work
+    cout << " (" << m_check % 10 << ")" << endl;
+  }
+
+private:
+  PVOID rx(size_t i) { return &m_data[m_frames[i].offset]; }
+  PVOID ip(size_t i) { return &m_tx[m_frames[i].offset + m_info[i].L2HdrLen]; }
+  ULONG ip_len(size_t i) { return m_frames[i].len - m_info[i].L2HdrLen; }
+
+  vector<UCHAR> &m_data;
+  // the TX stages write the checksums, the RX ones keep verifying the original
+  vector<UCHAR> m_tx;
+  vector<frame> &m_frames;
+  vector<NET_PACKET_INFO> m_info;
+  unsigned long m_passes;
+  unsigned m_table[RSS_TABLE_SIZE];
+  vector<unsigned long long> m_queues;
+  vector<stage_result> m_results;
+  unsigned long long m_check;
+};
+
+static void usage(const char *name)
+{
+  cerr << "Usage: " << name << " [-n passes] [-q queues] [-v level] file.pcap [file.pcap ...]" << endl;
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long passes = 100;
+  unsigned queues = 4;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:q:v:")) != -1) {
+    switch (opt) {
+    case 'n':
+      passes = strtoul(optarg, NULL, 0);
+      break;
+    case 'q':
+      queues = strtoul(optarg, NULL, 0);
+      break;
+    case 'v':
+      virtioDebugLevel = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc || !passes || !queues)
+    usage(argv[0]);
+
+  vector<UCHAR> data;
+  vector<frame> frames;
+  unsigned long long bytes = 0;
+  for (int i = optind; i < argc; i++) {
+    if (!load(argv[i], data, frames))
+      return 1;
+  }
+  if (frames.empty()) {
+    cerr << "No frames" << endl;
+    return 1;
+  }
+  for (auto &f : frames)
+    bytes += f.len;
+
+  bench b(data, frames, passes, queues);
+
+  b.run("rx analyze", [&b](size_t i) { b.rx_analyze(i); });
+  b.run("rx checksum verify", [&b](size_t i) { b.rx_checksum(i); });
+  b.run("rx rss hash", [&b](size_t i) { b.rx_hash(i); });
+  b.run("rx queue select", [&b](size_t i) { b.rx_queue(i); });
+  b.run("rx path", [&b](size_t i) { b.rx_all(i); });
+  b.run("tx l4 header offset", [&b](size_t i) { b.tx_l4_offset(i); });
+  b.run("tx offload prep", [&b](size_t i) { b.tx_offload(i); });
+  b.run("tx sw checksum", [&b](size_t i) { b.tx_sw_checksum(i); });
+
+  cout << frames.size() << " frames, " << bytes << " bytes, " << passes << " passes" << endl;
+  b.report(bytes);
+
+  return 0;
+}
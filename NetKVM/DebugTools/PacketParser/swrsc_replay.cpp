@@ -0,0 +1,551 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+#include "ndis56common.h"
+
+int virtioDebugLevel = -1;
+
+/* Replays captured frames through the software RSC of the driver
+   (Common/ParaNdis-SwRsc.cpp) in passes of 'budget' frames, as
+   ProcessReceiveQueue offers the frames of a receive queue, and checks
+   every indicated frame against the frames it was built from */
+
+struct pcap_file_hdr {
+  uint32_t magic;
+  uint16_t major, minor;
+  int32_t zone;
+  uint32_t sigfigs, snaplen, linktype;
+};
+
+struct pcap_rec_hdr {
+  uint32_t sec, usec, caplen, len;
+};
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NS       0xa1b23c4d
+#define DLT_EN10MB          1
+
+/* the receive descriptors: the frames, their parsed headers and the
+   segments the RSC links, by the index of the frame in the input */
+struct rx_frames {
+  vector<vector<UCHAR> > data;
+  vector<NET_PACKET_INFO> info;
+  vector<tSwRscSegment> segment;
+
+  size_t index(const tSwRscSegment *p) const { return p - &segment[0]; }
+};
+
+/* an indicated frame and the input frames it carries */
+struct indication {
+  vector<UCHAR> data;
+  vector<size_t> inputs;
+  /* as reported to NDIS */
+  ULONG segments;
+};
+
+static bool load(const char *name, vector<vector<UCHAR> > &frames)
+{
+  FILE *fp = fopen(name, "rb");
+  pcap_file_hdr fh;
+  pcap_rec_hdr rh;
+
+  if (!fp) {
+    perror(name);
+    return false;
+  }
+  if (fread(&fh, sizeof(fh), 1, fp) != 1 || (fh.magic != PCAP_MAGIC && fh.magic != PCAP_MAGIC_NS)) {
+    cerr << name << ": not a pcap file of this byte order" << endl;
+    fclose(fp);
+    return false;
+  }
+  if (fh.linktype != DLT_EN10MB) {
+    cerr << name << ": not an Ethernet capture" << endl;
+    fclose(fp);
+    return false;
+  }
+  while (fread(&rh, sizeof(rh), 1, fp) == 1) {
+    vector<UCHAR> f(rh.caplen);
+    if (rh.caplen && fread(&f[0], rh.caplen, 1, fp) != 1)
+      break;
+    // a truncated frame is not what the host would pass
+    if (rh.caplen == rh.len && rh.caplen >= ETH_HEADER_SIZE)
+      frames.push_back(f);
+  }
+  fclose(fp);
+  return true;
+}
+
+static bool save(const char *name, const vector<vector<UCHAR> > &frames)
+{
+  FILE *fp = fopen(name, "wb");
+  if (!fp)
+    return false;
+
+  pcap_file_hdr fh = { PCAP_MAGIC, 2, 4, 0, 0, 65535 + ETH_HEADER_SIZE, DLT_EN10MB };
+  fwrite(&fh, sizeof(fh), 1, fp);
+  for (size_t i = 0; i < frames.size(); i++) {
+    pcap_rec_hdr rh = { (uint32_t)(i / 1000), (uint32_t)(i % 1000) * 1000,
+                        (uint32_t)frames[i].size(), (uint32_t)frames[i].size() };
+    fwrite(&rh, sizeof(rh), 1, fp);
+    fwrite(&frames[i][0], frames[i].size(), 1, fp);
+  }
+  return fclose(fp) == 0;
+}
+
+static USHORT get16(const UCHAR *p)
+{
+  return (USHORT)((p[0] << 8) | p[1]);
+}
+
+static ULONG get32(const UCHAR *p)
+{
+  return ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+}
+
+static void put16(UCHAR *p, USHORT v)
+{
+  p[0] = (UCHAR)(v >> 8);
+  p[1] = (UCHAR)v;
+}
+
+static void put32(UCHAR *p, ULONG v)
+{
+  put16(p, (USHORT)(v >> 16));
+  put16(p + 2, (USHORT)v);
+}
+
+// RFC 1071, independent of the driver's checksum code
+static USHORT ip_checksum(const UCHAR *p, size_t len)
+{
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += get16(p + i);
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return (USHORT)~sum;
+}
+
+/* The TCP flow of a frame, the frames of other protocols share one key:
+   the RSC must keep the order within each of them */
+typedef tuple<int, vector<UCHAR>, USHORT, USHORT> flow_key;
+
+static flow_key flow_of(const vector<UCHAR> &f)
+{
+  vector<UCHAR> copy(f);
+  NET_PACKET_INFO info;
+
+  if (!ParaNdis_AnalyzeReceivedPacket(&copy[0], (ULONG)copy.size(), &info) ||
+      !info.isTCP || !info.isL4HdrComplete || !(info.isIP4 || info.isIP6))
+    return flow_key(0, vector<UCHAR>(), 0, 0);
+
+  const UCHAR *ip = &f[info.L2HdrLen], *tcp = ip + info.L3HdrLen;
+  vector<UCHAR> addresses = info.isIP4 ? vector<UCHAR>(ip + 12, ip + 20) : vector<UCHAR>(ip + 8, ip + 40);
+  return flow_key(info.isIP4 ? 4 : 6, addresses, get16(tcp), get16(tcp + 2));
+}
+
+/* the frame the merged segments stand for: the headers of the first one
+   with the IP length and checksum of the whole, the window of the last
+   one and the push flag of any; the payloads follow in order */
+static bool expected_frame(const vector<vector<UCHAR> > &input, const vector<size_t> &inputs,
+                           vector<UCHAR> &expected, string &error)
+{
+  NET_PACKET_INFO info;
+  vector<UCHAR> first(input[inputs[0]]);
+  ParaNdis_AnalyzeReceivedPacket(&first[0], (ULONG)first.size(), &info);
+  size_t headers = info.L2HdrLen + info.L3HdrLen + info.L4HdrLen;
+  size_t ip = info.L2HdrLen, tcp = ip + info.L3HdrLen;
+  ULONG seq = get32(&first[tcp + 4]);
+  UCHAR flags = 0;
+
+  expected.assign(first.begin(), first.begin() + headers);
+  for (size_t n = 0; n < inputs.size(); n++) {
+    const vector<UCHAR> &f = input[inputs[n]];
+    NET_PACKET_INFO segment;
+    vector<UCHAR> copy(f);
+
+    ParaNdis_AnalyzeReceivedPacket(&copy[0], (ULONG)copy.size(), &segment);
+    size_t offset = segment.L2HdrLen + segment.L3HdrLen + segment.L4HdrLen;
+    size_t end = segment.L2HdrLen + segment.IPTotalLength;
+    if (offset != headers || end != f.size()) {
+      error = "merged a segment with other headers or padding";
+      return false;
+    }
+    if (get32(&f[tcp + 4]) != seq || get32(&f[tcp + 8]) != get32(&first[tcp + 8])) {
+      error = "merged a segment out of sequence or with another ack";
+      return false;
+    }
+    // the rest of the headers must be the same but the IP length, checksum and TCP window
+    for (size_t i = 0; i < headers; i++) {
+      bool variable = info.isIP4 ? (i >= ip + 2 && i < ip + 6) || (i >= ip + 10 && i < ip + 12)
+                                 : (i >= ip + 4 && i < ip + 6);
+      // sequence (checked above), flags, window and checksum
+      variable = variable || (i >= tcp + 4 && i < tcp + 8) || (i >= tcp + 13 && i < tcp + 18);
+      if (!variable && f[i] != first[i]) {
+        error = "merged a segment whose headers differ";
+        return false;
+      }
+    }
+    if ((f[tcp + 13] & ~0x08) != (first[tcp + 13] & ~0x08)) {
+      error = "merged a segment with other TCP flags";
+      return false;
+    }
+    flags |= f[tcp + 13] & 0x08;
+    expected[tcp + 14] = f[tcp + 14];
+    expected[tcp + 15] = f[tcp + 15];
+    expected.insert(expected.end(), f.begin() + offset, f.end());
+    seq += (ULONG)(f.size() - offset);
+  }
+
+  expected[tcp + 13] |= flags;
+  if (info.isIP4) {
+    put16(&expected[ip + 2], (USHORT)(expected.size() - ip));
+    put16(&expected[ip + 10], 0);
+    put16(&expected[ip + 10], ip_checksum(&expected[ip], info.L3HdrLen));
+  } else {
+    put16(&expected[ip + 4], (USHORT)(expected.size() - ip - info.L3HdrLen));
+  }
+  if (expected.size() - ip > 0xffff) {
+    error = "merged frame longer than an IP packet";
+    return false;
+  }
+  return true;
+}
+
+// the frame as ParaNdis_PrepareReceivedPacket describes it with the MDLs
+static indication indicate(const rx_frames &frames, tSwRscSegment *segment)
+{
+  size_t head = frames.index(segment);
+  const vector<UCHAR> &data = frames.data[head];
+  indication ind;
+  ULONG coalesced = 0;
+
+  for (tSwRscSegment *p = segment->Next; p != NULL; p = p->Next)
+    coalesced += p->nPayloadLength;
+  // the head frame with its headers rewritten, then the merged payloads
+  ind.data.assign(data.begin(), data.begin() + (frames.info[head].dataLength - coalesced));
+  ind.inputs.push_back(head);
+  for (tSwRscSegment *p = segment->Next; p != NULL; p = p->Next) {
+    size_t i = frames.index(p);
+    const NET_PACKET_INFO &info = frames.info[i];
+    size_t offset = info.L2HdrLen + info.L3HdrLen + info.L4HdrLen;
+    ind.data.insert(ind.data.end(), frames.data[i].begin() + offset,
+                    frames.data[i].begin() + offset + p->nPayloadLength);
+    ind.inputs.push_back(i);
+  }
+  ind.segments = segment->nSegments;
+  return ind;
+}
+
+static void replay(const vector<vector<UCHAR> > &input, unsigned budget, BOOLEAN v4, BOOLEAN v6,
+                   vector<indication> &output)
+{
+  rx_frames frames;
+  tSwRscContext rsc;
+
+  frames.data = input;
+  frames.info.resize(input.size());
+  frames.segment.resize(input.size());
+
+  for (size_t start = 0; start < input.size(); start += budget) {
+    size_t end = min(input.size(), start + budget);
+
+    ParaNdis_SwRscInit(&rsc, v4, v6);
+    for (size_t i = start; i < end; i++) {
+      tSwRscSegment *flushed;
+      ULONG payload = 0;
+
+      if (ParaNdis_AnalyzeReceivedPacket(&frames.data[i][0], (ULONG)frames.data[i].size(), &frames.info[i]))
+        payload = ParaNdis_SwRscPayloadLength(&rsc, &frames.info[i]);
+      frames.segment[i].PacketInfo = &frames.info[i];
+
+      BOOLEAN taken = ParaNdis_SwRscOffer(&rsc, &frames.segment[i], payload, &flushed);
+      if (flushed)
+        output.push_back(indicate(frames, flushed));
+      if (!taken) {
+        indication ind;
+        ind.data = frames.data[i];
+        ind.inputs.push_back(i);
+        ind.segments = 1;
+        output.push_back(ind);
+      }
+    }
+    for (tSwRscSegment *flushed; (flushed = ParaNdis_SwRscFlushPending(&rsc)) != NULL; )
+      output.push_back(indicate(frames, flushed));
+  }
+}
+
+static unsigned verify(const vector<vector<UCHAR> > &input, const vector<indication> &output)
+{
+  vector<unsigned> seen(input.size());
+  map<flow_key, size_t> last;
+  unsigned errors = 0;
+
+  for (size_t n = 0; n < output.size(); n++) {
+    const indication &ind = output[n];
+    vector<UCHAR> expected;
+    string error;
+
+    if (ind.segments != ind.inputs.size())
+      error = "segment count " + to_string(ind.segments) + " does not match the merged segments";
+    for (size_t i : ind.inputs) {
+      seen[i]++;
+      // the frames of a flow are indicated in the order they were received
+      flow_key key = flow_of(input[i]);
+      auto it = last.find(key);
+      if (it != last.end() && it->second > i)
+        error = "reordered within the flow of frame " + to_string(it->second);
+      last[key] = i;
+    }
+    if (error.empty()) {
+      if (ind.inputs.size() == 1)
+        expected = input[ind.inputs[0]];
+      else if (ind.inputs.size() > PARANDIS_SW_RSC_MAX_SEGMENTS)
+        error = "too many segments merged";
+      else
+        expected_frame(input, ind.inputs, expected, error);
+    }
+    if (error.empty() && expected != ind.data)
+      error = ind.inputs.size() == 1 ? "frame changed" : "merged frame differs from its segments";
+    if (!error.empty()) {
+      cerr << "FAIL indication " << n << " of frame " << ind.inputs[0] << " (" << ind.inputs.size()
+           << " segments): " << error << endl;
+      errors++;
+    }
+  }
+  for (size_t i = 0; i < input.size(); i++) {
+    if (seen[i] != 1) {
+      cerr << "FAIL frame " << i << " indicated " << seen[i] << " times" << endl;
+      errors++;
+    }
+  }
+  return errors;
+}
+
+/* A capture exercising the merge and flush rules: bulk IPv4 and IPv6
+   flows with timestamps and a push every 16 segments, pure ACKs of the
+   other direction, a retransmission, reordering, a TTL change, more
+   flows than the RSC tracks, VLAN tagged and UDP frames between them.
+   The TCP checksums are not set, the host validated them */
+struct tcp_flow {
+  bool v6;
+  ULONG src, dst;
+  USHORT sport, dport;
+  ULONG seq, ack;
+  UCHAR ttl;
+  bool vlan;
+};
+
+static vector<UCHAR> tcp_frame(tcp_flow &fl, size_t payload, UCHAR flags, ULONG tsval)
+{
+  size_t l2 = fl.vlan ? 18 : 14, l3 = fl.v6 ? 40 : 20, l4 = 32;
+  vector<UCHAR> f(l2 + l3 + l4 + payload);
+  UCHAR *ip = &f[l2], *tcp = ip + l3;
+
+  memcpy(&f[0], "\x52\x54\x00\x12\x34\x56\x52\x54\x00\x65\x43\x21", 12);
+  if (fl.vlan) {
+    put16(&f[12], 0x8100);
+    put16(&f[14], 5);
+  }
+  put16(&f[l2 - 2], fl.v6 ? 0x86dd : 0x0800);
+  if (fl.v6) {
+    ip[0] = 0x60;
+    put16(ip + 4, (USHORT)(l4 + payload));
+    ip[6] = 6;
+    ip[7] = fl.ttl;
+    put32(ip + 8, 0x20010db8);
+    put32(ip + 20, fl.src);
+    put32(ip + 24, 0x20010db8);
+    put32(ip + 36, fl.dst);
+  } else {
+    ip[0] = 0x45;
+    put16(ip + 2, (USHORT)(l3 + l4 + payload));
+    put16(ip + 6, 0x4000);
+    ip[8] = fl.ttl;
+    ip[9] = 6;
+    put32(ip + 12, fl.src);
+    put32(ip + 16, fl.dst);
+    put16(ip + 10, ip_checksum(ip, l3));
+  }
+  put16(tcp, fl.sport);
+  put16(tcp + 2, fl.dport);
+  put32(tcp + 4, fl.seq);
+  put32(tcp + 8, fl.ack);
+  tcp[12] = (UCHAR)((l4 / 4) << 4);
+  tcp[13] = flags;
+  put16(tcp + 14, (USHORT)(1000 + (fl.seq / 1000) % 1000));
+  // NOP, NOP, timestamps
+  tcp[20] = tcp[21] = 1;
+  tcp[22] = 8;
+  tcp[23] = 10;
+  put32(tcp + 24, tsval);
+  put32(tcp + 28, 0x1234);
+  for (size_t i = 0; i < payload; i++)
+    tcp[l4 + i] = (UCHAR)((fl.seq + i) * 7 + fl.sport);
+  fl.seq += (ULONG)payload;
+  return f;
+}
+
+static vector<UCHAR> udp_frame(unsigned n)
+{
+  vector<UCHAR> f(14 + 20 + 8 + 100);
+  UCHAR *ip = &f[14];
+
+  memcpy(&f[0], "\x52\x54\x00\x12\x34\x56\x52\x54\x00\x65\x43\x21", 12);
+  put16(&f[12], 0x0800);
+  ip[0] = 0x45;
+  put16(ip + 2, (USHORT)(f.size() - 14));
+  ip[8] = 64;
+  ip[9] = 17;
+  put32(ip + 12, 0xc0a80114);
+  put32(ip + 16, 0xc0a8010a);
+  put16(ip + 10, ip_checksum(ip, 20));
+  put16(ip + 20, 5353);
+  put16(ip + 22, (USHORT)(1000 + n));
+  put16(ip + 24, 108);
+  return f;
+}
+
+#define ACK     0x10
+#define PSH     0x08
+#define SYN     0x02
+#define FIN     0x01
+
+static vector<vector<UCHAR> > test_capture()
+{
+  vector<vector<UCHAR> > frames;
+  tcp_flow bulk4 = { false, 0xc0a8010a, 0xc0a80114, 443, 50000, 1000000, 7000, 64, false };
+  tcp_flow bulk6 = { true, 0x10, 0x20, 443, 50001, 2000000, 9000, 64, false };
+  tcp_flow reverse = { false, 0xc0a80114, 0xc0a8010a, 50000, 443, 7000, 1000000, 64, false };
+  tcp_flow vlan = { false, 0xc0a8010b, 0xc0a80114, 80, 50002, 3000000, 100, 64, true };
+  tcp_flow small[6];
+  ULONG ts = 100;
+
+  for (unsigned i = 0; i < 6; i++)
+    small[i] = { (i & 1) != 0, 0xc0a80120 + i, 0xc0a80114, (USHORT)(8000 + i), 50100, 5000000 * (i + 1), 1, 64, false };
+
+  frames.push_back(tcp_frame(bulk4, 0, SYN | ACK, ts));
+  bulk4.seq++;
+  for (unsigned n = 0; n < 600; n++, ts++) {
+    bool push = n % 16 == 15;
+    frames.push_back(tcp_frame(bulk4, n == 599 ? 500 : 1448, ACK | (push ? PSH : 0), ts / 8));
+    frames.push_back(tcp_frame(bulk6, 1428, ACK | (n % 32 == 31 ? PSH : 0), ts / 8));
+    if (n % 5 == 0) {
+      reverse.ack = bulk4.seq;
+      frames.push_back(tcp_frame(reverse, 0, ACK, ts));
+    }
+    if (n % 7 == 3)
+      frames.push_back(udp_frame(n));
+    if (n % 3 == 1)
+      frames.push_back(tcp_frame(vlan, 1448, ACK, ts / 8));
+    // a retransmission of the previous segment
+    if (n == 100) {
+      bulk4.seq -= 1448;
+      frames.push_back(tcp_frame(bulk4, 1448, ACK, ts / 8));
+    }
+    // two segments swapped
+    if (n == 200) {
+      tcp_flow later = bulk6;
+      later.seq += 1428;
+      frames.push_back(tcp_frame(later, 1428, ACK, ts / 8));
+      frames.push_back(tcp_frame(bulk6, 1428, ACK, ts / 8));
+      bulk6.seq = later.seq;
+    }
+    if (n == 300)
+      bulk4.ttl = 63;
+    // more flows than PARANDIS_SW_RSC_MAX_FLOWS
+    if (n >= 400 && n < 500)
+      frames.push_back(tcp_frame(small[n % 6], 1000, ACK, ts / 8));
+  }
+  frames.push_back(tcp_frame(bulk4, 0, FIN | ACK, ts));
+  return frames;
+}
+
+static void usage(const char *name)
+{
+  cerr << "Usage: " << name << " [-b budget] [-4] [-6] [-o merged.pcap] [-v level] file.pcap ..." << endl
+       << "       " << name << " -w file.pcap" << endl;
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  const char *merged = NULL, *test = NULL;
+  unsigned budget = 64;
+  BOOLEAN v4 = TRUE, v6 = TRUE;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:46o:v:w:")) != -1) {
+    switch (opt) {
+    case 'b':
+      budget = strtoul(optarg, NULL, 0);
+      break;
+    case '4':
+      v6 = FALSE;
+      break;
+    case '6':
+      v4 = FALSE;
+      break;
+    case 'o':
+      merged = optarg;
+      break;
+    case 'v':
+      virtioDebugLevel = atoi(optarg);
+      break;
+    case 'w':
+      test = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (test) {
+    if (!save(test, test_capture())) {
+      perror(test);
+      return 1;
+    }
+    return 0;
+  }
+  if (optind >= argc || !budget || (!v4 && !v6))
+    usage(argv[0]);
+
+  vector<vector<UCHAR> > input;
+  for (int i = optind; i < argc; i++) {
+    if (!load(argv[i], input))
+      return 1;
+  }
+
+  vector<indication> output;
+  replay(input, budget, v4, v6, output);
+  unsigned errors = verify(input, output);
+
+  size_t aggregates = 0, merged_frames = 0;
+  for (auto &ind : output) {
+    if (ind.inputs.size() > 1) {
+      aggregates++;
+      merged_frames += ind.inputs.size();
+    }
+  }
+  cout << input.size() << " frames, " << output.size() << " indicated, " << aggregates
+       << " merged frames of " << (aggregates ? (double)merged_frames / aggregates : 0)
+       << " segments on average, " << errors << " errors" << endl;
+
+  if (merged) {
+    vector<vector<UCHAR> > frames;
+    for (auto &ind : output)
+      frames.push_back(ind.data);
+    if (!save(merged, frames)) {
+      perror(merged);
+      return 1;
+    }
+  }
+  return errors ? 2 : 0;
+}
@@ -0,0 +1,329 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pcap.h>
+
+using namespace std;
+
+#include "ndis_shim.h"
+#include "ethernetutils.h"
+#include "ParaNdis-PacketParser.h"
+#include "ParaNdis-RSSHash.h"
+
+#define HASH_KEY_SIZE       40
+#define MAX_TABLE_SIZE      128
+
+// the key Windows uses by default, also the one of the MSDN test vectors
+static UCHAR hash_key[HASH_KEY_SIZE] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+  0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+  0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+  0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+  0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa };
+
+static const struct {
+  const char *name;
+  ULONG type;
+} hash_types[] = {
+  { "ipv4", NDIS_HASH_IPV4 },
+  { "tcp4", NDIS_HASH_TCP_IPV4 },
+  { "udp4", NDIS_HASH_UDP_IPV4 },
+  { "ipv6", NDIS_HASH_IPV6 },
+  { "tcp6", NDIS_HASH_TCP_IPV6 },
+  { "udp6", NDIS_HASH_UDP_IPV6 },
+  { "ipv6ex", NDIS_HASH_IPV6_EX },
+  { "tcp6ex", NDIS_HASH_TCP_IPV6_EX },
+  { "udp6ex", NDIS_HASH_UDP_IPV6_EX },
+};
+
+struct load {
+  unsigned long long packets;
+  unsigned long long bytes;
+};
+
+struct flow {
+  ULONG hash;
+  load l;
+};
+
+static void usage(const char *name)
+{
+  cerr << "Usage: " << name << " [-k key] [-t types] [-i table | -q queues [-s size]] [-f flows] file.pcap ..." << endl
+       << "  -k key    hash key, 40 bytes in hex (the Windows default key)" << endl
+       << "  -t types  comma separated hash types: ipv4,tcp4,udp4,ipv6,tcp6,udp6,ipv6ex,tcp6ex,udp6ex" << endl
+       << "            (ipv4,tcp4,ipv6,tcp6)" << endl
+       << "  -i table  comma separated queue numbers of the indirection table entries" << endl
+       << "  -q queues round robin indirection table over the number of queues (4)" << endl
+       << "  -s size   number of entries of the round robin table (128)" << endl
+       << "  -f flows  number of the heaviest flows to report (10)" << endl;
+  exit(1);
+}
+
+static bool parse_key(const char *s)
+{
+  for (int i = 0; i < HASH_KEY_SIZE; i++) {
+    unsigned int b;
+    while (*s == ':' || *s == ' ' || *s == ',')
+      s++;
+    if (sscanf(s, "%2x", &b) != 1)
+      return false;
+    hash_key[i] = (UCHAR)b;
+    s += 2;
+  }
+  return true;
+}
+
+static bool parse_types(const char *s, ULONG &types)
+{
+  stringstream ss(s);
+  string name;
+
+  types = 0;
+  while (getline(ss, name, ',')) {
+    size_t i;
+    for (i = 0; i < sizeof(hash_types) / sizeof(hash_types[0]); i++) {
+      if (name == hash_types[i].name) {
+        types |= hash_types[i].type;
+        break;
+      }
+    }
+    if (i == sizeof(hash_types) / sizeof(hash_types[0]))
+      return false;
+  }
+  return types != 0;
+}
+
+static bool parse_table(const char *s, vector<unsigned> &table)
+{
+  stringstream ss(s);
+  string entry;
+
+  while (getline(ss, entry, ','))
+    table.push_back(strtoul(entry.c_str(), NULL, 0));
+  // the driver masks the hash with the table size
+  return !table.empty() && table.size() <= MAX_TABLE_SIZE && !(table.size() & (table.size() - 1));
+}
+
+// addresses and ports the hash was computed on
+static string flow_name(const UCHAR *data, const NET_PACKET_INFO &info)
+{
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  ostringstream os;
+
+  if (info.isIP4) {
+    inet_ntop(AF_INET, data + info.L2HdrLen + FIELD_OFFSET(IPv4Header, ip_src), src, sizeof(src));
+    inet_ntop(AF_INET, data + info.L2HdrLen + FIELD_OFFSET(IPv4Header, ip_dest), dst, sizeof(dst));
+  } else {
+    inet_ntop(AF_INET6, data + info.L2HdrLen + FIELD_OFFSET(IPv6Header, ip6_src_address), src, sizeof(src));
+    inet_ntop(AF_INET6, data + info.L2HdrLen + FIELD_OFFSET(IPv6Header, ip6_dst_address), dst, sizeof(dst));
+  }
+
+  bool ports = info.RSSHash.Type & (NDIS_HASH_TCP_IPV4 | NDIS_HASH_TCP_IPV6 | NDIS_HASH_TCP_IPV6_EX |
+                                    NDIS_HASH_UDP_IPV4 | NDIS_HASH_UDP_IPV6 | NDIS_HASH_UDP_IPV6_EX);
+  if (ports) {
+    const UCHAR *l4 = data + info.L2HdrLen + info.L3HdrLen;
+    os << (info.isTCP ? "TCP " : "UDP ") << src << ":" << ((l4[0] << 8) | l4[1])
+       << " -> " << dst << ":" << ((l4[2] << 8) | l4[3]);
+  } else {
+    os << "IP " << src << " -> " << dst;
+  }
+  return os.str();
+}
+
+static void print_loads(const vector<load> &queues, const load &total)
+{
+  unsigned long long max_bytes = 0;
+
+  for (size_t q = 0; q < queues.size(); q++) {
+    cout << "  queue " << setw(2) << q << ": " << setw(10) << queues[q].packets << " packets "
+         << setw(14) << queues[q].bytes << " bytes "
+         << fixed << setprecision(1) << setw(5)
+         << (total.bytes ? 100.0 * queues[q].bytes / total.bytes : 0.0) << "%" << endl;
+    max_bytes = max(max_bytes, queues[q].bytes);
+  }
+  // 1.00 is a perfect balance, the number of queues - everything on one queue
+  cout << "  imbalance (max/mean bytes): " << fixed << setprecision(2)
+       << (total.bytes ? (double)max_bytes * queues.size() / total.bytes : 0.0) << endl;
+}
+
+static void print_table(const vector<unsigned> &table)
+{
+  for (size_t i = 0; i < table.size(); i++)
+    cout << (i ? "," : "") << table[i];
+  cout << endl;
+}
+
+int main(int argc, char **argv)
+{
+  ULONG types = NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4 | NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6;
+  vector<unsigned> table;
+  unsigned nqueues = 4, table_size = MAX_TABLE_SIZE, nflows = 10;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:t:i:q:s:f:")) != -1) {
+    switch (opt) {
+    case 'k':
+      if (!parse_key(optarg)) {
+        cerr << "Bad key" << endl;
+        return 1;
+      }
+      break;
+    case 't':
+      if (!parse_types(optarg, types)) {
+        cerr << "Bad hash types" << endl;
+        return 1;
+      }
+      break;
+    case 'i':
+      if (!parse_table(optarg, table)) {
+        cerr << "The table size must be a power of 2 up to " << MAX_TABLE_SIZE << endl;
+        return 1;
+      }
+      break;
+    case 'q':
+      nqueues = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      table_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'f':
+      nflows = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc)
+    usage(argv[0]);
+
+  if (table.empty()) {
+    if (!nqueues || !table_size || table_size > MAX_TABLE_SIZE || (table_size & (table_size - 1))) {
+      cerr << "The table size must be a power of 2 up to " << MAX_TABLE_SIZE << endl;
+      return 1;
+    }
+    for (unsigned i = 0; i < table_size; i++)
+      table.push_back(i % nqueues);
+  }
+  nqueues = *max_element(table.begin(), table.end()) + 1;
+
+  ULONG hash_info = types | NdisHashFunctionToeplitz;
+  vector<load> buckets(table.size()), queues(nqueues);
+  load total = {}, unhashed = {};
+  map<string, flow> flows;
+
+  for (int f = optind; f < argc; f++) {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *p = pcap_open_offline(argv[f], errbuf);
+    if (!p) {
+      cerr << argv[f] << ": " << errbuf << endl;
+      return 1;
+    }
+    if (pcap_datalink(p) != DLT_EN10MB) {
+      cerr << argv[f] << ": not an Ethernet capture" << endl;
+      pcap_close(p);
+      return 1;
+    }
+
+    struct pcap_pkthdr *hdr;
+    const u_char *pkt;
+    while (pcap_next_ex(p, &hdr, &pkt) == 1) {
+      NET_PACKET_INFO info;
+      ULONG bytes = hdr->len;
+
+      total.packets++;
+      total.bytes += bytes;
+
+      // ParaNdis_AnalyzeReceivedPacket and ParaNdis6_RSSAnalyzeReceivedPacket
+      if (!ParaNdis_ParsePacketHeaders((PVOID)pkt, hdr->caplen, &info)) {
+        unhashed.packets++;
+        unhashed.bytes += bytes;
+        continue;
+      }
+      RSSCalcHash_Unsafe(hash_info, (PCCHAR)hash_key, (PVOID)pkt, &info);
+      if (info.RSSHash.Type == 0) {
+        // the driver leaves such packets on the queue they came on
+        unhashed.packets++;
+        unhashed.bytes += bytes;
+        continue;
+      }
+
+      // ParaNdis6_RSSGetScalingDataForPacket
+      ULONG bucket = info.RSSHash.Value & (table.size() - 1);
+      buckets[bucket].packets++;
+      buckets[bucket].bytes += bytes;
+      queues[table[bucket]].packets++;
+      queues[table[bucket]].bytes += bytes;
+
+      flow &fl = flows[flow_name(pkt, info)];
+      fl.hash = info.RSSHash.Value;
+      fl.l.packets++;
+      fl.l.bytes += bytes;
+    }
+    pcap_close(p);
+  }
+
+  cout << total.packets << " packets, " << total.bytes << " bytes, "
+       << flows.size() << " flows, not hashed: " << unhashed.packets << " packets "
+       << unhashed.bytes << " bytes" << endl;
+  cout << "Current table (" << table.size() << " entries):" << endl;
+  print_loads(queues, total);
+
+  vector<pair<string, flow> > heavy(flows.begin(), flows.end());
+  sort(heavy.begin(), heavy.end(), [](const pair<string, flow> &a, const pair<string, flow> &b) {
+    return a.second.l.bytes > b.second.l.bytes;
+  });
+  if (heavy.size() > nflows)
+    heavy.resize(nflows);
+  cout << "Heaviest flows:" << endl;
+  for (auto &h : heavy) {
+    ULONG bucket = h.second.hash & (table.size() - 1);
+    cout << "  " << setw(12) << h.second.l.bytes << " bytes " << setw(8) << h.second.l.packets
+         << " packets hash " << hex << setw(8) << setfill('0') << h.second.hash << dec << setfill(' ')
+         << " entry " << setw(3) << bucket << " queue " << setw(2) << table[bucket]
+         << "  " << h.first << endl;
+  }
+
+  // longest processing time first: the heaviest entries are placed one
+  // by one to the least loaded queue
+  vector<unsigned> order(table.size()), rebalanced(table.size());
+  vector<load> new_queues(nqueues);
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  stable_sort(order.begin(), order.end(), [&buckets](unsigned a, unsigned b) {
+    return buckets[a].bytes > buckets[b].bytes;
+  });
+  for (unsigned i : order) {
+    if (!buckets[i].packets) {
+      // no traffic seen, new flows keep their current queue
+      rebalanced[i] = table[i];
+      continue;
+    }
+    unsigned q = 0;
+    for (unsigned j = 1; j < nqueues; j++) {
+      if (new_queues[j].bytes < new_queues[q].bytes ||
+          (new_queues[j].bytes == new_queues[q].bytes && new_queues[j].packets < new_queues[q].packets))
+        q = j;
+    }
+    rebalanced[i] = q;
+    new_queues[q].packets += buckets[i].packets;
+    new_queues[q].bytes += buckets[i].bytes;
+  }
+
+  cout << "Rebalanced table:" << endl << "  ";
+  print_table(rebalanced);
+  print_loads(new_queues, total);
+  if (!heavy.empty() && total.bytes) {
+    // a flow is never split between queues, so no table does better
+    cout << "  heaviest flow alone: " << fixed << setprecision(1)
+         << 100.0 * heavy[0].second.l.bytes / total.bytes << "% of the bytes" << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,426 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+
+using namespace std;
+
+/* wdk/ndis56common.h, the driver's RSS code (wlh/ParaNdis6-RSS.cpp) is
+   built with the stand-ins of wdk/ */
+#include "ndis56common.h"
+
+#define TABLE_SIZE          128
+#define FLOWS               1024
+#define MAX_CPUS            64
+#define DPC_BUDGET          64
+#define QUARANTINE          256
+
+int virtioDebugLevel = -1;
+
+static UCHAR hash_key[NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+  0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+  0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+  0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+  0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa };
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* one cache line per reader, as the DPC of each processor */
+struct alignas(64) reader_state
+{
+  atomic<uint64_t> dpcs{0};
+  uint64_t lookups = 0;
+  uint64_t errors = 0;
+  uint64_t sum = 0;
+};
+
+struct result
+{
+  double seconds;
+  uint64_t lookups;
+  uint64_t updates;
+  uint64_t errors;
+};
+
+/* Each reader thread is a processor of the driver, its index is the one
+   of the reader */
+static ULONG processors;
+static thread_local ULONG current_processor;
+static vector<reader_state> *dispatch_readers;
+
+ULONG KeQueryActiveProcessorCountEx(USHORT)
+{
+  return processors;
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+  if (ProcNumber) {
+    ProcNumber->Group = 0;
+    ProcNumber->Number = (UCHAR)current_processor;
+    ProcNumber->Reserved = 0;
+  }
+  return current_processor;
+}
+
+ULONG KeGetProcessorIndexFromNumber(PPROCESSOR_NUMBER ProcNumber)
+{
+  if (ProcNumber->Group != 0 || ProcNumber->Number >= processors)
+    return INVALID_PROCESSOR_INDEX;
+  return ProcNumber->Number;
+}
+
+ULONG ParaNdis_GetSystemCPUCount()
+{
+  return processors;
+}
+
+/* the parts of Common/ParaNdis-Util.cpp the RSS code uses, the rest
+   of it needs the kernel */
+bool CNdisRWLock::Create(NDIS_HANDLE miniportHandle)
+{
+  m_pLock = NdisAllocateRWLock(miniportHandle);
+  return m_pLock != 0;
+}
+
+/* A freed block is poisoned and kept for a while, so a reader still using
+   a released snapshot reads the poison rather than a newer snapshot in
+   the same memory. A zeroed snapshot is a disabled one, which the bench
+   never sets. Only the updating thread allocates and frees */
+struct alignas(16) block_header
+{
+  size_t size;
+};
+
+static vector<block_header *> quarantine;
+
+PVOID NdisAllocateMemoryWithTagPriority(NDIS_HANDLE, UINT Length, ULONG, int)
+{
+  block_header *b = (block_header *)malloc(sizeof(*b) + Length);
+  if (!b)
+    return NULL;
+  b->size = Length;
+  return b + 1;
+}
+
+VOID NdisFreeMemoryWithTagPriority(NDIS_HANDLE, PVOID VirtualAddress, ULONG)
+{
+  block_header *b = (block_header *)VirtualAddress - 1;
+  memset(VirtualAddress, 0, b->size);
+  quarantine.push_back(b);
+  if (quarantine.size() > QUARANTINE) {
+    free(quarantine.front());
+    quarantine.erase(quarantine.begin());
+  }
+}
+
+/* As the DPCs queued by the driver to every processor: returns once every
+   reader has completed a DPC */
+bool ParaNdis_SynchronizeWithDispatchReaders(NDIS_HANDLE)
+{
+  vector<reader_state> &readers = *dispatch_readers;
+  vector<uint64_t> seen;
+
+  for (auto &r : readers)
+    seen.push_back(r.dpcs.load(memory_order_acquire));
+  for (size_t i = 0; i < readers.size(); i++) {
+    while (readers[i].dpcs.load(memory_order_acquire) == seen[i])
+      sched_yield();
+  }
+  return true;
+}
+
+void ParaNdis_PrintCharArray(int DebugPrintLevel, const CCHAR *data, size_t length)
+{
+  if (DebugPrintLevel > virtioDebugLevel)
+    return;
+  for (size_t i = 0; i < length; i++)
+    printf("%d ", data[i]);
+  printf("\n");
+}
+
+static void put16(vector<UCHAR> &f, size_t off, USHORT v)
+{
+  f[off] = (UCHAR)(v >> 8);
+  f[off + 1] = (UCHAR)v;
+}
+
+// TCP/IPv4 frames of FLOWS flows between two hosts, parsed once
+static void build_flows(vector<vector<UCHAR>> &frames, vector<NET_PACKET_INFO> &infos)
+{
+  frames.resize(FLOWS);
+  infos.resize(FLOWS);
+  for (unsigned i = 0; i < FLOWS; i++) {
+    vector<UCHAR> &f = frames[i];
+
+    f.assign(14 + 20 + 20, 0);
+    memcpy(&f[0], "\x52\x54\x00\x12\x34\x56\x52\x54\x00\x65\x43\x21", 12);
+    put16(f, 12, 0x0800);
+    f[14] = 0x45;
+    put16(f, 16, 40);
+    f[22] = 64;
+    f[23] = 6;
+    inet_pton(AF_INET, "192.168.1.1", &f[26]);
+    inet_pton(AF_INET, "192.168.1.2", &f[30]);
+    put16(f, 34, (USHORT)(10000 + i));
+    put16(f, 36, 5201);
+    f[46] = 0x50;
+    ParaNdis_ParsePacketHeaders(&f[0], (ULONG)f.size(), &infos[i]);
+  }
+}
+
+/* OID_GEN_RECEIVE_SCALE_PARAMETERS as NDIS sets it, the table is rotated
+   by the version so every change moves all the indirection entries */
+struct scale_parameters
+{
+  NDIS_RECEIVE_SCALE_PARAMETERS params;
+  PROCESSOR_NUMBER table[TABLE_SIZE];
+  UCHAR key[NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2];
+};
+
+static NDIS_STATUS set_parameters(PARANDIS_RSS_PARAMS *RSSParameters, uint32_t version)
+{
+  scale_parameters p;
+  UINT bytes_read;
+  NDIS_STATUS status;
+
+  memset(&p, 0, sizeof(p));
+  p.params.Header.Type = NDIS_OBJECT_TYPE_RSS_PARAMETERS;
+  p.params.Header.Revision = NDIS_RECEIVE_SCALE_PARAMETERS_REVISION_2;
+  p.params.Header.Size = sizeof(p.params);
+  p.params.HashInformation = NdisHashFunctionToeplitz | NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4;
+  p.params.IndirectionTableSize = sizeof(p.table);
+  p.params.IndirectionTableOffset = offsetof(scale_parameters, table);
+  p.params.HashSecretKeySize = sizeof(p.key);
+  p.params.HashSecretKeyOffset = offsetof(scale_parameters, key);
+  p.params.ProcessorMasksOffset = sizeof(p);
+  for (unsigned i = 0; i < TABLE_SIZE; i++)
+    p.table[i].Number = (UCHAR)((i + version) % processors);
+  memcpy(p.key, hash_key, sizeof(p.key));
+
+  /* as the OID handler (ParaNdis6-Oid.cpp) does */
+  {
+    CNdisPassiveWriteAutoLock autoLock(RSSParameters->rwLock);
+    status = ParaNdis6_RSSSetParameters(RSSParameters, &p.params, sizeof(p), &bytes_read, NULL);
+  }
+  ParaNdis6_RSSReleaseRetiredSnapshots(RSSParameters);
+  return status;
+}
+
+/* The receive path of a packet (ParaNdis_ProcessRxPath): the hash, then
+   the queue and processor of the packet. Before the snapshot it took the
+   RSS lock for both */
+template <bool Locked>
+static CCHAR classify(PARANDIS_RSS_PARAMS *RSSParameters, PVOID frame, NET_PACKET_INFO *info,
+                      PROCESSOR_NUMBER *processor)
+{
+  if (Locked) {
+    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    ParaNdis6_RSSAnalyzeReceivedPacket(RSSParameters, frame, info);
+    return ParaNdis6_RSSGetScalingDataForPacket(RSSParameters, info, processor);
+  }
+  ParaNdis6_RSSAnalyzeReceivedPacket(RSSParameters, frame, info);
+  return ParaNdis6_RSSGetScalingDataForPacket(RSSParameters, info, processor);
+}
+
+template <bool Locked>
+static CCHAR current_cpu_queue(PARANDIS_RSS_PARAMS *RSSParameters)
+{
+  if (Locked) {
+    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    return ParaNdis6_RSSGetCurrentCpuReceiveQueue(RSSParameters);
+  }
+  return ParaNdis6_RSSGetCurrentCpuReceiveQueue(RSSParameters);
+}
+
+/* each reader runs DPCs of DPC_BUDGET packets of random flows, a DPC
+   looks up the queue of its CPU. Every change of the settings is made
+   with full RSS, a packet that is not classified to a mapped queue and
+   processor was handled with a released or changing snapshot */
+template <bool Locked>
+static void run(unsigned threads, unsigned seconds, unsigned update_us, result &r)
+{
+  PARANDIS_RSS_PARAMS *RSSParameters = (PARANDIS_RSS_PARAMS *)calloc(1, sizeof(*RSSParameters));
+  NDIS_RECEIVE_SCALE_CAPABILITIES capabilities;
+  static ULONG queued[PARANDIS_RSS_MAX_RECEIVE_QUEUES];
+  CCHAR queues = (CCHAR)min(threads, (unsigned)PARANDIS_RSS_MAX_RECEIVE_QUEUES);
+  vector<vector<UCHAR>> frames;
+  vector<NET_PACKET_INFO> infos;
+  vector<reader_state> readers(threads);
+  vector<thread> workers;
+  atomic<bool> go(false), stop(false);
+  atomic<unsigned> ready(0);
+
+  processors = threads;
+  dispatch_readers = &readers;
+  build_flows(frames, infos);
+
+  /* as ParaNdis6_Initialize does; the receive queues stay empty, so a
+     moved indirection entry settles with its first packet */
+  ParaNdis6_RSSCreateConfiguration(RSSParameters, &capabilities, queues, NULL);
+  for (unsigned i = 0; i < PARANDIS_RSS_MAX_RECEIVE_QUEUES; i++)
+    RSSParameters->QueueQueued[i] = &queued[i];
+  new (&RSSParameters->rwLock) CNdisRWLock();
+  if (!RSSParameters->rwLock.Create(NULL) || set_parameters(RSSParameters, 1) != NDIS_STATUS_SUCCESS) {
+    cerr << "RSS configuration failed" << endl;
+    exit(1);
+  }
+
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      reader_state &state = readers[t];
+      vector<NET_PACKET_INFO> packets(infos);
+      uint64_t x = 0x9e3779b97f4a7c15ull * (t + 1);
+      uint64_t lookups = 0, errors = 0, sum = 0;
+
+      current_processor = t;
+      ready++;
+      while (!go)
+        cpu_relax();
+      while (!stop) {
+        for (unsigned n = 0; n < DPC_BUDGET; n++) {
+          x ^= x << 13;
+          x ^= x >> 7;
+          x ^= x << 17;
+          unsigned flow = x % FLOWS;
+          NET_PACKET_INFO *info = &packets[flow];
+          PROCESSOR_NUMBER processor = {};
+          CCHAR queue;
+
+          info->RSSHash.Type = 0;
+          queue = classify<Locked>(RSSParameters, &frames[flow][0], info, &processor);
+          if (info->RSSHash.Type != NDIS_HASH_TCP_IPV4 || queue < 0 || queue >= queues ||
+              processor.Group != 0 || processor.Number >= threads)
+            errors++;
+          sum += queue + processor.Number;
+        }
+        sum += current_cpu_queue<Locked>(RSSParameters);
+        lookups += DPC_BUDGET;
+        state.dpcs.fetch_add(1, memory_order_release);
+      }
+      state.lookups = lookups;
+      state.errors = errors;
+      state.sum = sum;
+    });
+  }
+
+  while (ready < threads)
+    usleep(100);
+
+  uint64_t start = now_ns(), deadline = start + seconds * 1000000000ull;
+  uint32_t version = 1;
+  uint64_t failed = 0;
+  go = true;
+  while (now_ns() < deadline) {
+    if (update_us) {
+      usleep(update_us);
+      if (set_parameters(RSSParameters, ++version) != NDIS_STATUS_SUCCESS)
+        failed++;
+    } else {
+      usleep(10000);
+    }
+  }
+  stop = true;
+  for (auto &w : workers)
+    w.join();
+
+  r.seconds = (now_ns() - start) / 1e9;
+  r.updates = version - 1;
+  r.lookups = 0;
+  r.errors = failed;
+  for (auto &s : readers) {
+    r.lookups += s.lookups;
+    r.errors += s.errors;
+  }
+
+  ParaNdis6_RSSCleanupConfiguration(RSSParameters);
+  RSSParameters->rwLock.~CNdisRWLock();
+  free(RSSParameters);
+  for (auto *b : quarantine)
+    free(b);
+  quarantine.clear();
+}
+
+static void report(const char *name, unsigned threads, result &r)
+{
+  double total = r.lookups / r.seconds / 1e6;
+  cout << left << setw(10) << name << right << setw(8) << threads
+       << fixed << setprecision(2) << setw(12) << total << setw(12) << total / threads
+       << setw(10) << r.updates << setw(8) << r.errors << endl;
+}
+
+static void usage(const char *name)
+{
+  cerr << "Usage: " << name << " [-t seconds per run] [-u update interval, us] [threads ...]" << endl;
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned seconds = 2, update_us = 1000;
+  vector<unsigned> counts;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:u:")) != -1) {
+    switch (opt) {
+    case 't':
+      seconds = strtoul(optarg, NULL, 0);
+      break;
+    case 'u':
+      update_us = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  for (int i = optind; i < argc; i++)
+    counts.push_back(strtoul(argv[i], NULL, 0));
+  if (counts.empty())
+    counts = { 1, 2, 4, 8, 16, 32 };
+  if (!seconds || find_if(counts.begin(), counts.end(),
+                          [](unsigned c) { return c == 0 || c > MAX_CPUS; }) != counts.end())
+    usage(argv[0]);
+
+  cout << thread::hardware_concurrency() << " CPUs, " << seconds << " s per run, ";
+  if (update_us)
+    cout << "settings changed every " << update_us << " us" << endl;
+  else
+    cout << "no settings changes" << endl;
+  cout << left << setw(10) << "settings" << right << setw(8) << "readers" << setw(12) << "Mpkt/s"
+       << setw(12) << "per reader" << setw(10) << "updates" << setw(8) << "errors" << endl;
+
+  uint64_t errors = 0;
+  for (unsigned threads : counts) {
+    result r;
+    run<true>(threads, seconds, update_us, r);
+    report("rwlock", threads, r);
+    errors += r.errors;
+    run<false>(threads, seconds, update_us, r);
+    report("snapshot", threads, r);
+    errors += r.errors;
+  }
+
+  return errors ? 2 : 0;
+}
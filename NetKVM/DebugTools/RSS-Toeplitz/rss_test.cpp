@@ -0,0 +1,255 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+#include "ndis_shim.h"
+#include "ethernetutils.h"
+#include "ParaNdis-PacketParser.h"
+#include "ParaNdis-RSSHash.h"
+
+#define NQUEUES             4
+#define TABLE_SIZE          128
+#define UDP_FLOWS           1024
+
+static UCHAR hash_key[40] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+  0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+  0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+  0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+  0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa };
+
+// the MSDN verification vectors, the 4-tuple hash is the same for TCP and UDP
+static const struct {
+  const char *src, *dst;
+  USHORT sport, dport;
+  ULONG ip_hash, l4_hash;
+} vectors[] = {
+  { "66.9.149.187", "161.142.100.80", 2794, 1766, 0x323e8fc2, 0x51ccc178 },
+  { "199.92.111.2", "65.69.140.83", 14230, 4739, 0xd718262a, 0xc626b0ea },
+  { "24.19.198.95", "12.22.207.184", 12898, 38024, 0xd2d0a5de, 0x5c2b394a },
+  { "38.27.205.30", "209.142.163.6", 48228, 2217, 0x82989176, 0xafc7327f },
+  { "153.39.163.191", "202.188.127.2", 44251, 1303, 0x5d1809c5, 0x10e828a2 },
+  { "3ffe:2501:200:1fff::7", "3ffe:2501:200:3::1", 2794, 1766, 0x2cc18cd5, 0x40207d3d },
+  { "3ffe:501:8::260:97ff:fe40:efab", "ff02::1", 14230, 4739, 0x0f0c461c, 0xdde51bbf },
+  { "3ffe:1900:4545:3:200:f8ff:fe21:67cf", "fe80::200:f8ff:fe21:67cf", 44251, 38024, 0x4b61e985, 0x02d1feef },
+};
+
+static const ULONG all_types = NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4 | NDIS_HASH_UDP_IPV4 |
+                               NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6 | NDIS_HASH_UDP_IPV6;
+
+static void put16(vector<UCHAR> &f, size_t off, USHORT v)
+{
+  f[off] = (UCHAR)(v >> 8);
+  f[off + 1] = (UCHAR)v;
+}
+
+// Ethernet frame with an IPv4/IPv6 header and a TCP or UDP header without payload
+static vector<UCHAR> build_frame(const char *src, const char *dst, USHORT sport, USHORT dport, bool udp)
+{
+  bool v6 = strchr(src, ':') != NULL;
+  size_t l3 = v6 ? 40 : 20, l4 = udp ? 8 : 20;
+  vector<UCHAR> f(14 + l3 + l4);
+
+  memcpy(&f[0], "\x52\x54\x00\x12\x34\x56\x52\x54\x00\x65\x43\x21", 12);
+  put16(f, 12, v6 ? 0x86dd : 0x0800);
+  if (v6) {
+    f[14] = 0x60;
+    put16(f, 18, (USHORT)l4);
+    f[20] = udp ? 17 : 6;
+    f[21] = 64;
+    inet_pton(AF_INET6, src, &f[22]);
+    inet_pton(AF_INET6, dst, &f[38]);
+  } else {
+    f[14] = 0x45;
+    put16(f, 16, (USHORT)(l3 + l4));
+    f[22] = 64;
+    f[23] = udp ? 17 : 6;
+    inet_pton(AF_INET, src, &f[26]);
+    inet_pton(AF_INET, dst, &f[30]);
+  }
+  put16(f, 14 + l3, sport);
+  put16(f, 14 + l3 + 2, dport);
+  if (udp)
+    put16(f, 14 + l3 + 4, (USHORT)l4);
+  else
+    f[14 + l3 + 12] = 0x50;
+  return f;
+}
+
+static bool hash_frame(vector<UCHAR> &f, ULONG types, NET_PACKET_INFO &info)
+{
+  if (!ParaNdis_ParsePacketHeaders(&f[0], (ULONG)f.size(), &info))
+    return false;
+  RSSCalcHash_Unsafe(types | NdisHashFunctionToeplitz, (PCCHAR)hash_key, &f[0], &info);
+  return true;
+}
+
+static int check(const char *what, const char *src, ULONG type, ULONG value, ULONG exp_type, ULONG exp_value)
+{
+  if (type == exp_type && value == exp_value)
+    return 0;
+  cerr << "FAIL " << what << " " << src << ": type " << hex << type << " hash " << value
+       << ", expected type " << exp_type << " hash " << exp_value << dec << endl;
+  return 1;
+}
+
+static int test_vectors()
+{
+  int failures = 0;
+
+  for (auto &v : vectors) {
+    bool v6 = strchr(v.src, ':') != NULL;
+    NET_PACKET_INFO info;
+
+    for (int udp = 0; udp < 2; udp++) {
+      vector<UCHAR> f = build_frame(v.src, v.dst, v.sport, v.dport, udp);
+      ULONG l4_type = v6 ? (udp ? NDIS_HASH_UDP_IPV6 : NDIS_HASH_TCP_IPV6)
+                         : (udp ? NDIS_HASH_UDP_IPV4 : NDIS_HASH_TCP_IPV4);
+      ULONG ip_type = v6 ? NDIS_HASH_IPV6 : NDIS_HASH_IPV4;
+
+      if (!hash_frame(f, all_types, info)) {
+        cerr << "FAIL parse " << v.src << endl;
+        failures++;
+        continue;
+      }
+      failures += check(udp ? "udp" : "tcp", v.src, info.RSSHash.Type, info.RSSHash.Value, l4_type, v.l4_hash);
+
+      // without the 4-tuple type of the protocol the addresses only are hashed
+      hash_frame(f, all_types & ~l4_type, info);
+      failures += check(udp ? "udp 2-tuple" : "tcp 2-tuple", v.src, info.RSSHash.Type, info.RSSHash.Value,
+                        ip_type, v.ip_hash);
+    }
+  }
+  return failures;
+}
+
+// the UDP capabilities ParaNdis-RSSHash.h defines for the pre-6.80 headers
+static int test_caps()
+{
+  static const struct {
+    const char *name;
+    ULONG value, expected;
+  } caps[] = {
+    { "NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4", NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4, 0x00000800 },
+    { "NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6", NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6, 0x00001000 },
+    { "NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6_EX", NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6_EX, 0x00002000 },
+  };
+  const ULONG taken = NdisHashFunctionMask | NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV4 |
+                      NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6 | NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6_EX;
+  int failures = 0;
+
+  for (auto &c : caps) {
+    if (c.value != c.expected || (c.value & taken)) {
+      cerr << "FAIL " << c.name << " " << hex << c.value << ", expected " << c.expected << dec << endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+struct pcap_file_hdr {
+  uint32_t magic;
+  uint16_t major, minor;
+  int32_t zone;
+  uint32_t sigfigs, snaplen, linktype;
+};
+
+struct pcap_rec_hdr {
+  uint32_t sec, usec, caplen, len;
+};
+
+// the UDP traffic of a server with one peer, e.g. a QUIC or DNS proxy
+static vector<vector<UCHAR> > udp_heavy_capture()
+{
+  vector<vector<UCHAR> > frames;
+
+  for (unsigned i = 0; i < UDP_FLOWS; i++)
+    frames.push_back(build_frame("192.168.1.10", "192.168.1.20", (USHORT)(32768 + i), 443, true));
+  return frames;
+}
+
+static bool write_capture(const char *name, const vector<vector<UCHAR> > &frames)
+{
+  FILE *fp = fopen(name, "wb");
+  if (!fp)
+    return false;
+
+  pcap_file_hdr fh = { 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1 /* DLT_EN10MB */ };
+  fwrite(&fh, sizeof(fh), 1, fp);
+  for (size_t i = 0; i < frames.size(); i++) {
+    pcap_rec_hdr rh = { (uint32_t)(i / 1000), (uint32_t)(i % 1000) * 1000,
+                        (uint32_t)frames[i].size(), (uint32_t)frames[i].size() };
+    fwrite(&rh, sizeof(rh), 1, fp);
+    fwrite(&frames[i][0], frames[i].size(), 1, fp);
+  }
+  return fclose(fp) == 0;
+}
+
+// max/mean packets per queue over a round robin table, as rss_dist reports it
+static double distribution(vector<vector<UCHAR> > &frames, ULONG types, const char *name)
+{
+  unsigned counts[NQUEUES] = {}, max_count = 0;
+
+  for (auto &f : frames) {
+    NET_PACKET_INFO info;
+    if (!hash_frame(f, types, info))
+      continue;
+    counts[(info.RSSHash.Value & (TABLE_SIZE - 1)) % NQUEUES]++;
+  }
+  cout << "  " << setw(10) << left << name << right;
+  for (unsigned q = 0; q < NQUEUES; q++) {
+    cout << setw(6) << counts[q];
+    max_count = max(max_count, counts[q]);
+  }
+  double imbalance = (double)max_count * NQUEUES / frames.size();
+  cout << "  imbalance " << fixed << setprecision(2) << imbalance << endl;
+  return imbalance;
+}
+
+int main(int argc, char **argv)
+{
+  const char *capture = NULL;
+  int opt, failures;
+
+  while ((opt = getopt(argc, argv, "w:")) != -1) {
+    switch (opt) {
+    case 'w':
+      capture = optarg;
+      break;
+    default:
+      cerr << "Usage: " << argv[0] << " [-w file.pcap]" << endl
+           << "  -w  also write the UDP-heavy capture, to be analyzed by rss_dist" << endl;
+      return 1;
+    }
+  }
+
+  failures = test_vectors();
+  cout << "verification vectors: " << (failures ? "FAILED" : "passed") << endl;
+  if (test_caps()) {
+    cout << "UDP capabilities: FAILED" << endl;
+    failures++;
+  }
+
+  vector<vector<UCHAR> > frames = udp_heavy_capture();
+  cout << UDP_FLOWS << " UDP flows between two hosts over " << NQUEUES << " queues:" << endl;
+  if (distribution(frames, NDIS_HASH_IPV4, "ipv4") != NQUEUES) {
+    cerr << "FAIL the 2-tuple hash is expected to place all the flows on one queue" << endl;
+    failures++;
+  }
+  if (distribution(frames, NDIS_HASH_IPV4 | NDIS_HASH_UDP_IPV4, "ipv4,udp4") > 1.25) {
+    cerr << "FAIL the 4-tuple hash does not spread the flows" << endl;
+    failures++;
+  }
+
+  if (capture && !write_capture(capture, frames)) {
+    cerr << "Can't write " << capture << endl;
+    return 1;
+  }
+  return failures ? 1 : 0;
+}
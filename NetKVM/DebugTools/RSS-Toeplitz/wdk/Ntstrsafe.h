@@ -0,0 +1,39 @@
+#pragma once
+
+/* The string functions of ParaNdis_PrintTable (ParaNdis-Util.h) */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#define STRSAFE_FILL_ON_FAILURE             0x00000200
+#define STATUS_BUFFER_OVERFLOW              ((NTSTATUS)0x80000005L)
+
+static inline NTSTATUS RtlStringCbCatA(char *Dest, size_t cbDest, const char *Src)
+{
+    size_t Length = strnlen(Dest, cbDest);
+
+    if (Length + strlen(Src) >= cbDest)
+        return STATUS_BUFFER_OVERFLOW;
+    strcpy(Dest + Length, Src);
+    return STATUS_SUCCESS;
+}
+
+static inline NTSTATUS RtlStringCbPrintfExA(char *Dest, size_t cbDest, char **ppDestEnd, size_t *pcbRemaining,
+                                            ULONG Flags, const char *Format, ...)
+{
+    va_list Args;
+    int Length;
+
+    UNREFERENCED_PARAMETER(Flags);
+    va_start(Args, Format);
+    Length = vsnprintf(Dest, cbDest, Format, Args);
+    va_end(Args);
+
+    if (Length < 0 || (size_t)Length >= cbDest)
+        return STATUS_BUFFER_OVERFLOW;
+    if (ppDestEnd != NULL)
+        *ppDestEnd = Dest + Length;
+    if (pcbRemaining != NULL)
+        *pcbRemaining = cbDest - Length;
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdio.h>
+
+extern int virtioDebugLevel;
+
+#define DPrintf(Level, MSG, ...) do { if ((Level) <= virtioDebugLevel) printf(MSG, ##__VA_ARGS__); } while (0)
+
+#define DEBUG_ENTRY(level)  DPrintf(level, "[%s]=>\n", __FUNCTION__)
+#define DEBUG_EXIT_STATUS(level, status) DPrintf((status == NDIS_STATUS_SUCCESS ? level : 0), "[%s]<=0x%X\n", __FUNCTION__, (status))
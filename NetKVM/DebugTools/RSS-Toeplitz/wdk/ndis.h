@@ -0,0 +1,281 @@
+#pragma once
+
+/* Stand-ins for the WDK pieces used by wlh/ParaNdis6-RSS.cpp and the
+   headers it includes (osdep.h, ParaNdis-Util.h, ParaNdis-RSS.h), for
+   rss_snapshot_bench. Built as the NDIS 6.30 driver without WPP.
+   What ParaNdis-Util.h declares for the rest of the driver is only
+   declared here, the RSS code does not use it */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ndis_shim.h"
+
+#define NTDDI_VISTA                         0x06000000
+#define NTDDI_VISTASP1                      0x06000100
+#define NTDDI_VERSION                       NTDDI_VISTA
+#define OSVERSION_MASK                      0xFFFF0000
+#define NDIS_SUPPORT_NDIS6                  1
+#define NDIS_SUPPORT_NDIS620                1
+#define NDIS_SUPPORT_NDIS630                1
+
+#define PARANDIS_MAJOR_DRIVER_VERSION       101
+#define PARANDIS_MINOR_DRIVER_VERSION       58000
+
+typedef int32_t LONG, *PLONG;
+typedef uint32_t *PUINT;
+typedef LONG NTSTATUS, NDIS_STATUS;
+typedef void *NDIS_HANDLE;
+typedef uint64_t KAFFINITY;
+typedef UCHAR KIRQL;
+typedef int64_t NDIS_PHYSICAL_ADDRESS;
+
+#define FORCEINLINE                         inline
+#define UNREFERENCED_PARAMETER(p)           ((void)(p))
+#define __in
+#define __inout
+#define __drv_interlocked
+
+#define PASSIVE_LEVEL                       0
+#define DISPATCH_LEVEL                      2
+#define NormalPoolPriority                  16
+#define ALL_PROCESSOR_GROUPS                0xffff
+#define INVALID_PROCESSOR_INDEX             0xffffffff
+
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#define NDIS_STATUS_SUCCESS                 ((NDIS_STATUS)STATUS_SUCCESS)
+#define NDIS_STATUS_RESOURCES               ((NDIS_STATUS)0xC000009AL)
+#define NDIS_STATUS_NOT_SUPPORTED           ((NDIS_STATUS)0xC00000BBL)
+#define NDIS_STATUS_INVALID_PARAMETER       ((NDIS_STATUS)0xC000000DL)
+#define NDIS_STATUS_INVALID_LENGTH          ((NDIS_STATUS)0xC0010014L)
+
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((PCHAR)(address) - offsetof(type, field)))
+#define NdisMoveMemory(d, s, l)             memmove((d), (s), (l))
+
+typedef struct _PROCESSOR_NUMBER
+{
+    USHORT  Group;
+    UCHAR   Number;
+    UCHAR   Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef struct _GROUP_AFFINITY
+{
+    KAFFINITY   Mask;
+    USHORT      Group;
+    USHORT      Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+/* ntddndis.h */
+typedef struct _NDIS_OBJECT_HEADER
+{
+    UCHAR   Type;
+    UCHAR   Revision;
+    USHORT  Size;
+} NDIS_OBJECT_HEADER;
+
+#define NDIS_OBJECT_TYPE_DEFAULT                    0x80
+#define NDIS_OBJECT_TYPE_RSS_CAPABILITIES           0x88
+#define NDIS_OBJECT_TYPE_RSS_PARAMETERS             0x89
+
+typedef struct _NDIS_RECEIVE_SCALE_CAPABILITIES
+{
+    NDIS_OBJECT_HEADER  Header;
+    ULONG               CapabilitiesFlags;
+    ULONG               NumberOfInterruptMessages;
+    ULONG               NumberOfReceiveQueues;
+    USHORT              NumberOfIndirectionTableEntries;
+} NDIS_RECEIVE_SCALE_CAPABILITIES;
+
+#define NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_1  1
+#define NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_2  2
+#define NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_1 \
+    RTL_SIZEOF_THROUGH_FIELD(NDIS_RECEIVE_SCALE_CAPABILITIES, NumberOfReceiveQueues)
+#define NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_2 \
+    RTL_SIZEOF_THROUGH_FIELD(NDIS_RECEIVE_SCALE_CAPABILITIES, NumberOfIndirectionTableEntries)
+
+#define NDIS_RSS_CAPS_MESSAGE_SIGNALED_INTERRUPTS   0x01000000
+#define NDIS_RSS_CAPS_CLASSIFICATION_AT_ISR         0x02000000
+#define NDIS_RSS_CAPS_CLASSIFICATION_AT_DPC         0x04000000
+
+typedef struct _NDIS_RECEIVE_SCALE_PARAMETERS
+{
+    NDIS_OBJECT_HEADER  Header;
+    USHORT              Flags;
+    USHORT              BaseCpuNumber;
+    ULONG               HashInformation;
+    USHORT              IndirectionTableSize;
+    ULONG               IndirectionTableOffset;
+    USHORT              HashSecretKeySize;
+    ULONG               HashSecretKeyOffset;
+    ULONG               ProcessorMasksOffset;
+    ULONG               NumberOfProcessorMasks;
+    ULONG               ProcessorMasksEntrySize;
+} NDIS_RECEIVE_SCALE_PARAMETERS;
+
+#define NDIS_RECEIVE_SCALE_PARAMETERS_REVISION_2    2
+#define NDIS_RSS_PARAM_FLAG_BASE_CPU_UNCHANGED      0x0001
+#define NDIS_RSS_PARAM_FLAG_HASH_INFO_UNCHANGED     0x0002
+#define NDIS_RSS_PARAM_FLAG_ITABLE_UNCHANGED        0x0004
+#define NDIS_RSS_PARAM_FLAG_HASH_KEY_UNCHANGED      0x0008
+#define NDIS_RSS_PARAM_FLAG_DISABLE_RSS             0x0010
+
+typedef struct _NDIS_RECEIVE_HASH_PARAMETERS
+{
+    NDIS_OBJECT_HEADER  Header;
+    ULONG               Flags;
+    ULONG               HashInformation;
+    USHORT              HashSecretKeySize;
+    ULONG               HashSecretKeyOffset;
+} NDIS_RECEIVE_HASH_PARAMETERS;
+
+#define NDIS_RECEIVE_HASH_PARAMETERS_REVISION_1     1
+#define NDIS_SIZEOF_RECEIVE_HASH_PARAMETERS_REVISION_1 \
+    RTL_SIZEOF_THROUGH_FIELD(NDIS_RECEIVE_HASH_PARAMETERS, HashSecretKeyOffset)
+#define NDIS_RECEIVE_HASH_FLAG_ENABLE_HASH          0x00000001
+#define NDIS_RECEIVE_HASH_FLAG_HASH_INFO_UNCHANGED  0x00000002
+#define NDIS_RECEIVE_HASH_FLAG_HASH_KEY_UNCHANGED   0x00000004
+
+#define NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2    40
+#define NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_2  (128 * sizeof(PROCESSOR_NUMBER))
+#define NDIS_RSS_HASH_FUNC_FROM_HASH_INFO(h)            ((h) & NdisHashFunctionMask)
+
+/* interlocked operations, return the value as the kernel ones do */
+#define InterlockedIncrement(p)             __sync_add_and_fetch((p), 1)
+#define InterlockedDecrement(p)             __sync_sub_and_fetch((p), 1)
+#define NdisInterlockedIncrement(p)         __sync_add_and_fetch((p), 1)
+#define NdisInterlockedDecrement(p)         __sync_sub_and_fetch((p), 1)
+#define InterlockedExchangeAdd(p, v)        __sync_fetch_and_add((p), (v))
+#define InterlockedOr(p, v)                 __sync_fetch_and_or((p), (v))
+#define InterlockedAnd(p, v)                __sync_fetch_and_and((p), (v))
+#define InterlockedExchange(p, v)           __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(p, v)    __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+
+/* reader/writer lock of NDIS 6.20, a waiting writer goes before new readers */
+typedef struct _NDIS_RW_LOCK_EX
+{
+    pthread_rwlock_t    Lock;
+} NDIS_RW_LOCK_EX, *PNDIS_RW_LOCK_EX;
+
+typedef struct _LOCK_STATE_EX
+{
+    KIRQL   OldIrql;
+} LOCK_STATE_EX;
+
+#define NDIS_RWL_AT_DISPATCH_LEVEL          1
+
+static inline PNDIS_RW_LOCK_EX NdisAllocateRWLock(NDIS_HANDLE)
+{
+    PNDIS_RW_LOCK_EX Lock = (PNDIS_RW_LOCK_EX)malloc(sizeof(*Lock));
+    pthread_rwlockattr_t Attr;
+
+    if (Lock != NULL)
+    {
+        pthread_rwlockattr_init(&Attr);
+        pthread_rwlockattr_setkind_np(&Attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&Lock->Lock, &Attr);
+        pthread_rwlockattr_destroy(&Attr);
+    }
+    return Lock;
+}
+
+static inline VOID NdisFreeRWLock(PNDIS_RW_LOCK_EX Lock)
+{
+    pthread_rwlock_destroy(&Lock->Lock);
+    free(Lock);
+}
+
+static inline VOID NdisAcquireRWLockRead(PNDIS_RW_LOCK_EX Lock, LOCK_STATE_EX *, ULONG)
+{
+    pthread_rwlock_rdlock(&Lock->Lock);
+}
+
+static inline VOID NdisAcquireRWLockWrite(PNDIS_RW_LOCK_EX Lock, LOCK_STATE_EX *, ULONG)
+{
+    pthread_rwlock_wrlock(&Lock->Lock);
+}
+
+static inline VOID NdisReleaseRWLock(PNDIS_RW_LOCK_EX Lock, LOCK_STATE_EX *)
+{
+    pthread_rwlock_unlock(&Lock->Lock);
+}
+
+/* the interrupt time, in 100 ns units */
+static inline ULONGLONG KeQueryInterruptTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 10000000ull + ts.tv_nsec / 100;
+}
+
+/* NDIS 6.80, the UDP hash types are advertised */
+static inline UINT NdisGetVersion()
+{
+    return (6 << 16) | 80;
+}
+
+/* the processors and the memory of the bench */
+extern "C"
+{
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+ULONG KeGetProcessorIndexFromNumber(PPROCESSOR_NUMBER ProcNumber);
+PVOID NdisAllocateMemoryWithTagPriority(NDIS_HANDLE NdisHandle, UINT Length, ULONG Tag, int Priority);
+VOID NdisFreeMemoryWithTagPriority(NDIS_HANDLE NdisHandle, PVOID VirtualAddress, ULONG Tag);
+}
+
+#define NdisFreeMemory(p, l, f)             NdisFreeMemoryWithTagPriority(NULL, (p), 0)
+#define KeGetCurrentIrql()                  ((KIRQL)DISPATCH_LEVEL)
+#define NDIS_CURRENT_IRQL()                 KeGetCurrentIrql()
+
+/* declared only */
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _NDIS_SPIN_LOCK
+{
+    PVOID   Lock;
+} NDIS_SPIN_LOCK, *PNDIS_SPIN_LOCK;
+
+typedef struct _NDIS_EVENT
+{
+    PVOID   Event;
+} NDIS_EVENT, *PNDIS_EVENT;
+
+typedef struct _NET_BUFFER_LIST
+{
+    struct _NET_BUFFER_LIST *Next;
+    NDIS_STATUS             Status;
+} NET_BUFFER_LIST, *PNET_BUFFER_LIST;
+
+#define NET_BUFFER_LIST_NEXT_NBL(l)         ((l)->Next)
+#define NET_BUFFER_LIST_STATUS(l)           ((l)->Status)
+
+VOID InitializeListHead(PLIST_ENTRY ListHead);
+BOOLEAN IsListEmpty(PLIST_ENTRY ListHead);
+VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry);
+VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry);
+PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead);
+BOOLEAN RemoveEntryList(PLIST_ENTRY Entry);
+VOID NdisAllocateSpinLock(PNDIS_SPIN_LOCK SpinLock);
+VOID NdisFreeSpinLock(PNDIS_SPIN_LOCK SpinLock);
+VOID NdisAcquireSpinLock(PNDIS_SPIN_LOCK SpinLock);
+VOID NdisReleaseSpinLock(PNDIS_SPIN_LOCK SpinLock);
+VOID NdisDprAcquireSpinLock(PNDIS_SPIN_LOCK SpinLock);
+VOID NdisDprReleaseSpinLock(PNDIS_SPIN_LOCK SpinLock);
+VOID NdisInitializeEvent(PNDIS_EVENT Event);
+VOID NdisSetEvent(PNDIS_EVENT Event);
+VOID NdisResetEvent(PNDIS_EVENT Event);
+BOOLEAN NdisWaitEvent(PNDIS_EVENT Event, UINT MsToWait);
+KIRQL KeRaiseIrqlToDpcLevel();
+VOID KeLowerIrql(KIRQL NewIrql);
+VOID NdisMSendNetBufferListsComplete(NDIS_HANDLE MiniportAdapterHandle, PNET_BUFFER_LIST NetBufferLists, ULONG SendCompleteFlags);
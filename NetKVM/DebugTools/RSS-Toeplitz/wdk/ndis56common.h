@@ -0,0 +1,19 @@
+#ifndef PARANDIS_56_COMMON_H
+#define PARANDIS_56_COMMON_H
+
+/* Found before Common/ndis56common.h by rss_snapshot_bench: the parts of
+   it that wlh/ParaNdis6-RSS.cpp uses, without the adapter */
+
+#include <ndis.h>
+
+#include "ethernetutils.h"
+#include "ParaNdis-PacketParser.h"
+#include "ParaNdis-RSS.h"
+
+#define PARANDIS_MEMORY_TAG                 '5muQ'
+
+#define PARANDIS_FIRST_RSS_RECEIVE_QUEUE    (0)
+#define PARANDIS_RECEIVE_UNCLASSIFIED_PACKET (-1)
+#define PARANDIS_RECEIVE_NO_QUEUE  (-2)
+
+#endif
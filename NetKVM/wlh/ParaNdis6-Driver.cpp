@@ -280,13 +280,20 @@ static NDIS_STATUS ParaNdis6_Initialize(
         miniportAttributes.GeneralAttributes.MacAddressLength =     ETH_ALEN;
 
 #if PARANDIS_SUPPORT_RSS
+        /* RSS parameters are initialized anyway as the receive path
+           always consults the (disabled) RSS snapshot */
+        ParaNdis6_RSSCreateConfiguration(
+                                        &pContext->RSSParameters,
+                                        &pContext->RSSCapabilities,
+                                        pContext->RSSMaxQueuesNumber,
+                                        pContext->MiniportHandle);
+        for (UINT i = 0; i < PARANDIS_RSS_MAX_RECEIVE_QUEUES; i++)
+        {
+            pContext->RSSParameters.QueueQueued[i] = &pContext->ReceiveQueues[i].QueuedPosition;
+        }
         if (pContext->bRSSOffloadSupported)
         {
-            miniportAttributes.GeneralAttributes.RecvScaleCapabilities =
-                ParaNdis6_RSSCreateConfiguration(
-                                                &pContext->RSSParameters,
-                                                &pContext->RSSCapabilities,
-                                                pContext->RSSMaxQueuesNumber);
+            miniportAttributes.GeneralAttributes.RecvScaleCapabilities = &pContext->RSSCapabilities;
             pContext->bRSSInitialized = TRUE;
         }
 
@@ -450,6 +457,47 @@ static NDIS_STATUS ParaNdis6_Restart(
 }
 
 
+#ifdef PARANDIS_SUPPORT_RSS
+/**********************************************************
+Chooses the TX queue for the NBL according to TxSteering
+called under RSS read lock
+***********************************************************/
+static CPUPathBundle *ParaNdis6_SelectTxPath(PARANDIS_ADAPTER *pContext, PNET_BUFFER_LIST pNBL)
+{
+    ULONG RSSHashValue = NET_BUFFER_LIST_GET_HASH_VALUE(pNBL);
+
+    if (pContext->TxSteering == txsCPU)
+    {
+        // the DPC of the queue with the same index runs on this CPU, so
+        // the completions are handled where the packets were sent from
+        ULONG CurrCpuIndex = ParaNdis_GetCurrentCPUIndex();
+        if (CurrCpuIndex < pContext->nActivePathBundles)
+        {
+            return &pContext->pPathBundles[CurrCpuIndex];
+        }
+    }
+
+    if (pContext->RSS2QueueMap != nullptr &&
+        (RSSHashValue != 0 || pContext->TxSteering == txsRSS))
+    {
+        ULONG indirectionIndex = RSSHashValue & (pContext->RSSParameters.ActiveSnapshot->ScalingSettings.RSSHashMask);
+        CPUPathBundle *pBundle = pContext->RSS2QueueMap[indirectionIndex];
+        // the device may have refused to enable the queue pair
+        if (pBundle < pContext->pPathBundles + pContext->nActivePathBundles)
+        {
+            return pBundle;
+        }
+    }
+
+    if (RSSHashValue == 0)
+    {
+        RSSHashValue = ParaNdis_TxFlowHash(pNBL);
+    }
+
+    return &pContext->pPathBundles[((ULONG64)RSSHashValue * pContext->nActivePathBundles) >> 32];
+}
+#endif
+
 /**********************************************************
 Required NDIS handler
 called at IRQL <= DISPATCH_LEVEL
@@ -465,17 +513,14 @@ static VOID ParaNdis6_SendNetBufferLists(
     UNREFERENCED_PARAMETER(flags);
 #ifdef PARANDIS_SUPPORT_RSS
     CNdisPassiveReadAutoLock autoLock(pContext->RSSParameters.rwLock);
-    if (pContext->RSS2QueueMap != nullptr)
+    if (pContext->RSS2QueueMap != nullptr || (pContext->TxSteering != txsRSS && pContext->nPathBundles > 1))
     {
         while (pNBL)
         {
-            ULONG RSSHashValue = NET_BUFFER_LIST_GET_HASH_VALUE(pNBL);
-            ULONG indirectionIndex = RSSHashValue & (pContext->RSSParameters.ActiveRSSScalingSettings.RSSHashMask);
-
             PNET_BUFFER_LIST nextNBL = NET_BUFFER_LIST_NEXT_NBL(pNBL);
             NET_BUFFER_LIST_NEXT_NBL(pNBL) = NULL;
 
-            pContext->RSS2QueueMap[indirectionIndex]->txPath.Send(pNBL);
+            ParaNdis6_SelectTxPath(pContext, pNBL)->txPath.Send(pNBL);
             pNBL = nextNBL;
         }
     }
@@ -244,6 +244,8 @@ static BOOLEAN MiniportInterrupt(
     {
         pContext->pPathBundles[i].txPath.DisableInterrupts();
         pContext->pPathBundles[i].rxPath.DisableInterrupts();
+        pContext->pPathBundles[i].txPath.StampInterrupt();
+        pContext->pPathBundles[i].rxPath.StampInterrupt();
     }
     if (pContext->bCXPathCreated)
     {
@@ -735,6 +737,26 @@ BOOLEAN ParaNdis_BindRxBufferToPacket(
     }
     *NextMdlLinkage = NULL;
 
+#if PARANDIS_SUPPORT_RSC
+    // software RSC describes the payload of a merged segment with it,
+    // sized for the whole first data page to fit any part of it
+    if (pContext->RSC.bIPv4Software || pContext->RSC.bIPv6Software)
+    {
+        p->CoalescedMdl = NdisAllocateMdl(
+            pContext->MiniportHandle,
+            p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
+            p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size);
+        if (p->CoalescedMdl == NULL) goto error_exit;
+    }
+#endif
+
+    p->BoundNBL = NdisAllocateNetBufferAndNetBufferList(pContext->BufferListsPool, 0, 0, p->Holder, 0, 0);
+    if (p->BoundNBL == NULL) goto error_exit;
+
+    p->BoundNBL->SourceHandle = pContext->MiniportHandle;
+    p->BoundNBL->MiniportReserved[0] = p;
+    p->BoundNBL->MiniportReserved[1] = NULL;
+
     return TRUE;
 
 error_exit:
@@ -749,6 +771,20 @@ void ParaNdis_UnbindRxBufferFromPacket(
     PMDL NextMdlLinkage = p->Holder;
     ULONG ulPageDescIndex = PARANDIS_FIRST_RX_DATA_PAGE;
 
+    if (p->BoundNBL != NULL)
+    {
+        NdisFreeNetBufferList(p->BoundNBL);
+        p->BoundNBL = NULL;
+    }
+
+#if PARANDIS_SUPPORT_RSC
+    if (p->CoalescedMdl != NULL)
+    {
+        NdisFreeMdl(p->CoalescedMdl);
+        p->CoalescedMdl = NULL;
+    }
+#endif
+
     while(NextMdlLinkage != NULL)
     {
         PMDL pThisMDL = NextMdlLinkage;
@@ -758,6 +794,24 @@ void ParaNdis_UnbindRxBufferFromPacket(
         NdisFreeMdl(pThisMDL);
         ulPageDescIndex++;
     }
+    p->Holder = NULL;
+}
+
+/* The NBL of the descriptor is not returned to the pool between packets,
+   so whatever the previous indication left in it is reset here */
+static __inline
+VOID ParaNdis_ResetBoundNBL(PNET_BUFFER_LIST pNBL, PMDL pMDL, ULONG ulDataOffset, ULONG ulDataLength)
+{
+    PNET_BUFFER pNB = NET_BUFFER_LIST_FIRST_NB(pNBL);
+
+    NET_BUFFER_LIST_NEXT_NBL(pNBL) = NULL;
+    NET_BUFFER_LIST_FLAGS(pNBL) &= NBL_FLAGS_NDIS_RESERVED;
+    NET_BUFFER_LIST_NBL_FLAGS(pNBL) = 0;
+    NdisZeroMemory(pNBL->NetBufferListInfo, sizeof(pNBL->NetBufferListInfo));
+
+    NET_BUFFER_FIRST_MDL(pNB) = NET_BUFFER_CURRENT_MDL(pNB) = pMDL;
+    NET_BUFFER_DATA_OFFSET(pNB) = NET_BUFFER_CURRENT_MDL_OFFSET(pNB) = ulDataOffset;
+    NET_BUFFER_DATA_LENGTH(pNB) = ulDataLength;
 }
 
 static
@@ -784,16 +838,12 @@ static __inline
 VOID NBLSetRSSInfo(PPARANDIS_ADAPTER pContext, PNET_BUFFER_LIST pNBL, PNET_PACKET_INFO PacketInfo)
 {
 #if PARANDIS_SUPPORT_RSS
-    CNdisRWLockState lockState;
-
-    pContext->RSSParameters.rwLock.acquireReadDpr(lockState);
-    if(pContext->RSSParameters.RSSMode != PARANDIS_RSS_DISABLED)
+    if(ParaNdis6_RSSGetActiveSnapshot(&pContext->RSSParameters)->RSSMode != PARANDIS_RSS_DISABLED)
     {
         NET_BUFFER_LIST_SET_HASH_TYPE    (pNBL, PacketInfo->RSSHash.Type);
         NET_BUFFER_LIST_SET_HASH_FUNCTION(pNBL, PacketInfo->RSSHash.Function);
         NET_BUFFER_LIST_SET_HASH_VALUE   (pNBL, PacketInfo->RSSHash.Value);
     }
-    pContext->RSSParameters.rwLock.releaseDpr(lockState);
 #else
     UNREFERENCED_PARAMETER(pContext);
     UNREFERENCED_PARAMETER(pNBL);
@@ -814,7 +864,7 @@ VOID NBLSet8021QInfo(PPARANDIS_ADAPTER pContext, PNET_BUFFER_LIST pNBL, PNET_PAC
         qInfo.TagHeader.VlanId = pPacketInfo->Vlan.VlanId;
 
     if(qInfo.Value != NULL)
-        pContext->extraStatistics.framesRxPriority++;
+        ParaNdis_CpuStatistics(pContext)->Extra.framesRxPriority++;
 
     NET_BUFFER_LIST_INFO(pNBL, Ieee8021QNetBufferListInfo) = qInfo.Value;
 }
@@ -848,6 +898,122 @@ VOID NBLSetRSCInfo(PPARANDIS_ADAPTER pContext, PNET_BUFFER_LIST pNBL,
     NdisInterlockedAddLargeStatistic(&pContext->RSC.Statistics.CoalesceEvents, 1);
     NdisInterlockedAddLargeStatistic(&pContext->RSC.Statistics.CoalescedPkts, nCoalescedSegments);
 }
+
+/**********************************************************
+Software RSC, the NDIS part: the flow logic is in ParaNdis-SwRsc.cpp,
+here the descriptors are checked for what their headers do not tell
+and the payloads of a flushed aggregation are chained to its first
+descriptor by payload-only MDLs.
+***********************************************************/
+static
+BOOLEAN SwRscIsEligible(pRxNetDescriptor p)
+{
+    virtio_net_hdr_rsc *pHeader = (virtio_net_hdr_rsc *) p->PhysicalPages[0].Virtual;
+
+    // only segments validated by the host, RSC reports the checksum as succeeded
+    if (!(pHeader->hdr.flags & VIRTIO_NET_HDR_F_DATA_VALID) || (pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE))
+        return FALSE;
+
+    // the whole frame in the first data page, the payload is described from it
+    return p->PacketInfo.dataLength <= p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size &&
+           p->CoalescedMdl != NULL;
+}
+
+static
+pRxNetDescriptor SwRscChainSegments(tSwRscSegment *pFlushed)
+{
+    pRxNetDescriptor pHead, pTail;
+    tSwRscSegment *pSegment;
+    ULONG nCoalescedBytes = 0;
+
+    if (pFlushed == NULL)
+        return NULL;
+
+    pHead = CONTAINING_RECORD(pFlushed, RxNetDescriptor, SwRsc);
+    pHead->CoalescedNext = NULL;
+    if (pFlushed->Next == NULL)
+        return pHead;
+
+    pTail = pHead;
+    for (pSegment = pFlushed->Next; pSegment != NULL; pSegment = pSegment->Next)
+    {
+        pRxNetDescriptor p = CONTAINING_RECORD(pSegment, RxNetDescriptor, SwRsc);
+        ULONG nPayloadOffset = p->PacketInfo.L2HdrLen + p->PacketInfo.L3HdrLen + p->PacketInfo.L4HdrLen;
+
+        // the segment is not indicated by itself, so its first data MDL is
+        // restored to the whole page and the payload is described from it
+        NdisAdjustMdlLength(p->Holder, p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size);
+        IoBuildPartialMdl(p->Holder, p->CoalescedMdl,
+                          RtlOffsetToPointer(p->PacketInfo.headersBuffer, nPayloadOffset),
+                          pSegment->nPayloadLength);
+        NDIS_MDL_LINKAGE(p->CoalescedMdl) = NULL;
+        p->CoalescedNext = NULL;
+
+        if (pTail != pHead)
+        {
+            NDIS_MDL_LINKAGE(pTail->CoalescedMdl) = p->CoalescedMdl;
+        }
+        pTail->CoalescedNext = p;
+        pTail = p;
+        nCoalescedBytes += pSegment->nPayloadLength;
+    }
+
+    // the head frame, whose lengths already include the merged payloads,
+    // occupies the first data MDL and the payloads follow it
+    NdisAdjustMdlLength(pHead->Holder, pHead->PacketInfo.dataLength - nCoalescedBytes);
+    pHead->CoalescedSavedLinkage = NDIS_MDL_LINKAGE(pHead->Holder);
+    NDIS_MDL_LINKAGE(pHead->Holder) = pHead->CoalescedNext->CoalescedMdl;
+
+    return pHead;
+}
+
+BOOLEAN ParaNdis_SwRscReceive(
+    tSwRscContext *pRsc,
+    pRxNetDescriptor pBuffer,
+    pRxNetDescriptor *ppFlushed)
+{
+    ULONG nPayloadLength = 0;
+    tSwRscSegment *pFlushed;
+    BOOLEAN bTaken;
+
+    if (SwRscIsEligible(pBuffer))
+    {
+        nPayloadLength = ParaNdis_SwRscPayloadLength(pRsc, &pBuffer->PacketInfo);
+    }
+
+    pBuffer->SwRsc.PacketInfo = &pBuffer->PacketInfo;
+    bTaken = ParaNdis_SwRscOffer(pRsc, &pBuffer->SwRsc, nPayloadLength, &pFlushed);
+    *ppFlushed = SwRscChainSegments(pFlushed);
+
+    return bTaken;
+}
+
+pRxNetDescriptor ParaNdis_SwRscFlush(tSwRscContext *pRsc)
+{
+    return SwRscChainSegments(ParaNdis_SwRscFlushPending(pRsc));
+}
+
+pRxNetDescriptor ParaNdis_SwRscDetachSegments(pRxNetDescriptor pHead)
+{
+    pRxNetDescriptor pSegments = pHead->CoalescedNext;
+    pRxNetDescriptor p;
+
+    if (pSegments == NULL)
+        return NULL;
+
+    NDIS_MDL_LINKAGE(pHead->Holder) = pHead->CoalescedSavedLinkage;
+    pHead->CoalescedSavedLinkage = NULL;
+    pHead->CoalescedNext = NULL;
+
+    // the payload MDLs stay with their descriptors for the next merge
+    for (p = pSegments; p != NULL; p = p->CoalescedNext)
+    {
+        MmPrepareMdlForReuse(p->CoalescedMdl);
+        NDIS_MDL_LINKAGE(p->CoalescedMdl) = NULL;
+    }
+
+    return pSegments;
+}
 #endif
 
 /**********************************************************
@@ -881,75 +1047,138 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(
             nBytesStripped = ParaNdis_StripVlanHeaderMoveHead(pPacketInfo);
         }
 
-        ParaNdis_PadPacketToMinimalLength(pPacketInfo);
-        ParaNdis_AdjustRxBufferHolderLength(pBuffersDesc, nBytesStripped);
-        pNBL = NdisAllocateNetBufferAndNetBufferList(pContext->BufferListsPool, 0, 0, pMDL, nBytesStripped, pPacketInfo->dataLength);
-
-        if (pNBL)
+#if PARANDIS_SUPPORT_RSC
+        // software RSC has already built the MDL chain of a coalesced frame
+        if (pBuffersDesc->CoalescedNext == NULL)
+#endif
         {
-            virtio_net_hdr_rsc *pHeader = (virtio_net_hdr_rsc *) pBuffersDesc->PhysicalPages[0].Virtual;
-            tChecksumCheckResult csRes;
-            pNBL->SourceHandle = pContext->MiniportHandle;
-            NBLSetRSSInfo(pContext, pNBL, pPacketInfo);
-            NBLSet8021QInfo(pContext, pNBL, pPacketInfo);
+            ParaNdis_PadPacketToMinimalLength(pPacketInfo);
+            ParaNdis_AdjustRxBufferHolderLength(pBuffersDesc, nBytesStripped);
+        }
+        pNBL = pBuffersDesc->BoundNBL;
+        ParaNdis_ResetBoundNBL(pNBL, pMDL, nBytesStripped, pPacketInfo->dataLength);
 
-            pNBL->MiniportReserved[0] = pBuffersDesc;
+        virtio_net_hdr_rsc *pHeader = (virtio_net_hdr_rsc *) pBuffersDesc->PhysicalPages[0].Virtual;
+        tChecksumCheckResult csRes;
+        NBLSetRSSInfo(pContext, pNBL, pPacketInfo);
+        NBLSet8021QInfo(pContext, pNBL, pPacketInfo);
 
 #if PARANDIS_SUPPORT_RSC
-            if (!(pContext->RSC.bIPv4SupportedQEMU || pContext->RSC.bIPv6SupportedQEMU) && (pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE))
-            {
-                *pnCoalescedSegmentsCount = PktGetTCPCoalescedSegmentsCount(pPacketInfo, pContext->MaxPacketSize.nMaxDataSize);
-                NBLSetRSCInfo(pContext, pNBL, pPacketInfo, *pnCoalescedSegmentsCount, 0);
-                DPrintf(1, "RSC host packet, datalen %d, GSO type %d\n", pPacketInfo->dataLength, pHeader->hdr.gso_type);
-                pContext->extraStatistics.framesCoalescedHost++;
-            }
-            else if ((pContext->RSC.bIPv4SupportedQEMU || pContext->RSC.bIPv6SupportedQEMU) && (pHeader->hdr.gso_type != VIRTIO_NET_HDR_RSC_NONE))
-            {
-                *pnCoalescedSegmentsCount = pHeader->rsc_pkts;
-                NBLSetRSCInfo(pContext, pNBL, pPacketInfo, *pnCoalescedSegmentsCount, pHeader->rsc_dup_acks);
-                DPrintf(1, "RSC win packet, datalen %d, GSO type %d\n", pPacketInfo->dataLength, pHeader->hdr.gso_type);
-                pContext->extraStatistics.framesCoalescedWindows++;
-            }
-            else
+        if (pBuffersDesc->CoalescedNext != NULL)
+        {
+            *pnCoalescedSegmentsCount = pBuffersDesc->SwRsc.nSegments;
+            NBLSetRSCInfo(pContext, pNBL, pPacketInfo, *pnCoalescedSegmentsCount, 0);
+            DPrintf(1, "RSC software packet, datalen %d, segments %d\n", pPacketInfo->dataLength, *pnCoalescedSegmentsCount);
+            ParaNdis_CpuStatistics(pContext)->Extra.framesCoalescedSoftware++;
+        }
+        else if (!(pContext->RSC.bIPv4SupportedQEMU || pContext->RSC.bIPv6SupportedQEMU) && (pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE))
+        {
+            *pnCoalescedSegmentsCount = PktGetTCPCoalescedSegmentsCount(pPacketInfo, pContext->MaxPacketSize.nMaxDataSize);
+            NBLSetRSCInfo(pContext, pNBL, pPacketInfo, *pnCoalescedSegmentsCount, 0);
+            DPrintf(1, "RSC host packet, datalen %d, GSO type %d\n", pPacketInfo->dataLength, pHeader->hdr.gso_type);
+            ParaNdis_CpuStatistics(pContext)->Extra.framesCoalescedHost++;
+        }
+        else if ((pContext->RSC.bIPv4SupportedQEMU || pContext->RSC.bIPv6SupportedQEMU) && (pHeader->hdr.gso_type != VIRTIO_NET_HDR_RSC_NONE))
+        {
+            *pnCoalescedSegmentsCount = pHeader->rsc_pkts;
+            NBLSetRSCInfo(pContext, pNBL, pPacketInfo, *pnCoalescedSegmentsCount, pHeader->rsc_dup_acks);
+            DPrintf(1, "RSC win packet, datalen %d, GSO type %d\n", pPacketInfo->dataLength, pHeader->hdr.gso_type);
+            ParaNdis_CpuStatistics(pContext)->Extra.framesCoalescedWindows++;
+        }
+        else
 #endif
+        {
+            csRes = ParaNdis_CheckRxChecksum(
+                pContext,
+                pHeader->hdr.flags,
+                &pBuffersDesc->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE],
+                pPacketInfo,
+                nBytesStripped, TRUE);
+            if (csRes.value)
             {
-                csRes = ParaNdis_CheckRxChecksum(
-                    pContext,
-                    pHeader->hdr.flags,
-                    &pBuffersDesc->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE],
-                    pPacketInfo,
-                    nBytesStripped, TRUE);
-                if (csRes.value)
-                {
-                    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO qCSInfo;
-                    qCSInfo.Value = NULL;
-                    qCSInfo.Receive.IpChecksumFailed = csRes.flags.IpFailed;
-                    qCSInfo.Receive.IpChecksumSucceeded = csRes.flags.IpOK;
-                    qCSInfo.Receive.TcpChecksumFailed = csRes.flags.TcpFailed;
-                    qCSInfo.Receive.TcpChecksumSucceeded = csRes.flags.TcpOK;
-                    qCSInfo.Receive.UdpChecksumFailed = csRes.flags.UdpFailed;
-                    qCSInfo.Receive.UdpChecksumSucceeded = csRes.flags.UdpOK;
-                    NET_BUFFER_LIST_INFO(pNBL, TcpIpChecksumNetBufferListInfo) = qCSInfo.Value;
-                    DPrintf(1, "Reporting CS %X->%X\n", csRes.value, (ULONG)(ULONG_PTR)qCSInfo.Value);
-                }
+                NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO qCSInfo;
+                qCSInfo.Value = NULL;
+                qCSInfo.Receive.IpChecksumFailed = csRes.flags.IpFailed;
+                qCSInfo.Receive.IpChecksumSucceeded = csRes.flags.IpOK;
+                qCSInfo.Receive.TcpChecksumFailed = csRes.flags.TcpFailed;
+                qCSInfo.Receive.TcpChecksumSucceeded = csRes.flags.TcpOK;
+                qCSInfo.Receive.UdpChecksumFailed = csRes.flags.UdpFailed;
+                qCSInfo.Receive.UdpChecksumSucceeded = csRes.flags.UdpOK;
+                NET_BUFFER_LIST_INFO(pNBL, TcpIpChecksumNetBufferListInfo) = qCSInfo.Value;
+                DPrintf(1, "Reporting CS %X->%X\n", csRes.value, (ULONG)(ULONG_PTR)qCSInfo.Value);
             }
-            pNBL->Status = NDIS_STATUS_SUCCESS;
+        }
+        pNBL->Status = NDIS_STATUS_SUCCESS;
 #if defined(ENABLE_HISTORY_LOG)
-            {
-                tTcpIpPacketParsingResult packetReview = ParaNdis_CheckSumVerify(
-                    RtlOffsetToPointer(pPacketInfo->headersBuffer, ETH_HEADER_SIZE),
-                    pPacketInfo->dataLength,
-                    pcrIpChecksum | pcrTcpChecksum | pcrUdpChecksum,
-                    __FUNCTION__
-                    );
-                ParaNdis_DebugHistory(pContext, hopPacketReceived, pNBL, pPacketInfo->dataLength, (ULONG)(ULONG_PTR)qInfo.Value, packetReview.value);
-            }
-#endif
+        {
+            tTcpIpPacketParsingResult packetReview = ParaNdis_CheckSumVerify(
+                RtlOffsetToPointer(pPacketInfo->headersBuffer, ETH_HEADER_SIZE),
+                pPacketInfo->dataLength,
+                pcrIpChecksum | pcrTcpChecksum | pcrUdpChecksum,
+                __FUNCTION__
+                );
+            ParaNdis_DebugHistory(pContext, hopPacketReceived, pNBL, pPacketInfo->dataLength, (ULONG)(ULONG_PTR)qInfo.Value, packetReview.value);
         }
+#endif
     }
     return pNBL;
 }
 
+/**********************************************************
+Copies a prepared frame up to RxCopyThreshold bytes to a copy buffer
+of its queue, the descriptor can be reposted as soon as this returns
+Parameters:
+    context
+    pRxNetDescriptor pBuffersDesc - descriptor of the prepared frame
+    PNET_BUFFER_LIST pNBL - NBL returned by ParaNdis_PrepareReceivedPacket
+Return value:
+    NBL of the copy buffer to indicate instead of pNBL
+    NULL if the frame is indicated from the ring buffer
+***********************************************************/
+tPacketIndicationType ParaNdis_CopyReceivedPacket(
+    PARANDIS_ADAPTER *pContext,
+    pRxNetDescriptor pBuffersDesc,
+    PNET_BUFFER_LIST pNBL)
+{
+    PNET_BUFFER pNB = NET_BUFFER_LIST_FIRST_NB(pNBL);
+    ULONG ulDataOffset = NET_BUFFER_DATA_OFFSET(pNB);
+    ULONG ulDataLength = NET_BUFFER_DATA_LENGTH(pNB);
+    ULONG ulClass = ParaNdis_RxSizeClass(ulDataLength);
+    tExtraStatistics *pExtra = &ParaNdis_CpuStatistics(pContext)->Extra;
+
+    pExtra->framesRxBySize[ulClass]++;
+
+    if (ulDataLength > pContext->uRxCopyThreshold ||
+#if PARANDIS_SUPPORT_RSC
+        pBuffersDesc->CoalescedNext != NULL ||
+#endif
+        ulDataOffset + ulDataLength > pBuffersDesc->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size)
+    {
+        return NULL;
+    }
+
+    CRxCopyBuffer *pCopyBuffer = pBuffersDesc->Queue->GetCopyBuffer();
+    if (pCopyBuffer == NULL)
+    {
+        pExtra->framesRxCopyNoBuffer++;
+        return NULL;
+    }
+
+    NdisMoveMemory(pCopyBuffer->Data,
+        RtlOffsetToPointer(pBuffersDesc->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual, ulDataOffset),
+        ulDataLength);
+
+    PNET_BUFFER_LIST pCopyNBL = pCopyBuffer->NBL;
+    ParaNdis_ResetBoundNBL(pCopyNBL, pCopyBuffer->Mdl, 0, ulDataLength);
+    // checksum, hash and VLAN results of the frame
+    NdisMoveMemory(pCopyNBL->NetBufferListInfo, pNBL->NetBufferListInfo, sizeof(pNBL->NetBufferListInfo));
+    pCopyNBL->Status = pNBL->Status;
+    pCopyBuffer->UsedTimestamp = pBuffersDesc->UsedTimestamp;
+
+    pExtra->framesRxCopied[ulClass]++;
+    return pCopyNBL;
+}
+
 
 /**********************************************************
 NDIS procedure of returning us buffer of previously indicated packets
@@ -958,10 +1187,8 @@ Parameters:
     PNET_BUFFER_LIST pNBL - list of buffers to free
     returnFlags - is dpc
 
-The procedure frees:
-received buffer descriptors back to list of RX buffers
-all the allocated MDL structures
-all the received NBLs back to our pool
+The procedure returns the received buffer descriptors to their
+queues, the NBLs stay bound to the descriptors
 ***********************************************************/
 VOID ParaNdis6_ReturnNetBufferLists(
     NDIS_HANDLE miniportAdapterContext,
@@ -46,7 +46,8 @@ static NDIS_IO_WORKITEM_FUNCTION OnSetPowerWorkItem;
 { oid, el, xfl, xokl, flags, setproc }
 
 /**********************************************************
-Just fail the request for unsupported OID
+Enables or disables notification coalescing of the device,
+fails the request when the device can not coalesce
 Parameters:
     context
     tOidDesc *pOid      descriptor of OID request
@@ -55,10 +56,37 @@ Return value:
 ***********************************************************/
 static NDIS_STATUS OnSetInterruptModeration(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
 {
-    UNREFERENCED_PARAMETER(pContext);
-    UNREFERENCED_PARAMETER(pOid);
+    NDIS_INTERRUPT_MODERATION_PARAMETERS params;
+    NDIS_STATUS status;
+
+    if (!pContext->bNotfCoalSupported)
+    {
+        return NDIS_STATUS_INVALID_DATA;
+    }
+
+    status = ParaNdis_OidSetCopy(pOid, &params, sizeof(params));
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    switch (params.InterruptModeration)
+    {
+        case NdisInterruptModerationDisabled:
+            ParaNdis_SetInterruptModeration(pContext, imDisabled);
+            break;
+        case NdisInterruptModerationEnabled:
+            if (pContext->InterruptModeration == imDisabled)
+            {
+                ParaNdis_SetInterruptModeration(pContext, imAdaptive);
+            }
+            break;
+        default:
+            status = NDIS_STATUS_INVALID_DATA;
+            break;
+    }
 
-    return  NDIS_STATUS_INVALID_DATA;
+    return status;
 }
 
 
@@ -67,9 +95,13 @@ static NDIS_STATUS OnSetOffloadEncapsulation(PARANDIS_ADAPTER *pContext, tOidDes
 static NDIS_STATUS OnSetLinkParameters(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
 static NDIS_STATUS OnSetVendorSpecific1(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
 static NDIS_STATUS OnSetVendorSpecific2(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
+static NDIS_STATUS OnSetVendorSpecific5(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
 
 #define OID_VENDOR_1                    0xff010201
 #define OID_VENDOR_2                    0xff010202
+#define OID_VENDOR_3                    0xff010203
+#define OID_VENDOR_4                    0xff010204
+#define OID_VENDOR_5                    0xff010205
 
 #if PARANDIS_SUPPORT_RSS
 
@@ -80,29 +112,39 @@ static NDIS_STATUS RSSSetParameters(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
     if (!pContext->bRSSOffloadSupported)
         return NDIS_STATUS_NOT_SUPPORTED;
 
-    CNdisPassiveWriteAutoLock autoLock(pContext->RSSParameters.rwLock);
-
-    status = ParaNdis6_RSSSetParameters(&pContext->RSSParameters,
-                                        (NDIS_RECEIVE_SCALE_PARAMETERS*) pOid->InformationBuffer,
-                                        pOid->InformationBufferLength,
-                                        pOid->pBytesRead,
-                                        pContext->MiniportHandle);
-    ParaNdis_ResetRxClassification(pContext);
-    if (status != NDIS_STATUS_SUCCESS)
     {
-        DPrintf(0, "[%s] - RSS parameters setting failed\n", __FUNCTION__);
-    }
+        CNdisPassiveWriteAutoLock autoLock(pContext->RSSParameters.rwLock);
+
+        status = ParaNdis6_RSSSetParameters(&pContext->RSSParameters,
+                                            (NDIS_RECEIVE_SCALE_PARAMETERS*) pOid->InformationBuffer,
+                                            pOid->InformationBufferLength,
+                                            pOid->pBytesRead,
+                                            pContext->MiniportHandle);
+        ParaNdis_ResetRxClassification(pContext);
+        if (status != NDIS_STATUS_SUCCESS)
+        {
+            DPrintf(0, "[%s] - RSS parameters setting failed\n", __FUNCTION__);
+        }
 
-    if (status == NDIS_STATUS_SUCCESS)
-    {
-        status = ParaNdis_SetupRSSQueueMap(pContext);
-    }
+        if (status == NDIS_STATUS_SUCCESS)
+        {
+            status = ParaNdis_SetupRSSQueueMap(pContext);
+        }
 
-    if (status != NDIS_STATUS_SUCCESS)
-    {
-        DPrintf(0, "[%s] - RSS to queue mapping setup failed\n", __FUNCTION__);
+        if (status != NDIS_STATUS_SUCCESS)
+        {
+            DPrintf(0, "[%s] - RSS to queue mapping setup failed\n", __FUNCTION__);
+        }
+        else
+        {
+            ParaNdis_UpdateQueuePairs(pContext);
+        }
     }
 
+    ParaNdis_TrimQueuePairs(pContext);
+
+    ParaNdis6_RSSReleaseRetiredSnapshots(&pContext->RSSParameters);
+
     return status;
 }
 
@@ -120,6 +162,8 @@ static NDIS_STATUS RSSSetReceiveHash(   PARANDIS_ADAPTER *pContext, tOidDesc *pO
 
     ParaNdis_ResetRxClassification(pContext);
 
+    ParaNdis6_RSSReleaseRetiredSnapshots(&pContext->RSSParameters);
+
     return status;
 }
 
@@ -216,6 +260,9 @@ OIDENTRYPROC(OID_TCP_OFFLOAD_PARAMETERS,        0,0,0, ohfSet | ohfSetMoreOK | o
 OIDENTRYPROC(OID_OFFLOAD_ENCAPSULATION,         0,0,0, ohfQuerySet, OnSetOffloadEncapsulation),
 OIDENTRYPROC(OID_VENDOR_1,                      0,0,0, ohfQueryStat | ohfSet | ohfSetMoreOK, OnSetVendorSpecific1),
 OIDENTRYPROC(OID_VENDOR_2,                      0,0,0, ohfQueryStat | ohfSet | ohfSetMoreOK, OnSetVendorSpecific2),
+OIDENTRY(OID_VENDOR_3,                          0,0,0, ohfQueryStat),
+OIDENTRY(OID_VENDOR_4,                          0,0,0, ohfQueryStat),
+OIDENTRYPROC(OID_VENDOR_5,                      0,0,0, ohfQueryStat | ohfSet | ohfSetMoreOK, OnSetVendorSpecific5),
 
 #if PARANDIS_SUPPORT_RSS
     OIDENTRYPROC(OID_GEN_RECEIVE_SCALE_PARAMETERS,  0,0,0, ohfSet | ohfSetMoreOK, RSSSetParameters),
@@ -290,6 +337,9 @@ static NDIS_OID SupportedOids[] =
         OID_GEN_SUPPORTED_GUIDS,
         OID_VENDOR_1,
         OID_VENDOR_2,
+        OID_VENDOR_3,
+        OID_VENDOR_4,
+        OID_VENDOR_5,
 #endif
         OID_OFFLOAD_ENCAPSULATION,
         OID_TCP_OFFLOAD_PARAMETERS,
@@ -305,7 +355,10 @@ static NDIS_OID SupportedOids[] =
 static const NDIS_GUID supportedGUIDs[]
 {
     { NetKvm_LoggingGuid,    OID_VENDOR_1, NetKvm_Logging_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ | fNDIS_GUID_ALLOW_WRITE },
-    { NetKvm_StatisticsGuid, OID_VENDOR_2, NetKvm_Statistics_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ | fNDIS_GUID_ALLOW_WRITE }
+    { NetKvm_StatisticsGuid, OID_VENDOR_2, NetKvm_Statistics_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ | fNDIS_GUID_ALLOW_WRITE },
+    { NetKvm_RxBudgetGuid,   OID_VENDOR_3, NetKvm_RxBudget_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
+    { NetKvm_QueueStatisticsGuid, OID_VENDOR_4, NetKvm_QueueStatistics_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ },
+    { NetKvm_LatencyGuid,    OID_VENDOR_5, NetKvm_Latency_SIZE, fNDIS_GUID_TO_OID | fNDIS_GUID_ALLOW_READ | fNDIS_GUID_ALLOW_WRITE }
 };
 
 /**********************************************************
@@ -410,10 +463,28 @@ static NDIS_STATUS OnSetVendorSpecific2(PARANDIS_ADAPTER *pContext, tOidDesc *pO
     NDIS_STATUS status;
     UNREFERENCED_PARAMETER(pContext);
     status = ParaNdis_OidSetCopy(pOid, &dummy, sizeof(dummy));
-    RtlZeroMemory(&pContext->extraStatistics, sizeof(pContext->extraStatistics));
+    ParaNdis_ResetExtraStatistics(pContext);
     return status;
 }
 
+static NDIS_STATUS OnSetVendorSpecific5(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
+{
+    ULONG dummy = 0;
+    NDIS_STATUS status;
+    status = ParaNdis_OidSetCopy(pOid, &dummy, sizeof(dummy));
+    ParaNdis_ResetLatencyHistograms(pContext);
+    return status;
+}
+
+/* The histograms of a queue are stored one after another in each array */
+static void FillLatencyHistogram(ULONG *Dest, UINT Queue, const ULONG *Histogram)
+{
+    for (UINT j = 0; j < PARANDIS_LATENCY_HISTOGRAM_SIZE; j++)
+    {
+        Dest[Queue * PARANDIS_LATENCY_HISTOGRAM_SIZE + j] = Histogram[j];
+    }
+}
+
 /*****************************************************************
 Handles NDIS6 specific OID, all the rest handled by common handler
 *****************************************************************/
@@ -437,6 +508,8 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
     BOOLEAN bFreeInfo = FALSE;
     LONGLONG ul64LinkSpeed = 0;
     NetKvm_Statistics wmiStatistics;
+    NetKvm_RxBudget wmiRxBudget;
+    NetKvm_QueueStatistics wmiQueueStatistics;
 
 #define SETINFO(field, value) pInfo = &u.##field; ulSize = sizeof(u.##field); u.##field = (value)
     switch(pOid->Oid)
@@ -459,6 +532,7 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
             }
             break;
         case OID_GEN_STATISTICS:
+            ParaNdis_CollectStatistics(pContext);
             pInfo  = &pContext->Statistics;
             ulSize = sizeof(pContext->Statistics);
             break;
@@ -475,6 +549,7 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
         case OID_VENDOR_2:
             pInfo = &wmiStatistics;
             ulSize = sizeof(wmiStatistics);
+            ParaNdis_CollectStatistics(pContext);
             wmiStatistics.txChecksumOffload = pContext->extraStatistics.framesCSOffload;
             wmiStatistics.txLargeOffload = pContext->extraStatistics.framesLSO;
             wmiStatistics.rxPriority = pContext->extraStatistics.framesRxPriority;
@@ -482,13 +557,96 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
             wmiStatistics.rxCoalescedWin = pContext->extraStatistics.framesCoalescedWindows;
             wmiStatistics.rxCoalescedHost = pContext->extraStatistics.framesCoalescedHost;
             break;
+        case OID_VENDOR_3:
+            pInfo = &wmiRxBudget;
+            ulSize = sizeof(wmiRxBudget);
+            RtlZeroMemory(&wmiRxBudget, sizeof(wmiRxBudget));
+            wmiRxBudget.queueCount = min(pContext->nPathBundles, (UINT)ARRAYSIZE(wmiRxBudget.budget));
+            wmiRxBudget.budgetMin = min(pContext->uNumberOfHandledRXPacketsInDPC, (ULONG)PARANDIS_RX_BUDGET_MIN);
+            wmiRxBudget.budgetMax = pContext->uNumberOfHandledRXPacketsInDPC;
+            for (UINT i = 0; i < wmiRxBudget.queueCount; i++)
+            {
+                CParaNdisRX &rxPath = pContext->pPathBundles[i].rxPath;
+                const ULONG *histogram = rxPath.GetDpcHistogram();
+                wmiRxBudget.budget[i] = rxPath.GetDpcBudget();
+                wmiRxBudget.grows[i] = rxPath.GetDpcBudgetGrows();
+                wmiRxBudget.shrinks[i] = rxPath.GetDpcBudgetShrinks();
+                for (UINT j = 0; j < ARRAYSIZE(wmiRxBudget.histogram) && j < PARANDIS_RX_BUDGET_HISTOGRAM_SIZE; j++)
+                {
+                    wmiRxBudget.histogram[j] += histogram[j];
+                }
+            }
+            break;
+        case OID_VENDOR_4:
+            pInfo = &wmiQueueStatistics;
+            ulSize = sizeof(wmiQueueStatistics);
+            RtlZeroMemory(&wmiQueueStatistics, sizeof(wmiQueueStatistics));
+            wmiQueueStatistics.queueCount = min(pContext->nPathBundles, (UINT)ARRAYSIZE(wmiQueueStatistics.rxPackets));
+            for (UINT i = 0; i < wmiQueueStatistics.queueCount; i++)
+            {
+                const tQueueStatistics &rx = pContext->pPathBundles[i].rxPath.QueueStatistics();
+                const tQueueStatistics &tx = pContext->pPathBundles[i].txPath.QueueStatistics();
+                wmiQueueStatistics.rxPackets[i] = rx.Packets;
+                wmiQueueStatistics.rxBytes[i] = rx.Bytes;
+                wmiQueueStatistics.rxDrops[i] = rx.Drops;
+                wmiQueueStatistics.rxKicks[i] = rx.Kicks;
+                wmiQueueStatistics.rxInterrupts[i] = rx.Interrupts;
+                wmiQueueStatistics.rxDpcRequeues[i] = rx.DpcRequeues;
+                wmiQueueStatistics.txPackets[i] = tx.Packets;
+                wmiQueueStatistics.txBytes[i] = tx.Bytes;
+                wmiQueueStatistics.txDrops[i] = tx.Drops;
+                wmiQueueStatistics.txKicks[i] = tx.Kicks;
+                wmiQueueStatistics.txInterrupts[i] = tx.Interrupts;
+                wmiQueueStatistics.txDpcRequeues[i] = tx.DpcRequeues;
+            }
+            break;
+        case OID_VENDOR_5:
+            {
+                // too large for the stack, ParaNdis_OidQueryCopy frees it
+                NetKvm_Latency *pLatency = (NetKvm_Latency *)ParaNdis_AllocateMemory(pContext, sizeof(*pLatency));
+                if (pLatency == NULL)
+                {
+                    status = NDIS_STATUS_RESOURCES;
+                    break;
+                }
+                pInfo = pLatency;
+                ulSize = sizeof(*pLatency);
+                bFreeInfo = TRUE;
+                RtlZeroMemory(pLatency, sizeof(*pLatency));
+                pLatency->queueCount = min(pContext->nPathBundles,
+                    (UINT)(ARRAYSIZE(pLatency->rxInterruptToDpc) / PARANDIS_LATENCY_HISTOGRAM_SIZE));
+                pLatency->bucketCount = PARANDIS_LATENCY_HISTOGRAM_SIZE;
+                for (UINT i = 0; i < pLatency->queueCount; i++)
+                {
+                    const tQueueLatency &rx = pContext->pPathBundles[i].rxPath.QueueLatency();
+                    const tQueueLatency &tx = pContext->pPathBundles[i].txPath.QueueLatency();
+                    FillLatencyHistogram(pLatency->rxInterruptToDpc, i, rx.InterruptToDpc);
+                    FillLatencyHistogram(pLatency->rxDpcDuration, i, rx.DpcDuration);
+                    FillLatencyHistogram(pLatency->rxUsedToIndicate, i, rx.Completion);
+                    FillLatencyHistogram(pLatency->txInterruptToDpc, i, tx.InterruptToDpc);
+                    FillLatencyHistogram(pLatency->txDpcDuration, i, tx.DpcDuration);
+                    FillLatencyHistogram(pLatency->txSendToComplete, i, tx.Completion);
+                }
+            }
+            break;
 
         case OID_GEN_INTERRUPT_MODERATION:
             u.InterruptModeration.Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
             u.InterruptModeration.Header.Size = sizeof(u.InterruptModeration);
             u.InterruptModeration.Header.Revision = NDIS_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
             u.InterruptModeration.Flags = 0;
-            u.InterruptModeration.InterruptModeration = NdisInterruptModerationNotSupported;
+            if (!pContext->bNotfCoalSupported)
+            {
+                u.InterruptModeration.InterruptModeration = NdisInterruptModerationNotSupported;
+            }
+            else if (pContext->InterruptModeration == imDisabled)
+            {
+                u.InterruptModeration.InterruptModeration = NdisInterruptModerationDisabled;
+            }
+            else
+            {
+                u.InterruptModeration.InterruptModeration = NdisInterruptModerationEnabled;
+            }
             pInfo = &u.InterruptModeration;
             ulSize = sizeof(u.InterruptModeration);
             break;
@@ -1142,8 +1300,8 @@ NDIS_STATUS OnSetRSCParameters(PPARANDIS_ADAPTER pContext, PNDIS_OFFLOAD_PARAMET
     }
 
     GuestOffloads = 1 << VIRTIO_NET_F_GUEST_CSUM                                        |
-                    ((pContext->RSC.bIPv4Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
-                    ((pContext->RSC.bIPv6Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
+                    ((pContext->RSC.bIPv4Enabled && !pContext->RSC.bIPv4Software) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
+                    ((pContext->RSC.bIPv6Enabled && !pContext->RSC.bIPv6Software) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
                     ((pContext->RSC.bIPv4EnabledQEMU) ? ((UINT64)1 << VIRTIO_NET_F_GUEST_RSC4) : 0) |
                     ((pContext->RSC.bIPv6EnabledQEMU) ? ((UINT64)1 << VIRTIO_NET_F_GUEST_RSC6) : 0);
 
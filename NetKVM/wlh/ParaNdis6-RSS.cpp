@@ -9,50 +9,231 @@
 
 #define RSS_PRINT_LEVEL 0
 
+#include "ParaNdis-RSSHash.h"
+
+/* the UDP hash types are advertised when NDIS knows them (6.80 and later),
+   their capability bits follow the TCP ones (ParaNdis-RSSHash.h) */
+#if NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4 != (NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6_EX << 1) || \
+    NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6 != (NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4 << 1) || \
+    NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6_EX != (NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6 << 1)
+#error The UDP RSS capabilities do not match ntddndis.h
+#endif
+#define RSS_NDIS_VERSION_UDP_HASH           ((6 << 16) | 80)
+
+static __inline
+BOOLEAN IsUDPHashSupported()
+{
+    return NdisGetVersion() >= RSS_NDIS_VERSION_UDP_HASH;
+}
+
+/* longest time a moved indirection entry waits for its previous queue,
+   in 100 ns units of the interrupt time */
+#define RSS_MIGRATION_TIMEOUT       (20000)
+
+/* the drain position of an entry keeps the low bits of the queue
+   position, with a bit that tells it from an unset one */
+#define RSS_POSITION_MASK           (0x0FFFFFFF)
+#define RSS_POSITION_SET            (0x10000000)
+
 static void PrintIndirectionTable(const NDIS_RECEIVE_SCALE_PARAMETERS* Params);
 static void PrintIndirectionTable(const PARANDIS_SCALING_SETTINGS *RSSScalingSetting);
 
 static void PrintRSSSettings(PPARANDIS_RSS_PARAMS RSSParameters);
 
-static VOID ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
+/* the positions wrap around, compare them as a signed distance */
+static __inline
+BOOLEAN PositionReached(ULONG Current, ULONG Position)
+{
+    return ((Current - Position) & RSS_POSITION_MASK) <= (RSS_POSITION_MASK >> 1);
+}
+
+static BOOLEAN IsSameQueueProcessor(const PARANDIS_RSS_SNAPSHOT *Old, const PARANDIS_RSS_SNAPSHOT *New, CCHAR Queue)
+{
+    if (Old->RSSMode != PARANDIS_RSS_FULL || New->RSSMode != PARANDIS_RSS_FULL ||
+        Queue >= Old->ScalingSettings.ReceiveQueuesMapped ||
+        Queue >= New->ScalingSettings.ReceiveQueuesMapped)
+    {
+        return FALSE;
+    }
+
+    return Old->ScalingSettings.QueueProcessor[Queue].Group == New->ScalingSettings.QueueProcessor[Queue].Group &&
+           Old->ScalingSettings.QueueProcessor[Queue].Number == New->ScalingSettings.QueueProcessor[Queue].Number;
+}
+
+/* Marks the indirection entries whose queue changes, before the new
+   snapshot is published so no packet of theirs misses the hold */
+static VOID MarkMovedEntries(PPARANDIS_RSS_PARAMS RSSParameters, const PARANDIS_RSS_SNAPSHOT *Old, const PARANDIS_RSS_SNAPSHOT *New)
+{
+    const PARANDIS_SCALING_SETTINGS *OldSettings = &Old->ScalingSettings;
+    const PARANDIS_SCALING_SETTINGS *NewSettings = &New->ScalingSettings;
+
+    if (Old->RSSMode != PARANDIS_RSS_FULL || New->RSSMode != PARANDIS_RSS_FULL)
+        return;
+
+    for (ULONG i = 0; i < NewSettings->IndirectionTableSize / sizeof(PROCESSOR_NUMBER); i++)
+    {
+        CCHAR NewQueue = NewSettings->QueueIndirectionTable[i];
+
+        CCHAR OldQueue = OldSettings->QueueIndirectionTable[i & OldSettings->RSSHashMask];
+
+        if (NewQueue >= 0 && NewQueue != OldQueue)
+        {
+            PARANDIS_RSS_ENTRY_STATE *Entry = &RSSParameters->EntryState[i];
+
+            /* an entry new to RSS has no packets to wait for */
+            if (OldQueue < 0)
+            {
+                continue;
+            }
+            Entry->PreviousQueue = OldQueue;
+            Entry->HoldStart = 0;
+            Entry->DrainPosition = 0;
+            InterlockedExchange(&Entry->MovedVersion, (LONG) New->Version);
+        }
+    }
+}
+
+static VOID FreeSnapshot(PPARANDIS_RSS_PARAMS RSSParameters, PPARANDIS_RSS_SNAPSHOT Snapshot)
+{
+    if (Snapshot != &RSSParameters->DisabledSnapshot)
+    {
+        NdisFreeMemoryWithTagPriority(RSSParameters->MiniportHandle, Snapshot, PARANDIS_MEMORY_TAG);
+    }
+}
+
+/* Builds a new snapshot of the active settings and publishes it to the data path.
+   The caller holds rwLock for write, the replaced snapshot is queued for
+   ParaNdis6_RSSReleaseRetiredSnapshots */
+static NDIS_STATUS ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
         PARANDIS_RSS_MODE NewRSSMode,
         PARANDIS_HASHING_SETTINGS *ReceiveHashingSettings,
         PARANDIS_SCALING_SETTINGS *ReceiveScalingSettings)
 {
-    CNdisPassiveWriteAutoLock autoLock(RSSParameters->rwLock);
-
-    RSSParameters->RSSMode = NewRSSMode;
+    PPARANDIS_RSS_SNAPSHOT NewSnapshot = &RSSParameters->DisabledSnapshot;
+    PPARANDIS_RSS_SNAPSHOT OldSnapshot;
+    LONG QueuesToReclassify = 0;
 
     if(NewRSSMode != PARANDIS_RSS_DISABLED)
     {
-        RSSParameters->ActiveHashingSettings = *ReceiveHashingSettings;
+        ULONG CPUIndexMappingSize = (NewRSSMode == PARANDIS_RSS_FULL) ? ReceiveScalingSettings->CPUIndexMappingSize : 0;
+
+        /* CPU mapping array is kept in the same allocation to make the snapshot self-contained */
+        NewSnapshot = (PPARANDIS_RSS_SNAPSHOT) NdisAllocateMemoryWithTagPriority(
+                                                                    RSSParameters->MiniportHandle,
+                                                                    sizeof(*NewSnapshot) + CPUIndexMappingSize,
+                                                                    PARANDIS_MEMORY_TAG,
+                                                                    NormalPoolPriority);
+        if (NewSnapshot == NULL)
+        {
+            DPrintf(0, "[%s] - RSS snapshot allocation failed\n", __FUNCTION__);
+            return NDIS_STATUS_RESOURCES;
+        }
+
+        NdisZeroMemory(NewSnapshot, sizeof(*NewSnapshot));
+        NewSnapshot->RSSMode = NewRSSMode;
+        NewSnapshot->HashingSettings = *ReceiveHashingSettings;
+        NewSnapshot->ScalingSettings.FirstQueueIndirectionIndex = INVALID_INDIRECTION_INDEX;
 
         if(NewRSSMode == PARANDIS_RSS_FULL)
         {
-            if(RSSParameters->ActiveRSSScalingSettings.CPUIndexMapping != NULL)
-                NdisFreeMemory(RSSParameters->ActiveRSSScalingSettings.CPUIndexMapping, 0, 0);
+            NewSnapshot->ScalingSettings = *ReceiveScalingSettings;
+            NewSnapshot->ScalingSettings.CPUIndexMapping = (PCHAR) (NewSnapshot + 1);
+            if (CPUIndexMappingSize)
+            {
+                NdisMoveMemory(NewSnapshot->ScalingSettings.CPUIndexMapping,
+                               ReceiveScalingSettings->CPUIndexMapping, CPUIndexMappingSize);
+            }
+        }
+        NewSnapshot->Version = ++RSSParameters->SnapshotVersion;
+    }
+
+    RSSParameters->RSSMode = NewRSSMode;
 
-            RSSParameters->ActiveRSSScalingSettings = *ReceiveScalingSettings;
+    MarkMovedEntries(RSSParameters, RSSParameters->ActiveSnapshot, NewSnapshot);
 
-            ReceiveScalingSettings->CPUIndexMapping = NULL;
+    OldSnapshot = (PPARANDIS_RSS_SNAPSHOT) InterlockedExchangePointer((PVOID volatile *) &RSSParameters->ActiveSnapshot, NewSnapshot);
+
+    /* The packets waiting on a queue that keeps its processor are left there,
+       the moved entries drain them in order. The others are reclassified */
+    for (CCHAR i = 0; i < PARANDIS_RSS_MAX_RECEIVE_QUEUES; i++)
+    {
+        if (!IsSameQueueProcessor(OldSnapshot, NewSnapshot, i))
+        {
+            QueuesToReclassify |= 1 << i;
         }
     }
+    InterlockedOr(&RSSParameters->ReceiveQueuesToReclassify, QueuesToReclassify);
+
+    if (OldSnapshot != &RSSParameters->DisabledSnapshot)
+    {
+        OldSnapshot->NextRetired = RSSParameters->RetiredSnapshots;
+        RSSParameters->RetiredSnapshots = OldSnapshot;
+    }
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID ParaNdis6_RSSReleaseRetiredSnapshots(PARANDIS_RSS_PARAMS *RSSParameters)
+{
+    PPARANDIS_RSS_SNAPSHOT Retired;
+
+    {
+        CNdisPassiveWriteAutoLock autoLock(RSSParameters->rwLock);
+        Retired = RSSParameters->RetiredSnapshots;
+        RSSParameters->RetiredSnapshots = NULL;
+    }
+
+    if (Retired == NULL)
+        return;
+
+    if (!ParaNdis_SynchronizeWithDispatchReaders(RSSParameters->MiniportHandle))
+    {
+        /* keep them for the next attempt or for the cleanup */
+        PPARANDIS_RSS_SNAPSHOT Last = Retired;
+        while (Last->NextRetired != NULL)
+            Last = Last->NextRetired;
+
+        CNdisPassiveWriteAutoLock autoLock(RSSParameters->rwLock);
+        Last->NextRetired = RSSParameters->RetiredSnapshots;
+        RSSParameters->RetiredSnapshots = Retired;
+        return;
+    }
+
+    while (Retired != NULL)
+    {
+        PPARANDIS_RSS_SNAPSHOT Next = Retired->NextRetired;
+        FreeSnapshot(RSSParameters, Retired);
+        Retired = Next;
+    }
 }
 
-static VOID InitRSSParameters(PARANDIS_RSS_PARAMS *RSSParameters, CCHAR RSSReceiveQueuesNumber)
+static VOID InitRSSParameters(PARANDIS_RSS_PARAMS *RSSParameters, CCHAR RSSReceiveQueuesNumber, NDIS_HANDLE MiniportHandle)
 {
     NdisZeroMemory(RSSParameters, sizeof(*RSSParameters));
     RSSParameters->ReceiveQueuesNumber = RSSReceiveQueuesNumber;
+    RSSParameters->MiniportHandle = MiniportHandle;
+    RSSParameters->DisabledSnapshot.RSSMode = PARANDIS_RSS_DISABLED;
+    RSSParameters->DisabledSnapshot.ScalingSettings.FirstQueueIndirectionIndex = INVALID_INDIRECTION_INDEX;
+    RSSParameters->ActiveSnapshot = &RSSParameters->DisabledSnapshot;
 }
 
 static VOID CleanupRSSParameters(PARANDIS_RSS_PARAMS *RSSParameters)
 {
-    if(RSSParameters->ActiveRSSScalingSettings.CPUIndexMapping != NULL)
-        NdisFreeMemory(RSSParameters->ActiveRSSScalingSettings.CPUIndexMapping, 0, 0);
+    PPARANDIS_RSS_SNAPSHOT Retired = RSSParameters->RetiredSnapshots;
+
+    while (Retired != NULL)
+    {
+        PPARANDIS_RSS_SNAPSHOT Next = Retired->NextRetired;
+        FreeSnapshot(RSSParameters, Retired);
+        Retired = Next;
+    }
+    RSSParameters->RetiredSnapshots = NULL;
+
+    FreeSnapshot(RSSParameters, RSSParameters->ActiveSnapshot);
+    RSSParameters->ActiveSnapshot = &RSSParameters->DisabledSnapshot;
 
     if(RSSParameters->RSSScalingSettings.CPUIndexMapping != NULL)
         NdisFreeMemory(RSSParameters->RSSScalingSettings.CPUIndexMapping, 0, 0);
-
 }
 
 static VOID InitRSSCapabilities(NDIS_RECEIVE_SCALE_CAPABILITIES *RSSCapabilities, ULONG RSSReceiveQueuesNumber)
@@ -71,6 +252,12 @@ static VOID InitRSSCapabilities(NDIS_RECEIVE_SCALE_CAPABILITIES *RSSCapabilities
                                         NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6 |
                                         NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6_EX |
                                         NdisHashFunctionToeplitz;
+    if (IsUDPHashSupported())
+    {
+        RSSCapabilities->CapabilitiesFlags |= NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV4 |
+                                              NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6 |
+                                              NDIS_RSS_CAPS_HASH_TYPE_UDP_IPV6_EX;
+    }
     RSSCapabilities->NumberOfInterruptMessages = 1;
     RSSCapabilities->NumberOfReceiveQueues = RSSReceiveQueuesNumber;
 #if (NDIS_SUPPORT_NDIS630)
@@ -80,9 +267,10 @@ static VOID InitRSSCapabilities(NDIS_RECEIVE_SCALE_CAPABILITIES *RSSCapabilities
 
 NDIS_RECEIVE_SCALE_CAPABILITIES* ParaNdis6_RSSCreateConfiguration(PARANDIS_RSS_PARAMS *RSSParameters,
                                                                   NDIS_RECEIVE_SCALE_CAPABILITIES *RSSCapabilities,
-                                                                  CCHAR RSSReceiveQueuesNumber)
+                                                                  CCHAR RSSReceiveQueuesNumber,
+                                                                  NDIS_HANDLE MiniportHandle)
 {
-    InitRSSParameters(RSSParameters, RSSReceiveQueuesNumber);
+    InitRSSParameters(RSSParameters, RSSReceiveQueuesNumber, MiniportHandle);
     InitRSSCapabilities(RSSCapabilities, RSSReceiveQueuesNumber);
     return RSSCapabilities;
 }
@@ -96,7 +284,7 @@ static BOOLEAN IsValidHashInfo(ULONG HashInformation)
 {
 #define HASH_FLAGS_COMBINATION(Type, Flags) ( ((Type) & (Flags)) && !((Type) & ~(Flags)) )
 
-    ULONG ulHashType = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(HashInformation);
+    ULONG ulHashType = PARANDIS_RSS_HASH_TYPE_FROM_HASH_INFO(HashInformation);
     ULONG ulHashFunction = NDIS_RSS_HASH_FUNC_FROM_HASH_INFO(HashInformation);
 
     if (HashInformation == 0)
@@ -104,7 +292,8 @@ static BOOLEAN IsValidHashInfo(ULONG HashInformation)
 
     if (HASH_FLAGS_COMBINATION(ulHashType, NDIS_HASH_IPV4 | NDIS_HASH_TCP_IPV4 |
                                            NDIS_HASH_IPV6 | NDIS_HASH_TCP_IPV6 |
-                                           NDIS_HASH_IPV6_EX | NDIS_HASH_TCP_IPV6_EX))
+                                           NDIS_HASH_IPV6_EX | NDIS_HASH_TCP_IPV6_EX |
+                                           (IsUDPHashSupported() ? PARANDIS_HASH_UDP_TYPES : 0)))
         return ulHashFunction == NdisHashFunctionToeplitz;
 
     return FALSE;
@@ -123,7 +312,7 @@ BOOLEAN IsCompatibleAffinities(PGROUP_AFFINITY a1, PGROUP_AFFINITY a2)
 }
 
 static
-CCHAR FindReceiveQueueForCurrentCpu(PPARANDIS_SCALING_SETTINGS RSSScalingSettings)
+CCHAR FindReceiveQueueForCurrentCpu(const PARANDIS_SCALING_SETTINGS *RSSScalingSettings)
 {
     ULONG CurrProcIdx;
 
@@ -149,6 +338,9 @@ BOOLEAN AllocateCPUMappingArray(NDIS_HANDLE NdisHandle, PPARANDIS_SCALING_SETTIN
     if(!NewCPUMappingArray)
         return FALSE;
 
+    if(RSSScalingSettings->CPUIndexMapping != NULL)
+        NdisFreeMemory(RSSScalingSettings->CPUIndexMapping, 0, 0);
+
     RSSScalingSettings->CPUIndexMapping = NewCPUMappingArray;
     RSSScalingSettings->CPUIndexMappingSize = CPUNumber;
 
@@ -185,6 +377,7 @@ VOID FillCPUMappingArray(
 
                 if (ReceiveQueue != ReceiveQueuesNumber)
                 {
+                    RSSScalingSettings->QueueProcessor[ReceiveQueue] = *ProcNum;
                     RSSScalingSettings->CPUIndexMapping[CurrProcIdx] = ReceiveQueue++;
                 }
             }
@@ -198,6 +391,8 @@ VOID FillCPUMappingArray(
         }
     }
 
+    RSSScalingSettings->ReceiveQueuesMapped = ReceiveQueue;
+
     if (RSSScalingSettings->FirstQueueIndirectionIndex == INVALID_INDIRECTION_INDEX)
     {
         DPrintf(0, "[%s] - CPU <-> queue assignment failed!", __FUNCTION__);
@@ -306,10 +501,12 @@ NDIS_STATUS ParaNdis6_RSSSetParameters( PARANDIS_RSS_PARAMS *RSSParameters,
             *ParamsBytesRead += Params->HashSecretKeySize;
         }
 
-        ApplySettings(RSSParameters,
-                    PARANDIS_RSS_FULL,
-                    &RSSParameters->RSSHashingSettings,
-                    &RSSParameters->RSSScalingSettings);
+        NDIS_STATUS status = ApplySettings(RSSParameters,
+                                           PARANDIS_RSS_FULL,
+                                           &RSSParameters->RSSHashingSettings,
+                                           &RSSParameters->RSSScalingSettings);
+        if (status != NDIS_STATUS_SUCCESS)
+            return status;
     }
 
     *ParamsBytesRead += sizeof(NDIS_RECEIVE_SCALE_PARAMETERS);
@@ -394,7 +591,7 @@ NDIS_STATUS ParaNdis6_RSSSetReceiveHash(PARANDIS_RSS_PARAMS *RSSParameters,
 
     if(RSSParameters->RSSMode != PARANDIS_RSS_FULL)
     {
-        ApplySettings(RSSParameters,
+        return ApplySettings(RSSParameters,
                 ((Params->Flags & NDIS_RECEIVE_HASH_FLAG_ENABLE_HASH) && (Params->HashInformation != 0))
                     ? PARANDIS_RSS_HASHING : PARANDIS_RSS_DISABLED,
                 &RSSParameters->ReceiveHashingSettings, NULL);
@@ -403,174 +600,82 @@ NDIS_STATUS ParaNdis6_RSSSetReceiveHash(PARANDIS_RSS_PARAMS *RSSParameters,
     return NDIS_STATUS_SUCCESS;
 }
 
-typedef struct _tagHASH_CALC_SG_BUF_ENTRY
-{
-    PCHAR chunkPtr;
-    ULONG  chunkLen;
-} HASH_CALC_SG_BUF_ENTRY, *PHASH_CALC_SG_BUF_ENTRY;
-
-// Little Endian version ONLY
-static
-UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, PCCHAR fullKey)
+VOID ParaNdis6_RSSAnalyzeReceivedPacket(
+    PARANDIS_RSS_PARAMS *RSSParameters,
+    PVOID dataBuffer,
+    PNET_PACKET_INFO packetInfo)
 {
-#define TOEPLITZ_MAX_BIT_NUM (7)
-#define TOEPLITZ_BYTE_HAS_BIT(byte, bit) ((byte) & (1 << (TOEPLITZ_MAX_BIT_NUM - (bit))))
-#define TOEPLITZ_BYTE_BIT_STATE(byte, bit) (((byte) >> (TOEPLITZ_MAX_BIT_NUM - (bit))) & 1)
-
-    UINT32 firstKeyWord, res = 0;
-    UINT byte, bit;
-    PHASH_CALC_SG_BUF_ENTRY sgEntry;
-    PCCHAR next_key_byte = fullKey + sizeof(firstKeyWord);
-    firstKeyWord = RtlUlongByteSwap(*(UINT32*)fullKey);
+    const PARANDIS_RSS_SNAPSHOT *Snapshot = ParaNdis6_RSSGetActiveSnapshot(RSSParameters);
 
-    for(sgEntry = sgBuff; sgEntry < sgBuff + sgEntriesNum; ++sgEntry)
+    if(Snapshot->RSSMode != PARANDIS_RSS_DISABLED)
     {
-        for (byte = 0; byte < sgEntry->chunkLen; ++byte)
-        {
-            for (bit = 0; bit <= TOEPLITZ_MAX_BIT_NUM; ++bit)
-            {
-                if (TOEPLITZ_BYTE_HAS_BIT(sgEntry->chunkPtr[byte], bit))
-                {
-                    res ^= firstKeyWord;
-                }
-                firstKeyWord = (firstKeyWord << 1) | TOEPLITZ_BYTE_BIT_STATE(*next_key_byte, bit);
-            }
-            ++next_key_byte;
-        }
+        RSSCalcHash_Unsafe(Snapshot->HashingSettings.HashInformation,
+                           Snapshot->HashingSettings.HashSecretKey,
+                           dataBuffer, packetInfo);
     }
-    return res;
-
-#undef TOEPLITZ_BYTE_HAS_BIT
-#undef TOEPLITZ_BYTE_BIT_STATE
-#undef TOEPLITZ_MAX_BIT_NUM
-}
-
-static __inline
-IPV6_ADDRESS* GetIP6SrcAddrForHash(
-                            PVOID dataBuffer,
-                            PNET_PACKET_INFO packetInfo,
-                            ULONG hashTypes)
-{
-    return ((hashTypes & (NDIS_HASH_TCP_IPV6_EX | NDIS_HASH_IPV6_EX)) && packetInfo->ip6HomeAddrOffset)
-        ? (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->ip6HomeAddrOffset)
-        : (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen + FIELD_OFFSET(IPv6Header, ip6_src_address));
-}
-
-static __inline
-IPV6_ADDRESS* GetIP6DstAddrForHash(
-                            PVOID dataBuffer,
-                            PNET_PACKET_INFO packetInfo,
-                            ULONG hashTypes)
-{
-    return ((hashTypes & (NDIS_HASH_TCP_IPV6_EX | NDIS_HASH_IPV6_EX)) && packetInfo->ip6DestAddrOffset)
-        ? (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->ip6DestAddrOffset)
-        : (IPV6_ADDRESS*) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen + FIELD_OFFSET(IPv6Header, ip6_dst_address));
 }
 
-static
-VOID RSSCalcHash_Unsafe(
-                PARANDIS_RSS_PARAMS *RSSParameters,
-                PVOID dataBuffer,
-                PNET_PACKET_INFO packetInfo)
+/* Keeps the packets of an indirection entry moved to another queue on the
+   previous one while the packets queued there before and while it is held
+   are not indicated. The hold ends after RSS_MIGRATION_TIMEOUT or when the previous queue has no
+   processor any more; such a migration is counted as forced as the packets
+   still waiting may be indicated after the newer ones */
+static CCHAR HoldMovedEntry(PARANDIS_RSS_PARAMS *RSSParameters,
+                            const PARANDIS_RSS_SNAPSHOT *Snapshot,
+                            ULONG IndirectionIndex,
+                            CCHAR TargetQueue,
+                            PPROCESSOR_NUMBER TargetProcessor)
 {
-    HASH_CALC_SG_BUF_ENTRY sgBuff[3];
-    ULONG hashTypes = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(RSSParameters->ActiveHashingSettings.HashInformation);
-
-    if(packetInfo->isIP4)
+    PARANDIS_RSS_ENTRY_STATE *Entry = &RSSParameters->EntryState[IndirectionIndex];
+    LONG MovedVersion = Entry->MovedVersion;
+    LONG DrainPosition;
+    CCHAR PreviousQueue;
+    BOOLEAN Drained;
+
+    /* not moved, or moved by a snapshot this packet does not use yet */
+    if (MovedVersion == 0 || (LONG) (Snapshot->Version - (ULONG) MovedVersion) < 0)
     {
-        if(packetInfo->isTCP && (hashTypes & NDIS_HASH_TCP_IPV4))
-        {
-            IPv4Header *pIpHeader = (IPv4Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
-            TCPHeader *pTCPHeader = (TCPHeader *) RtlOffsetToPointer(pIpHeader, packetInfo->L3HdrLen);
-
-            sgBuff[0].chunkPtr = RtlOffsetToPointer(pIpHeader, FIELD_OFFSET(IPv4Header, ip_src));
-            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
-            sgBuff[1].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
-            sgBuff[1].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
+        return TargetQueue;
+    }
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, &RSSParameters->ActiveHashingSettings.HashSecretKey[0]);
-            packetInfo->RSSHash.Type = NDIS_HASH_TCP_IPV4;
-            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
-            return;
-        }
+    PreviousQueue = Entry->PreviousQueue;
+    DrainPosition = Entry->DrainPosition;
+    if (DrainPosition == 0 && PreviousQueue != TargetQueue)
+    {
+        /* any packet queued there before the entry moved may be its own,
+           the ones queued after are recorded by ParaNdis6_RSSPacketQueued */
+        LONG Queued = (LONG) ((*RSSParameters->QueueQueued[PreviousQueue] & RSS_POSITION_MASK) | RSS_POSITION_SET);
 
-        if(hashTypes & NDIS_HASH_IPV4)
+        DrainPosition = InterlockedCompareExchange(&Entry->DrainPosition, Queued, 0);
+        if (DrainPosition == 0)
         {
-            sgBuff[0].chunkPtr = RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen + FIELD_OFFSET(IPv4Header, ip_src));
-            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
-
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, RSSParameters->ActiveHashingSettings.HashSecretKey);
-            packetInfo->RSSHash.Type = NDIS_HASH_IPV4;
-            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
-            return;
+            DrainPosition = Queued;
         }
     }
-    else if(packetInfo->isIP6)
-    {
-        if(packetInfo->isTCP)
-        {
-            if(hashTypes & (NDIS_HASH_TCP_IPV6 | NDIS_HASH_TCP_IPV6_EX))
-            {
-                IPv6Header *pIpHeader =  (IPv6Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
-                TCPHeader  *pTCPHeader = (TCPHeader *) RtlOffsetToPointer(pIpHeader, packetInfo->L3HdrLen);
-
-                sgBuff[0].chunkPtr = (PCHAR) GetIP6SrcAddrForHash(dataBuffer, packetInfo, hashTypes);
-                sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address);
-                sgBuff[1].chunkPtr = (PCHAR) GetIP6DstAddrForHash(dataBuffer, packetInfo, hashTypes);
-                sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
-                sgBuff[2].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
-                sgBuff[2].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
-
-                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingSettings.HashSecretKey);
-                packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_TCP_IPV6_EX) ? NDIS_HASH_TCP_IPV6_EX : NDIS_HASH_TCP_IPV6;
-                packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
-                return;
-            }
-        }
+    Drained = PreviousQueue == TargetQueue ||
+              PositionReached((ULONG) RSSParameters->QueueIndicated[PreviousQueue], (ULONG) DrainPosition);
 
-        if(hashTypes & (NDIS_HASH_IPV6 | NDIS_HASH_IPV6_EX))
-        {
-            sgBuff[0].chunkPtr = (PCHAR) GetIP6SrcAddrForHash(dataBuffer, packetInfo, hashTypes);
-            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address);
-            sgBuff[1].chunkPtr = (PCHAR) GetIP6DstAddrForHash(dataBuffer, packetInfo, hashTypes);
-            sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
-
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
-            packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_IPV6_EX) ? NDIS_HASH_IPV6_EX : NDIS_HASH_IPV6;
-            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
-            return;
-        }
+    /* a queue that changed its processor is emptied by ParaNdis_ResetRxClassification */
+    if (!Drained && PreviousQueue < Snapshot->ScalingSettings.ReceiveQueuesMapped &&
+        !(RSSParameters->ReceiveQueuesToReclassify & (1 << PreviousQueue)))
+    {
+        ULONG Now = (ULONG) KeQueryInterruptTime() | 1;
 
-        if(hashTypes & NDIS_HASH_IPV6)
+        InterlockedCompareExchange(&Entry->HoldStart, (LONG) Now, 0);
+        if (Now - (ULONG) Entry->HoldStart < RSS_MIGRATION_TIMEOUT)
         {
-            IPv6Header *pIpHeader = (IPv6Header *) RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen);
-
-            sgBuff[0].chunkPtr = RtlOffsetToPointer(pIpHeader, FIELD_OFFSET(IPv6Header, ip6_src_address));
-            sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address) + RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
-
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
-            packetInfo->RSSHash.Type = NDIS_HASH_IPV6;
-            packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
-            return;
+            InterlockedIncrement(&RSSParameters->FramesHeld);
+            *TargetProcessor = Snapshot->ScalingSettings.QueueProcessor[PreviousQueue];
+            return PreviousQueue;
         }
     }
 
-    packetInfo->RSSHash.Value = 0;
-    packetInfo->RSSHash.Type = 0;
-    packetInfo->RSSHash.Function = 0;
-}
-
-VOID ParaNdis6_RSSAnalyzeReceivedPacket(
-    PARANDIS_RSS_PARAMS *RSSParameters,
-    PVOID dataBuffer,
-    PNET_PACKET_INFO packetInfo)
-{
-    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
-
-    if(RSSParameters->RSSMode != PARANDIS_RSS_DISABLED)
+    if (InterlockedCompareExchange(&Entry->MovedVersion, 0, MovedVersion) == MovedVersion)
     {
-        RSSCalcHash_Unsafe(RSSParameters, dataBuffer, packetInfo);
+        InterlockedIncrement(Drained ? &RSSParameters->MigrationsDrained : &RSSParameters->MigrationsForced);
     }
+
+    return TargetQueue;
 }
 
 CCHAR ParaNdis6_RSSGetScalingDataForPacket(
@@ -579,10 +684,11 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(
     PPROCESSOR_NUMBER targetProcessor)
 {
     CCHAR targetQueue;
-    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    const PARANDIS_RSS_SNAPSHOT *Snapshot = ParaNdis6_RSSGetActiveSnapshot(RSSParameters);
+    const PARANDIS_SCALING_SETTINGS *ScalingSettings = &Snapshot->ScalingSettings;
 
-    if (RSSParameters->RSSMode != PARANDIS_RSS_FULL || 
-        RSSParameters->ActiveRSSScalingSettings.FirstQueueIndirectionIndex == INVALID_INDIRECTION_INDEX)
+    if (Snapshot->RSSMode != PARANDIS_RSS_FULL ||
+        ScalingSettings->FirstQueueIndirectionIndex == INVALID_INDIRECTION_INDEX)
     {
         targetQueue = PARANDIS_RECEIVE_UNCLASSIFIED_PACKET;
     }
@@ -592,34 +698,83 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(
     }
     else
     {
-        ULONG indirectionIndex = packetInfo->RSSHash.Value & RSSParameters->ActiveRSSScalingSettings.RSSHashMask;
+        ULONG indirectionIndex = packetInfo->RSSHash.Value & ScalingSettings->RSSHashMask;
 
-        targetQueue = RSSParameters->ActiveRSSScalingSettings.QueueIndirectionTable[indirectionIndex];
+        targetQueue = ScalingSettings->QueueIndirectionTable[indirectionIndex];
         if (targetQueue == PARANDIS_RECEIVE_NO_QUEUE)
         {
             targetQueue = PARANDIS_RECEIVE_UNCLASSIFIED_PACKET;
         }
         else
         {
-            *targetProcessor = RSSParameters->ActiveRSSScalingSettings.IndirectionTable[indirectionIndex];
+            *targetProcessor = ScalingSettings->IndirectionTable[indirectionIndex];
+            targetQueue = HoldMovedEntry(RSSParameters, Snapshot, indirectionIndex, targetQueue, targetProcessor);
         }
     }
 
     return targetQueue;
 }
 
+VOID ParaNdis6_RSSPacketQueued(
+    PARANDIS_RSS_PARAMS *RSSParameters,
+    ULONG hashValue,
+    CCHAR receiveQueue,
+    ULONG position)
+{
+    const PARANDIS_RSS_SNAPSHOT *Snapshot = ParaNdis6_RSSGetActiveSnapshot(RSSParameters);
+    PARANDIS_RSS_ENTRY_STATE *Entry = &RSSParameters->EntryState[hashValue & Snapshot->ScalingSettings.RSSHashMask];
+    LONG NewPosition = (LONG) ((position & RSS_POSITION_MASK) | RSS_POSITION_SET);
+    LONG DrainPosition;
+
+    /* a settled entry is only read, it stays shared between the processors */
+    if (Entry->MovedVersion == 0 || Entry->PreviousQueue != receiveQueue)
+    {
+        return;
+    }
+
+    /* the packets of an entry may come from several virtqueues at once,
+       the latest position in the queue wins */
+    do
+    {
+        DrainPosition = Entry->DrainPosition;
+        if (DrainPosition != 0 && PositionReached((ULONG) DrainPosition, position))
+        {
+            return;
+        }
+    } while (InterlockedCompareExchange(&Entry->DrainPosition, NewPosition, DrainPosition) != DrainPosition);
+}
+
+VOID ParaNdis6_RSSReceiveQueueIndicated(
+    PARANDIS_RSS_PARAMS *RSSParameters,
+    CCHAR receiveQueue,
+    ULONG position)
+{
+    volatile LONG *Indicated = &RSSParameters->QueueIndicated[receiveQueue];
+    LONG Current;
+
+    /* two processors may handle the queue for a moment after a change */
+    do
+    {
+        Current = *Indicated;
+        if (PositionReached((ULONG) Current, position))
+        {
+            return;
+        }
+    } while (InterlockedCompareExchange(Indicated, (LONG) position, Current) != Current);
+}
+
 CCHAR ParaNdis6_RSSGetCurrentCpuReceiveQueue(PARANDIS_RSS_PARAMS *RSSParameters)
 {
     CCHAR res;
-    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    const PARANDIS_RSS_SNAPSHOT *Snapshot = ParaNdis6_RSSGetActiveSnapshot(RSSParameters);
 
-    if(RSSParameters->RSSMode != PARANDIS_RSS_FULL)
+    if(Snapshot->RSSMode != PARANDIS_RSS_FULL)
     {
         res = PARANDIS_RECEIVE_NO_QUEUE;
     }
     else
     {
-        res = FindReceiveQueueForCurrentCpu(&RSSParameters->ActiveRSSScalingSettings);
+        res = FindReceiveQueueForCurrentCpu(&Snapshot->ScalingSettings);
     }
 
     return res;
@@ -655,13 +810,13 @@ static void PrintRSSSettings(const PPARANDIS_RSS_PARAMS RSSParameters)
         CPUNumber, RSSParameters->ReceiveQueuesNumber,
         RSSParameters->RSSScalingSettings.FirstQueueIndirectionIndex);
 
-    PrintIndirectionTable(&RSSParameters->ActiveRSSScalingSettings);
+    PrintIndirectionTable(&RSSParameters->RSSScalingSettings);
 
-    DPrintf(RSS_PRINT_LEVEL, "CPU mapping table[%u]: ", RSSParameters->ActiveRSSScalingSettings.CPUIndexMappingSize);
-    ParaNdis_PrintCharArray(RSS_PRINT_LEVEL, RSSParameters->ActiveRSSScalingSettings.CPUIndexMapping, RSSParameters->ActiveRSSScalingSettings.CPUIndexMappingSize);
+    DPrintf(RSS_PRINT_LEVEL, "CPU mapping table[%u]: ", RSSParameters->RSSScalingSettings.CPUIndexMappingSize);
+    ParaNdis_PrintCharArray(RSS_PRINT_LEVEL, RSSParameters->RSSScalingSettings.CPUIndexMapping, RSSParameters->RSSScalingSettings.CPUIndexMappingSize);
 
     DPrintf(RSS_PRINT_LEVEL, "Queue indirection table[%u]: ", RSSParameters->ReceiveQueuesNumber);
-    ParaNdis_PrintCharArray(RSS_PRINT_LEVEL, RSSParameters->ActiveRSSScalingSettings.QueueIndirectionTable, RSSParameters->ReceiveQueuesNumber);
+    ParaNdis_PrintCharArray(RSS_PRINT_LEVEL, RSSParameters->RSSScalingSettings.QueueIndirectionTable, RSSParameters->ReceiveQueuesNumber);
 }
 
 #endif